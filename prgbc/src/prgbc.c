@@ -5,21 +5,48 @@
   C64 PRG files.
 */
 
+/* For fileno, open_memstream and the POSIX process and clock
+   functions, where the host has them */
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+
+/* The fuzzer's decompiler co-process, the peak RSS of --alloc-stats
+   and the language server's in-memory messages use POSIX; other hosts
+   build without them or with plain fallbacks */
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX 1
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 typedef int32_t   s32;
+typedef int64_t   s64;
 
 typedef uint8_t   u8;
 typedef uint16_t  u16;
 typedef uint32_t  u32;
+typedef uint64_t  u64;
 
 typedef u8  byte_t;
 
@@ -39,6 +66,164 @@ typedef u8  byte_t;
 #define MAX_LABEL_LENGTH  32
 
 
+/*
+  Allocation accounting
+
+  All heap allocations go through counting wrappers, which keep the
+  size of every block in a small header in front of it. This tracks
+  the number of allocations, the bytes allocated and the live heap
+  bytes, including their peak, so that --alloc-stats can report them
+  at exit and --max-alloc-per-line can hold the peak to a budget per
+  input line. Memory the C library allocates itself isn't counted.
+*/
+#define ALLOC_HEADER_SIZE  16
+
+struct alloc_stats
+{
+  u64 allocations;
+  u64 bytes_allocated;
+  u64 live_bytes;
+  u64 peak_live_bytes;
+  u64 input_lines;
+};
+struct alloc_stats alloc_stats;
+
+
+/*
+  Alloc_Count
+
+  Record size in the header of a block just allocated with room for
+  the header, and count it. Returns the memory after the header, or 0
+  if the allocation failed.
+*/
+void*
+Alloc_Count(byte_t* header, size_t size)
+{
+  if (!header)
+    return 0;
+  memcpy(header, &size, sizeof(size));
+  ++alloc_stats.allocations;
+  alloc_stats.bytes_allocated += size;
+  alloc_stats.live_bytes += size;
+  if (alloc_stats.live_bytes > alloc_stats.peak_live_bytes)
+    alloc_stats.peak_live_bytes = alloc_stats.live_bytes;
+  return header + ALLOC_HEADER_SIZE;
+}
+
+
+/*
+  Alloc_BlockSize
+
+  Returns the size of a block allocated by the counting wrappers.
+*/
+size_t
+Alloc_BlockSize(void* ptr)
+{
+  size_t size;
+  memcpy(&size, (byte_t*)ptr - ALLOC_HEADER_SIZE, sizeof(size));
+  return size;
+}
+
+
+/*
+  Counted_Malloc
+
+  malloc, counted.
+*/
+void*
+Counted_Malloc(size_t size)
+{
+  return Alloc_Count((byte_t*)malloc(ALLOC_HEADER_SIZE + size), size);
+}
+
+
+/*
+  Counted_Calloc
+
+  calloc, counted.
+*/
+void*
+Counted_Calloc(size_t count, size_t size)
+{
+  if (size &&
+      count > (SIZE_MAX - ALLOC_HEADER_SIZE) / size)
+    return 0;
+  return Alloc_Count((byte_t*)calloc(1, ALLOC_HEADER_SIZE + count * size), count * size);
+}
+
+
+/*
+  Counted_Realloc
+
+  realloc, counted. A reallocation counts as an allocation of the new
+  size.
+*/
+void*
+Counted_Realloc(void* ptr, size_t size)
+{
+  if (!ptr)
+    return Counted_Malloc(size);
+  size_t old_size = Alloc_BlockSize(ptr);
+  byte_t* header = (byte_t*)realloc((byte_t*)ptr - ALLOC_HEADER_SIZE,
+                                    ALLOC_HEADER_SIZE + size);
+  if (!header)
+    return 0;
+  alloc_stats.live_bytes -= old_size;
+  return Alloc_Count(header, size);
+}
+
+
+/*
+  Counted_Free
+
+  free, counted.
+*/
+void
+Counted_Free(void* ptr)
+{
+  if (!ptr)
+    return;
+  alloc_stats.live_bytes -= Alloc_BlockSize(ptr);
+  free((byte_t*)ptr - ALLOC_HEADER_SIZE);
+}
+
+
+/*
+  Alloc_PrintStats
+
+  Print the allocation statistics and, where the host reports it, the
+  peak resident set size of the process.
+*/
+void
+Alloc_PrintStats(FILE* fp)
+{
+  fprintf(fp, "Allocations:      %llu (%llu bytes)\n",
+          (unsigned long long)alloc_stats.allocations,
+          (unsigned long long)alloc_stats.bytes_allocated);
+  fprintf(fp, "Peak heap:        %llu bytes",
+          (unsigned long long)alloc_stats.peak_live_bytes);
+  if (alloc_stats.input_lines)
+    fprintf(fp, " (%llu per line, %llu lines)",
+            (unsigned long long)(alloc_stats.peak_live_bytes / alloc_stats.input_lines),
+            (unsigned long long)alloc_stats.input_lines);
+  fprintf(fp, "\n");
+  fprintf(fp, "Leaked at exit:   %llu bytes\n",
+          (unsigned long long)alloc_stats.live_bytes);
+#if defined(HAVE_POSIX)
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  getrusage(RUSAGE_SELF, &usage);
+  /* ru_maxrss is in kilobytes on Linux and the BSDs, but in bytes on
+     macOS */
+#if defined(__APPLE__)
+  fprintf(fp, "Peak RSS:         %ld KB\n", (long)(usage.ru_maxrss / 1024));
+#else
+  fprintf(fp, "Peak RSS:         %ld KB\n", (long)usage.ru_maxrss);
+#endif
+#endif
+}
+
+
 /* Translation table for keycodes between modern ASCII standard and
    C64 PETSCII */
 char* PETSCII_table[] =
@@ -384,6 +569,313 @@ char* token_list[] =
 };
 
 
+/* Keywords that BASIC dialects add to the V2 set. A prefix of 0 means
+   a one-byte token; otherwise the keyword is tokenized as the two
+   bytes prefix, token. */
+struct dialect_keyword
+{
+  char*  keyword;
+  byte_t prefix;
+  byte_t token;
+};
+
+/* BASIC 3.5 (C16/Plus4) keywords following the V2 set */
+struct dialect_keyword basic35_keywords[] =
+{
+    { "RGR",       0x00, 0xCC },
+    { "RCLR",      0x00, 0xCD },
+    { "RLUM",      0x00, 0xCE },
+    { "JOY",       0x00, 0xCF },
+    { "RDOT",      0x00, 0xD0 },
+    { "DEC",       0x00, 0xD1 },
+    { "HEX$",      0x00, 0xD2 },
+    { "ERR$",      0x00, 0xD3 },
+    { "INSTR",     0x00, 0xD4 },
+    { "ELSE",      0x00, 0xD5 },
+    { "RESUME",    0x00, 0xD6 },
+    { "TRAP",      0x00, 0xD7 },
+    { "TRON",      0x00, 0xD8 },
+    { "TROFF",     0x00, 0xD9 },
+    { "SOUND",     0x00, 0xDA },
+    { "VOL",       0x00, 0xDB },
+    { "AUTO",      0x00, 0xDC },
+    { "PUDEF",     0x00, 0xDD },
+    { "GRAPHIC",   0x00, 0xDE },
+    { "PAINT",     0x00, 0xDF },
+    { "CHAR",      0x00, 0xE0 },
+    { "BOX",       0x00, 0xE1 },
+    { "CIRCLE",    0x00, 0xE2 },
+    { "GSHAPE",    0x00, 0xE3 },
+    { "SSHAPE",    0x00, 0xE4 },
+    { "DRAW",      0x00, 0xE5 },
+    { "LOCATE",    0x00, 0xE6 },
+    { "COLOR",     0x00, 0xE7 },
+    { "SCNCLR",    0x00, 0xE8 },
+    { "SCALE",     0x00, 0xE9 },
+    { "HELP",      0x00, 0xEA },
+    { "DO",        0x00, 0xEB },
+    { "LOOP",      0x00, 0xEC },
+    { "EXIT",      0x00, 0xED },
+    { "DIRECTORY", 0x00, 0xEE },
+    { "DSAVE",     0x00, 0xEF },
+    { "DLOAD",     0x00, 0xF0 },
+    { "HEADER",    0x00, 0xF1 },
+    { "SCRATCH",   0x00, 0xF2 },
+    { "COLLECT",   0x00, 0xF3 },
+    { "COPY",      0x00, 0xF4 },
+    { "RENAME",    0x00, 0xF5 },
+    { "BACKUP",    0x00, 0xF6 },
+    { "DELETE",    0x00, 0xF7 },
+    { "RENUMBER",  0x00, 0xF8 },
+    { "KEY",       0x00, 0xF9 },
+    { "MONITOR",   0x00, 0xFA },
+    { "USING",     0x00, 0xFB },
+    { "UNTIL",     0x00, 0xFC },
+    { "WHILE",     0x00, 0xFD },
+    { 0 }
+};
+
+
+/* BASIC 7.0 (C128) keywords. 0xCE and 0xFE prefix two-byte tokens
+   in place of 3.5's RLUM and the unused 0xFE. */
+struct dialect_keyword basic70_keywords[] =
+{
+    { "RGR",       0x00, 0xCC },
+    { "RCLR",      0x00, 0xCD },
+    { "JOY",       0x00, 0xCF },
+    { "RDOT",      0x00, 0xD0 },
+    { "DEC",       0x00, 0xD1 },
+    { "HEX$",      0x00, 0xD2 },
+    { "ERR$",      0x00, 0xD3 },
+    { "INSTR",     0x00, 0xD4 },
+    { "ELSE",      0x00, 0xD5 },
+    { "RESUME",    0x00, 0xD6 },
+    { "TRAP",      0x00, 0xD7 },
+    { "TRON",      0x00, 0xD8 },
+    { "TROFF",     0x00, 0xD9 },
+    { "SOUND",     0x00, 0xDA },
+    { "VOL",       0x00, 0xDB },
+    { "AUTO",      0x00, 0xDC },
+    { "PUDEF",     0x00, 0xDD },
+    { "GRAPHIC",   0x00, 0xDE },
+    { "PAINT",     0x00, 0xDF },
+    { "CHAR",      0x00, 0xE0 },
+    { "BOX",       0x00, 0xE1 },
+    { "CIRCLE",    0x00, 0xE2 },
+    { "GSHAPE",    0x00, 0xE3 },
+    { "SSHAPE",    0x00, 0xE4 },
+    { "DRAW",      0x00, 0xE5 },
+    { "LOCATE",    0x00, 0xE6 },
+    { "COLOR",     0x00, 0xE7 },
+    { "SCNCLR",    0x00, 0xE8 },
+    { "SCALE",     0x00, 0xE9 },
+    { "HELP",      0x00, 0xEA },
+    { "DO",        0x00, 0xEB },
+    { "LOOP",      0x00, 0xEC },
+    { "EXIT",      0x00, 0xED },
+    { "DIRECTORY", 0x00, 0xEE },
+    { "DSAVE",     0x00, 0xEF },
+    { "DLOAD",     0x00, 0xF0 },
+    { "HEADER",    0x00, 0xF1 },
+    { "SCRATCH",   0x00, 0xF2 },
+    { "COLLECT",   0x00, 0xF3 },
+    { "COPY",      0x00, 0xF4 },
+    { "RENAME",    0x00, 0xF5 },
+    { "BACKUP",    0x00, 0xF6 },
+    { "DELETE",    0x00, 0xF7 },
+    { "RENUMBER",  0x00, 0xF8 },
+    { "KEY",       0x00, 0xF9 },
+    { "MONITOR",   0x00, 0xFA },
+    { "USING",     0x00, 0xFB },
+    { "UNTIL",     0x00, 0xFC },
+    { "WHILE",     0x00, 0xFD },
+    { "POT",       0xCE, 0x02 },
+    { "BUMP",      0xCE, 0x03 },
+    { "PEN",       0xCE, 0x04 },
+    { "RSPPOS",    0xCE, 0x05 },
+    { "RSPRITE",   0xCE, 0x06 },
+    { "RSPCOLOR",  0xCE, 0x07 },
+    { "XOR",       0xCE, 0x08 },
+    { "RWINDOW",   0xCE, 0x09 },
+    { "POINTER",   0xCE, 0x0A },
+    { "BANK",      0xFE, 0x02 },
+    { "FILTER",    0xFE, 0x03 },
+    { "PLAY",      0xFE, 0x04 },
+    { "TEMPO",     0xFE, 0x05 },
+    { "MOVSPR",    0xFE, 0x06 },
+    { "SPRITE",    0xFE, 0x07 },
+    { "SPRCOLOR",  0xFE, 0x08 },
+    { "RREG",      0xFE, 0x09 },
+    { "ENVELOPE",  0xFE, 0x0A },
+    { "SLEEP",     0xFE, 0x0B },
+    { "CATALOG",   0xFE, 0x0C },
+    { "DOPEN",     0xFE, 0x0D },
+    { "APPEND",    0xFE, 0x0E },
+    { "DCLOSE",    0xFE, 0x0F },
+    { "BSAVE",     0xFE, 0x10 },
+    { "BLOAD",     0xFE, 0x11 },
+    { "RECORD",    0xFE, 0x12 },
+    { "CONCAT",    0xFE, 0x13 },
+    { "DVERIFY",   0xFE, 0x14 },
+    { "DCLEAR",    0xFE, 0x15 },
+    { "SPRSAV",    0xFE, 0x16 },
+    { "COLLISION", 0xFE, 0x17 },
+    { "BEGIN",     0xFE, 0x18 },
+    { "BEND",      0xFE, 0x19 },
+    { "WINDOW",    0xFE, 0x1A },
+    { "BOOT",      0xFE, 0x1B },
+    { "WIDTH",     0xFE, 0x1C },
+    { "SPRDEF",    0xFE, 0x1D },
+    { "QUIT",      0xFE, 0x1E },
+    { "STASH",     0xFE, 0x1F },
+    { "FETCH",     0xFE, 0x21 },
+    { "SWAP",      0xFE, 0x23 },
+    { "OFF",       0xFE, 0x24 },
+    { "FAST",      0xFE, 0x25 },
+    { "SLOW",      0xFE, 0x26 },
+    { 0 }
+};
+
+
+/* Simons' BASIC keywords, all of them 0x64-prefixed two-byte tokens.
+   Unassigned tokens are left out. */
+struct dialect_keyword simons_keywords[] =
+{
+    { "HIRES",     0x64, 0x01 },
+    { "PLOT",      0x64, 0x02 },
+    { "LINE",      0x64, 0x03 },
+    { "BLOCK",     0x64, 0x04 },
+    { "FCHR",      0x64, 0x05 },
+    { "FCOL",      0x64, 0x06 },
+    { "FILL",      0x64, 0x07 },
+    { "REC",       0x64, 0x08 },
+    { "ROT",       0x64, 0x09 },
+    { "DRAW",      0x64, 0x0A },
+    { "CHAR",      0x64, 0x0B },
+    { "HI COL",    0x64, 0x0C },
+    { "INV",       0x64, 0x0D },
+    { "FRAC",      0x64, 0x0E },
+    { "MOVE",      0x64, 0x0F },
+    { "PLACE",     0x64, 0x10 },
+    { "UPB",       0x64, 0x11 },
+    { "UPW",       0x64, 0x12 },
+    { "LEFTW",     0x64, 0x13 },
+    { "LEFTB",     0x64, 0x14 },
+    { "DOWNB",     0x64, 0x15 },
+    { "DOWNW",     0x64, 0x16 },
+    { "RIGHTB",    0x64, 0x17 },
+    { "RIGHTW",    0x64, 0x18 },
+    { "MULTI",     0x64, 0x19 },
+    { "COLOUR",    0x64, 0x1A },
+    { "MMOB",      0x64, 0x1B },
+    { "BFLASH",    0x64, 0x1C },
+    { "MOB SET",   0x64, 0x1D },
+    { "MUSIC",     0x64, 0x1E },
+    { "FLASH",     0x64, 0x1F },
+    { "REPEAT",    0x64, 0x20 },
+    { "PLAY",      0x64, 0x21 },
+    { "CENTRE",    0x64, 0x23 },
+    { "ENVELOPE",  0x64, 0x24 },
+    { "CGOTO",     0x64, 0x25 },
+    { "WAVE",      0x64, 0x26 },
+    { "FETCH",     0x64, 0x27 },
+    { "AT(",       0x64, 0x28 },
+    { "UNTIL",     0x64, 0x29 },
+    { "USE",       0x64, 0x2C },
+    { "GLOBAL",    0x64, 0x2E },
+    { "RESET",     0x64, 0x30 },
+    { "PROC",      0x64, 0x31 },
+    { "CALL",      0x64, 0x32 },
+    { "EXEC",      0x64, 0x33 },
+    { "END PROC",  0x64, 0x34 },
+    { "EXIT",      0x64, 0x35 },
+    { "END LOOP",  0x64, 0x36 },
+    { "ON KEY",    0x64, 0x37 },
+    { "DISABLE",   0x64, 0x38 },
+    { "RESUME",    0x64, 0x39 },
+    { "LOOP",      0x64, 0x3A },
+    { "DELAY",     0x64, 0x3B },
+    { "SECURE",    0x64, 0x40 },
+    { "DISAPA",    0x64, 0x41 },
+    { "CIRCLE",    0x64, 0x42 },
+    { "ON ERROR",  0x64, 0x43 },
+    { "NO ERROR",  0x64, 0x44 },
+    { "LOCAL",     0x64, 0x45 },
+    { "RCOMP",     0x64, 0x46 },
+    { "ELSE",      0x64, 0x47 },
+    { "RETRACE",   0x64, 0x48 },
+    { "TRACE",     0x64, 0x49 },
+    { "DIR",       0x64, 0x4A },
+    { "PAGE",      0x64, 0x4B },
+    { "DUMP",      0x64, 0x4C },
+    { "FIND",      0x64, 0x4D },
+    { "OPTION",    0x64, 0x4E },
+    { "AUTO",      0x64, 0x4F },
+    { "OLD",       0x64, 0x50 },
+    { "JOY",       0x64, 0x51 },
+    { "MOD",       0x64, 0x52 },
+    { "DIV",       0x64, 0x53 },
+    { "DUP",       0x64, 0x55 },
+    { "INKEY",     0x64, 0x56 },
+    { "INST",      0x64, 0x57 },
+    { "TEST",      0x64, 0x58 },
+    { "LIN",       0x64, 0x59 },
+    { "EXOR",      0x64, 0x5A },
+    { "INSERT",    0x64, 0x5B },
+    { "POT",       0x64, 0x5C },
+    { "PENX",      0x64, 0x5D },
+    { "PENY",      0x64, 0x5F },
+    { "SOUND",     0x64, 0x60 },
+    { "GRAPHICS",  0x64, 0x61 },
+    { "DESIGN",    0x64, 0x62 },
+    { "RLOCMOB",   0x64, 0x63 },
+    { "CMOB",      0x64, 0x64 },
+    { "BCKGNDS",   0x64, 0x65 },
+    { "PAUSE",     0x64, 0x66 },
+    { "NRM",       0x64, 0x67 },
+    { "MOB OFF",   0x64, 0x68 },
+    { "OFF",       0x64, 0x69 },
+    { "ANGL",      0x64, 0x6A },
+    { "ARC",       0x64, 0x6B },
+    { "COLD",      0x64, 0x6C },
+    { "SCRSV",     0x64, 0x6D },
+    { "SCRLD",     0x64, 0x6E },
+    { "TEXT",      0x64, 0x6F },
+    { "CSET",      0x64, 0x70 },
+    { "VOL",       0x64, 0x71 },
+    { "DISK",      0x64, 0x72 },
+    { "HRDCPY",    0x64, 0x73 },
+    { "KEY",       0x64, 0x74 },
+    { "PAINT",     0x64, 0x75 },
+    { "LOW COL",   0x64, 0x76 },
+    { "COPY",      0x64, 0x77 },
+    { "MERGE",     0x64, 0x78 },
+    { "RENUMBER",  0x64, 0x79 },
+    { "MEM",       0x64, 0x7A },
+    { "DETECT",    0x64, 0x7B },
+    { "CHECK",     0x64, 0x7C },
+    { "DISPLAY",   0x64, 0x7D },
+    { "ERR",       0x64, 0x7E },
+    { "OUT",       0x64, 0x7F },
+    { 0 }
+};
+
+/* Dialects selectable with --dialect. V2 adds nothing to token_list. */
+struct dialect
+{
+  char*                   name;
+  struct dialect_keyword* keywords;
+};
+
+struct dialect dialects[] =
+{
+    { "v2",     0 },
+    { "3.5",    basic35_keywords },
+    { "7.0",    basic70_keywords },
+    { "simons", simons_keywords },
+};
+
+
 /* Maximum line length in C64 BASIC is 80 chars (two physical 40-char
    lines). Allocate a very large buffer for potential insertion of
    PETSCII placeholder strings. */
@@ -395,7 +887,7 @@ struct BASIC_line
   u32    source_line_number;
   char   source_line[MAX_SOURCE_LINE_LEN];
   byte_t tokenized_line[MAX_SOURCE_LINE_LEN];
-  char   label[MAX_LABEL_LENGTH];
+  char   label[MAX_LABEL_LENGTH+1];
 
   struct BASIC_line*   next;
 };
@@ -404,14 +896,33 @@ struct BASIC_program
 {
   s32    last_line_no;
   struct BASIC_line*   first_line;
+  struct BASIC_line*   tail_line;   /* Last line added */
+  BOOL   unsorted;                  /* Lines were added out of order */
 };
 struct BASIC_program program;
 
+/* The line numbers an INCBIN directive took for its bytes */
+struct incbin_range
+{
+  s32    line_no;             /* The directive's own line */
+  s32    first;
+  s32    last;
+  u32    source_line_number;
+};
+
 struct source_file
 {
   char* buffer;
   u32   buf_len;
-  u32   pos;
+};
+
+/* An input of --link, with the offset to add to its line numbers */
+#define MAX_LINK_INPUTS  64
+
+struct link_input
+{
+  char*  path;
+  s32    offset;
 };
 
 struct global_args
@@ -419,9 +930,37 @@ struct global_args
   char*   src_path;
   char*   prg_path;
   u16     load_address;
+  BOOL    renumber;
+  BOOL    fold_constants;
+  BOOL    cost_report;
+  BOOL    memory_report;
+  BOOL    skip_unchanged;
+  u32     max_size;
+  BOOL    pack;
+  BOOL    show_alloc_stats;
+  u32     max_alloc_per_line;
+  BOOL    order_variables;
+  BOOL    framed;
+  struct dialect* dialect;
+  BOOL    link;
+  struct link_input link_inputs[MAX_LINK_INPUTS];
+  u32     num_link_inputs;
+  s32     link_offset;
+  u64     fuzz_iterations;
+  u64     fuzz_seed;
+  char*   prgdc_path;
+  BOOL    lsp;
 };
 struct global_args args;
 
+/* If set, SyntaxError jumps here instead of exiting, so that one bad
+   program doesn't end a run over many. Messages are suppressed if
+   syntax_error_quiet is set, but the last one is kept in
+   syntax_error_message. */
+jmp_buf* syntax_error_jump;
+BOOL     syntax_error_quiet;
+char     syntax_error_message[512];
+
 
 /*
   SyntaxError
@@ -433,94 +972,306 @@ SyntaxError(s32 line_no, char* msg, ...)
 {
   /* TODO: Rework this to use the line number within the source file
      instead of the BASIC line number */
-  char buffer[512];
   va_list args;
   va_start(args, msg);
-  vsprintf(buffer, msg, args);
+  vsnprintf(syntax_error_message, sizeof(syntax_error_message), msg, args);
   va_end(args);
+  if (syntax_error_jump &&
+      syntax_error_quiet)
+    longjmp(*syntax_error_jump, 1);
+
   fprintf(stderr, "SYNTAX ERROR: ");
   if (line_no >= 0)
     fprintf(stderr, "Line %u: ", (u16)line_no);
-  fprintf(stderr, "%s\n", buffer);
+  fprintf(stderr, "%s\n", syntax_error_message);
 
+  if (syntax_error_jump)
+    longjmp(*syntax_error_jump, 1);
   exit(-1);
 }
 
 
 /*
-  StripWhitespace
+  Keyword lookup
 
-  Remove beginning and trailing whitespace from line.
+  TranslateToken is called for every byte in the inner loops of many
+  passes, and TokenizeLine tries the keywords at every position of a
+  line, so token_list is indexed on first use: by a hash of each
+  keyword, and by first character in token order.
 */
-void
-StripWhitespace(char* line)
+#define TOKEN_HASH_SIZE  256   /* A power of two, well above NUM_BASIC_TOKENS */
+
+struct keyword_index
 {
-  if (strlen(line) < 1) return;
+  BOOL   built;
+  s32    hashed[TOKEN_HASH_SIZE];   /* Token index, or -1 */
+  u8     by_first[NUM_BASIC_TOKENS];
+  u8     first[257];                /* Range of by_first per first character */
+};
+struct keyword_index keyword_index;
+
+
+/*
+  HashKeyword
+*/
+u32
+HashKeyword(char* keyword)
+{
+  u32 hash = 2166136261u;
+  for (; *keyword; ++keyword)
+    hash = (hash ^ (byte_t)*keyword) * 16777619u;
+  return hash & (TOKEN_HASH_SIZE - 1);
+}
 
-  /* Skip past beginning whitespace */
-  u16 begin = 0;
-  while (line[begin] &&
-         (line[begin] == ' ' ||
-          line[begin] == '\t'))
-    ++begin;
 
-  /* Copy from beginning of non-whitespace to front of line */
-  if (begin > 0)
+/*
+  BuildKeywordIndex
+*/
+void
+BuildKeywordIndex()
+{
+  for (u32 i = 0; i < TOKEN_HASH_SIZE; ++i)
+    keyword_index.hashed[i] = -1;
+  for (u32 i = 0; i < NUM_BASIC_TOKENS; ++i)
   {
-    char temp_buffer[MAX_SOURCE_LINE_LEN];
-    memset(temp_buffer, 0, MAX_SOURCE_LINE_LEN);
-    strncpy(temp_buffer, &line[begin], MAX_SOURCE_LINE_LEN);
-    strncpy(line, temp_buffer, MAX_SOURCE_LINE_LEN);
+    u32 slot = HashKeyword(token_list[i]);
+    while (keyword_index.hashed[slot] >= 0)
+      slot = (slot + 1) & (TOKEN_HASH_SIZE - 1);
+    keyword_index.hashed[slot] = i;
   }
-  if (strlen(line) < 1) return;
 
-  u16 end = strlen(line)-1;
-  while (end > 0 &&
-         (line[end] == ' ' ||
-          line[end] == '\t'))
-    --end;
-  line[end+1] = '\0';
+  u32 n = 0;
+  for (u32 c = 0; c < 256; ++c)
+  {
+    keyword_index.first[c] = n;
+    for (u32 i = 0; i < NUM_BASIC_TOKENS; ++i)
+      if ((byte_t)token_list[i][0] == c)
+        keyword_index.by_first[n++] = i;
+  }
+  keyword_index.first[256] = n;
+  keyword_index.built = TRUE;
 }
 
 
 /*
-  ConvertLowercaseToUppercase
+  FindTokenIndex
 
-  Convert all lowercase alpabetic characters in line to
-  uppercase. This is necessary for compatibility with the C64's
-  PETSCII character set.
+  Return the index of keyword in token_list, or -1.
 */
-void
-ConvertLowercaseToUppercase(char* line)
+int
+FindTokenIndex(char* keyword)
 {
-  while (*line)
+  if (!keyword_index.built)
+    BuildKeywordIndex();
+  for (u32 slot = HashKeyword(keyword);
+       keyword_index.hashed[slot] >= 0;
+       slot = (slot + 1) & (TOKEN_HASH_SIZE - 1))
   {
-    if (*line >= 'a' &&
-        *line <= 'z')
-      *line -= 0x20;
-    ++line;
+    if (strcmp(keyword, token_list[keyword_index.hashed[slot]]) == 0)
+      return keyword_index.hashed[slot];
   }
+  return -1;
 }
 
 
 /*
-  FindTokenIndex
+  MatchKeyword
+
+  Find the first V2 keyword, in token order, at the start of text.
 
-  Return the index of keyword in token_list.
+  Returns its index in token_list, or -1 if none matches.
 */
 int
-FindTokenIndex(char* keyword)
+MatchKeyword(byte_t* text)
 {
-  for (u8 i = 0;
-       i < (sizeof(token_list) / sizeof(char*));
+  if (!keyword_index.built)
+    BuildKeywordIndex();
+  for (u32 i = keyword_index.first[text[0]];
+       i < keyword_index.first[text[0] + 1];
        ++i)
   {
-    if (strcmp(keyword, token_list[i]) == 0)
-      return (int)i;
+    char* keyword = token_list[keyword_index.by_first[i]];
+    if (strncmp((char*)text, keyword, strlen(keyword)) == 0)
+      return keyword_index.by_first[i];
   }
   return -1;
 }
 
+/*
+  Dialect keyword matching
+
+  TokenizeLine tries the keywords of the selected dialect before the
+  V2 keywords, since Simons' BASIC reads ON ERROR before ON. The
+  keywords are indexed by first character, longest first, so that
+  only keywords that can match are compared and DOPEN is preferred to
+  DO. With V2 the index is empty and TokenizeLine skips it.
+*/
+#define MAX_DIALECT_PREFIXES  4
+
+struct dialect_matcher
+{
+  struct dialect_keyword** keywords;
+  u32    first[257];  /* keywords[first[c]] is the first starting with c */
+
+  /* Keywords by token, for reading tokenized lines back */
+  char*  token_text[256];
+  byte_t prefixes[MAX_DIALECT_PREFIXES];
+  u32    num_prefixes;
+  char*  prefixed_text[MAX_DIALECT_PREFIXES][256];
+};
+struct dialect_matcher dialect_matcher;
+
+
+/*
+  Dialect_Find
+
+  Return the dialect named name, or NULL if there is none.
+*/
+struct dialect*
+Dialect_Find(char* name)
+{
+  for (u32 i = 0;
+       i < sizeof(dialects) / sizeof(dialects[0]);
+       ++i)
+  {
+    if (strcmp(dialects[i].name, name) == 0)
+      return &dialects[i];
+  }
+  return 0;
+}
+
+
+/*
+  Dialect_CompareKeywords
+
+  qsort comparator ordering dialect keywords by first character, and
+  by descending length within the same first character.
+*/
+int
+Dialect_CompareKeywords(const void* a, const void* b)
+{
+  const struct dialect_keyword* keyword_a = *(struct dialect_keyword* const*)a;
+  const struct dialect_keyword* keyword_b = *(struct dialect_keyword* const*)b;
+  byte_t first_a = (byte_t)keyword_a->keyword[0];
+  byte_t first_b = (byte_t)keyword_b->keyword[0];
+  if (first_a != first_b)
+    return (int)first_a - (int)first_b;
+  int len_a = strlen(keyword_a->keyword);
+  int len_b = strlen(keyword_b->keyword);
+  if (len_a != len_b)
+    return len_b - len_a;
+  return (keyword_a > keyword_b) - (keyword_a < keyword_b);
+}
+
+
+/*
+  Dialect_BuildMatcher
+
+  Index the keywords of dialect in dialect_matcher.
+*/
+void
+Dialect_BuildMatcher(struct dialect* dialect)
+{
+  Counted_Free(dialect_matcher.keywords);
+  memset(&dialect_matcher, 0, sizeof(dialect_matcher));
+  if (!dialect->keywords)
+    return;
+
+  u32 num_keywords = 0;
+  while (dialect->keywords[num_keywords].keyword)
+    ++num_keywords;
+  dialect_matcher.keywords = (struct dialect_keyword**)Counted_Malloc(num_keywords * sizeof(struct dialect_keyword*));
+  for (u32 i = 0; i < num_keywords; ++i)
+    dialect_matcher.keywords[i] = &dialect->keywords[i];
+  qsort(dialect_matcher.keywords, num_keywords, sizeof(struct dialect_keyword*),
+        Dialect_CompareKeywords);
+
+  u32 i = 0;
+  for (u32 c = 0; c < 256; ++c)
+  {
+    dialect_matcher.first[c] = i;
+    while (i < num_keywords &&
+           (byte_t)dialect_matcher.keywords[i]->keyword[0] == c)
+      ++i;
+  }
+  dialect_matcher.first[256] = num_keywords;
+
+  for (i = 0; i < num_keywords; ++i)
+  {
+    struct dialect_keyword* keyword = &dialect->keywords[i];
+    if (!keyword->prefix)
+    {
+      dialect_matcher.token_text[keyword->token] = keyword->keyword;
+      continue;
+    }
+    u32 p = 0;
+    while (p < dialect_matcher.num_prefixes &&
+           dialect_matcher.prefixes[p] != keyword->prefix)
+      ++p;
+    if (p == dialect_matcher.num_prefixes)
+    {
+      assert(p < MAX_DIALECT_PREFIXES);
+      dialect_matcher.prefixes[dialect_matcher.num_prefixes++] = keyword->prefix;
+    }
+    dialect_matcher.prefixed_text[p][keyword->token] = keyword->keyword;
+  }
+}
+
+
+/*
+  Dialect_MatchKeyword
+
+  Find the longest keyword of the selected dialect at the start of
+  text.
+
+  Returns the keyword, or NULL if none matches.
+*/
+struct dialect_keyword*
+Dialect_MatchKeyword(byte_t* text)
+{
+  for (u32 i = dialect_matcher.first[text[0]];
+       i < dialect_matcher.first[text[0] + 1];
+       ++i)
+  {
+    struct dialect_keyword* keyword = dialect_matcher.keywords[i];
+    if (strncmp((char*)text, keyword->keyword, strlen(keyword->keyword)) == 0)
+      return keyword;
+  }
+  return 0;
+}
+
+
+/*
+  TokenText
+
+  Return the keyword of the token at the start of tokenized text,
+  storing the number of bytes the token takes in len: two for the
+  prefixed tokens of a dialect, otherwise one. The selected dialect's
+  tokens are looked up before the V2 tokens.
+
+  Returns NULL if text doesn't start with a token.
+*/
+char*
+TokenText(byte_t* text, u32* len)
+{
+  *len = 1;
+  for (u32 p = 0; p < dialect_matcher.num_prefixes; ++p)
+  {
+    if (text[0] == dialect_matcher.prefixes[p] &&
+        dialect_matcher.prefixed_text[p][text[1]])
+    {
+      *len = 2;
+      return dialect_matcher.prefixed_text[p][text[1]];
+    }
+  }
+  if (dialect_matcher.token_text[text[0]])
+    return dialect_matcher.token_text[text[0]];
+  if (text[0] >= 0x80 &&
+      text[0] < 0x80 + NUM_BASIC_TOKENS)
+    return token_list[text[0] - 0x80];
+  return 0;
+}
+
 
 /*
   IsValidLabelChar
@@ -543,8 +1294,8 @@ IsValidLabelChar(char c)
 /*
   IsLabel
 
-  Determine if a line is a label. Labels must follow the following
-  format:
+  Determine if the len bytes of line, stripped of whitespace, are a
+  label. Labels must follow the following format:
 
    - Must be alone on a line Must be no longer than MAX_LABEL_LENGTH
      (32) *without* the trailing colon
@@ -557,25 +1308,18 @@ IsValidLabelChar(char c)
   Returns TRUE if line designates a label, FALSE otherwise
 */
 BOOL
-IsLabel(char* line)
+IsLabel(char* line, u32 len)
 {
-  StripWhitespace(line);
-
-  char* c = line;
-  if (strlen(line) > MAX_LABEL_LENGTH+1)
-    return FALSE;
-  if (!isalpha(*c))
+  if (!isalpha(line[0]) ||
+      line[len-1] != ':')
     return FALSE;
-  while (*c != ':')
+  for (u32 i = 0; i < len-1; ++i)
   {
-    if (!IsValidLabelChar(*c))
+    if (!IsValidLabelChar(line[i]))
       return FALSE;
-    ++c;
   }
-  if (*(++c) != '\0')
-    return FALSE;
 
-  if (strlen(line) > MAX_LABEL_LENGTH+1)
+  if (len > MAX_LABEL_LENGTH+1)
   {
     SyntaxError(-1, "Label length too long (maximum: %u)", MAX_LABEL_LENGTH);
     return FALSE;  /* This shouldn't actually return. (SyntaxError exits) */
@@ -584,10 +1328,13 @@ IsLabel(char* line)
   /* Check for conflict with BASIC keywords */
   char temp_label[MAX_LABEL_LENGTH+1];
   /* -1 to remove trailing colon */
-  strncpy(temp_label, line, strlen(line)-1);
-  if (FindTokenIndex(temp_label) >= 0)
+  memcpy(temp_label, line, len-1);
+  temp_label[len-1] = '\0';
+  struct dialect_keyword* dialect_keyword = Dialect_MatchKeyword((byte_t*)temp_label);
+  if (FindTokenIndex(temp_label) >= 0 ||
+      (dialect_keyword && strcmp(dialect_keyword->keyword, temp_label) == 0))
   {
-    SyntaxError(-1, "Label conflicts with BASIC keyword: %s\n", temp_label);
+    SyntaxError(-1, "Label conflicts with BASIC keyword: %s", temp_label);
     return FALSE;  /* This shouldn't actually return. (SyntaxError exits) */
   }
 
@@ -596,76 +1343,56 @@ IsLabel(char* line)
 
 
 /*
-  ReplaceStringWithByte
+  FindPETSCIIPlaceholderIndex
 
-  Replace first occurance of target in line with byte.
-  
-  Returns non-zero if a replacement occurs, zero in no replacement
-  occurs.
+  Return the index in PETSCII_table of the len characters of
+  placeholder, or -1 if they aren't a placeholder. Placeholders are
+  looked up by binary search in an index sorted by name; names that
+  appear more than once in PETSCII_table give their first index.
 */
-int
-ReplaceStringWithByte(byte_t* line, char* target, byte_t byte)
-{
-  char* location = strstr((char*)line, target);
-  if (!location) return 0;
-
-  u16 target_len = strlen(target);
-  if (target_len == 1)
-  {
-    location[0] = byte;
-    return 1;
-  }
-
-  char buffer[MAX_SOURCE_LINE_LEN];
-  buffer[0] = byte;
-  buffer[1] = 0;
-  strcat(buffer, &location[target_len]);
-  strcpy(location, buffer);
-
-  return 1;
-}
-
+#define NUM_PETSCII_CODES  (sizeof(PETSCII_table) / sizeof(char*))
+u8  sorted_placeholders[NUM_PETSCII_CODES];
+u32 num_sorted_placeholders;
 
-/*
-  ReplaceStringWithString
-  
-  Replace first occurance in dst of target with sub.
-  
-  Returns non-zero if a replacement occurs, zero in no replacement
-  occurs.
-*/
 int
-ReplaceStringWithString(char* dst, char* target, char* sub)
+ComparePlaceholders(const void* a, const void* b)
 {
-  char* location = strstr(dst, target);
-  if (!location) return 0;
-
-  u16 target_len = strlen(target);
-  u16 sub_len    = strlen(sub);
-
-  char buffer[MAX_SOURCE_LINE_LEN];
-  memset(buffer, 0, MAX_SOURCE_LINE_LEN);
-  strncpy(buffer, sub, sub_len);
-  strcat(buffer, &location[target_len]);
-  strcpy(location, buffer);
-
-  return 1;
+  u8 index_a = *(const u8*)a;
+  u8 index_b = *(const u8*)b;
+  int order = strcmp(PETSCII_table[index_a], PETSCII_table[index_b]);
+  return order ? order : (int)index_a - (int)index_b;
 }
 
-/*
-  FindPETSCIIPlaceholderIndex
-
-  Return the index of placeholder in PETSCII_table.
-*/
 int
-FindPETSCIIPlaceholderIndex(char* placeholder)
+FindPETSCIIPlaceholderIndex(char* placeholder, u32 len)
 {
-  for (u16 i = 0;
-       i < (sizeof(PETSCII_table) / sizeof(char*));
-       ++i)
+  if (!num_sorted_placeholders)
+  {
+    for (u32 i = 0; i < NUM_PETSCII_CODES; ++i)
+      if (PETSCII_table[i][0] == '{')
+        sorted_placeholders[num_sorted_placeholders++] = i;
+    qsort(sorted_placeholders, num_sorted_placeholders, sizeof(u8), ComparePlaceholders);
+  }
+
+  /* Find the first entry not less than placeholder */
+  u32 low = 0;
+  u32 high = num_sorted_placeholders;
+  while (low < high)
+  {
+    u32 mid = (low + high) / 2;
+    char* name = PETSCII_table[sorted_placeholders[mid]];
+    int order = strncmp(name, placeholder, len);
+    if (order < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low < num_sorted_placeholders)
   {
-    if (strcmp(placeholder, PETSCII_table[i]) == 0)
-      return (int)i;
+    char* name = PETSCII_table[sorted_placeholders[low]];
+    if (strncmp(name, placeholder, len) == 0 &&
+        name[len] == '\0')
+      return sorted_placeholders[low];
   }
   return -1;
 }
@@ -714,23 +1441,38 @@ TranslatePETSCIIPlaceholder(char* string)
   Translate a string from ASCII encoding to PETSCII, translating
   placeholder strings where necessary.
 */
+#define MAX_PLACEHOLDER_LEN  64
 void
 TranslateASCIIToPETSCII(byte_t* line)
 {
-  /* For each possible placeholder string, scan the line for the
-     placeholder, and replace any found placeholder with the correct
-     string */
-  for (u16 petscii_index = 0;
-       petscii_index < (sizeof(PETSCII_table) / sizeof(char*));
-       ++petscii_index)
+  /* Placeholders only ever shrink the line, so the translation is
+     written over the line as it is read */
+  u32 read  = 0;
+  u32 write = 0;
+  while (line[read])
   {
-    char* location = (char*)line;
-    while ((location = strstr(location, PETSCII_table[petscii_index])))
+    if (line[read] == '{')
     {
-      ReplaceStringWithByte((byte_t*)location, PETSCII_table[petscii_index], (byte_t)petscii_index);
-      ++location;
+      u32 close = read + 1;
+      while (line[close] &&
+             line[close] != '}' &&
+             close - read < MAX_PLACEHOLDER_LEN)
+        ++close;
+      if (line[close] == '}')
+      {
+        u32 len = close - read + 1;
+        int petscii_index = FindPETSCIIPlaceholderIndex((char*)&line[read], len);
+        if (petscii_index >= 0)
+        {
+          line[write++] = (byte_t)petscii_index;
+          read += len;
+          continue;
+        }
+      }
     }
+    line[write++] = line[read++];
   }
+  line[write] = 0;
 }
 
 /*
@@ -773,72 +1515,300 @@ Program_AddLine(struct BASIC_program* program, struct BASIC_line* line)
   if (line->line_no < 0)
     line->line_no = program->last_line_no + 1;
 
+  /* The line is freed before reporting an error, since SyntaxError
+     may jump back to a caller that carries on, such as the fuzzer */
   if (line->line_no > MAX_LINE_NUMBER)
   {
-    SyntaxError(line->line_no, "Line number too high (maximum: %d)", MAX_LINE_NUMBER);
+    s32 line_no = line->line_no;
+    Counted_Free(line);
+    SyntaxError(line_no, "Line number too high (maximum: %d)", MAX_LINE_NUMBER);
   }
 
-  /* Are we the first line? */
+  /* Lines are appended in source order, which is usually ascending.
+     Others are put in order, and checked for duplicates, by
+     Program_SortLines once the whole source has been read. */
   if (!program->first_line)
-  {
     program->first_line = line;
-    program->last_line_no = line->line_no;
-    return;
-  }
-
-  /* We *are NOT* the first line */
-  struct BASIC_line* prev_line = 0;
-  struct BASIC_line* curr_line = program->first_line;
-  while (curr_line)
+  else
   {
-    /* Check for duplicate line numbers */
-    if (line->line_no == curr_line->line_no)
-    {
-      fprintf(stderr, "%s\n", (char*)line->source_line);
-      SyntaxError(line->line_no, "Duplicate line number");
-    }
-    /* Sort by line numbers, ascending */
-    if (line->line_no < curr_line->line_no) 
-    {
-      prev_line->next = line;
-      line->next = curr_line;
-      program->last_line_no = line->line_no;
-      return;
-    }
-
-    prev_line = curr_line;
-    curr_line = curr_line->next;
+    if (line->line_no <= program->tail_line->line_no)
+      program->unsorted = TRUE;
+    program->tail_line->next = line;
   }
-  /* We've reached the end of the list; append line */
-  prev_line->next = line;
+  program->tail_line = line;
   program->last_line_no = line->line_no;
 }
 
 
 /*
-  Program_FindLineNumberByLabel
-  
-  Find the BASIC line number in program associated with label.
-  
-  Returns the associated line number if the label exists, or -1 if the
-  label does not exist.
+  Program_CompareLines
+
+  qsort comparator ordering lines by line number, and by position in
+  the source within equal line numbers.
 */
-s32
-Program_FindLineNumberByLabel(struct BASIC_program* program, char* label)
+int
+Program_CompareLines(const void* a, const void* b)
 {
-  if (!program ||
-      !program->first_line)
-    return -1; /* Empty or non-existing program */
+  const struct BASIC_line* line_a = *(const struct BASIC_line**)a;
+  const struct BASIC_line* line_b = *(const struct BASIC_line**)b;
+  if (line_a->line_no != line_b->line_no)
+    return (line_a->line_no > line_b->line_no) - (line_a->line_no < line_b->line_no);
+  return (line_a->source_line_number > line_b->source_line_number) -
+         (line_a->source_line_number < line_b->source_line_number);
+}
 
-  struct BASIC_line* line = program->first_line;
-  while(line)
-  {
-    if (strncmp(line->label, label, MAX_LABEL_LENGTH) == 0)
-      return line->line_no;
-    line = line->next;
-  }
 
-  return -1;
+/*
+  Program_SortLines
+
+  Put the lines of program in order of line number, if they were added
+  out of order, and report duplicate line numbers and lines that fall
+  among the DATA lines of one of the num_incbins INCBIN directives in
+  incbins.
+*/
+void
+Program_SortLines(struct BASIC_program* program, struct incbin_range* incbins,
+                  u32 num_incbins)
+{
+  if (!program->unsorted)
+    return;
+
+  u32 num_lines = 0;
+  for (struct BASIC_line* line = program->first_line; line; line = line->next)
+    ++num_lines;
+  struct BASIC_line** lines =
+    (struct BASIC_line**)Counted_Malloc(num_lines * sizeof(struct BASIC_line*));
+  u32 i = 0;
+  for (struct BASIC_line* line = program->first_line; line; line = line->next)
+    lines[i++] = line;
+  qsort(lines, num_lines, sizeof(struct BASIC_line*), Program_CompareLines);
+
+  /* The list is still in source order, so an error leaves it intact
+     for Program_Free */
+  for (u32 j = 0; j < num_incbins; ++j)
+  {
+    struct incbin_range* incbin = &incbins[j];
+    u32 low = 0;
+    u32 high = num_lines;
+    while (low < high)
+    {
+      u32 mid = low + (high - low) / 2;
+      if (lines[mid]->line_no < incbin->first)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    for (i = low; i < num_lines && lines[i]->line_no <= incbin->last; ++i)
+    {
+      if (lines[i]->source_line_number != incbin->source_line_number)
+      {
+        s32 line_no = lines[i]->line_no;
+        Counted_Free(lines);
+        SyntaxError(incbin->line_no, "INCBIN needs lines %d to %d for its bytes, "
+                    "which overlap line %d", incbin->first, incbin->last, line_no);
+      }
+    }
+  }
+  for (i = 1; i < num_lines; ++i)
+  {
+    if (lines[i]->line_no == lines[i-1]->line_no)
+    {
+      struct BASIC_line* line = lines[i];
+      Counted_Free(lines);
+      if (!syntax_error_quiet)
+        fprintf(stderr, "%s\n", (char*)line->source_line);
+      SyntaxError(line->line_no, "Duplicate line number");
+    }
+  }
+
+  for (i = 0; i + 1 < num_lines; ++i)
+    lines[i]->next = lines[i+1];
+  lines[num_lines-1]->next = 0;
+  program->first_line = lines[0];
+  program->tail_line = lines[num_lines-1];
+  program->unsorted = FALSE;
+  Counted_Free(lines);
+}
+
+
+/*
+  Program_Free
+
+  Free all lines of program.
+*/
+void
+Program_Free(struct BASIC_program* program)
+{
+  struct BASIC_line* line = program->first_line;
+  while (line)
+  {
+    struct BASIC_line* next = line->next;
+    Counted_Free(line);
+    line = next;
+  }
+  program->first_line = 0;
+  program->tail_line = 0;
+  program->unsorted = FALSE;
+}
+
+
+/*
+  Structural scanning
+
+  ScanLine finds all quotes and colons of a line at once, 32 or 16
+  bytes at a time where the compiler targets AVX2 or SSE2, and byte by
+  byte otherwise. A prefix XOR over the quote positions then gives the
+  mask of bytes within strings. Scanning code can skip quoted text and
+  find the next unquoted colon with a bit scan instead of walking the
+  line.
+*/
+#define SCAN_WORDS  ((MAX_SOURCE_LINE_LEN + 63) / 64)
+
+struct line_scan
+{
+  u32    len;
+  u64    quotes[SCAN_WORDS];
+  u64    colons[SCAN_WORDS];
+  u64    quoted[SCAN_WORDS];  /* Strings, including their quotes */
+};
+
+
+/*
+  LowestBit
+
+  Return the index of the lowest set bit in the non-zero value bits.
+*/
+u32
+LowestBit(u64 bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  u32 index = 0;
+  while (!(bits & 1))
+  {
+    bits >>= 1;
+    ++index;
+  }
+  return index;
+#endif
+}
+
+
+/*
+  ScanLine
+
+  Build the quote, colon and quoted masks of the len bytes of line.
+*/
+void
+ScanLine(byte_t* line, u32 len, struct line_scan* scan)
+{
+  u32 num_words = len / 64 + 1;
+  assert(num_words <= SCAN_WORDS);
+  scan->len = len;
+  memset(scan->quotes, 0, num_words * sizeof(u64));
+  memset(scan->colons, 0, num_words * sizeof(u64));
+
+  u32 i = 0;
+#if defined(__AVX2__)
+  const __m256i quote_32 = _mm256_set1_epi8('"');
+  const __m256i colon_32 = _mm256_set1_epi8(':');
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)&line[i]);
+    u32 quotes = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote_32));
+    u32 colons = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, colon_32));
+    scan->quotes[i / 64] |= (u64)quotes << (i % 64);
+    scan->colons[i / 64] |= (u64)colons << (i % 64);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote_16 = _mm_set1_epi8('"');
+  const __m128i colon_16 = _mm_set1_epi8(':');
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&line[i]);
+    u32 quotes = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote_16));
+    u32 colons = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, colon_16));
+    scan->quotes[i / 64] |= (u64)quotes << (i % 64);
+    scan->colons[i / 64] |= (u64)colons << (i % 64);
+  }
+#endif
+  for (; i < len; ++i)
+  {
+    if (line[i] == '"')
+      scan->quotes[i / 64] |= 1ULL << (i % 64);
+    else if (line[i] == ':')
+      scan->colons[i / 64] |= 1ULL << (i % 64);
+  }
+
+  /* Each bit of the prefix XOR of the quote bits tells whether an odd
+     number of quotes precede or are at that byte: set from an opening
+     quote up to, but not including, its closing quote. An unterminated
+     string runs to the end of the line. */
+  u64 carry = 0;
+  for (u32 word = 0; word < num_words; ++word)
+  {
+    u64 inside = scan->quotes[word];
+    inside ^= inside << 1;
+    inside ^= inside << 2;
+    inside ^= inside << 4;
+    inside ^= inside << 8;
+    inside ^= inside << 16;
+    inside ^= inside << 32;
+    inside ^= carry;
+    scan->quoted[word] = inside | scan->quotes[word];
+    carry = 0 - (inside >> 63);
+  }
+}
+
+
+/*
+  Scan_NextUnquoted
+
+  Return the position of the first byte at or after pos that isn't
+  part of a string, or the line length if there is none.
+*/
+u32
+Scan_NextUnquoted(struct line_scan* scan, u32 pos)
+{
+  for (u32 word = pos / 64;
+       word * 64 < scan->len;
+       ++word)
+  {
+    u64 bits = ~scan->quoted[word];
+    if (word == pos / 64)
+      bits &= ~0ULL << (pos % 64);
+    if (bits)
+    {
+      u32 next = word * 64 + LowestBit(bits);
+      return (next < scan->len) ? next : scan->len;
+    }
+  }
+  return scan->len;
+}
+
+
+/*
+  Scan_NextUnquotedColon
+
+  Return the position of the first colon at or after pos that isn't
+  part of a string, or the line length if there is none.
+*/
+u32
+Scan_NextUnquotedColon(struct line_scan* scan, u32 pos)
+{
+  for (u32 word = pos / 64;
+       word * 64 < scan->len;
+       ++word)
+  {
+    u64 bits = scan->colons[word] & ~scan->quoted[word];
+    if (word == pos / 64)
+      bits &= ~0ULL << (pos % 64);
+    if (bits)
+      return word * 64 + LowestBit(bits);
+  }
+  return scan->len;
 }
 
 
@@ -853,66 +1823,106 @@ TokenizeLine(byte_t* line)
 {
   /* 
      For each byte, do a string compare against every
-     keyword/operator. If matched, replace the keyword/operator with
-     the correct token.
+     keyword/operator. If matched, emit the correct token instead of
+     the keyword/operator. Tokens are never longer than their
+     keywords, so the output is written over the line as it is read.
 
      Note the following conditions:
      
+     - Nothing within quotes is tokenized
+
      - If a REM statement is encountered, all remaining characters on
      the line should be copied directly (not tokenized)
        
      - If a DATA statement is encountered, all characters should be
-     copied directly (not tokenized) up until either a ':' or end of
-     line
+     copied directly (not tokenized) up until either a ':' outside
+     quotes or end of line
   */
-  char* location = (char*)line;
-  while (*location)
+  u32 len = strlen((char*)line);
+  struct line_scan scan;
+  ScanLine(line, len, &scan);
+
+  u32 read  = 0;
+  u32 write = 0;
+  while (read < len)
   {
     /* Don't tokenize anything within quotes */
-    if (*location == '"')
+    u32 unquoted = Scan_NextUnquoted(&scan, read);
+    if (unquoted != read)
     {
-      ++location;
-      while (*location &&
-             *location != '"')
-        ++location;
-      ++location;
+      memmove(&line[write], &line[read], unquoted - read);
+      write += unquoted - read;
+      read = unquoted;
       continue;
     }
 
-    /* Test against all possible keywords */
-    for (int i = 0;
-         i < NUM_BASIC_TOKENS;
-         ++i)
+    /* Test against the keywords of the selected dialect, then all V2
+       keywords */
+    struct dialect_keyword* dialect_keyword = Dialect_MatchKeyword(&line[read]);
+    if (dialect_keyword)
     {
-      char* keyword = token_list[i];
-      if (strncmp(location, keyword, strlen(keyword)) == 0)
-      {
-        byte_t token = TranslateToken(keyword);
-        ReplaceStringWithByte(line, keyword, token);
+      if (dialect_keyword->prefix)
+        line[write++] = dialect_keyword->prefix;
+      line[write++] = dialect_keyword->token;
+      read += strlen(dialect_keyword->keyword);
+      continue;
+    }
 
-        if (token == TranslateToken("REM"))
-        {
-          /* Skip entire line after REM */
-          return;
-        }
-        else if (token == TranslateToken("DATA"))
-        {
-          ++location;
-          /* Skip to colon or newline after DATA */
-          while (*location &&
-                 *location != ':')
-            ++location;
-          if (!*location)
-            return;
-        }
+    int i = MatchKeyword(&line[read]);
+    if (i < 0)
+    {
+      line[write++] = line[read++];
+      continue;
+    }
 
-        /* Keyword tokenized; break for loop */
-        break;
-      }
+    byte_t token = 0x80 + i;
+    line[write++] = token;
+    read += strlen(token_list[i]);
+
+    u32 copy_end = read;
+    if (token == TranslateToken("REM"))
+    {
+      /* Copy entire line after REM */
+      copy_end = len;
+    }
+    else if (token == TranslateToken("DATA"))
+    {
+      /* Copy up to colon or end of line after DATA */
+      copy_end = Scan_NextUnquotedColon(&scan, read);
+    }
+    memmove(&line[write], &line[read], copy_end - read);
+    write += copy_end - read;
+    read = copy_end;
+  }
+  line[write] = 0;
+}
+
+
+/*
+  ReadStream
+
+  Read fp to its end into a newly allocated buffer. The length read is
+  stored in len.
+
+  Return: Pointer to byte buffer
+*/
+byte_t*
+ReadStream(FILE* fp, u32* len)
+{
+  u32 capacity = 0x10000;
+  byte_t* buffer = (byte_t*)Counted_Malloc(capacity);
+  *len = 0;
+  size_t bytes_read;
+  while ((bytes_read = fread(&buffer[*len], 1, capacity - *len, fp)) > 0)
+  {
+    *len += bytes_read;
+    if (*len == capacity)
+    {
+      capacity *= 2;
+      buffer = (byte_t*)Counted_Realloc(buffer, capacity);
     }
-      
-    ++location;
   }
+  return buffer;
 }
 
 
@@ -920,6 +1930,7 @@ TokenizeLine(byte_t* line)
   LoadSrc
 
   Load a BASIC source file located at path into a source_file struct.
+  A path of "-" reads from stdin.
 
   Return: Pointer to byte buffer
 */
@@ -928,6 +1939,12 @@ LoadSrc(struct source_file* source_file, char* path)
 {
   assert(source_file);
 
+  if (strcmp(path, "-") == 0)
+  {
+    source_file->buffer = (char*)ReadStream(stdin, &source_file->buf_len);
+    return;
+  }
+
   FILE* fp = fopen(path, "rb");
   if (!fp)
   {
@@ -937,319 +1954,6421 @@ LoadSrc(struct source_file* source_file, char* path)
   struct stat fs;
   fstat(fileno(fp), &fs);
   source_file->buf_len = fs.st_size;
-  source_file->buffer = (char*)malloc(source_file->buf_len);
+  source_file->buffer = (char*)Counted_Malloc(source_file->buf_len);
   fread(source_file->buffer, 1, fs.st_size, fp);
   fclose(fp);
 }
 
 
 /*
-  ReadLine
+  Source normalization
+
+  NormalizeSource prepares the whole source buffer in one pass instead
+  of per line: it uppercases the buffer in place (labels are case
+  insensitive, and lowercase text and PETSCII placeholders compile as
+  uppercase, within strings too) while finding the newlines, 32 or 16
+  bytes at a time with AVX2 or SSE2 where available. Each non-blank
+  line then gets a descriptor pointing into the buffer, with its
+  whitespace trimmed (including the CR of CRLF line ends), its line
+  number parsed and labels recognized.
+*/
+struct source_line
+{
+  char*  text;          /* Line text after the line number, if any */
+  u32    len;
+  s32    line_no;       /* -1 if the line has no line number */
+  u32    source_line_number;
+  BOOL   is_label;      /* text is a label, including its colon */
+};
+
+struct source_lines
+{
+  struct source_line*  lines;
+  u32    num_lines;
+  u32    capacity;
+};
+
+
+/*
+  Normalize_AddLine
 
-  Read the next line from the source file into line.
+  Classify the source line spanning buffer[begin] up to buffer[end]
+  and add its descriptor to lines, unless it is blank.
 */
-int
-ReadLine(struct source_file* source_file, char* line)
+void
+Normalize_AddLine(char* buffer, u32 begin, u32 end, u32 source_line_number,
+                  struct source_lines* lines)
 {
-  if (source_file->pos >= source_file->buf_len) return -1;
+  while (begin < end &&
+         (buffer[begin] == ' ' || buffer[begin] == '\t'))
+    ++begin;
+  while (end > begin &&
+         (buffer[end-1] == ' ' || buffer[end-1] == '\t' || buffer[end-1] == '\r'))
+    --end;
+  if (begin == end)
+    return;
 
-  int i;
-  for (i = 0;
-       source_file->buffer[source_file->pos+i] &&
-       source_file->buffer[source_file->pos+i] != '\n';
-       ++i)
+  if (lines->num_lines == lines->capacity)
+  {
+    lines->capacity = lines->capacity ? lines->capacity * 2 : 256;
+    lines->lines = (struct source_line*)Counted_Realloc(lines->lines,
+                                                lines->capacity * sizeof(struct source_line));
+  }
+  struct source_line* line = &lines->lines[lines->num_lines++];
+  line->source_line_number = source_line_number;
+  line->line_no = -1;
+  line->is_label = IsLabel(&buffer[begin], end - begin);
+  if (!line->is_label &&
+      isdigit(buffer[begin]))
   {
-    line[i] = source_file->buffer[source_file->pos+i]; 
+    /* Line numbers beyond the maximum saturate; Program_AddLine
+       rejects them */
+    line->line_no = 0;
+    while (begin < end &&
+           isdigit(buffer[begin]))
+    {
+      if (line->line_no <= MAX_LINE_NUMBER)
+        line->line_no = line->line_no * 10 + (buffer[begin] - '0');
+      ++begin;
+    }
+    while (begin < end &&
+           (buffer[begin] == ' ' || buffer[begin] == '\t'))
+      ++begin;
   }
-  line[i] = 0;
-  source_file->pos += i+1;
-  return i;
+  line->text = &buffer[begin];
+  line->len  = end - begin;
 }
 
 
 /*
-  WritePRG
+  NormalizeSource
 
-  Output program to file in C64 PRG format.
+  Uppercase the source buffer and split it into line descriptors. The
+  descriptors point into the buffer, which must outlive them. The
+  caller frees lines->lines.
 */
-BOOL
-WritePRG(struct BASIC_program* program, u16 load_address, char* path)
+void
+NormalizeSource(struct source_file* source_file, struct source_lines* lines)
 {
-  if (!program ||
-      !program->first_line)
+  memset(lines, 0, sizeof(struct source_lines));
+  char* buffer = source_file->buffer;
+  u32 len = source_file->buf_len;
+  u32 line_begin = 0;
+  u32 source_line_number = 1;
+
+  u32 i = 0;
+#if defined(__AVX2__)
+  const __m256i newline_32 = _mm256_set1_epi8('\n');
+  const __m256i before_a_32 = _mm256_set1_epi8('a' - 1);
+  const __m256i after_z_32 = _mm256_set1_epi8('z' + 1);
+  const __m256i case_bit_32 = _mm256_set1_epi8(0x20);
+  for (; i + 32 <= len; i += 32)
   {
-    fprintf(stderr, "ERROR: Empty program\n");
-    return FALSE;
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)&buffer[i]);
+    __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, before_a_32),
+                                     _mm256_cmpgt_epi8(after_z_32, chunk));
+    chunk = _mm256_sub_epi8(chunk, _mm256_and_si256(lower, case_bit_32));
+    _mm256_storeu_si256((__m256i*)&buffer[i], chunk);
+    u32 newlines = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline_32));
+    while (newlines)
+    {
+      u32 end = i + LowestBit(newlines);
+      newlines &= newlines - 1;
+      Normalize_AddLine(buffer, line_begin, end, source_line_number++, lines);
+      line_begin = end + 1;
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i newline_16 = _mm_set1_epi8('\n');
+  const __m128i before_a_16 = _mm_set1_epi8('a' - 1);
+  const __m128i after_z_16 = _mm_set1_epi8('z' + 1);
+  const __m128i case_bit_16 = _mm_set1_epi8(0x20);
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&buffer[i]);
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(chunk, before_a_16),
+                                  _mm_cmplt_epi8(chunk, after_z_16));
+    chunk = _mm_sub_epi8(chunk, _mm_and_si128(lower, case_bit_16));
+    _mm_storeu_si128((__m128i*)&buffer[i], chunk);
+    u32 newlines = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline_16));
+    while (newlines)
+    {
+      u32 end = i + LowestBit(newlines);
+      newlines &= newlines - 1;
+      Normalize_AddLine(buffer, line_begin, end, source_line_number++, lines);
+      line_begin = end + 1;
+    }
+  }
+#endif
+  for (; i < len; ++i)
+  {
+    if (buffer[i] >= 'a' &&
+        buffer[i] <= 'z')
+      buffer[i] -= 0x20;
+    else if (buffer[i] == '\n')
+    {
+      Normalize_AddLine(buffer, line_begin, i, source_line_number++, lines);
+      line_begin = i + 1;
+    }
   }
+  if (line_begin < len)
+    Normalize_AddLine(buffer, line_begin, len, source_line_number, lines);
+}
 
-  FILE* fp;
-  if (path)
-    fp = fopen(path, "wb");
+
+/*
+  Memory footprint
+
+  BuildPRGImage accounts for the bytes of the program as it emits
+  them. On the C64, BASIC memory runs from the load address up to
+  $A000, and variables, arrays and strings share whatever the program
+  leaves free: 38,911 bytes for an empty program.
+*/
+#define BASIC_MEMORY_END   0xA000
+#define MAX_LARGEST_LINES  5
+
+struct memory_footprint
+{
+  u32    program_bytes;     /* Excluding the load address */
+  u32    start_address;
+  u32    end_address;
+  u32    line_overhead;     /* Links, line numbers and terminators */
+  u32    rem_bytes;
+  u32    space_bytes;
+  u32    literal_bytes;     /* Numbers, strings and DATA */
+  u32    num_largest;
+  s32    largest_line_nos[MAX_LARGEST_LINES];
+  u32    largest_bytes[MAX_LARGEST_LINES];
+};
+
+
+/*
+  Footprint_CountLine
+
+  Account for the tokenized line line_no, of len bytes, in footprint.
+*/
+void
+Footprint_CountLine(struct memory_footprint* footprint, s32 line_no, byte_t* line, u32 len)
+{
+  footprint->line_overhead += 4 + 1;
+
+  u32 pos = 0;
+  while (pos < len)
+  {
+    byte_t c = line[pos];
+    if (c == TranslateToken("REM"))
+    {
+      footprint->rem_bytes += len - pos;
+      break;
+    }
+    if (c == TranslateToken("DATA"))
+    {
+      /* DATA items are literals, up to the end of the statement */
+      BOOL in_quotes = FALSE;
+      u32 begin = ++pos;
+      while (pos < len &&
+             (in_quotes || line[pos] != ':'))
+      {
+        if (line[pos] == '"')
+          in_quotes = !in_quotes;
+        ++pos;
+      }
+      footprint->literal_bytes += pos - begin;
+      continue;
+    }
+    if (c == '"')
+    {
+      u32 begin = pos++;
+      while (pos < len &&
+             line[pos] != '"')
+        ++pos;
+      if (pos < len)
+        ++pos;
+      footprint->literal_bytes += pos - begin;
+      continue;
+    }
+    if (c == ' ')
+      ++footprint->space_bytes;
+    else if (isalpha(c))
+    {
+      /* Skip variable names, so their digits aren't counted */
+      while (pos < len &&
+             isalnum(line[pos]))
+        ++pos;
+      continue;
+    }
+    else if (isdigit(c) ||
+             c == '.')
+      ++footprint->literal_bytes;
+    ++pos;
+  }
+
+  /* Keep the largest lines, largest first */
+  u32 bytes = 4 + len + 1;
+  u32 i = footprint->num_largest;
+  if (i < MAX_LARGEST_LINES)
+    ++footprint->num_largest;
+  else if (bytes <= footprint->largest_bytes[i-1])
+    return;
   else
-    fp = stdout;
-  if (!fp)
+    --i;
+  while (i > 0 &&
+         footprint->largest_bytes[i-1] < bytes)
   {
-    fprintf(stderr, "ERROR: Unable to open %s for writing\n", path);
+    footprint->largest_bytes[i]    = footprint->largest_bytes[i-1];
+    footprint->largest_line_nos[i] = footprint->largest_line_nos[i-1];
+    --i;
+  }
+  footprint->largest_bytes[i]    = bytes;
+  footprint->largest_line_nos[i] = line_no;
+}
+
+
+/*
+  Program_PrintMemoryReport
+
+  Print footprint, the memory use of a program, to fp.
+*/
+void
+Program_PrintMemoryReport(FILE* fp, struct memory_footprint* footprint)
+{
+  u32 total = footprint->program_bytes;
+  u32 other = total - footprint->line_overhead - footprint->rem_bytes -
+              footprint->space_bytes - footprint->literal_bytes;
+  fprintf(fp, "Memory footprint:\n");
+  fprintf(fp, "  Program:        %6u bytes ($%04X-$%04X)\n", total,
+          footprint->start_address, footprint->end_address - 1);
+  fprintf(fp, "  Line overhead:  %6u bytes (%.1f%%)\n", footprint->line_overhead,
+          100.0 * footprint->line_overhead / total);
+  fprintf(fp, "  REM:            %6u bytes (%.1f%%)\n", footprint->rem_bytes,
+          100.0 * footprint->rem_bytes / total);
+  fprintf(fp, "  Spaces:         %6u bytes (%.1f%%)\n", footprint->space_bytes,
+          100.0 * footprint->space_bytes / total);
+  fprintf(fp, "  Literals:       %6u bytes (%.1f%%)\n", footprint->literal_bytes,
+          100.0 * footprint->literal_bytes / total);
+  fprintf(fp, "  Other:          %6u bytes (%.1f%%)\n", other,
+          100.0 * other / total);
+  if (footprint->end_address <= BASIC_MEMORY_END)
+    fprintf(fp, "  Free:           %6u bytes for variables, arrays and strings\n",
+            BASIC_MEMORY_END - footprint->end_address);
+  else
+    fprintf(fp, "  Free:           none; the program runs %u bytes past $%04X\n",
+            footprint->end_address - BASIC_MEMORY_END, BASIC_MEMORY_END);
+  fprintf(fp, "Largest lines:\n");
+  for (u32 i = 0; i < footprint->num_largest; ++i)
+    fprintf(fp, "  %5d  %4u bytes\n", footprint->largest_line_nos[i],
+            footprint->largest_bytes[i]);
+}
+
+
+/*
+  Footprint_CheckBudget
+
+  Check footprint against the --max-size budget, and warn if the
+  program runs past the end of BASIC memory.
+
+  Returns FALSE if the budget is exceeded.
+*/
+BOOL
+Footprint_CheckBudget(struct memory_footprint* footprint)
+{
+  if (args.max_size &&
+      footprint->program_bytes > args.max_size)
+  {
+    fprintf(stderr, "ERROR: Program is %u bytes, over the --max-size budget of %u bytes\n",
+            footprint->program_bytes, args.max_size);
     return FALSE;
   }
+  if (footprint->start_address < BASIC_MEMORY_END &&
+      footprint->end_address > BASIC_MEMORY_END)
+    fprintf(stderr, "WARNING: Program ends at $%04X, past the end of BASIC memory at $%04X\n",
+            footprint->end_address, BASIC_MEMORY_END);
+  return TRUE;
+}
+
 
+/*
+  BuildPRGImage
+
+  Build the C64 PRG image of program, including its two byte load
+  address, in a newly allocated buffer. The length of the image is
+  stored in len, and its memory use in footprint unless that is NULL.
+
+  Return: Pointer to image buffer, or NULL if the program doesn't fit
+  below the top of memory
+*/
 #define DEFAULT_LOAD_ADDRESS 0x0801
+byte_t*
+BuildPRGImage(struct BASIC_program* program, u16 load_address, u32* len,
+              struct memory_footprint* footprint)
+{
   if (load_address == 0)
     load_address = DEFAULT_LOAD_ADDRESS;
 
-  fwrite(&load_address, 2, 1, fp);
+  u32 image_len = 2 + 2;
+  struct BASIC_line* curr_line;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    image_len += 4 + strlen((char*)curr_line->tokenized_line) + 1;
+
+  /* The link pointers are 16 bits wide */
+  if (load_address + image_len - 2 > 0x10000)
+  {
+    fprintf(stderr, "ERROR: Program too large: %u bytes from $%04X run past $FFFF\n",
+            image_len - 2, load_address);
+    return 0;
+  }
+
+  if (footprint)
+  {
+    memset(footprint, 0, sizeof(struct memory_footprint));
+    footprint->program_bytes = image_len - 2;
+    footprint->start_address = load_address;
+    footprint->end_address   = load_address + image_len - 2;
+    footprint->line_overhead = 2;  /* Terminating link */
+  }
+
+  byte_t* image = (byte_t*)Counted_Malloc(image_len);
+  u32 pos = 0;
+  image[pos++] = load_address & 0xff;
+  image[pos++] = load_address >> 8;
   u16 next_line_addr = load_address;
-  struct BASIC_line* curr_line = program->first_line;
-  while (curr_line)
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
   {
     u16 line_length = strlen((char*)curr_line->tokenized_line);
     next_line_addr += 4 + line_length + 1;
-    fwrite(&next_line_addr, 2, 1, fp);
-    fwrite(&curr_line->line_no, 2, 1, fp);
+    image[pos++] = next_line_addr & 0xff;
+    image[pos++] = next_line_addr >> 8;
+    image[pos++] = curr_line->line_no & 0xff;
+    image[pos++] = (curr_line->line_no >> 8) & 0xff;
     /* Line data including NULL byte */
-    fwrite(&curr_line->tokenized_line, 1, line_length+1, fp); 
-    curr_line = curr_line->next;
+    memcpy(&image[pos], curr_line->tokenized_line, line_length+1);
+    pos += line_length+1;
+    if (footprint)
+      Footprint_CountLine(footprint, curr_line->line_no,
+                          curr_line->tokenized_line, line_length);
   }
   /* NULL address to terminate program */
-  fputc(0, fp);
-  fputc(0, fp);
+  image[pos++] = 0;
+  image[pos++] = 0;
 
-  return TRUE;
+  *len = pos;
+  return image;
 }
 
 
 /*
-  DoLinesPass
-
-  Parse a source file and split it into BASIC lines, filling out a
-  program structure.
+  Packing
+
+  A 1541 loads about 400 bytes a second, so every byte of a PRG is
+  load time. --pack compresses the program image with a byte-oriented
+  LZ scheme and puts a depacker behind a "10 SYS2061" line. The
+  stream is a sequence of tokens:
+
+    $01-$7F            1-127 literal bytes follow
+    %10LLLLLL lo       match of L+2 bytes, offset $FF00+lo
+    %11LLLLLL hi lo    match of L+3 bytes, offset hi*256+lo
+    $00                end of stream
+
+  A match copies from the output at the offset (the negative distance)
+  from the current position. The parse is optimal: for every position
+  the cheapest encoding of the rest of the image is known, given the
+  longest near (up to 256 bytes back) and far match found there.
+
+  When the packed PRG is run, a mover at $080D copies the depacker to
+  the tape buffer at $033C and the packed stream to the top of BASIC
+  memory, ending at $A000. The depacker then restores the program to
+  $0801 from there, sets the end of program, and runs it through the
+  ROM's CLR and the interpreter loop. The output never overtakes the
+  unread stream, which PackPRGImage checks for as it packs.
 */
-void
-DoLinesPass(struct BASIC_program* program, struct source_file* source_file)
+#define PACK_MAX_LITERALS    0x7F
+#define PACK_MAX_NEAR_MATCH  (0x3F + 2)
+#define PACK_MAX_FAR_MATCH   (0x3F + 3)
+#define PACK_MAX_CHAIN       1024
+#define PACK_DEPACKER_ADDRESS  0x033C
+#define PAL_CLOCK_HZ         985248
+#define DISK_BYTES_PER_SECOND  400
+
+/* 10 SYS2061 */
+byte_t pack_basic_stub[] =
 {
-  /* TODO: Clean up this mess */
-  memset(program, 0, sizeof(struct BASIC_program));
+  0x0B, 0x08, 0x0A, 0x00, 0x9E, '2', '0', '6', '1', 0x00, 0x00, 0x00
+};
 
-  char current_label[MAX_LABEL_LENGTH+1];
-  memset(current_label, 0, MAX_LABEL_LENGTH+1);
+/* Runs at $080D. The operands at the offsets below are filled in by
+   PackPRGImage. */
+#define MOVER_DEPACKER_LEN    1   /* LDX #len */
+#define MOVER_DEPACKER_SRC    3   /* LDA depacker-1,X */
+#define MOVER_SRC_LO         12   /* Start of the last partial page */
+#define MOVER_SRC_HI         16
+#define MOVER_DST_LO         20
+#define MOVER_DST_HI         24
+#define MOVER_PAGES          28
+#define MOVER_PARTIAL        30
+#define MOVER_STREAM_LO      52   /* Depacker input */
+#define MOVER_STREAM_HI      56
+byte_t pack_mover[] =
+{
+  0xA2, 0x00,           /*      LDX #len        */
+  0xBD, 0x00, 0x00,     /* rl:  LDA depacker-1,X  */
+  0x9D, 0x3B, 0x03,     /*      STA $033B,X     */
+  0xCA,                 /*      DEX             */
+  0xD0, 0xF7,           /*      BNE rl          */
+  0xA9, 0x00,           /*      LDA #<src       */
+  0x85, 0xFB,           /*      STA $FB         */
+  0xA9, 0x00,           /*      LDA #>src       */
+  0x85, 0xFC,           /*      STA $FC         */
+  0xA9, 0x00,           /*      LDA #<dst       */
+  0x85, 0xFD,           /*      STA $FD         */
+  0xA9, 0x00,           /*      LDA #>dst       */
+  0x85, 0xFE,           /*      STA $FE         */
+  0xA2, 0x00,           /*      LDX #pages      */
+  0xA0, 0x00,           /*      LDY #partial    */
+  0xF0, 0x08,           /*      BEQ pg          */
+  0x88,                 /* cp:  DEY             */
+  0xB1, 0xFB,           /*      LDA ($FB),Y     */
+  0x91, 0xFD,           /*      STA ($FD),Y     */
+  0x98,                 /*      TYA             */
+  0xD0, 0xF8,           /*      BNE cp          */
+  0x8A,                 /* pg:  TXA             */
+  0xF0, 0x07,           /*      BEQ go          */
+  0xCA,                 /*      DEX             */
+  0xC6, 0xFC,           /*      DEC $FC         */
+  0xC6, 0xFE,           /*      DEC $FE         */
+  0xD0, 0xEE,           /*      BNE cp          */
+  0xA9, 0x00,           /* go:  LDA #<stream    */
+  0x85, 0xFB,           /*      STA $FB         */
+  0xA9, 0x00,           /*      LDA #>stream    */
+  0x85, 0xFC,           /*      STA $FC         */
+  0xA9, 0x01,           /*      LDA #$01        */
+  0x85, 0xFD,           /*      STA $FD         */
+  0xA9, 0x08,           /*      LDA #$08        */
+  0x85, 0xFE,           /*      STA $FE         */
+  0x4C, 0x3C, 0x03,     /*      JMP $033C       */
+};
 
-  int len = 0;
-  char line_buffer[MAX_SOURCE_LINE_LEN];
-  int source_line_number = 0;
-  while ((len = ReadLine(source_file, line_buffer)) > -1)
+/* Runs at $033C, with the stream at ($FB), the output at ($FD), the
+   match source at ($22) and the token length in $02 */
+byte_t pack_depacker[] =
+{
+  0xA0, 0x00,           /* tk:  LDY #$00        */
+  0xB1, 0xFB,           /*      LDA ($FB),Y     */
+  0xF0, 0x64,           /*      BEQ end         */
+  0x30, 0x27,           /*      BMI match       */
+  0x85, 0x02,           /*      STA $02         */
+  0xE6, 0xFB,           /*      INC $FB         */
+  0xD0, 0x02,           /*      BNE lit         */
+  0xE6, 0xFC,           /*      INC $FC         */
+  0xB1, 0xFB,           /* lit: LDA ($FB),Y     */
+  0x91, 0xFD,           /*      STA ($FD),Y     */
+  0xC8,                 /*      INY             */
+  0xC4, 0x02,           /*      CPY $02         */
+  0xD0, 0xF7,           /*      BNE lit         */
+  0x98,                 /*      TYA             */
+  0x18,                 /*      CLC             */
+  0x65, 0xFB,           /*      ADC $FB         */
+  0x85, 0xFB,           /*      STA $FB         */
+  0x90, 0x02,           /*      BCC out         */
+  0xE6, 0xFC,           /*      INC $FC         */
+  0x98,                 /* out: TYA             */
+  0x18,                 /*      CLC             */
+  0x65, 0xFD,           /*      ADC $FD         */
+  0x85, 0xFD,           /*      STA $FD         */
+  0x90, 0xD5,           /*      BCC tk          */
+  0xE6, 0xFE,           /*      INC $FE         */
+  0xB0, 0xD1,           /*      BCS tk          */
+  0x85, 0x02,           /* match: STA $02       */
+  0xA2, 0xFF,           /*      LDX #$FF        */
+  0xA0, 0x01,           /*      LDY #$01        */
+  0xC9, 0xC0,           /*      CMP #$C0        */
+  0x90, 0x04,           /*      BCC near        */
+  0xB1, 0xFB,           /*      LDA ($FB),Y     */
+  0xAA,                 /*      TAX             */
+  0xC8,                 /*      INY             */
+  0xB1, 0xFB,           /* near: LDA ($FB),Y    */
+  0x18,                 /*      CLC             */
+  0x65, 0xFD,           /*      ADC $FD         */
+  0x85, 0x22,           /*      STA $22         */
+  0x8A,                 /*      TXA             */
+  0x65, 0xFE,           /*      ADC $FE         */
+  0x85, 0x23,           /*      STA $23         */
+  0x38,                 /*      SEC             */
+  0x98,                 /*      TYA             */
+  0x65, 0xFB,           /*      ADC $FB         */
+  0x85, 0xFB,           /*      STA $FB         */
+  0x90, 0x02,           /*      BCC len         */
+  0xE6, 0xFC,           /*      INC $FC         */
+  0xA5, 0x02,           /* len: LDA $02         */
+  0xC9, 0xC0,           /*      CMP #$C0        */
+  0x29, 0x3F,           /*      AND #$3F        */
+  0x69, 0x02,           /*      ADC #$02        */
+  0x85, 0x02,           /*      STA $02         */
+  0xA0, 0x00,           /*      LDY #$00        */
+  0xB1, 0x22,           /* cpy: LDA ($22),Y     */
+  0x91, 0xFD,           /*      STA ($FD),Y     */
+  0xC8,                 /*      INY             */
+  0xC4, 0x02,           /*      CPY $02         */
+  0xD0, 0xF7,           /*      BNE cpy         */
+  0xF0, 0xB9,           /*      BEQ out         */
+  0xA5, 0xFD,           /* end: LDA $FD         */
+  0x85, 0x2D,           /*      STA $2D         */
+  0xA5, 0xFE,           /*      LDA $FE         */
+  0x85, 0x2E,           /*      STA $2E         */
+  0x20, 0x59, 0xA6,     /*      JSR $A659       */
+  0x4C, 0xAE, 0xA7,     /*      JMP $A7AE       */
+};
+
+struct pack_step
+{
+  u32 cost;     /* Bytes needed for the rest of the image */
+  u16 length;
+  u16 distance; /* 0 for a literal run */
+};
+
+
+/*
+  Pack_FindMatches
+
+  Find the longest near (distance up to 256) and far match for
+  data[pos] among the earlier positions on its hash chain.
+*/
+void
+Pack_FindMatches(byte_t* data, u32 len, u32 pos, s32* chain,
+                 u32* near_length, u32* near_distance,
+                 u32* far_length, u32* far_distance)
+{
+  *near_length = *far_length = 0;
+  u32 steps = 0;
+  for (s32 candidate = chain[pos];
+       candidate >= 0 &&
+         pos - candidate <= 0xFFFF &&
+         steps < PACK_MAX_CHAIN;
+       candidate = chain[candidate], ++steps)
+  {
+    u32 distance = pos - candidate;
+    u32 max_length = (distance <= 0x100) ? PACK_MAX_NEAR_MATCH : PACK_MAX_FAR_MATCH;
+    if (max_length > len - pos)
+      max_length = len - pos;
+    u32 length = 0;
+    while (length < max_length &&
+           data[candidate + length] == data[pos + length])
+      ++length;
+
+    if (distance <= 0x100)
+    {
+      if (length > *near_length)
+      {
+        *near_length = length;
+        *near_distance = distance;
+      }
+    }
+    else if (length > *far_length)
+    {
+      *far_length = length;
+      *far_distance = distance;
+    }
+    if (*near_length == PACK_MAX_NEAR_MATCH ||
+        *far_length == PACK_MAX_FAR_MATCH)
+      break;
+  }
+  /* A near match serves as a far one, too */
+  if (*near_length > *far_length)
+  {
+    *far_length = *near_length;
+    *far_distance = *near_distance;
+  }
+}
+
+
+/*
+  Pack_Compress
+
+  Compress the len bytes of data into a newly allocated stream, using
+  an optimal parse. Sets *margin to the most the output gets ahead of
+  the consumed stream. Returns the stream, its length in *packed_len.
+*/
+byte_t*
+Pack_Compress(byte_t* data, u32 len, u32* packed_len, u32* margin)
+{
+  /* Chain every position to the previous one starting with the same
+     two bytes */
+  s32* heads = (s32*)Counted_Malloc(0x10000 * sizeof(s32));
+  s32* chain = (s32*)Counted_Malloc((len + 1) * sizeof(s32));
+  memset(heads, 0xFF, 0x10000 * sizeof(s32));
+  for (u32 pos = 0; pos + 1 < len; ++pos)
+  {
+    u32 hash = data[pos] | (data[pos + 1] << 8);
+    chain[pos] = heads[hash];
+    heads[hash] = pos;
+  }
+  chain[len - 1] = -1;
+
+  struct pack_step* steps = (struct pack_step*)Counted_Malloc((len + 1) * sizeof(struct pack_step));
+  steps[len].cost = 1;  /* End of stream */
+  for (u32 pos = len; pos-- > 0;)
+  {
+    u32 near_length, near_distance, far_length, far_distance;
+    Pack_FindMatches(data, len, pos, chain, &near_length, &near_distance,
+                     &far_length, &far_distance);
+
+    /* Longer tokens first, so ties go to fewer tokens, which depack
+       faster */
+    struct pack_step best = { 0xFFFFFFFF, 0, 0 };
+    for (u32 length = far_length; length >= 2; --length)
+    {
+      u32 cost;
+      u32 distance;
+      if (length <= near_length)
+      {
+        cost = 2;
+        distance = near_distance;
+      }
+      else if (length >= 3)
+      {
+        cost = 3;
+        distance = far_distance;
+      }
+      else
+        continue;
+      cost += steps[pos + length].cost;
+      if (cost < best.cost)
+      {
+        best.cost = cost;
+        best.length = length;
+        best.distance = distance;
+      }
+    }
+    u32 max_literals = (len - pos < PACK_MAX_LITERALS) ? len - pos : PACK_MAX_LITERALS;
+    for (u32 length = max_literals; length >= 1; --length)
+    {
+      u32 cost = 1 + length + steps[pos + length].cost;
+      if (cost < best.cost)
+      {
+        best.cost = cost;
+        best.length = length;
+        best.distance = 0;
+      }
+    }
+    steps[pos] = best;
+  }
+  Counted_Free(chain);
+  Counted_Free(heads);
+
+  byte_t* packed = (byte_t*)Counted_Malloc(steps[0].cost);
+  u32 out = 0;
+  *margin = 0;
+  for (u32 pos = 0; pos < len; pos += steps[pos].length)
+  {
+    struct pack_step* step = &steps[pos];
+    if (pos + step->length > out &&
+        pos + step->length - out > *margin)
+      *margin = pos + step->length - out;
+
+    u16 offset = (u16)(0x10000 - step->distance);
+    if (!step->distance)
+    {
+      packed[out++] = step->length;
+      memcpy(&packed[out], &data[pos], step->length);
+      out += step->length;
+    }
+    else if (step->distance <= 0x100 &&
+             step->length <= PACK_MAX_NEAR_MATCH)
+    {
+      packed[out++] = 0x80 | (step->length - 2);
+      packed[out++] = offset & 0xFF;
+    }
+    else
+    {
+      packed[out++] = 0xC0 | (step->length - 3);
+      packed[out++] = offset >> 8;
+      packed[out++] = offset & 0xFF;
+    }
+  }
+  packed[out++] = 0;
+  Counted_Free(steps);
+
+  *packed_len = out;
+  return packed;
+}
+
+
+/*
+  Pack_EstimateCycles
+
+  Estimate the C64 cycles the mover and depacker take for a stream of
+  packed_len bytes, not counting page crossings.
+*/
+u64
+Pack_EstimateCycles(byte_t* packed, u32 packed_len)
+{
+  u64 cycles = 14 * sizeof(pack_depacker) + 18 * (u64)packed_len + 60;
+  u32 pos = 0;
+  while (packed[pos])
+  {
+    byte_t token = packed[pos];
+    if (token < 0x80)
+    {
+      cycles += 19 * token + 47;
+      pos += 1 + token;
+    }
+    else if (token < 0xC0)
+    {
+      cycles += 19 * ((token & 0x3F) + 2) + 107;
+      pos += 2;
+    }
+    else
+    {
+      cycles += 19 * ((token & 0x3F) + 3) + 115;
+      pos += 3;
+    }
+  }
+  return cycles + 30;
+}
+
+
+/*
+  PackPRGImage
+
+  Pack the PRG image of *len bytes, which must load to $0801, into a
+  self-extracting one. Prints the ratio and the estimated depacking
+  time to fp. Returns the new image, a copy of image if packing
+  doesn't make it load faster, or 0 if the program can't be packed.
+*/
+byte_t*
+PackPRGImage(byte_t* image, u32* len, FILE* fp)
+{
+  u32 program_len = *len - 2;
+  u32 packed_len, margin;
+  byte_t* packed = Pack_Compress(&image[2], program_len, &packed_len, &margin);
+
+  u32 code_len = sizeof(pack_basic_stub) + sizeof(pack_mover) + sizeof(pack_depacker);
+  u32 packed_image_len = 2 + code_len + packed_len;
+  u64 cycles = Pack_EstimateCycles(packed, packed_len);
+  double depack_seconds = (double)cycles / PAL_CLOCK_HZ;
+  double saved_seconds = ((double)*len - packed_image_len) / DISK_BYTES_PER_SECOND;
+
+  /* Depacking must take less time than loading the bytes saved */
+  if (depack_seconds >= saved_seconds)
+  {
+    fprintf(fp, "Packing doesn't make this program load faster; writing it unpacked\n");
+    Counted_Free(packed);
+    byte_t* unpacked_image = (byte_t*)Counted_Malloc(*len);
+    memcpy(unpacked_image, image, *len);
+    return unpacked_image;
+  }
+
+  u32 src = DEFAULT_LOAD_ADDRESS + code_len;
+  u32 stream = BASIC_MEMORY_END - packed_len;
+  if (src + packed_len > BASIC_MEMORY_END ||
+      DEFAULT_LOAD_ADDRESS + margin > stream)
+  {
+    fprintf(stderr, "ERROR: Program too large to pack: %u bytes packed into %u\n",
+            program_len, packed_len);
+    Counted_Free(packed);
+    return 0;
+  }
+
+  byte_t* packed_image = (byte_t*)Counted_Malloc(packed_image_len);
+  byte_t* out = packed_image;
+  *out++ = DEFAULT_LOAD_ADDRESS & 0xFF;
+  *out++ = DEFAULT_LOAD_ADDRESS >> 8;
+  memcpy(out, pack_basic_stub, sizeof(pack_basic_stub));
+  out += sizeof(pack_basic_stub);
+
+  byte_t* mover = out;
+  memcpy(mover, pack_mover, sizeof(pack_mover));
+  u32 depacker = src - sizeof(pack_depacker);
+  u32 pages = packed_len >> 8;
+  mover[MOVER_DEPACKER_LEN] = sizeof(pack_depacker);
+  mover[MOVER_DEPACKER_SRC]     = (depacker - 1) & 0xFF;
+  mover[MOVER_DEPACKER_SRC + 1] = (depacker - 1) >> 8;
+  mover[MOVER_SRC_LO]    = (src + (pages << 8)) & 0xFF;
+  mover[MOVER_SRC_HI]    = (src + (pages << 8)) >> 8;
+  mover[MOVER_DST_LO]    = (stream + (pages << 8)) & 0xFF;
+  mover[MOVER_DST_HI]    = (stream + (pages << 8)) >> 8;
+  mover[MOVER_PAGES]     = pages;
+  mover[MOVER_PARTIAL]   = packed_len & 0xFF;
+  mover[MOVER_STREAM_LO] = stream & 0xFF;
+  mover[MOVER_STREAM_HI] = stream >> 8;
+  out += sizeof(pack_mover);
+
+  memcpy(out, pack_depacker, sizeof(pack_depacker));
+  out += sizeof(pack_depacker);
+  memcpy(out, packed, packed_len);
+
+  fprintf(fp, "Packed %u bytes into %u (%.1f%%)\n",
+          *len, packed_image_len, 100.0 * packed_image_len / *len);
+  fprintf(fp, "Depacking takes about %.2f s (%llu cycles); loading from a 1541 takes %.1f s less\n",
+          depack_seconds, (unsigned long long)cycles, saved_seconds);
+
+  Counted_Free(packed);
+  *len = packed_image_len;
+  return packed_image;
+}
+
+
+/*
+  FileMatches
+
+  Returns TRUE if the file at path holds exactly the len bytes of
+  data.
+*/
+BOOL
+FileMatches(char* path, byte_t* data, u32 len)
+{
+  struct stat fs;
+  if (stat(path, &fs) != 0 ||
+      (u32)fs.st_size != len)
+    return FALSE;
+
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    return FALSE;
+  byte_t* existing = (byte_t*)Counted_Malloc(len + 1);
+  BOOL matches = (fread(existing, 1, len + 1, fp) == len &&
+                  memcmp(existing, data, len) == 0);
+  Counted_Free(existing);
+  fclose(fp);
+  return matches;
+}
+
+
+/*
+  WritePRG
+
+  Output program to file in C64 PRG format. A path of "-" writes to
+  stdout. The program's memory use is stored in footprint. Nothing is
+  written if the program exceeds the --max-size budget. With
+  --skip-unchanged, a file that already holds the identical image is
+  left alone, keeping its modification time, and unchanged is set.
+*/
+BOOL
+WritePRG(struct BASIC_program* program, u16 load_address, char* path,
+         struct memory_footprint* footprint, BOOL* unchanged)
+{
+  memset(footprint, 0, sizeof(struct memory_footprint));
+  *unchanged = FALSE;
+  if (!program ||
+      !program->first_line)
+  {
+    fprintf(stderr, "ERROR: Empty program\n");
+    return FALSE;
+  }
+
+  u32 image_len;
+  byte_t* image = BuildPRGImage(program, load_address, &image_len, footprint);
+  if (!image)
+    return FALSE;
+  if (!Footprint_CheckBudget(footprint))
+  {
+    Counted_Free(image);
+    return FALSE;
+  }
+
+  BOOL to_stdout = (!path || strcmp(path, "-") == 0);
+  if (args.pack)
+  {
+    byte_t* packed_image = PackPRGImage(image, &image_len, to_stdout ? stderr : stdout);
+    Counted_Free(image);
+    if (!packed_image)
+      return FALSE;
+    image = packed_image;
+  }
+  if (!to_stdout &&
+      args.skip_unchanged &&
+      FileMatches(path, image, image_len))
+  {
+    Counted_Free(image);
+    *unchanged = TRUE;
+    return TRUE;
+  }
+
+  FILE* fp;
+  if (!to_stdout)
+    fp = fopen(path, "wb");
+  else
+    fp = stdout;
+  if (!fp)
+  {
+    fprintf(stderr, "ERROR: Unable to open %s for writing\n", path);
+    Counted_Free(image);
+    return FALSE;
+  }
+
+  fwrite(image, 1, image_len, fp);
+  Counted_Free(image);
+  if (!to_stdout)
+    fclose(fp);
+  else
+    fflush(fp);
+
+  return TRUE;
+}
+
+
+/*
+  Binary includes
+
+  A source line of the form
+
+    [line] INCBIN "path"[,offset[,length]]
+
+  includes the bytes of a binary file, such as sprites, a charset or
+  music, as DATA lines. The first line takes the INCBIN line's number
+  and label and holds the number of bytes to READ. The bytes follow on
+  the next line numbers, each line filled up to the 80 characters the
+  screen editor takes (counting the line number as LIST shows it).
+  Every byte is written in its shortest form: decimal without leading
+  zeros, and zero as an empty item, which READ takes as 0. The file is
+  read a chunk at a time, so large assets aren't held in memory.
+*/
+#define INCBIN_MAX_LISTED_LEN  80
+#define INCBIN_CHUNK_SIZE      4096
+
+
+/*
+  IsIncbinLine
+
+  Returns TRUE if the len characters of text are an INCBIN directive.
+*/
+BOOL
+IsIncbinLine(char* text, u32 len)
+{
+  if (len < 7 ||
+      strncmp(text, "INCBIN", 6) != 0)
+    return FALSE;
+  u32 pos = 6;
+  while (pos < len &&
+         text[pos] == ' ')
+    ++pos;
+  return (pos < len && text[pos] == '"');
+}
+
+
+/*
+  Incbin_NewLine
+
+  Allocate a DATA line numbered line_no, without items yet.
+*/
+struct BASIC_line*
+Incbin_NewLine(s32 line_no, u32 source_line_number)
+{
+  struct BASIC_line* line = (struct BASIC_line*)Counted_Malloc(sizeof(struct BASIC_line));
+  memset(line, 0, sizeof(struct BASIC_line));
+  line->line_no = line_no;
+  line->source_line_number = source_line_number;
+  strcpy(line->source_line, "DATA");
+  return line;
+}
+
+
+/*
+  Incbin_AddLine
+
+  Complete the DATA line and add it to program.
+*/
+void
+Incbin_AddLine(struct BASIC_program* program, struct BASIC_line* line)
+{
+  /* A lone empty item would read as 0 too, but spell it out */
+  if (!line->source_line[4])
+    strcpy(line->source_line, "DATA0");
+  strcpy((char*)line->tokenized_line, line->source_line);
+  Program_AddLine(program, line);
+}
+
+
+/*
+  IncludeBinary
+
+  Add the DATA lines for the INCBIN directive of source_line to
+  program. text is the directive as written, before uppercasing, since
+  paths are case sensitive. label is the label of the directive, if
+  any.
+
+  Returns the line number of the first DATA line, which holds the byte
+  count.
+*/
+s32
+IncludeBinary(struct BASIC_program* program, struct source_line* source_line,
+              char* text, char* label)
+{
+  s32 line_no = source_line->line_no;
+  char directive[MAX_SOURCE_LINE_LEN];
+  memcpy(directive, text, source_line->len);
+  directive[source_line->len] = '\0';
+
+  char* pos = strchr(directive, '"') + 1;
+  char* path = pos;
+  pos = strchr(pos, '"');
+  if (!pos ||
+      pos == path)
+    SyntaxError(line_no, "INCBIN needs a file path in quotes");
+  *pos++ = '\0';
+
+  u32 offset = 0;
+  u32 length = 0xFFFFFFFF;
+  for (u32 arg = 0; arg < 2; ++arg)
+  {
+    while (*pos == ' ')
+      ++pos;
+    if (!*pos)
+      break;
+    char* end;
+    u32 value = strtoul(&pos[1], &end, 0);
+    if (*pos != ',' ||
+        end == &pos[1])
+      SyntaxError(line_no, "INCBIN takes a path, an offset and a length");
+    if (arg == 0)
+      offset = value;
+    else
+      length = value;
+    pos = end;
+  }
+  while (*pos == ' ')
+    ++pos;
+  if (*pos)
+    SyntaxError(line_no, "INCBIN takes a path, an offset and a length");
+
+  FILE* fp = fopen(path, "rb");
+  if (!fp)
+    SyntaxError(line_no, "Failed to open binary file \"%s\"", path);
+  if (fseek(fp, offset, SEEK_SET) != 0)
+  {
+    fclose(fp);
+    SyntaxError(line_no, "Failed to seek to %u in binary file \"%s\"", offset, path);
+  }
+
+  /* The byte count is filled in once the file has been read */
+  struct BASIC_line* header = Incbin_NewLine(line_no, source_line->source_line_number);
+  strncpy(header->label, label, sizeof(header->label)-1);
+  header->label[sizeof(header->label)-1] = '\0';
+  strcpy((char*)header->tokenized_line, header->source_line);
+  Program_AddLine(program, header);
+
+  static byte_t chunk[INCBIN_CHUNK_SIZE];
+  struct BASIC_line* line = 0;
+  u32 text_len = 0;
+  u32 listed_len = 0;
+  u32 count = 0;
+  while (count < length)
+  {
+    u32 wanted = (length - count < INCBIN_CHUNK_SIZE) ? length - count : INCBIN_CHUNK_SIZE;
+    u32 got = fread(chunk, 1, wanted, fp);
+    if (!got)
+      break;
+    for (u32 i = 0; i < got; ++i)
+    {
+      char item[4] = "";
+      u32 item_len = chunk[i] ? sprintf(item, "%u", chunk[i]) : 0;
+      if (line &&
+          listed_len + 1 + item_len > INCBIN_MAX_LISTED_LEN)
+      {
+        Incbin_AddLine(program, line);
+        line = 0;
+      }
+      if (!line)
+      {
+        line = Incbin_NewLine(program->last_line_no + 1, source_line->source_line_number);
+        text_len = 4;
+        /* LIST shows the line number and a space */
+        listed_len = snprintf(0, 0, "%d", line->line_no) + 1 + text_len;
+      }
+      else
+      {
+        line->source_line[text_len++] = ',';
+        ++listed_len;
+      }
+      memcpy(&line->source_line[text_len], item, item_len + 1);
+      text_len += item_len;
+      listed_len += item_len;
+    }
+    count += got;
+  }
+  fclose(fp);
+  if (line)
+    Incbin_AddLine(program, line);
+  if (!count)
+    SyntaxError(line_no, "No bytes to include from binary file \"%s\"", path);
+
+  sprintf(header->source_line, "DATA%u", count);
+  strcpy((char*)header->tokenized_line, header->source_line);
+  return header->line_no;
+}
+
+
+/*
+  DoLinesPass
+
+  Parse a source file and split it into BASIC lines, filling out a
+  program structure.
+*/
+void
+DoLinesPass(struct BASIC_program* program, struct source_file* source_file)
+{
+  memset(program, 0, sizeof(struct BASIC_program));
+
+  char current_label[MAX_LABEL_LENGTH+1];
+  memset(current_label, 0, MAX_LABEL_LENGTH+1);
+
+  /* Keep the source as written for the paths of INCBIN directives */
+  char* original = (char*)Counted_Malloc(source_file->buf_len + 1);
+  memcpy(original, source_file->buffer, source_file->buf_len);
+
+  struct source_lines source_lines;
+  NormalizeSource(source_file, &source_lines);
+  alloc_stats.input_lines += source_lines.num_lines;
+
+  struct incbin_range* incbins = 0;
+  u32 num_incbins = 0;
+
+  /* If a syntax error jumps back to a caller that carries on, such as
+     the fuzzer, free the pass's buffers on the way */
+  jmp_buf jump;
+  jmp_buf* outer_jump = syntax_error_jump;
+  if (outer_jump)
+  {
+    syntax_error_jump = &jump;
+    if (setjmp(jump) != 0)
+    {
+      syntax_error_jump = outer_jump;
+      Counted_Free(source_lines.lines);
+      Counted_Free(original);
+      Counted_Free(incbins);
+      longjmp(*outer_jump, 1);
+    }
+  }
+
+  for (u32 i = 0; i < source_lines.num_lines; ++i)
+  {
+    struct source_line* source_line = &source_lines.lines[i];
+
+    /* Store label and advance to next non-blank line */
+    if (source_line->is_label)
+    {
+      /* Remove trailing colon from label */
+      memcpy(current_label, source_line->text, source_line->len-1);
+      current_label[source_line->len-1] = '\0';
+      continue;
+    }
+
+    if (source_line->len >= MAX_SOURCE_LINE_LEN)
+    {
+      SyntaxError(source_line->line_no, "Line too long (maximum: %d characters)",
+                  MAX_SOURCE_LINE_LEN-1);
+    }
+
+    if (IsIncbinLine(source_line->text, source_line->len))
+    {
+      s32 line_no = IncludeBinary(program, source_line,
+                                  &original[source_line->text - source_file->buffer],
+                                  current_label);
+      current_label[0] = '\0';
+
+      /* The bytes take the line numbers after the directive's, which
+         no other line may use */
+      incbins = (struct incbin_range*)Counted_Realloc(incbins,
+                                          (num_incbins + 1) * sizeof(struct incbin_range));
+      struct incbin_range* incbin = &incbins[num_incbins++];
+      incbin->line_no = line_no;
+      incbin->first = line_no + 1;
+      incbin->last = program->last_line_no;
+      incbin->source_line_number = source_line->source_line_number;
+      continue;
+    }
+
+    struct BASIC_line* line = (struct BASIC_line*)Counted_Malloc(sizeof(struct BASIC_line));
+    memset(line, 0, sizeof(struct BASIC_line));
+    line->source_line_number = source_line->source_line_number;
+
+    if (strlen(current_label) > 0)
+    {
+      /* Store label in line. Duplicates are caught by LabelTrie_Build */
+      memcpy(line->label, current_label, sizeof(line->label));
+    }
+
+    /* A line without a line number gets one generated */
+    line->line_no = source_line->line_no;
+    memcpy(line->source_line, source_line->text, source_line->len);
+    memcpy(line->tokenized_line, source_line->text, source_line->len);
+
+    Program_AddLine(program, line);
+    current_label[0] = '\0';
+  }
+  Program_SortLines(program, incbins, num_incbins);
+  syntax_error_jump = outer_jump;
+  Counted_Free(source_lines.lines);
+  Counted_Free(original);
+  Counted_Free(incbins);
+}
+
+/*
+  DoTokenizePass
+  
+  Tokenize all BASIC keywords and operators in each line of program.
+*/
+void
+DoTokenizePass(struct BASIC_program* program)
+{
+  struct BASIC_line* line = program->first_line;
+  while (line)
+  {
+    TokenizeLine(line->tokenized_line);
+
+    line = line->next;
+  }
+}
+
+/*
+  Constant folding
+
+  Literal-only arithmetic subexpressions are evaluated at compile time
+  so the C64 doesn't have to evaluate them with its floating point
+  routines every time they run.
+
+  The C64 stores numbers as 40-bit floats (8-bit exponent, 32-bit
+  mantissa). To guarantee that a folded value is exactly the value the
+  C64 would have computed, only integer literals of at most 9 digits
+  are considered constant, and they are only combined with +, -, * and
+  exact division as long as every intermediate result is an integer of
+  at most 9 digits. All such values fit the 32-bit mantissa exactly, so
+  no rounding occurs on either the host or the C64, and the C64 parses
+  the folded decimal literal back to the identical value.
+
+  ^ is never folded: the C64 computes it as EXP(LOG(x)*y), which does
+  not produce exact results even for integer operands. ^ also binds
+  more tightly than unary minus, so a negative value folded into the
+  base of ^ is written in parentheses: (0-2)^2 becomes (-2)^2, not
+  -2^2.
+*/
+#define MAX_FOLD_MAGNITUDE  999999999.0
+#define MAX_FOLD_DIGITS     9
+
+struct fold_value
+{
+  BOOL    is_const;
+  BOOL    is_literal;     /* Bare literal; nothing to fold */
+  double  value;
+  u32     begin;
+  u32     end;
+};
+
+struct fold_span
+{
+  u32     begin;
+  u32     end;
+  s32     value;
+  BOOL    parenthesize;   /* Base of ^; keep a negative value in () */
+};
+
+struct fold_context
+{
+  byte_t* line;
+  u32     pos;
+  BOOL    failed;
+  u32     num_folds;
+  struct fold_span folds[MAX_SOURCE_LINE_LEN/2];
+};
+
+struct fold_value Fold_ParseExpression(struct fold_context* ctx);
+struct fold_value Fold_ParseUnary(struct fold_context* ctx);
+
+
+/*
+  Fold_Peek
+
+  Skip spaces and return the next byte of the line.
+*/
+byte_t
+Fold_Peek(struct fold_context* ctx)
+{
+  while (ctx->line[ctx->pos] == ' ')
+    ++ctx->pos;
+  return ctx->line[ctx->pos];
+}
+
+
+/*
+  Fold_NonConst
+
+  Return a non-constant value spanning begin to the current position,
+  excluding any trailing spaces.
+*/
+struct fold_value
+Fold_NonConst(struct fold_context* ctx, u32 begin)
+{
+  struct fold_value v;
+  memset(&v, 0, sizeof(v));
+  v.begin = begin;
+  v.end   = ctx->pos;
+  while (v.end > begin &&
+         ctx->line[v.end-1] == ' ')
+    --v.end;
+  return v;
+}
+
+
+/*
+  Fold_Emit
+
+  Record value as a span to be replaced by its folded result, if it is
+  a constant that was computed (rather than a bare literal).
+*/
+void
+Fold_Emit(struct fold_context* ctx, struct fold_value v)
+{
+  if (!v.is_const ||
+      v.is_literal)
+    return;
+  struct fold_span* span = &ctx->folds[ctx->num_folds++];
+  span->begin = v.begin;
+  span->end   = v.end;
+  span->value = (s32)v.value;
+  span->parenthesize = FALSE;
+}
+
+
+/*
+  Fold_ParseArgs
+
+  Parse a comma separated argument list up to and including the
+  closing parenthesis.
+*/
+void
+Fold_ParseArgs(struct fold_context* ctx)
+{
+  while (!ctx->failed)
+  {
+    Fold_Emit(ctx, Fold_ParseExpression(ctx));
+    byte_t c = Fold_Peek(ctx);
+    ++ctx->pos;
+    if (c == ')')
+      return;
+    if (c != ',')
+      ctx->failed = TRUE;
+  }
+}
+
+
+/*
+  Fold_ParseName
+
+  Parse a variable name with optional type suffix and subscripts.
+*/
+void
+Fold_ParseName(struct fold_context* ctx)
+{
+  if (!isalpha(Fold_Peek(ctx)))
+  {
+    ctx->failed = TRUE;
+    return;
+  }
+  /* The C64 ignores spaces within names */
+  while (isalnum(Fold_Peek(ctx)))
+    ++ctx->pos;
+  if (ctx->line[ctx->pos] == '$' ||
+      ctx->line[ctx->pos] == '%')
+    ++ctx->pos;
+  if (Fold_Peek(ctx) == '(')
+  {
+    ++ctx->pos;
+    Fold_ParseArgs(ctx);
+  }
+}
+
+
+/*
+  Fold_ParsePrimary
+
+  Parse a number, string, parenthesized expression, variable or
+  function call.
+*/
+struct fold_value
+Fold_ParsePrimary(struct fold_context* ctx)
+{
+  byte_t c = Fold_Peek(ctx);
+  u32 begin = ctx->pos;
+
+  if (isdigit(c) ||
+      c == '.')
+  {
+    /* The C64 ignores spaces within numbers, too */
+    int digits = 0;
+    BOOL is_integer = TRUE;
+    double value = 0;
+    u32 end = ctx->pos;
+    while (isdigit(Fold_Peek(ctx)) ||
+           ctx->line[ctx->pos] == '.')
+    {
+      if (ctx->line[ctx->pos] == '.')
+        is_integer = FALSE;
+      else
+      {
+        value = value * 10 + (ctx->line[ctx->pos] - '0');
+        ++digits;
+      }
+      end = ++ctx->pos;
+    }
+    if (Fold_Peek(ctx) == 'E')
+    {
+      is_integer = FALSE;
+      ++ctx->pos;
+      c = Fold_Peek(ctx);
+      if (c == TranslateToken("+") ||
+          c == TranslateToken("-"))
+        ++ctx->pos;
+      while (isdigit(Fold_Peek(ctx)))
+        ++ctx->pos;
+      end = ctx->pos;
+    }
+    ctx->pos = end;
+
+    struct fold_value v = Fold_NonConst(ctx, begin);
+    v.is_literal = TRUE;
+    if (is_integer &&
+        digits <= MAX_FOLD_DIGITS)
+    {
+      v.is_const = TRUE;
+      v.value    = value;
+    }
+    return v;
+  }
+
+  if (c == '"')
+  {
+    ++ctx->pos;
+    while (ctx->line[ctx->pos] &&
+           ctx->line[ctx->pos] != '"')
+      ++ctx->pos;
+    if (ctx->line[ctx->pos])
+      ++ctx->pos;
+    return Fold_NonConst(ctx, begin);
+  }
+
+  if (c == '(')
+  {
+    ++ctx->pos;
+    struct fold_value inner = Fold_ParseExpression(ctx);
+    if (Fold_Peek(ctx) != ')')
+    {
+      ctx->failed = TRUE;
+      return Fold_NonConst(ctx, begin);
+    }
+    ++ctx->pos;
+    if (!inner.is_const)
+      return Fold_NonConst(ctx, begin);
+    inner.begin      = begin;
+    inner.end        = ctx->pos;
+    inner.is_literal = FALSE;
+    return inner;
+  }
+
+  if (isalpha(c))
+  {
+    Fold_ParseName(ctx);
+    return Fold_NonConst(ctx, begin);
+  }
+
+  if (c == TranslateToken("FN"))
+  {
+    ++ctx->pos;
+    Fold_ParseName(ctx);
+    return Fold_NonConst(ctx, begin);
+  }
+
+  if (c == TranslateToken("TAB(") ||
+      c == TranslateToken("SPC("))
+  {
+    ++ctx->pos;
+    Fold_ParseArgs(ctx);
+    return Fold_NonConst(ctx, begin);
+  }
+
+  if (c >= TranslateToken("SGN") &&
+      c <= TranslateToken("MID$"))
+  {
+    ++ctx->pos;
+    if (Fold_Peek(ctx) != '(')
+      ctx->failed = TRUE;
+    else
+    {
+      ++ctx->pos;
+      Fold_ParseArgs(ctx);
+    }
+    return Fold_NonConst(ctx, begin);
+  }
+
+  if (c == 0xff)  /* pi */
+  {
+    ++ctx->pos;
+    return Fold_NonConst(ctx, begin);
+  }
+
+  ctx->failed = TRUE;
+  return Fold_NonConst(ctx, begin);
+}
+
+
+/*
+  Fold_ParsePower
+
+  Parse exponentiation. Operands are emitted but never folded
+  together, and a folded base keeps its parentheses if it is negative
+  (see above).
+*/
+struct fold_value
+Fold_ParsePower(struct fold_context* ctx)
+{
+  struct fold_value left = Fold_ParsePrimary(ctx);
+  while (!ctx->failed &&
+         Fold_Peek(ctx) == TranslateToken("^"))
+  {
+    ++ctx->pos;
+    struct fold_value right = Fold_ParseUnary(ctx);
+    u32 base = ctx->num_folds;
+    Fold_Emit(ctx, left);
+    if (ctx->num_folds > base)
+      ctx->folds[base].parenthesize = TRUE;
+    Fold_Emit(ctx, right);
+    left = Fold_NonConst(ctx, left.begin);
+  }
+  return left;
+}
+
+
+/*
+  Fold_ParseUnary
+
+  Parse unary plus and minus, which bind less tightly than ^ but more
+  tightly than * and /.
+*/
+struct fold_value
+Fold_ParseUnary(struct fold_context* ctx)
+{
+  byte_t c = Fold_Peek(ctx);
+  if (c != TranslateToken("-") &&
+      c != TranslateToken("+"))
+    return Fold_ParsePower(ctx);
+
+  u32 begin = ctx->pos++;
+  struct fold_value v = Fold_ParseUnary(ctx);
+  v.begin = begin;
+  if (c == TranslateToken("-"))
+    v.value = -v.value;
+  return v;
+}
+
+
+/*
+  Fold_Binary
+
+  Combine left and right with op. The result stays constant only if
+  both operands are constant and the result is exact (see above);
+  otherwise any constant operands are emitted.
+*/
+struct fold_value
+Fold_Binary(struct fold_context* ctx, byte_t op,
+            struct fold_value left, struct fold_value right)
+{
+  if (left.is_const &&
+      right.is_const)
+  {
+    double result = 0;
+    BOOL exact = TRUE;
+    if (op == TranslateToken("+"))
+      result = left.value + right.value;
+    else if (op == TranslateToken("-"))
+      result = left.value - right.value;
+    else if (op == TranslateToken("*"))
+      result = left.value * right.value;
+    else if (right.value != 0 &&
+             (s64)left.value % (s64)right.value == 0)
+      result = left.value / right.value;
+    else
+      exact = FALSE;
+
+    if (exact &&
+        result <= MAX_FOLD_MAGNITUDE &&
+        result >= -MAX_FOLD_MAGNITUDE)
+    {
+      struct fold_value v = Fold_NonConst(ctx, left.begin);
+      v.is_const = TRUE;
+      v.value    = result;
+      return v;
+    }
+  }
+
+  Fold_Emit(ctx, left);
+  Fold_Emit(ctx, right);
+  return Fold_NonConst(ctx, left.begin);
+}
+
+
+/*
+  Fold_ParseMultiplicative
+*/
+struct fold_value
+Fold_ParseMultiplicative(struct fold_context* ctx)
+{
+  struct fold_value left = Fold_ParseUnary(ctx);
+  while (!ctx->failed)
+  {
+    byte_t op = Fold_Peek(ctx);
+    if (op != TranslateToken("*") &&
+        op != TranslateToken("/"))
+      break;
+    ++ctx->pos;
+    struct fold_value right = Fold_ParseUnary(ctx);
+    left = Fold_Binary(ctx, op, left, right);
+  }
+  return left;
+}
+
+
+/*
+  Fold_ParseAdditive
+*/
+struct fold_value
+Fold_ParseAdditive(struct fold_context* ctx)
+{
+  struct fold_value left = Fold_ParseMultiplicative(ctx);
+  while (!ctx->failed)
+  {
+    byte_t op = Fold_Peek(ctx);
+    if (op != TranslateToken("+") &&
+        op != TranslateToken("-"))
+      break;
+    ++ctx->pos;
+    struct fold_value right = Fold_ParseMultiplicative(ctx);
+    left = Fold_Binary(ctx, op, left, right);
+  }
+  return left;
+}
+
+
+/*
+  Fold_ParseExpression
+
+  Parse a full expression. Relational and logical operators all bind
+  less tightly than + and -, so each of their operands is a complete
+  arithmetic subexpression that can be folded on its own.
+*/
+struct fold_value
+Fold_ParseExpression(struct fold_context* ctx)
+{
+  u32 begin = ctx->pos;
+  BOOL is_compound = FALSE;
+  struct fold_value v;
+  for (;;)
+  {
+    while (Fold_Peek(ctx) == TranslateToken("NOT"))
+    {
+      ++ctx->pos;
+      is_compound = TRUE;
+    }
+    v = Fold_ParseAdditive(ctx);
+    if (ctx->failed)
+      return v;
+
+    byte_t op = Fold_Peek(ctx);
+    if (op != TranslateToken("AND") &&
+        op != TranslateToken("OR")  &&
+        !(op >= TranslateToken(">") &&
+          op <= TranslateToken("<")))
+      break;
+    while (Fold_Peek(ctx) >= TranslateToken(">") &&
+           ctx->line[ctx->pos] <= TranslateToken("<"))
+      ++ctx->pos;
+    if (op == TranslateToken("AND") ||
+        op == TranslateToken("OR"))
+      ++ctx->pos;
+    Fold_Emit(ctx, v);
+    is_compound = TRUE;
+  }
+  if (!is_compound)
+    return v;
+  Fold_Emit(ctx, v);
+  return Fold_NonConst(ctx, begin);
+}
+
+
+/*
+  Fold_IsExpressionStart
+
+  Returns TRUE if byte can begin an expression.
+*/
+BOOL
+Fold_IsExpressionStart(byte_t c)
+{
+  return (isdigit(c) ||
+          isalpha(c) ||
+          c == '.'   ||
+          c == '"'   ||
+          c == '('   ||
+          c == 0xff  ||
+          c == TranslateToken("+")    ||
+          c == TranslateToken("-")    ||
+          c == TranslateToken("NOT")  ||
+          c == TranslateToken("FN")   ||
+          c == TranslateToken("TAB(") ||
+          c == TranslateToken("SPC(") ||
+          (c >= TranslateToken("SGN") &&
+           c <= TranslateToken("MID$")));
+}
+
+
+/*
+  Fold_CompareSpans
+
+  qsort comparator ordering fold spans by position.
+*/
+int
+Fold_CompareSpans(const void* a, const void* b)
+{
+  const struct fold_span* span_a = (const struct fold_span*)a;
+  const struct fold_span* span_b = (const struct fold_span*)b;
+  return (int)span_a->begin - (int)span_b->begin;
+}
+
+
+/*
+  FoldConstants
+
+  Replace all literal-only arithmetic subexpressions in a tokenized
+  line with their value. Line number arguments (GOTO, GOSUB, THEN,
+  RUN, LIST), strings, REM and DATA are left untouched.
+*/
+void
+FoldConstants(byte_t* line)
+{
+  static struct fold_context ctx;
+  memset(&ctx, 0, sizeof(struct fold_context) - sizeof(ctx.folds));
+  ctx.line = line;
+
+  while (line[ctx.pos])
+  {
+    byte_t c = line[ctx.pos];
+
+    if (c == TranslateToken("REM"))
+      break;
+
+    if (c == TranslateToken("DATA"))
+    {
+      BOOL in_quotes = FALSE;
+      while (line[ctx.pos] &&
+             (in_quotes || line[ctx.pos] != ':'))
+      {
+        if (line[ctx.pos] == '"')
+          in_quotes = !in_quotes;
+        ++ctx.pos;
+      }
+      continue;
+    }
+
+    if (c == TranslateToken("GOTO")  ||
+        c == TranslateToken("GOSUB") ||
+        c == TranslateToken("GO")    ||
+        c == TranslateToken("RUN")   ||
+        c == TranslateToken("LIST"))
+    {
+      /* Skip line number (or label) arguments */
+      ++ctx.pos;
+      if (c == TranslateToken("GO") &&
+          Fold_Peek(&ctx) == TranslateToken("TO"))
+        ++ctx.pos;
+      while (line[ctx.pos] == ' ' ||
+             line[ctx.pos] == ',' ||
+             line[ctx.pos] == TranslateToken("-") ||
+             IsValidLabelChar(line[ctx.pos]))
+        ++ctx.pos;
+      continue;
+    }
+
+    if (c == TranslateToken("THEN"))
+    {
+      ++ctx.pos;
+      if (isdigit(Fold_Peek(&ctx)))
+        while (isdigit(line[ctx.pos]) ||
+               line[ctx.pos] == ' ')
+          ++ctx.pos;
+      continue;
+    }
+
+    if (!Fold_IsExpressionStart(c))
+    {
+      ++ctx.pos;
+      continue;
+    }
+
+    u32 saved_num_folds = ctx.num_folds;
+    ctx.failed = FALSE;
+    struct fold_value v = Fold_ParseExpression(&ctx);
+    if (ctx.failed)
+    {
+      /* Couldn't make sense of this statement; leave it alone */
+      ctx.num_folds = saved_num_folds;
+      BOOL in_quotes = FALSE;
+      while (line[ctx.pos] &&
+             (in_quotes || line[ctx.pos] != ':'))
+      {
+        if (line[ctx.pos] == '"')
+          in_quotes = !in_quotes;
+        ++ctx.pos;
+      }
+      continue;
+    }
+    Fold_Emit(&ctx, v);
+  }
+
+  if (!ctx.num_folds)
+    return;
+
+  qsort(ctx.folds, ctx.num_folds, sizeof(struct fold_span), Fold_CompareSpans);
+
+  byte_t out[MAX_SOURCE_LINE_LEN];
+  u32 in  = 0;
+  u32 pos = 0;
+  for (u32 i = 0;
+       i < ctx.num_folds;
+       ++i)
+  {
+    struct fold_span* span = &ctx.folds[i];
+    while (in < span->begin)
+      out[pos++] = line[in++];
+    if (span->value < 0)
+    {
+      /* The span of a folded base includes its parentheses, so the
+         result is never longer than the text it replaces */
+      if (span->parenthesize)
+        out[pos++] = '(';
+      out[pos++] = TranslateToken("-");
+      pos += sprintf((char*)&out[pos], "%d", -span->value);
+      if (span->parenthesize)
+        out[pos++] = ')';
+    }
+    else
+      pos += sprintf((char*)&out[pos], "%d", span->value);
+    in = span->end;
+  }
+  while (line[in])
+    out[pos++] = line[in++];
+  out[pos] = 0;
+  memcpy(line, out, pos+1);
+}
+
+
+/*
+  DoConstantFoldPass
+
+  Fold literal-only arithmetic subexpressions in each line of
+  program. Must run after DoTokenizePass, since it operates on
+  operator tokens.
+*/
+void
+DoConstantFoldPass(struct BASIC_program* program)
+{
+  struct BASIC_line* line = program->first_line;
+  while (line)
+  {
+    FoldConstants(line->tokenized_line);
+    line = line->next;
+  }
+}
+
+/*
+  Label trie
+
+  Label references are resolved with a trie over the program's labels,
+  so the longest label at a position is found in one forward scan.
+  Labels are matched against the tokenized line: a token matches the
+  characters of its keyword, so that labels such as TOTAL (TO, TAL) or
+  ENDGAME (END, GAME) still resolve, as do labels containing keywords
+  of the selected dialect, such as DOIT with BASIC 7.0's DO.
+*/
+#define LABEL_TRIE_FANOUT  37   /* A-Z, 0-9 and _ */
+
+struct label_trie_node
+{
+  s32    line_no;               /* -1 unless a label ends here */
+  u32    children[LABEL_TRIE_FANOUT];  /* 0: no child */
+};
+
+struct label_trie
+{
+  struct label_trie_node*  nodes;
+  u32    num_nodes;
+  u32    capacity;
+};
+
+
+/*
+  LabelTrie_CharIndex
+
+  Return the child index of label character c, or -1 if c can't be
+  part of a label.
+*/
+int
+LabelTrie_CharIndex(byte_t c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= '0' && c <= '9')
+    return 26 + (c - '0');
+  if (c == '_')
+    return 36;
+  return -1;
+}
+
+
+/*
+  LabelTrie_NewNode
+
+  Add an empty node to trie and return its index.
+*/
+u32
+LabelTrie_NewNode(struct label_trie* trie)
+{
+  if (trie->num_nodes == trie->capacity)
+  {
+    trie->capacity = trie->capacity ? trie->capacity * 2 : 64;
+    trie->nodes = (struct label_trie_node*)Counted_Realloc(trie->nodes,
+                                                   trie->capacity * sizeof(struct label_trie_node));
+  }
+  struct label_trie_node* node = &trie->nodes[trie->num_nodes];
+  memset(node, 0, sizeof(struct label_trie_node));
+  node->line_no = -1;
+  return trie->num_nodes++;
+}
+
+
+/*
+  LabelTrie_Build
+
+  Build the trie of all labels in program.
+*/
+void
+LabelTrie_Build(struct label_trie* trie, struct BASIC_program* program)
+{
+  memset(trie, 0, sizeof(struct label_trie));
+  LabelTrie_NewNode(trie);
+  for (struct BASIC_line* line = program->first_line;
+       line;
+       line = line->next)
+  {
+    u32 node = 0;
+    for (char* c = line->label; *c; ++c)
+    {
+      int index = LabelTrie_CharIndex(*c);
+      if (index < 0)
+        break;
+      if (!trie->nodes[node].children[index])
+      {
+        u32 child = LabelTrie_NewNode(trie);
+        trie->nodes[node].children[index] = child;
+      }
+      node = trie->nodes[node].children[index];
+    }
+    if (!node)
+      continue;
+    if (trie->nodes[node].line_no >= 0)
+    {
+      Counted_Free(trie->nodes);
+      SyntaxError(-1, "Duplicate label: \"%s\"", line->label);
+    }
+    trie->nodes[node].line_no = line->line_no;
+  }
+}
+
+
+/*
+  LabelTrie_Match
+
+  Find the longest label at the start of text. Token bytes match their
+  keyword, but a label must end on a byte boundary.
+
+  Returns the number of bytes of text the label spans, or 0 if there
+  is none, storing the label's line number in line_no.
+*/
+u32
+LabelTrie_Match(struct label_trie* trie, byte_t* text, s32* line_no)
+{
+  u32 node = 0;
+  u32 match_len = 0;
+  for (u32 i = 0; text[i];)
+  {
+    char single[2] = { (char)text[i], 0 };
+    u32 len;
+    char* chars = TokenText(&text[i], &len);
+    if (!chars)
+      chars = single;
+    i += len;
+
+    for (; *chars && node != (u32)-1; ++chars)
+    {
+      int index = LabelTrie_CharIndex(*chars);
+      if (index < 0 ||
+          !trie->nodes[node].children[index])
+        node = (u32)-1;
+      else
+        node = trie->nodes[node].children[index];
+    }
+    if (node == (u32)-1)
+      break;
+    if (trie->nodes[node].line_no >= 0)
+    {
+      match_len = i;
+      *line_no = trie->nodes[node].line_no;
+    }
+  }
+  return match_len;
+}
+
+
+/*
+  LabelName
+
+  Copy the name at the start of text to name: the longest run of label
+  characters, with tokens spelled as their keywords, of at most
+  MAX_LABEL_LENGTH characters. Comparing it to the longest label
+  matched tells a label from a target that only starts with one.
+
+  Returns the number of bytes of text the name spans.
+*/
+u32
+LabelName(byte_t* text, char* name)
+{
+  u32 name_len = 0;
+  u32 end = 0;
+  while (text[end])
+  {
+    char single[2] = { (char)text[end], 0 };
+    u32 token_len;
+    char* chars = TokenText(&text[end], &token_len);
+    if (!chars)
+      chars = single;
+    u32 chars_len = strlen(chars);
+    u32 i = 0;
+    while (i < chars_len &&
+           LabelTrie_CharIndex(chars[i]) >= 0)
+      ++i;
+    if (i < chars_len ||
+        name_len + chars_len > MAX_LABEL_LENGTH)
+      break;
+    memcpy(&name[name_len], chars, chars_len);
+    name_len += chars_len;
+    end += token_len;
+  }
+  name[name_len] = '\0';
+  return end;
+}
+
+
+/*
+  TranslateLabelTargets
+
+  Translate the jump targets at line[*read], copying them to out at
+  *write: a comma separated list of line numbers or labels. Labels
+  become their line numbers, and a name that isn't a label is an error
+  reported for line line_no. If must_end_statement is set, a label is
+  only translated if nothing but the end of the statement follows it,
+  and a name starting with a keyword is taken as a statement.
+*/
+void
+TranslateLabelTargets(struct label_trie* trie, byte_t* line, s32 line_no, u32* read,
+                      byte_t* out, u32* write, BOOL must_end_statement)
+{
+  for (;;)
+  {
+    while (line[*read] == ' ')
+      out[(*write)++] = line[(*read)++];
+
+    if (isdigit(line[*read]))
+    {
+      while (isdigit(line[*read]))
+        out[(*write)++] = line[(*read)++];
+    }
+    else
+    {
+      char name[MAX_LABEL_LENGTH+1];
+      u32 name_len = LabelName(&line[*read], name);
+      if (!isalpha(name[0]))
+        return;
+      if (must_end_statement)
+      {
+        u32 end = *read + name_len;
+        while (line[end] == ' ')
+          ++end;
+        if (line[end] &&
+            line[end] != ':')
+          return;
+      }
+      s32 target_line_no;
+      if (LabelTrie_Match(trie, &line[*read], &target_line_no) != name_len)
+      {
+        /* After THEN, a keyword starts a statement such as PRINT */
+        u32 token_len;
+        if (must_end_statement &&
+            TokenText(&line[*read], &token_len))
+          return;
+        Counted_Free(trie->nodes);
+        SyntaxError(line_no, "Undefined label: \"%s\"", name);
+      }
+      /* We've found a label. Emit the corresponding line number */
+      *write += sprintf((char*)&out[*write], "%d", target_line_no);
+      *read += name_len;
+    }
+
+    u32 next = *read;
+    while (line[next] == ' ')
+      ++next;
+    if (line[next] != ',')
+      return;
+    while (*read <= next)
+      out[(*write)++] = line[(*read)++];
+  }
+}
+
+
+/*
+  TranslateLabels
+
+  Replace all occurances of valid labels (in valid locations) with the
+  corresponding BASIC line number. Labels are valid targets of GOTO,
+  GO TO, GOSUB (including the lists of ON...GOTO and ON...GOSUB),
+  THEN, RESTORE and RUN. Errors are reported for line line_no.
+*/
+void
+TranslateLabels(struct label_trie* trie, byte_t* line, s32 line_no)
+{
+  /* Line numbers can be longer than labels, so the line is rebuilt in
+     out and copied back. A reference takes at least two bytes (token
+     and label) and expands to at most six, so out can't overflow. */
+  byte_t out[3 * MAX_SOURCE_LINE_LEN];
+  u32 read  = 0;
+  u32 write = 0;
+  BOOL in_quotes = FALSE;
+  BOOL in_data   = FALSE;
+  byte_t rem_token     = TranslateToken("REM");
+  byte_t data_token    = TranslateToken("DATA");
+  byte_t go_token      = TranslateToken("GO");
+  byte_t goto_token    = TranslateToken("GOTO");
+  byte_t gosub_token   = TranslateToken("GOSUB");
+  byte_t restore_token = TranslateToken("RESTORE");
+  byte_t run_token     = TranslateToken("RUN");
+  byte_t then_token    = TranslateToken("THEN");
+  while (line[read])
+  {
+    byte_t token = line[read];
+    out[write++] = line[read++];
+
+    /* Labels aren't translated in strings, REM or DATA */
+    if (token == '"')
+      in_quotes = !in_quotes;
+    if (in_quotes)
+      continue;
+    if (in_data)
+    {
+      in_data = (token != ':');
+      continue;
+    }
+    if (token == rem_token)
+    {
+      u32 rest = strlen((char*)&line[read]);
+      memcpy(&out[write], &line[read], rest);
+      write += rest;
+      break;
+    }
+    if (token == data_token)
+    {
+      in_data = TRUE;
+      continue;
+    }
+
+    if (token == go_token)
+    {
+      /* GO TO */
+      while (line[read] == ' ')
+        out[write++] = line[read++];
+      if (line[read] != TranslateToken("TO"))
+        continue;
+      out[write++] = line[read++];
+      token = goto_token;
+    }
+
+    if (token == goto_token  ||
+        token == gosub_token ||
+        token == restore_token ||
+        token == run_token)
+      TranslateLabelTargets(trie, line, line_no, &read, out, &write, FALSE);
+    else if (token == then_token)
+      /* THEN may be followed by a statement instead, such as an
+         assignment to a variable that shares its name with a label */
+      TranslateLabelTargets(trie, line, line_no, &read, out, &write, TRUE);
+  }
+  if (write >= MAX_SOURCE_LINE_LEN)
+    SyntaxError(-1, "Line too long after label substitution");
+  out[write] = 0;
+  memcpy(line, out, write + 1);
+}
+
+
+/*
+  DoLabelPass
+
+  Run through program and replace label strings with the corresponding
+  line numbers where necessary.
+*/
+void
+DoLabelPass(struct BASIC_program* program)
+{
+  struct label_trie trie;
+  LabelTrie_Build(&trie, program);
+
+  struct BASIC_line* curr_line = program->first_line;
+  while (curr_line)
+  {
+    TranslateLabels(&trie, curr_line->tokenized_line, curr_line->line_no);
+    curr_line = curr_line->next;
+  }
+  Counted_Free(trie.nodes);
+}
+
+/*
+  FindLineIndex
+
+  Binary search the sorted array line_numbers for line_no.
+
+  Returns the index of line_no in line_numbers, or -1 if it is not
+  present.
+*/
+s32
+FindLineIndex(s32* line_numbers, u32 count, s32 line_no)
+{
+  u32 lo = 0;
+  u32 hi = count;
+  while (lo < hi)
+  {
+    u32 mid = lo + (hi - lo) / 2;
+    if (line_numbers[mid] == line_no)
+      return (s32)mid;
+    if (line_numbers[mid] < line_no)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+
+/*
+  RenumberLineTargets
+
+  Rewrite every numeric jump target in line (GOTO, GOSUB, GO TO, THEN,
+  RUN, RESTORE and the target lists of ON ... GOTO/GOSUB) from the old
+  line numbers in the sorted array line_numbers to their new numbers:
+  the entries of new_line_numbers, or the index in line_numbers if
+  new_line_numbers is NULL. Without new_line_numbers a target missing
+  from line_numbers is an error; with it, the target is kept. Text
+  within quotes, after REM and within DATA is copied unchanged.
+*/
+void
+RenumberLineTargets(byte_t* line, s32 line_no, s32* line_numbers, u32 count,
+                    s32* new_line_numbers)
+{
+  byte_t goto_token  = TranslateToken("GOTO");
+  byte_t gosub_token = TranslateToken("GOSUB");
+  byte_t go_token    = TranslateToken("GO");
+  byte_t to_token    = TranslateToken("TO");
+  byte_t then_token  = TranslateToken("THEN");
+  byte_t run_token   = TranslateToken("RUN");
+  byte_t restore_token = TranslateToken("RESTORE");
+  byte_t rem_token   = TranslateToken("REM");
+  byte_t data_token  = TranslateToken("DATA");
+
+  byte_t out[MAX_SOURCE_LINE_LEN];
+  u32 in  = 0;
+  u32 pos = 0;
+  while (line[in])
+  {
+    byte_t byte = line[in];
+
+    if (byte == '"')
+    {
+      /* Copy quoted string verbatim */
+      out[pos++] = line[in++];
+      while (line[in] &&
+             line[in] != '"')
+        out[pos++] = line[in++];
+      if (line[in])
+        out[pos++] = line[in++];
+      continue;
+    }
+
+    out[pos++] = line[in++];
+
+    if (byte == rem_token)
+    {
+      /* Copy the remainder of the line verbatim */
+      while (line[in])
+        out[pos++] = line[in++];
+      break;
+    }
+    if (byte == data_token)
+    {
+      /* Copy up to the next statement verbatim */
+      BOOL in_quotes = FALSE;
+      while (line[in] &&
+             (in_quotes || line[in] != ':'))
+      {
+        if (line[in] == '"')
+          in_quotes = !in_quotes;
+        out[pos++] = line[in++];
+      }
+      continue;
+    }
+
+    BOOL is_list = FALSE;
+    if (byte == goto_token ||
+        byte == gosub_token)
+    {
+      is_list = TRUE;
+    }
+    else if (byte == go_token)
+    {
+      /* GO TO is tokenized as GO, TO */
+      u32 next = in;
+      while (line[next] == ' ') ++next;
+      if (line[next] != to_token)
+        continue;
+      while (in <= next)
+        out[pos++] = line[in++];
+      is_list = TRUE;
+    }
+    else if (byte != then_token &&
+             byte != run_token &&
+             byte != restore_token)
+    {
+      continue;
+    }
+
+    for (;;)
+    {
+      while (line[in] == ' ')
+        out[pos++] = line[in++];
+      if (!isdigit(line[in]))
+        break;
+
+      u32 digits = in;
+      s32 target = 0;
+      while (isdigit(line[in]))
+      {
+        target = target * 10 + (line[in++] - '0');
+        if (target > MAX_LINE_NUMBER)
+          SyntaxError(line_no, "Jump target too high (maximum: %d)", MAX_LINE_NUMBER);
+      }
+      s32 new_target = FindLineIndex(line_numbers, count, target);
+      if (new_target < 0 &&
+          new_line_numbers)
+      {
+        /* Not ours to rewrite */
+        memcpy(&out[pos], &line[digits], in - digits);
+        pos += in - digits;
+      }
+      else
+      {
+        if (new_target < 0)
+          SyntaxError(line_no, "Jump to undefined line number: %d", target);
+        if (new_line_numbers)
+          new_target = new_line_numbers[new_target];
+        if (pos + 6 + strlen((char*)&line[in]) >= MAX_SOURCE_LINE_LEN)
+          SyntaxError(line_no, "Line too long after renumbering");
+        pos += sprintf((char*)&out[pos], "%d", new_target);
+      }
+
+      while (line[in] == ' ')
+        out[pos++] = line[in++];
+      if (!is_list ||
+          line[in] != ',')
+        break;
+      out[pos++] = line[in++];
+    }
+  }
+  out[pos] = 0;
+  memcpy(line, out, pos+1);
+}
+
+
+/*
+  DoRenumberPass
+
+  Renumber the program with the smallest possible line numbers
+  (starting at 0, step 1) and rewrite all numeric jump targets to
+  match. Short line numbers take fewer bytes and are parsed faster by
+  the C64 interpreter. Must run after DoLabelPass so that labels have
+  already been resolved to line numbers.
+*/
+void
+DoRenumberPass(struct BASIC_program* program)
+{
+  u32 count = 0;
+  struct BASIC_line* curr_line = program->first_line;
+  while (curr_line)
+  {
+    ++count;
+    curr_line = curr_line->next;
+  }
+  if (!count) return;
+
+  /* Lines are kept sorted, so this array is sorted as well */
+  s32* line_numbers = (s32*)Counted_Malloc(count * sizeof(s32));
+  u32 i = 0;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    line_numbers[i++] = curr_line->line_no;
+
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    RenumberLineTargets(curr_line->tokenized_line, curr_line->line_no,
+                        line_numbers, count, 0);
+
+  i = 0;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    curr_line->line_no = i++;
+  program->last_line_no = count - 1;
+
+  Counted_Free(line_numbers);
+}
+
+/*
+  DoPETSCIIPlaceholderPass
+
+  Replace all PETSCII placeholder strings with correct PETSCII
+  code. This needs to be called before the tokenize pass so that the
+  curly braces are not translated to PETSCII.
+*/
+
+void
+DoPETSCIIPlaceholderPass(struct BASIC_program* program)
+{
+  struct BASIC_line* curr_line = program->first_line;
+  while (curr_line)
+  {
+    TranslateASCIIToPETSCII((byte_t*)curr_line->tokenized_line);
+    curr_line = curr_line->next;
+  }
+}
+
+
+/*
+  DoPETSCIIPass
+
+  Convert each program line from ASCII to C64 PETSCII
+*/
+void
+DoPETSCIIPass(struct BASIC_program* program)
+{
+  struct BASIC_line* curr_line = program->first_line;
+  while (curr_line)
+  {
+    TranslateASCIIToPETSCII((byte_t*)curr_line->tokenized_line);
+    curr_line = curr_line->next;
+  }
+}
+
+
+/*
+  Cost estimation
+
+  A static estimate of the C64 interpreter's running time for each
+  line and each subroutine, for programs too interactive to profile
+  by running them. The model charges:
+
+   - every byte of program text the interpreter reads (CHRGET)
+   - statement dispatch
+   - parsing of every digit of number literals and line numbers
+   - the line search of jumps: forward jumps search from the current
+     line, backward jumps from the start of the program
+   - variable lookup, by position in the variable table. The table
+     order is approximated by the order of first appearance in the
+     program text.
+   - arithmetic, string temporaries and function calls
+
+  Lines within loops are weighted by the estimated iteration count:
+  FOR loops with literal bounds by their actual count, all other loops
+  (including backward jumps) by LOOP_DEFAULT_ITERATIONS. NEXT returns
+  to the statement after FOR, so a FOR line is split into segments at
+  the end of each FOR statement, and a loop weights only the segments
+  after its FOR; the statements up to and including FOR run once per
+  entry of the line.
+
+  The cycle counts are rough figures for the C64 BASIC ROM, good
+  enough to rank lines against each other.
+*/
+#define COST_CHRGET           20
+#define COST_STATEMENT        60
+#define COST_LINE_HOP         30
+#define COST_NUMBER_DIGIT     250
+#define COST_VAR_LOOKUP       60
+#define COST_VAR_SCAN         25
+#define COST_ARRAY_ELEMENT    400
+#define COST_FADD             180
+#define COST_FMUL             1100
+#define COST_FDIV             1900
+#define COST_FCOMPARE         150
+#define COST_FPOWER           25000
+#define COST_TRANSCENDENTAL   15000
+#define COST_INT              250
+#define COST_STRING_ALLOC     300
+#define COST_NUMBER_TO_STRING 2500
+
+#define LOOP_DEFAULT_ITERATIONS  10
+#define MAX_COST_VARIABLES       1024
+#define MAX_COST_SEGMENTS        8
+
+struct cost_segment
+{
+  u32    begin;         /* Offset in the tokenized line */
+  double cycles;        /* Per execution of the segment */
+  double weight;        /* Estimated executions per program run */
+};
+
+struct line_cost
+{
+  struct BASIC_line* line;
+  double cycles;        /* Per execution of the whole line */
+  double entry_weight;  /* Entries, excluding loops starting on this line */
+  BOOL   is_subroutine;
+  double calls;         /* Weighted number of GOSUB calls */
+  double call_cycles;   /* Cycles per call, for subroutines */
+  struct cost_segment segments[MAX_COST_SEGMENTS];
+  u32    num_segments;  /* One, plus one after each FOR statement */
+};
+
+/* A FOR loop whose NEXT hasn't been found yet */
+struct cost_loop
+{
+  u32    line;
+  u32    segment;       /* First segment of the FOR line in the loop */
+  double iterations;
+};
+
+struct cost_model
+{
+  struct line_cost* lines;
+  u32    num_lines;
+  char   vars[MAX_COST_VARIABLES][4];
+  u32    num_vars;
+};
+
+
+/*
+  Cost_FindLine
+
+  Return the index of line line_no in the model, or -1.
+*/
+s32
+Cost_FindLine(struct cost_model* model, s32 line_no)
+{
+  u32 lo = 0;
+  u32 hi = model->num_lines;
+  while (lo < hi)
+  {
+    u32 mid = lo + (hi - lo) / 2;
+    s32 mid_line_no = model->lines[mid].line->line_no;
+    if (mid_line_no == line_no)
+      return (s32)mid;
+    if (mid_line_no < line_no)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+
+/*
+  Cost_ParseName
+
+  Parse a variable name at *pos into name (first two characters plus
+  type suffix, and '(' for arrays) and advance *pos past it.
+*/
+void
+Cost_ParseName(byte_t* line, u32* pos, char* name)
+{
+  memset(name, 0, 4);
+  name[0] = line[(*pos)++];
+  while (isalnum(line[*pos]))
+  {
+    if (!name[1])
+      name[1] = line[*pos];
+    ++*pos;
+  }
+  if (line[*pos] == '$' ||
+      line[*pos] == '%')
+    name[2] = line[(*pos)++];
+  u32 next = *pos;
+  while (line[next] == ' ')
+    ++next;
+  if (line[next] == '(')
+    name[3] = '(';
+}
+
+
+/*
+  Cost_VariableIndex
+
+  Return the position of name in the estimated variable table,
+  adding it if necessary. Arrays live in a table of their own on the
+  C64, but sharing positions here keeps the estimate conservative.
+*/
+u32
+Cost_VariableIndex(struct cost_model* model, char* name)
+{
+  for (u32 i = 0;
+       i < model->num_vars;
+       ++i)
+  {
+    if (memcmp(model->vars[i], name, 4) == 0)
+      return i;
+  }
+  if (model->num_vars < MAX_COST_VARIABLES)
+    memcpy(model->vars[model->num_vars++], name, 4);
+  return model->num_vars - 1;
+}
+
+
+/*
+  Cost_JumpCycles
+
+  Estimate the line search cost of a jump from line index from to line
+  line_no.
+*/
+double
+Cost_JumpCycles(struct cost_model* model, u32 from, s32 line_no)
+{
+  s32 to = Cost_FindLine(model, line_no);
+  if (to < 0)
+    return 0;
+  u32 hops = ((u32)to > from) ? (u32)to - from : (u32)to + 1;
+  return hops * COST_LINE_HOP;
+}
+
+
+/*
+  Cost_MarkLoop
+
+  Multiply the weight of lines first through last by iterations,
+  starting at segment first_segment of line first.
+*/
+void
+Cost_MarkLoop(struct cost_model* model, u32 first, u32 first_segment,
+              u32 last, double iterations)
+{
+  for (u32 i = first;
+       i <= last && i < model->num_lines;
+       ++i)
+  {
+    struct line_cost* cost = &model->lines[i];
+    for (u32 s = (i == first) ? first_segment : 0;
+         s < cost->num_segments;
+         ++s)
+      cost->segments[s].weight *= iterations;
+    if (i > first)
+      cost->entry_weight *= iterations;
+  }
+}
+
+
+/*
+  Cost_WeightAt
+
+  Return the weight of the statement at offset pos of the line.
+*/
+double
+Cost_WeightAt(struct line_cost* cost, u32 pos)
+{
+  u32 s = cost->num_segments - 1;
+  while (s > 0 &&
+         cost->segments[s].begin > pos)
+    --s;
+  return cost->segments[s].weight;
+}
+
+
+/*
+  Cost_Weighted
+
+  Return the estimated cycles spent on the line per program run.
+*/
+double
+Cost_Weighted(const struct line_cost* cost)
+{
+  double weighted = 0;
+  for (u32 s = 0; s < cost->num_segments; ++s)
+    weighted += cost->segments[s].cycles * cost->segments[s].weight;
+  return weighted;
+}
+
+
+/*
+  Cost_ParseLiteral
+
+  Parse a (possibly signed) number literal at *pos. Returns FALSE if
+  there isn't one.
+*/
+BOOL
+Cost_ParseLiteral(byte_t* line, u32* pos, double* value)
+{
+  u32 p = *pos;
+  while (line[p] == ' ') ++p;
+  BOOL negative = FALSE;
+  if (line[p] == TranslateToken("-"))
+  {
+    negative = TRUE;
+    ++p;
+    while (line[p] == ' ') ++p;
+  }
+  if (!isdigit(line[p]) &&
+      line[p] != '.')
+    return FALSE;
+  char* end;
+  *value = strtod((char*)&line[p], &end);
+  if (negative)
+    *value = -*value;
+  *pos = (byte_t*)end - line;
+  while (line[*pos] == ' ') ++*pos;
+  return TRUE;
+}
+
+
+/*
+  Cost_ForIterations
+
+  Estimate the iteration count of the FOR statement whose arguments
+  begin at pos.
+*/
+double
+Cost_ForIterations(byte_t* line, u32 pos)
+{
+  /* Skip the loop variable and '=' */
+  while (line[pos] &&
+         line[pos] != TranslateToken("="))
+    ++pos;
+  if (!line[pos])
+    return LOOP_DEFAULT_ITERATIONS;
+  ++pos;
+
+  double start, limit, step = 1;
+  if (!Cost_ParseLiteral(line, &pos, &start) ||
+      line[pos] != TranslateToken("TO"))
+    return LOOP_DEFAULT_ITERATIONS;
+  ++pos;
+  if (!Cost_ParseLiteral(line, &pos, &limit))
+    return LOOP_DEFAULT_ITERATIONS;
+  if (line[pos] == TranslateToken("STEP"))
+  {
+    ++pos;
+    if (!Cost_ParseLiteral(line, &pos, &step))
+      return LOOP_DEFAULT_ITERATIONS;
+  }
+  if (line[pos] &&
+      line[pos] != ':')
+    return LOOP_DEFAULT_ITERATIONS;
+  if (step == 0)
+    return LOOP_DEFAULT_ITERATIONS;
+
+  /* A FOR loop always runs at least once */
+  double iterations = (double)(s64)((limit - start) / step) + 1;
+  return (iterations < 1) ? 1 : iterations;
+}
+
+
+/*
+  Cost_ScanLine
+
+  Estimate the cycles for one execution of each segment of line index,
+  and record loops and subroutine calls found on it.
+*/
+void
+Cost_ScanLine(struct cost_model* model, u32 index,
+              struct cost_loop* loops, u32* num_loops)
+{
+  struct line_cost* cost = &model->lines[index];
+  byte_t* line = cost->line->tokenized_line;
+  double cycles = COST_STATEMENT;   /* Of the current segment */
+  BOOL split = FALSE;               /* Start a segment after this statement */
+  u32 pos = 0;
+
+  while (line[pos])
+  {
+    byte_t c = line[pos];
+    cycles += COST_CHRGET;
+
+    if (c == '"')
+    {
+      ++pos;
+      while (line[pos] &&
+             line[pos] != '"')
+      {
+        cycles += COST_CHRGET;
+        ++pos;
+      }
+      if (line[pos])
+        ++pos;
+      cycles += COST_STRING_ALLOC;
+      continue;
+    }
+
+    if (c == TranslateToken("REM"))
+    {
+      cycles += strlen((char*)&line[pos]) * COST_CHRGET;
+      break;
+    }
+
+    if (c == TranslateToken("DATA"))
+    {
+      /* DATA is skipped at run time */
+      BOOL in_quotes = FALSE;
+      while (line[pos] &&
+             (in_quotes || line[pos] != ':'))
+      {
+        if (line[pos] == '"')
+          in_quotes = !in_quotes;
+        cycles += COST_CHRGET;
+        ++pos;
+      }
+      continue;
+    }
+
+    if (c == ':')
+    {
+      if (split &&
+          cost->num_segments < MAX_COST_SEGMENTS)
+      {
+        /* Code after FOR starts with the weight of the line's entry;
+           the loop's NEXT multiplies it */
+        struct cost_segment* segment = &cost->segments[cost->num_segments++];
+        segment->begin  = pos;
+        segment->weight = cost->segments[0].weight;
+        segment[-1].cycles = cycles;
+        cycles = 0;
+      }
+      split = FALSE;
+      cycles += COST_STATEMENT;
+      ++pos;
+      continue;
+    }
+
+    if (isdigit(c) ||
+        c == '.')
+    {
+      while (isdigit(line[pos]) ||
+             line[pos] == '.')
+      {
+        cycles += COST_NUMBER_DIGIT + COST_CHRGET;
+        ++pos;
+      }
+      if (line[pos] == 'E')
+      {
+        ++pos;
+        if (line[pos] == TranslateToken("+") ||
+            line[pos] == TranslateToken("-"))
+          ++pos;
+        while (isdigit(line[pos]))
+        {
+          cycles += COST_NUMBER_DIGIT + COST_CHRGET;
+          ++pos;
+        }
+      }
+      continue;
+    }
+
+    if (isalpha(c))
+    {
+      char name[4];
+      u32 begin = pos;
+      Cost_ParseName(line, &pos, name);
+      cycles += (pos - begin) * COST_CHRGET;
+      cycles += COST_VAR_LOOKUP +
+                Cost_VariableIndex(model, name) * COST_VAR_SCAN;
+      if (name[3])
+        cycles += COST_ARRAY_ELEMENT;
+      if (name[2] == '$')
+        cycles += COST_STRING_ALLOC;
+      continue;
+    }
+
+    ++pos;
+
+    if (c == TranslateToken("GOTO")  ||
+        c == TranslateToken("GOSUB") ||
+        c == TranslateToken("THEN")  ||
+        c == TranslateToken("RUN")   ||
+        c == TranslateToken("GO"))
+    {
+      if (c == TranslateToken("GO"))
+      {
+        while (line[pos] == ' ') ++pos;
+        if (line[pos] == TranslateToken("TO"))
+          ++pos;
+      }
+
+      /* Jump targets. Only one target of an ON list is taken, so
+         their search costs are averaged. */
+      double jump_cycles = 0;
+      u32 num_targets = 0;
+      for (;;)
+      {
+        while (line[pos] == ' ') ++pos;
+        if (!isdigit(line[pos]))
+          break;
+        s32 target = atoi((char*)&line[pos]);
+        while (isdigit(line[pos]))
+        {
+          cycles += COST_NUMBER_DIGIT + COST_CHRGET;
+          ++pos;
+        }
+        jump_cycles += Cost_JumpCycles(model, index, target);
+        ++num_targets;
+
+        s32 target_index = Cost_FindLine(model, target);
+        if (target_index >= 0)
+        {
+          if (c == TranslateToken("GOSUB"))
+            model->lines[target_index].is_subroutine = TRUE;
+          else if ((u32)target_index <= index)
+            /* Backward jump: assume a loop */
+            Cost_MarkLoop(model, target_index, 0, index, LOOP_DEFAULT_ITERATIONS);
+        }
+
+        while (line[pos] == ' ') ++pos;
+        if (line[pos] != ',')
+          break;
+        ++pos;
+      }
+      if (num_targets)
+        cycles += jump_cycles / num_targets;
+      continue;
+    }
+
+    if (c == TranslateToken("FOR") &&
+        *num_loops < MAX_COST_VARIABLES)
+    {
+      /* The loop starts with the segment after this statement, if
+         there is room for one */
+      struct cost_loop* loop = &loops[(*num_loops)++];
+      loop->line       = index;
+      loop->segment    = cost->num_segments;
+      loop->iterations = Cost_ForIterations(line, pos);
+      if (cost->num_segments == MAX_COST_SEGMENTS)
+        --loop->segment;
+      split = TRUE;
+      continue;
+    }
+
+    if (c == TranslateToken("NEXT"))
+    {
+      /* NEXT I,J closes two loops */
+      u32 closed = 1;
+      for (u32 p = pos; line[p] && line[p] != ':'; ++p)
+        if (line[p] == ',')
+          ++closed;
+      while (closed-- &&
+             *num_loops > 0)
+      {
+        struct cost_loop* loop = &loops[--*num_loops];
+        Cost_MarkLoop(model, loop->line, loop->segment, index, loop->iterations);
+        cycles += COST_FADD + COST_FCOMPARE;
+      }
+      continue;
+    }
+
+    if (c == TranslateToken("+") ||
+        c == TranslateToken("-"))
+      cycles += COST_FADD;
+    else if (c == TranslateToken("*"))
+      cycles += COST_FMUL;
+    else if (c == TranslateToken("/"))
+      cycles += COST_FDIV;
+    else if (c == TranslateToken("^"))
+      cycles += COST_FPOWER;
+    else if (c >= TranslateToken(">") &&
+             c <= TranslateToken("<"))
+      cycles += COST_FCOMPARE;
+    else if (c == TranslateToken("INT"))
+      cycles += COST_INT;
+    else if (c == TranslateToken("SQR") ||
+             (c >= TranslateToken("LOG") &&
+              c <= TranslateToken("ATN")))
+      cycles += COST_TRANSCENDENTAL;
+    else if (c == TranslateToken("STR$"))
+      cycles += COST_NUMBER_TO_STRING + COST_STRING_ALLOC;
+    else if (c >= TranslateToken("CHR$") &&
+             c <= TranslateToken("MID$"))
+      cycles += COST_STRING_ALLOC;
+  }
+
+  cost->segments[cost->num_segments-1].cycles = cycles;
+  cost->cycles = 0;
+  for (u32 s = 0; s < cost->num_segments; ++s)
+    cost->cycles += cost->segments[s].cycles;
+}
+
+
+/*
+  Cost_LineReturns
+
+  Returns TRUE if line contains a RETURN statement.
+*/
+BOOL
+Cost_LineReturns(byte_t* line)
+{
+  BOOL in_quotes = FALSE;
+  for (; *line; ++line)
+  {
+    if (*line == '"')
+      in_quotes = !in_quotes;
+    if (in_quotes)
+      continue;
+    if (*line == TranslateToken("REM"))
+      return FALSE;
+    if (*line == TranslateToken("RETURN"))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+/*
+  Cost_CompareWeighted
+
+  qsort comparator ranking line costs by weighted cycles, descending.
+*/
+int
+Cost_CompareWeighted(const void* a, const void* b)
+{
+  const struct line_cost* line_a = *(const struct line_cost**)a;
+  const struct line_cost* line_b = *(const struct line_cost**)b;
+  double cost_a = Cost_Weighted(line_a);
+  double cost_b = Cost_Weighted(line_b);
+  return (cost_a < cost_b) - (cost_a > cost_b);
+}
+
+
+/*
+  Cost_CompareSubroutines
+
+  qsort comparator ranking subroutines by weighted cycles, descending.
+*/
+int
+Cost_CompareSubroutines(const void* a, const void* b)
+{
+  const struct line_cost* line_a = *(const struct line_cost**)a;
+  const struct line_cost* line_b = *(const struct line_cost**)b;
+  double cost_a = line_a->call_cycles * line_a->calls;
+  double cost_b = line_b->call_cycles * line_b->calls;
+  return (cost_a < cost_b) - (cost_a > cost_b);
+}
+
+
+/*
+  Cost_BuildModel
+
+  Estimate the cost and loop weight of every line of program. The
+  caller frees model->lines.
+
+  Returns FALSE if the program is empty.
+*/
+BOOL
+Cost_BuildModel(struct BASIC_program* program, struct cost_model* model)
+{
+  memset(model, 0, sizeof(struct cost_model));
+  for (struct BASIC_line* line = program->first_line;
+       line;
+       line = line->next)
+    ++model->num_lines;
+  if (!model->num_lines)
+    return FALSE;
+
+  model->lines = (struct line_cost*)Counted_Calloc(model->num_lines, sizeof(struct line_cost));
+  u32 i = 0;
+  for (struct BASIC_line* line = program->first_line;
+       line;
+       line = line->next, ++i)
+  {
+    model->lines[i].line = line;
+    model->lines[i].entry_weight = 1;
+    model->lines[i].segments[0].weight = 1;
+    model->lines[i].num_segments = 1;
+  }
+
+  static struct cost_loop loops[MAX_COST_VARIABLES];
+  u32 num_loops = 0;
+  for (i = 0; i < model->num_lines; ++i)
+    Cost_ScanLine(model, i, loops, &num_loops);
+
+  return TRUE;
+}
+
+
+/*
+  Program_PrintCostReport
+
+  Print the estimated cost of each line and each subroutine of
+  program to fp, ranked from most to least expensive.
+*/
+void
+Program_PrintCostReport(FILE* fp, struct BASIC_program* program)
+{
+  struct cost_model model;
+  if (!Cost_BuildModel(program, &model))
+    return;
+  u32 i;
+
+  /* Subroutine costs: from the entry line up to the first line that
+     returns, relative to the weight with which the entry line is
+     entered. Calls are weighted by the weight of the calling statement. */
+  for (i = 0; i < model.num_lines; ++i)
+  {
+    byte_t* line = model.lines[i].line->tokenized_line;
+    BOOL in_quotes = FALSE;
+    for (u32 pos = 0; line[pos]; ++pos)
+    {
+      if (line[pos] == '"')
+        in_quotes = !in_quotes;
+      if (in_quotes ||
+          line[pos] != TranslateToken("GOSUB"))
+        continue;
+      /* ON ... GOSUB takes one of its targets per call */
+      char* targets = (char*)&line[pos+1];
+      u32 num_targets = 1;
+      for (char* c = targets; *c && *c != ':'; ++c)
+        if (*c == ',')
+          ++num_targets;
+      for (char* c = targets; c; c = strchr(c, ','))
+      {
+        if (*c == ',')
+          ++c;
+        s32 target = Cost_FindLine(&model, atoi(c));
+        if (target >= 0)
+          model.lines[target].calls += Cost_WeightAt(&model.lines[i], pos) / num_targets;
+        char* colon = strchr(c, ':');
+        char* comma = strchr(c, ',');
+        if (colon && comma && colon < comma)
+          break;
+      }
+    }
+  }
+  for (i = 0; i < model.num_lines; ++i)
+  {
+    struct line_cost* entry = &model.lines[i];
+    if (!entry->is_subroutine)
+      continue;
+    for (u32 j = i; j < model.num_lines; ++j)
+    {
+      entry->call_cycles += Cost_Weighted(&model.lines[j]) / entry->entry_weight;
+      if (Cost_LineReturns(model.lines[j].line->tokenized_line))
+        break;
+    }
+  }
+
+  struct line_cost** ranked = (struct line_cost**)Counted_Malloc(model.num_lines * sizeof(struct line_cost*));
+  double total = 0;
+  for (i = 0; i < model.num_lines; ++i)
+  {
+    ranked[i] = &model.lines[i];
+    total += Cost_Weighted(&model.lines[i]);
+  }
+  if (total <= 0)
+    total = 1;
+
+  qsort(ranked, model.num_lines, sizeof(struct line_cost*), Cost_CompareWeighted);
+  fprintf(fp, "\nEstimated cost per line (ranked):\n");
+  fprintf(fp, "%-8s %-*s %12s %12s %14s %7s\n", "Line", MAX_LABEL_LENGTH, "Label",
+          "Weight", "Cycles/run", "Weighted", "%");
+  for (i = 0; i < model.num_lines; ++i)
+  {
+    struct line_cost* cost = ranked[i];
+    double weighted = Cost_Weighted(cost);
+    fprintf(fp, "%-8d %-*s %12.0f %12.0f %14.0f %7.2f\n", cost->line->line_no,
+            MAX_LABEL_LENGTH, cost->line->label, cost->segments[0].weight, cost->cycles,
+            weighted, 100.0 * weighted / total);
+  }
+
+  u32 num_subroutines = 0;
+  for (i = 0; i < model.num_lines; ++i)
+    if (model.lines[i].is_subroutine)
+      ranked[num_subroutines++] = &model.lines[i];
+  if (num_subroutines)
+  {
+    qsort(ranked, num_subroutines, sizeof(struct line_cost*), Cost_CompareSubroutines);
+    fprintf(fp, "\nEstimated cost per subroutine (ranked):\n");
+    fprintf(fp, "%-8s %-*s %12s %12s %14s\n", "Line", MAX_LABEL_LENGTH, "Label",
+            "Calls", "Cycles/call", "Weighted");
+    for (i = 0; i < num_subroutines; ++i)
+    {
+      struct line_cost* cost = ranked[i];
+      fprintf(fp, "%-8d %-*s %12.1f %12.0f %14.0f\n", cost->line->line_no,
+              MAX_LABEL_LENGTH, cost->line->label, cost->calls,
+              cost->call_cycles, cost->call_cycles * cost->calls);
+    }
+  }
+
+  Counted_Free(ranked);
+  Counted_Free(model.lines);
+}
+
+
+/*
+  Variable ordering
+
+  The C64 finds simple variables by a linear search of the variable
+  table, which is in order of creation. DoVariableOrderPass inserts a
+  new first line that assigns every simple variable its initial value
+  (0 or ""), hottest first, so the most frequently used variables are
+  found fastest. Hotness is the number of references weighted by the
+  estimated loop weight of the referencing statement. Since RUN clears all
+  variables, the new line doesn't change the program's behavior.
+*/
+#define MAX_ORDER_LINE_LEN  250
+
+struct variable_heat
+{
+  char   name[4];
+  double heat;
+  u32    first_seen;
+};
+
+
+/*
+  Order_CompareHeat
+
+  qsort comparator ranking variables by heat, descending, and by first
+  appearance within equal heat.
+*/
+int
+Order_CompareHeat(const void* a, const void* b)
+{
+  const struct variable_heat* var_a = (const struct variable_heat*)a;
+  const struct variable_heat* var_b = (const struct variable_heat*)b;
+  if (var_a->heat != var_b->heat)
+    return (var_a->heat < var_b->heat) - (var_a->heat > var_b->heat);
+  return (int)var_a->first_seen - (int)var_b->first_seen;
+}
+
+
+/*
+  Order_CountReferences
+
+  Add the weight of each reference to a simple variable in the line of
+  cost to the variable's heat.
+*/
+void
+Order_CountReferences(struct line_cost* cost,
+                      struct variable_heat* vars, u32* num_vars)
+{
+  byte_t* line = cost->line->tokenized_line;
+  u32 pos = 0;
+  while (line[pos])
+  {
+    byte_t c = line[pos];
+
+    if (c == '"')
+    {
+      ++pos;
+      while (line[pos] &&
+             line[pos] != '"')
+        ++pos;
+      if (line[pos])
+        ++pos;
+      continue;
+    }
+
+    if (c == TranslateToken("REM"))
+      break;
+
+    if (c == TranslateToken("DATA"))
+    {
+      BOOL in_quotes = FALSE;
+      while (line[pos] &&
+             (in_quotes || line[pos] != ':'))
+      {
+        if (line[pos] == '"')
+          in_quotes = !in_quotes;
+        ++pos;
+      }
+      continue;
+    }
+
+    if (isdigit(c) ||
+        c == '.')
+    {
+      while (isdigit(line[pos]) ||
+             line[pos] == '.')
+        ++pos;
+      if (line[pos] == 'E')
+      {
+        ++pos;
+        if (line[pos] == TranslateToken("+") ||
+            line[pos] == TranslateToken("-"))
+          ++pos;
+        while (isdigit(line[pos]))
+          ++pos;
+      }
+      continue;
+    }
+
+    if (c == TranslateToken("FN"))
+    {
+      /* Skip the function name */
+      ++pos;
+      while (line[pos] == ' ')
+        ++pos;
+      while (isalnum(line[pos]))
+        ++pos;
+      continue;
+    }
+
+    if (!isalpha(c))
+    {
+      ++pos;
+      continue;
+    }
+
+    char name[4];
+    u32 begin = pos;
+    Cost_ParseName(line, &pos, name);
+    /* Arrays have a table of their own, and TI, TI$ and ST are
+       reserved */
+    if (name[3] ||
+        (name[0] == 'T' && name[1] == 'I' && name[2] != '%') ||
+        (name[0] == 'S' && name[1] == 'T' && !name[2]))
+      continue;
+
+    u32 i;
+    for (i = 0; i < *num_vars; ++i)
+      if (memcmp(vars[i].name, name, 4) == 0)
+        break;
+    if (i == *num_vars)
+    {
+      if (*num_vars >= MAX_COST_VARIABLES)
+        continue;
+      memcpy(vars[i].name, name, 4);
+      vars[i].heat = 0;
+      vars[i].first_seen = i;
+      ++*num_vars;
+    }
+    vars[i].heat += Cost_WeightAt(cost, begin);
+  }
+}
+
+
+/*
+  DoVariableOrderPass
+
+  Insert a first line creating the program's simple variables in
+  order of descending heat. Must run after DoLabelPass, so that label
+  references aren't mistaken for variables.
+*/
+void
+DoVariableOrderPass(struct BASIC_program* program)
+{
+  struct cost_model model;
+  if (!Cost_BuildModel(program, &model))
+    return;
+
+  static struct variable_heat vars[MAX_COST_VARIABLES];
+  u32 num_vars = 0;
+  for (u32 i = 0; i < model.num_lines; ++i)
+    Order_CountReferences(&model.lines[i], vars, &num_vars);
+  Counted_Free(model.lines);
+  if (!num_vars)
+    return;
+
+  qsort(vars, num_vars, sizeof(struct variable_heat), Order_CompareHeat);
+
+  struct BASIC_line* line = (struct BASIC_line*)Counted_Malloc(sizeof(struct BASIC_line));
+  memset(line, 0, sizeof(struct BASIC_line));
+  byte_t* out = line->tokenized_line;
+  u32 pos = 0;
+  for (u32 i = 0; i < num_vars; ++i)
+  {
+    /* Only the first two characters of a name are significant */
+    char name[4];
+    char* c = name;
+    *c++ = vars[i].name[0];
+    if (vars[i].name[1])
+      *c++ = vars[i].name[1];
+    if (vars[i].name[2])
+      *c++ = vars[i].name[2];
+    *c = 0;
+    char* value = (vars[i].name[2] == '$') ? "\"\"" : "0";
+
+    u32 len = (pos ? 1 : 0) + strlen(name) + 1 + strlen(value);
+    if (pos + len > MAX_ORDER_LINE_LEN)
+      break;
+    if (pos)
+      out[pos++] = ':';
+    pos += sprintf((char*)&out[pos], "%s", name);
+    out[pos++] = TranslateToken("=");
+    pos += sprintf((char*)&out[pos], "%s", value);
+  }
+  strncpy(line->source_line, (char*)out, MAX_SOURCE_LINE_LEN);
+
+  /* The new line goes before the current first line. Line 0 can only
+     be preceded if the program is renumbered afterwards. */
+  s32 first_line_no = program->first_line->line_no;
+  if (first_line_no == 0 &&
+      !args.renumber)
+  {
+    fprintf(stderr, "WARNING: Program starts at line 0; variable ordering needs --renumber\n");
+    Counted_Free(line);
+    return;
+  }
+  line->line_no = first_line_no - 1;
+  line->next = program->first_line;
+  program->first_line = line;
+}
+
+
+/*
+  ProgramCompile
+
+  Run through the necessary passes to compile a source file into a
+  tokenized, PETSCII-compatible program.
+ */
+void
+Program_Compile(struct BASIC_program* program, struct source_file* source_file)
+{
+  DoLinesPass(program, source_file);
+  DoPETSCIIPlaceholderPass(program);
+  DoTokenizePass(program);
+  if (args.fold_constants)
+    DoConstantFoldPass(program);
+  DoLabelPass(program);
+  if (args.order_variables)
+    DoVariableOrderPass(program);
+  if (args.renumber)
+    DoRenumberPass(program);
+  DoPETSCIIPass(program);
+}
+
+
+/*
+  Round-trip fuzzing
+
+  Generates random programs and runs each through compile, decompile
+  and compile again, asserting that both compiles produce
+  byte-identical PRG images. Failing programs are shrunk to a minimal
+  reproducer before being reported.
+
+  Both compiles run in memory. Decompiling is left to prgdc itself, so
+  that the round trip tests the decoder that ships: prgdc runs once
+  for the whole session in --framed mode, as a co-process that is
+  written PRG frames and answers with listing frames on pipes.
+
+  The generator only places PETSCII placeholders where their bytes
+  can't be mistaken for tokens (strings, REM and DATA): a placeholder
+  byte in the token range anywhere else would decompile as a keyword,
+  just as it LISTs as one on the C64.
+*/
+#define FUZZ_MAX_SOURCE_LEN  4096
+#define FUZZ_MAX_LINES       8
+
+struct fuzz_rng
+{
+  u64 state;
+};
+
+/* Buffers are reused for every case, so a case allocates only what the
+   compiler does */
+struct fuzz_session
+{
+#if defined(HAVE_POSIX)
+  pid_t  pid;                 /* The decompiler */
+#endif
+  FILE*  to;                  /* Its stdin */
+  FILE*  from;                /* Its stdout */
+  char*  listing;             /* The last listing */
+  u32    listing_capacity;
+  char*  source;              /* Copy of the source being compiled */
+  u32    source_capacity;
+};
+struct fuzz_session fuzz_session;
+
+enum fuzz_result
+{
+  FUZZ_PASSED,
+  FUZZ_SKIPPED,               /* The generated program doesn't compile */
+  FUZZ_FAILED
+};
+
+void WriteFrame(FILE* fp, byte_t* data, u32 len);
+
+
+/*
+  Fuzz_Next
+
+  xorshift64* pseudo random number generator.
+*/
+u32
+Fuzz_Next(struct fuzz_rng* rng)
+{
+  rng->state ^= rng->state >> 12;
+  rng->state ^= rng->state << 25;
+  rng->state ^= rng->state >> 27;
+  return (u32)((rng->state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+/*
+  Fuzz_Below
+
+  Return a random number in [0, n).
+*/
+u32
+Fuzz_Below(struct fuzz_rng* rng, u32 n)
+{
+  return Fuzz_Next(rng) % n;
+}
+
+
+/*
+  Fuzz_Append
+
+  Append formatted text to the source buffer being generated.
+*/
+void
+Fuzz_Append(char* buffer, u32* pos, char* format, ...)
+{
+  if (*pos >= FUZZ_MAX_SOURCE_LEN - 256)
+    return;
+  va_list args;
+  va_start(args, format);
+  *pos += vsprintf(&buffer[*pos], format, args);
+  va_end(args);
+}
+
+
+/*
+  Fuzz_AppendText
+
+  Append random text: printable characters, keywords and, if
+  allow_placeholders is set, PETSCII placeholders. Quotes are never
+  generated.
+*/
+void
+Fuzz_AppendText(struct fuzz_rng* rng, char* buffer, u32* pos,
+                BOOL allow_placeholders, BOOL allow_colons)
+{
+  u32 len = Fuzz_Below(rng, 12);
+  for (u32 i = 0; i < len; ++i)
+  {
+    u32 kind = Fuzz_Below(rng, 8);
+    if (kind == 0)
+    {
+      Fuzz_Append(buffer, pos, "%s", token_list[Fuzz_Below(rng, NUM_BASIC_TOKENS)]);
+    }
+    else if (kind == 1 &&
+             allow_placeholders)
+    {
+      /* Only table entries which actually are placeholders, except
+         for byte 0, which would end the line */
+      char* placeholder;
+      do
+        placeholder = PETSCII_table[1 + Fuzz_Below(rng, 255)];
+      while (placeholder[0] != '{');
+      Fuzz_Append(buffer, pos, "%s", placeholder);
+    }
+    else
+    {
+      char c;
+      do
+        c = 0x20 + Fuzz_Below(rng, 0x5f);
+      while (c == '"' ||
+             (c == ':' && !allow_colons) ||
+             (c == '{' && !allow_placeholders));
+      Fuzz_Append(buffer, pos, "%c", c);
+    }
+  }
+}
+
+
+/*
+  Fuzz_AppendExpression
+
+  Append a random expression.
+*/
+void
+Fuzz_AppendExpression(struct fuzz_rng* rng, char* buffer, u32* pos, int depth)
+{
+  static char* operators[] = { "+", "-", "*", "/", "^", " AND ", " OR ", "=", "<", ">", "<=" };
+  static char* functions[] = { "SGN", "INT", "ABS", "SQR", "RND", "PEEK", "LEN", "STR$", "CHR$", "ASC" };
+
+  u32 kind = Fuzz_Below(rng, depth > 2 ? 3 : 6);
+  switch (kind)
+  {
+    case 0:
+      Fuzz_Append(buffer, pos, "%u", Fuzz_Below(rng, 70000));
+      break;
+    case 1:
+      Fuzz_Append(buffer, pos, "%c%s", 'A' + Fuzz_Below(rng, 26),
+                  Fuzz_Below(rng, 4) ? "" : "$");
+      break;
+    case 2:
+      Fuzz_Append(buffer, pos, "\"");
+      Fuzz_AppendText(rng, buffer, pos, TRUE, TRUE);
+      Fuzz_Append(buffer, pos, "\"");
+      break;
+    case 3:
+      Fuzz_AppendExpression(rng, buffer, pos, depth+1);
+      Fuzz_Append(buffer, pos, "%s", operators[Fuzz_Below(rng, sizeof(operators)/sizeof(char*))]);
+      Fuzz_AppendExpression(rng, buffer, pos, depth+1);
+      break;
+    case 4:
+      Fuzz_Append(buffer, pos, "(");
+      Fuzz_AppendExpression(rng, buffer, pos, depth+1);
+      Fuzz_Append(buffer, pos, ")");
+      break;
+    case 5:
+      Fuzz_Append(buffer, pos, "%s(", functions[Fuzz_Below(rng, sizeof(functions)/sizeof(char*))]);
+      Fuzz_AppendExpression(rng, buffer, pos, depth+1);
+      Fuzz_Append(buffer, pos, ")");
+      break;
+  }
+}
+
+
+/*
+  Fuzz_AppendTarget
+
+  Append a random jump target: a line of the program, by number or, if
+  the line is labelled, by label.
+*/
+void
+Fuzz_AppendTarget(struct fuzz_rng* rng, char* buffer, u32* pos,
+                  u32* line_numbers, BOOL* labelled, u32 num_lines)
+{
+  u32 i = Fuzz_Below(rng, num_lines);
+  Fuzz_Append(buffer, pos, "%s%u", labelled[i] && Fuzz_Below(rng, 2) ? "L" : "",
+              line_numbers[i]);
+}
+
+
+/*
+  Fuzz_AppendStatement
+
+  Append a random statement. Jump targets are drawn from the line
+  numbers and labels of the program.
+*/
+void
+Fuzz_AppendStatement(struct fuzz_rng* rng, char* buffer, u32* pos,
+                     u32* line_numbers, BOOL* labelled, u32 num_lines, BOOL* last)
+{
+  char* space = Fuzz_Below(rng, 4) ? " " : "";
+  switch (Fuzz_Below(rng, 12))
+  {
+    case 0:
+      Fuzz_Append(buffer, pos, "PRINT%s", space);
+      Fuzz_AppendExpression(rng, buffer, pos, 0);
+      Fuzz_Append(buffer, pos, Fuzz_Below(rng, 2) ? ";" : ",");
+      Fuzz_AppendExpression(rng, buffer, pos, 0);
+      break;
+    case 1:
+      Fuzz_Append(buffer, pos, "%c%s=", 'A' + Fuzz_Below(rng, 26), Fuzz_Below(rng, 2) ? "" : "1");
+      Fuzz_AppendExpression(rng, buffer, pos, 0);
+      break;
+    case 2:
+      Fuzz_Append(buffer, pos, "IF%s", space);
+      Fuzz_AppendExpression(rng, buffer, pos, 0);
+      Fuzz_Append(buffer, pos, " THEN%s", space);
+      Fuzz_AppendTarget(rng, buffer, pos, line_numbers, labelled, num_lines);
+      break;
+    case 3:
+    {
+      static char* jumps[] = { "GOTO", "GO TO", "GOSUB" };
+      Fuzz_Append(buffer, pos, "%s%s", jumps[Fuzz_Below(rng, 3)], space);
+      Fuzz_AppendTarget(rng, buffer, pos, line_numbers, labelled, num_lines);
+      break;
+    }
+    case 4:
+      Fuzz_Append(buffer, pos, "ON X %s ", Fuzz_Below(rng, 2) ? "GOTO" : "GOSUB");
+      Fuzz_AppendTarget(rng, buffer, pos, line_numbers, labelled, num_lines);
+      Fuzz_Append(buffer, pos, ", ");
+      Fuzz_AppendTarget(rng, buffer, pos, line_numbers, labelled, num_lines);
+      break;
+    case 5:
+      Fuzz_Append(buffer, pos, "FOR I=1 TO %u%s:NEXT I", Fuzz_Below(rng, 100),
+                  Fuzz_Below(rng, 2) ? " STEP 2" : "");
+      break;
+    case 6:
+    {
+      /* DATA items: numbers, quoted strings (which may contain colons)
+         and unquoted text */
+      Fuzz_Append(buffer, pos, "DATA%s", space);
+      u32 items = 1 + Fuzz_Below(rng, 4);
+      for (u32 i = 0; i < items; ++i)
+      {
+        if (i)
+          Fuzz_Append(buffer, pos, ",");
+        switch (Fuzz_Below(rng, 3))
+        {
+          case 0:
+            Fuzz_Append(buffer, pos, "%d", (int)Fuzz_Below(rng, 512) - 256);
+            break;
+          case 1:
+            Fuzz_Append(buffer, pos, "\"");
+            Fuzz_AppendText(rng, buffer, pos, TRUE, TRUE);
+            Fuzz_Append(buffer, pos, "\"");
+            break;
+          case 2:
+            Fuzz_AppendText(rng, buffer, pos, TRUE, FALSE);
+            break;
+        }
+      }
+      break;
+    }
+    case 7:
+      Fuzz_Append(buffer, pos, "REM%s", space);
+      Fuzz_AppendText(rng, buffer, pos, TRUE, TRUE);
+      *last = TRUE;
+      break;
+    case 8:
+      Fuzz_Append(buffer, pos, "POKE %u,%u", Fuzz_Below(rng, 65536), Fuzz_Below(rng, 256));
+      break;
+    case 9:
+      /* Unterminated string at the end of the line */
+      Fuzz_Append(buffer, pos, "PRINT \"");
+      Fuzz_AppendText(rng, buffer, pos, TRUE, TRUE);
+      *last = TRUE;
+      break;
+    default:
+      /* Keyword soup */
+      Fuzz_AppendText(rng, buffer, pos, FALSE, FALSE);
+      break;
+  }
+}
+
+
+/*
+  Fuzz_GenerateProgram
+
+  Generate a random source program into buffer.
+*/
+void
+Fuzz_GenerateProgram(struct fuzz_rng* rng, char* buffer)
+{
+  u32 line_numbers[FUZZ_MAX_LINES];
+  BOOL labelled[FUZZ_MAX_LINES];
+  u32 num_lines = 1 + Fuzz_Below(rng, FUZZ_MAX_LINES);
+  u32 line_no = Fuzz_Below(rng, 100);
+  for (u32 i = 0; i < num_lines; ++i)
+  {
+    line_numbers[i] = line_no;
+    labelled[i] = (Fuzz_Below(rng, 3) == 0);
+    line_no += 1 + Fuzz_Below(rng, 50);
+  }
+
+  u32 pos = 0;
+  buffer[0] = 0;
+  for (u32 i = 0; i < num_lines; ++i)
+  {
+    /* Labels are named after the line they precede */
+    if (labelled[i])
+      Fuzz_Append(buffer, &pos, "L%u:\n", line_numbers[i]);
+    if (Fuzz_Below(rng, 8))
+      Fuzz_Append(buffer, &pos, "%u ", line_numbers[i]);
+    else
+      Fuzz_Append(buffer, &pos, "%u", line_numbers[i]);
+
+    u32 num_statements = 1 + Fuzz_Below(rng, 4);
+    BOOL last = FALSE;
+    for (u32 j = 0; j < num_statements && !last; ++j)
+    {
+      if (j)
+        Fuzz_Append(buffer, &pos, Fuzz_Below(rng, 2) ? ":" : " : ");
+      Fuzz_AppendStatement(rng, buffer, &pos, line_numbers, labelled, num_lines, &last);
+    }
+    if (Fuzz_Below(rng, 4) == 0)
+      Fuzz_Append(buffer, &pos, "%s", "  ");
+    Fuzz_Append(buffer, &pos, "\n");
+
+    /* Mix in some lowercase */
+    if (Fuzz_Below(rng, 4) == 0)
+      for (char* c = buffer; *c; ++c)
+        if (Fuzz_Below(rng, 8) == 0)
+          *c = tolower(*c);
+  }
+}
+
+
+/*
+  Fuzz_StartSession
+
+  Run prgdc_path --framed as a co-process for Fuzz_Decompile. The
+  child reports a failed exec back through a pipe that closes on a
+  successful one, so a missing decompiler is known before the first
+  round trip.
+
+  Returns 0, or why the decompiler can't be started.
+*/
+char*
+Fuzz_StartSession(char* prgdc_path)
+{
+#if defined(HAVE_POSIX)
+  int to_pipe[2];
+  int from_pipe[2];
+  int exec_pipe[2];
+  if (pipe(to_pipe) != 0)
+    return strerror(errno);
+  if (pipe(from_pipe) != 0)
+  {
+    int error = errno;
+    close(to_pipe[0]);
+    close(to_pipe[1]);
+    return strerror(error);
+  }
+  if (pipe(exec_pipe) != 0)
+  {
+    int error = errno;
+    close(to_pipe[0]);
+    close(to_pipe[1]);
+    close(from_pipe[0]);
+    close(from_pipe[1]);
+    return strerror(error);
+  }
+  fcntl(exec_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  fuzz_session.pid = fork();
+  if (fuzz_session.pid == 0)
+  {
+    dup2(to_pipe[0], STDIN_FILENO);
+    dup2(from_pipe[1], STDOUT_FILENO);
+    close(to_pipe[0]);
+    close(to_pipe[1]);
+    close(from_pipe[0]);
+    close(from_pipe[1]);
+    close(exec_pipe[0]);
+    execlp(prgdc_path, prgdc_path, "--framed", (char*)0);
+    /* Tell the parent why, which reports it */
+    int error = errno;
+    ssize_t written = write(exec_pipe[1], &error, sizeof(error));
+    _exit(written == sizeof(error) ? 127 : 126);
+  }
+  int error = (fuzz_session.pid < 0) ? errno : 0;
+  close(to_pipe[0]);
+  close(from_pipe[1]);
+  close(exec_pipe[1]);
+  /* A successful exec closes the pipe without writing to it */
+  if (!error &&
+      read(exec_pipe[0], &error, sizeof(error)) == sizeof(error))
+    waitpid(fuzz_session.pid, 0, 0);
+  close(exec_pipe[0]);
+  if (error)
+  {
+    close(to_pipe[1]);
+    close(from_pipe[0]);
+    return strerror(error);
+  }
+
+  /* A decompiler that exits makes writes fail rather than kill us */
+  signal(SIGPIPE, SIG_IGN);
+  fuzz_session.to   = fdopen(to_pipe[1], "wb");
+  fuzz_session.from = fdopen(from_pipe[0], "rb");
+  return 0;
+#else
+  return "running it as a co-process needs a POSIX host";
+#endif
+}
+
+
+/*
+  Fuzz_EndSession
+
+  Close the decompiler's input, which ends it, wait for it and free
+  the session's buffers.
+*/
+void
+Fuzz_EndSession()
+{
+  fclose(fuzz_session.to);
+  fclose(fuzz_session.from);
+#if defined(HAVE_POSIX)
+  waitpid(fuzz_session.pid, 0, 0);
+#endif
+  Counted_Free(fuzz_session.listing);
+  Counted_Free(fuzz_session.source);
+  memset(&fuzz_session, 0, sizeof(fuzz_session));
+}
+
+
+/*
+  Fuzz_Seconds
+
+  Returns the wall time in seconds from an arbitrary start, or the
+  processor time where the host has no monotonic clock.
+*/
+double
+Fuzz_Seconds()
+{
+#if defined(HAVE_POSIX)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/*
+  Fuzz_Decompile
+
+  Decompile a PRG image with prgdc.
+
+  Return: Pointer to the NULL terminated listing, valid until the next
+  call
+*/
+char*
+Fuzz_Decompile(byte_t* image, u32 image_len)
+{
+  WriteFrame(fuzz_session.to, image, image_len);
+  fflush(fuzz_session.to);
+
+  byte_t header[4];
+  if (fread(header, 1, 4, fuzz_session.from) != 4)
+  {
+    fprintf(stderr, "ERROR: The decompiler stopped responding\n");
+    exit(-1);
+  }
+  u32 len = header[0] | (header[1] << 8) | (header[2] << 16) | ((u32)header[3] << 24);
+  if (len + 1 > fuzz_session.listing_capacity)
+  {
+    fuzz_session.listing_capacity = len + 1;
+    fuzz_session.listing = (char*)Counted_Realloc(fuzz_session.listing,
+                                                  fuzz_session.listing_capacity);
+  }
+  if (fread(fuzz_session.listing, 1, len, fuzz_session.from) != len)
+  {
+    fprintf(stderr, "ERROR: The decompiler stopped responding\n");
+    exit(-1);
+  }
+  fuzz_session.listing[len] = 0;
+  return fuzz_session.listing;
+}
+
+
+/*
+  Fuzz_Compile
+
+  Compile source text in memory into a newly allocated PRG image.
+
+  Returns 0 if the source doesn't compile.
+*/
+byte_t*
+Fuzz_Compile(char* source, u32* image_len)
+{
+  struct BASIC_program fuzz_program;
+  memset(&fuzz_program, 0, sizeof(fuzz_program));
+  struct source_file source_file;
+  memset(&source_file, 0, sizeof(source_file));
+  /* Compiling uppercases the source in place */
+  source_file.buf_len = strlen(source);
+  if (source_file.buf_len + 1 > fuzz_session.source_capacity)
+  {
+    fuzz_session.source_capacity = source_file.buf_len + 1;
+    fuzz_session.source = (char*)Counted_Realloc(fuzz_session.source,
+                                                 fuzz_session.source_capacity);
+  }
+  source_file.buffer = fuzz_session.source;
+  memcpy(source_file.buffer, source, source_file.buf_len + 1);
+
+  jmp_buf jump;
+  byte_t* image = 0;
+  syntax_error_jump = &jump;
+  syntax_error_quiet = TRUE;
+  if (setjmp(jump) == 0)
+  {
+    Program_Compile(&fuzz_program, &source_file);
+    if (fuzz_program.first_line)
+      image = BuildPRGImage(&fuzz_program, 0, image_len, 0);
+  }
+  syntax_error_jump = 0;
+  syntax_error_quiet = FALSE;
+  Program_Free(&fuzz_program);
+  return image;
+}
+
+
+/*
+  Fuzz_RoundTrip
+
+  Run source through compile, decompile and compile. If the two PRG
+  images differ, returns FUZZ_FAILED and stores the offset of the
+  first difference in mismatch_offset. A source that doesn't compile
+  in the first place tests nothing and is FUZZ_SKIPPED.
+*/
+enum fuzz_result
+Fuzz_RoundTrip(char* source, u32* mismatch_offset)
+{
+  u32 image_len = 0;
+  byte_t* image = Fuzz_Compile(source, &image_len);
+  if (!image)
+    return FUZZ_SKIPPED;
+
+  char* decompiled = Fuzz_Decompile(image, image_len);
+  u32 round_trip_len = 0;
+  byte_t* round_trip = Fuzz_Compile(decompiled, &round_trip_len);
+
+  BOOL fails = FALSE;
+  if (!round_trip)
+  {
+    fails = TRUE;
+    *mismatch_offset = 0;
+  }
+  else if (image_len != round_trip_len ||
+           memcmp(image, round_trip, image_len) != 0)
+  {
+    fails = TRUE;
+    u32 i = 0;
+    while (i < image_len &&
+           i < round_trip_len &&
+           image[i] == round_trip[i])
+      ++i;
+    *mismatch_offset = i;
+  }
+  Counted_Free(image);
+  Counted_Free(round_trip);
+  return fails ? FUZZ_FAILED : FUZZ_PASSED;
+}
+
+
+/*
+  Fuzz_Shrink
+
+  Reduce a failing source to a minimal program that still fails the
+  round trip: first drop whole lines, then chunks of each line's text
+  (keeping line numbers intact, so that no duplicates arise).
+*/
+void
+Fuzz_Shrink(char* source)
+{
+  char candidate[FUZZ_MAX_SOURCE_LEN];
+  u32 offset;
+  BOOL progress = TRUE;
+  while (progress)
+  {
+    progress = FALSE;
+
+    /* Drop lines */
+    char* line = source;
+    while (*line)
+    {
+      char* next = strchr(line, '\n');
+      next = next ? next + 1 : line + strlen(line);
+      u32 prefix_len = line - source;
+      memcpy(candidate, source, prefix_len);
+      strcpy(&candidate[prefix_len], next);
+      if (Fuzz_RoundTrip(candidate, &offset) == FUZZ_FAILED)
+      {
+        strcpy(source, candidate);
+        progress = TRUE;
+        continue;
+      }
+      line = next;
+    }
+
+    /* Drop chunks of text, halving the chunk size */
+    line = source;
+    while (*line)
+    {
+      char* next = strchr(line, '\n');
+      u32 line_len = next ? (u32)(next - line) : strlen(line);
+      u32 text_begin = 0;
+      while (text_begin < line_len &&
+             isdigit(line[text_begin]))
+        ++text_begin;
+
+      for (u32 chunk = (line_len - text_begin) / 2 + 1;
+           chunk > 0;
+           chunk /= 2)
+      {
+        for (u32 begin = text_begin;
+             begin + chunk <= line_len;)
+        {
+          u32 prefix_len = (line - source) + begin;
+          memcpy(candidate, source, prefix_len);
+          strcpy(&candidate[prefix_len], &line[begin + chunk]);
+          if (Fuzz_RoundTrip(candidate, &offset) == FUZZ_FAILED)
+          {
+            strcpy(source, candidate);
+            line_len -= chunk;
+            progress = TRUE;
+            continue;
+          }
+          ++begin;
+        }
+      }
+      next = strchr(line, '\n');
+      line = next ? next + 1 : line + strlen(line);
+    }
+  }
+}
+
+
+/*
+  Fuzz_PrintImage
+
+  Print a PRG image as hex, for failure reports.
+*/
+void
+Fuzz_PrintImage(char* title, byte_t* image, u32 image_len)
+{
+  fprintf(stderr, "%s:", title);
+  for (u32 i = 0; i < image_len; ++i)
+    fprintf(stderr, "%s%02x", (i % 16) ? " " : "\n  ", image[i]);
+  fprintf(stderr, "\n");
+}
+
+
+/*
+  DoFuzz
+
+  Run iterations round trips on random programs generated from seed,
+  decompiling with the prgdc at prgdc_path. On the first failure,
+  shrink it and report the minimal program.
+
+  Returns TRUE if all round trips succeeded.
+*/
+BOOL
+DoFuzz(u64 iterations, u64 seed, char* prgdc_path)
+{
+  struct fuzz_rng rng;
+  rng.state = seed ? seed : 1;
+  char source[FUZZ_MAX_SOURCE_LEN];
+  char* error = Fuzz_StartSession(prgdc_path);
+  if (error)
+  {
+    fprintf(stderr, "Failed to run the decompiler \"%s\": %s (select one with --prgdc <path>)\n",
+            prgdc_path, error);
+    return FALSE;
+  }
+
+  /* Wall time, since prgdc does part of the work */
+  double start = Fuzz_Seconds();
+  u64 passed = 0;
+  u64 skipped = 0;
+  for (u64 i = 0; i < iterations; ++i)
+  {
+    Fuzz_GenerateProgram(&rng, source);
+    u32 offset;
+    enum fuzz_result result = Fuzz_RoundTrip(source, &offset);
+    if (result == FUZZ_PASSED)
+      ++passed;
+    if (result != FUZZ_FAILED)
+    {
+      skipped += (result == FUZZ_SKIPPED);
+      continue;
+    }
+
+    fprintf(stderr, "Round trip mismatch in iteration %llu (seed %llu)\n",
+            (unsigned long long)i, (unsigned long long)seed);
+    Fuzz_Shrink(source);
+    Fuzz_RoundTrip(source, &offset);
+    fprintf(stderr, "Minimal program:\n%s", source);
+
+    u32 image_len = 0;
+    byte_t* image = Fuzz_Compile(source, &image_len);
+    char* decompiled = Fuzz_Decompile(image, image_len);
+    fprintf(stderr, "Decompiled:\n%s", decompiled);
+    u32 round_trip_len = 0;
+    byte_t* round_trip = Fuzz_Compile(decompiled, &round_trip_len);
+    Fuzz_PrintImage("First compile", image, image_len);
+    if (round_trip)
+      Fuzz_PrintImage("Second compile", round_trip, round_trip_len);
+    fprintf(stderr, "Images differ at offset %u\n", offset);
+    Counted_Free(image);
+    Counted_Free(round_trip);
+    Fuzz_EndSession();
+    return FALSE;
+  }
+  Fuzz_EndSession();
+
+  double seconds = Fuzz_Seconds() - start;
+  fprintf(stderr, "%llu round trips passed, %llu skipped (programs that don't compile), "
+          "in %.2f s (%.0f per minute)\n",
+          (unsigned long long)passed, (unsigned long long)skipped, seconds,
+          seconds > 0 ? iterations * 60 / seconds : 0);
+  return TRUE;
+}
+
+/*
+  Framing
+
+  In framed mode, stdin carries a stream of BASIC sources and stdout
+  the corresponding PRG images, so that one process can compile any
+  number of programs. Each frame is a 32-bit little-endian length
+  followed by that many bytes. A program that fails to compile yields
+  an empty frame, with the errors on stderr.
+*/
+
+/*
+  ReadFrame
+
+  Read the next frame from fp into a newly allocated buffer, storing
+  its length in len.
+
+  Returns FALSE at the end of the stream.
+*/
+BOOL
+ReadFrame(FILE* fp, byte_t** data, u32* len)
+{
+  byte_t header[4];
+  size_t header_len = fread(header, 1, 4, fp);
+  if (header_len == 0)
+    return FALSE;
+  if (header_len < 4)
+  {
+    fprintf(stderr, "ERROR: Truncated frame header\n");
+    exit(-1);
+  }
+  *len = header[0] | (header[1] << 8) | (header[2] << 16) | ((u32)header[3] << 24);
+  *data = (byte_t*)Counted_Malloc(*len + 1);
+  if (fread(*data, 1, *len, fp) != *len)
+  {
+    fprintf(stderr, "ERROR: Truncated frame\n");
+    exit(-1);
+  }
+  return TRUE;
+}
+
+
+/*
+  WriteFrame
+
+  Write len bytes of data to fp as one frame.
+*/
+void
+WriteFrame(FILE* fp, byte_t* data, u32 len)
+{
+  byte_t header[4] = { len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24 };
+  fwrite(header, 1, 4, fp);
+  /* An empty frame has no data buffer */
+  if (len)
+    fwrite(data, 1, len, fp);
+}
+
+
+/*
+  CompileFrame
+
+  Compile one source frame into a newly allocated PRG image, storing
+  its length in image_len.
+
+  Returns 0 if the source doesn't compile.
+*/
+byte_t*
+CompileFrame(struct source_file* source_file, u16 load_address, u32* image_len)
+{
+  /* Assigned between setjmp and longjmp */
+  byte_t* volatile image = 0;
+  jmp_buf jump;
+  syntax_error_jump = &jump;
+  if (setjmp(jump) == 0)
+  {
+    Program_Compile(&program, source_file);
+    if (program.first_line)
+    {
+      if (args.cost_report)
+        Program_PrintCostReport(stderr, &program);
+      struct memory_footprint footprint;
+      image = BuildPRGImage(&program, load_address, image_len, &footprint);
+      if (image &&
+          args.memory_report)
+        Program_PrintMemoryReport(stderr, &footprint);
+      if (image &&
+          !Footprint_CheckBudget(&footprint))
+      {
+        Counted_Free(image);
+        image = 0;
+      }
+    }
+    else
+      fprintf(stderr, "ERROR: Empty program\n");
+  }
+  syntax_error_jump = 0;
+  return image;
+}
+
+
+/*
+  CompileFrames
+
+  Compile every source frame on stdin into a PRG frame on stdout.
+*/
+void
+CompileFrames(u16 load_address)
+{
+  byte_t* data;
+  u32 len;
+  for (u32 frame = 0;
+       ReadFrame(stdin, &data, &len);
+       ++frame)
+  {
+    struct source_file source_file;
+    memset(&source_file, 0, sizeof(source_file));
+    source_file.buffer  = (char*)data;
+    source_file.buf_len = len;
+
+    u32 image_len = 0;
+    byte_t* image = CompileFrame(&source_file, load_address, &image_len);
+    if (!image)
+    {
+      image_len = 0;
+      fprintf(stderr, "Frame %u: Compilation failed\n", frame);
+    }
+    WriteFrame(stdout, image, image_len);
+    Counted_Free(image);
+    Program_Free(&program);
+    Counted_Free(data);
+  }
+  fflush(stdout);
+}
+
+
+/*
+  Linking
+
+  With --link, prgbc combines several programs into one. Each input is
+  either a PRG (by its .prg extension) or a source file, which is
+  compiled on its own, so labels stay local to their file. --offset n
+  adds n to the line numbers of the following input and to the jump
+  targets that refer to its own lines; targets outside the input, such
+  as calls into a library linked alongside it, are kept. Line numbers
+  that collide between inputs are an error. The link pointers of the
+  combined program are recomputed for the load address when it is
+  written, as for any compiled program.
+*/
+struct link_line
+{
+  struct BASIC_line* line;
+  u32    input;
+};
+
+
+/*
+  Link_IsPRGPath
+
+  Returns TRUE if path names a PRG file rather than a source file.
+*/
+BOOL
+Link_IsPRGPath(char* path)
+{
+  u32 len = strlen(path);
+  if (len < 4)
+    return FALSE;
+  char* ext = &path[len - 4];
+  return (ext[0] == '.' &&
+          toupper(ext[1]) == 'P' &&
+          toupper(ext[2]) == 'R' &&
+          toupper(ext[3]) == 'G');
+}
+
+
+/*
+  Link_LoadPRG
+
+  Load the lines of the PRG file at path into program. The PRG's own
+  load address and link pointers are only used to walk its lines.
+*/
+void
+Link_LoadPRG(struct BASIC_program* program, char* path)
+{
+  struct source_file file;
+  LoadSrc(&file, path);
+  byte_t* image = (byte_t*)file.buffer;
+
+  memset(program, 0, sizeof(struct BASIC_program));
+  struct BASIC_line* last_line = 0;
+  u16 load_address = (file.buf_len >= 2) ? (image[0] | (image[1] << 8)) : 0;
+  u32 offset = 2;
+  while (offset + 4 <= file.buf_len)
+  {
+    u16 next_line_addr = image[offset] | (image[offset+1] << 8);
+    if (!next_line_addr)
+      break;
+
+    struct BASIC_line* line = (struct BASIC_line*)Counted_Malloc(sizeof(struct BASIC_line));
+    memset(line, 0, sizeof(struct BASIC_line));
+    line->line_no = image[offset+2] | (image[offset+3] << 8);
+    ++alloc_stats.input_lines;
+    u32 len = 0;
+    while (offset + 4 + len < file.buf_len &&
+           image[offset + 4 + len] &&
+           len < MAX_SOURCE_LINE_LEN - 1)
+      ++len;
+    memcpy(line->tokenized_line, &image[offset+4], len);
+
+    if (last_line &&
+        line->line_no <= last_line->line_no)
+    {
+      fprintf(stderr, "ERROR: %s: line %d follows line %d\n", path,
+              line->line_no, last_line->line_no);
+      exit(-1);
+    }
+    if (last_line)
+      last_line->next = line;
+    else
+      program->first_line = line;
+    last_line = line;
+    program->last_line_no = line->line_no;
+
+    /* Stop at links that don't point forward */
+    if (next_line_addr - load_address + 2 <= (s32)offset)
+      break;
+    offset = next_line_addr - load_address + 2;
+  }
+  Counted_Free(file.buffer);
+}
+
+
+/*
+  Link_OffsetProgram
+
+  Add offset to the line numbers of program, and to the jump targets
+  that refer to lines of program.
+*/
+void
+Link_OffsetProgram(struct BASIC_program* program, s32 offset, char* path)
+{
+  u32 count = 0;
+  struct BASIC_line* curr_line;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    ++count;
+  if (!count ||
+      !offset)
+    return;
+
+  /* Lines are kept sorted, so these arrays are sorted as well */
+  s32* line_numbers = (s32*)Counted_Malloc(count * sizeof(s32));
+  s32* new_line_numbers = (s32*)Counted_Malloc(count * sizeof(s32));
+  u32 i = 0;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+  {
+    line_numbers[i] = curr_line->line_no;
+    new_line_numbers[i] = curr_line->line_no + offset;
+    if (new_line_numbers[i] < 0 ||
+        new_line_numbers[i] > MAX_LINE_NUMBER)
+    {
+      fprintf(stderr, "ERROR: %s: line %d moves to %d with offset %d (allowed: 0-%d)\n",
+              path, curr_line->line_no, new_line_numbers[i], offset, MAX_LINE_NUMBER);
+      exit(-1);
+    }
+    ++i;
+  }
+
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    RenumberLineTargets(curr_line->tokenized_line, curr_line->line_no,
+                        line_numbers, count, new_line_numbers);
+
+  i = 0;
+  for (curr_line = program->first_line;
+       curr_line;
+       curr_line = curr_line->next)
+    curr_line->line_no = new_line_numbers[i++];
+  program->last_line_no += offset;
+
+  Counted_Free(line_numbers);
+  Counted_Free(new_line_numbers);
+}
+
+
+/*
+  Link_CompareLines
+
+  qsort comparator ordering lines by line number, and by input within
+  the same line number.
+*/
+int
+Link_CompareLines(const void* a, const void* b)
+{
+  const struct link_line* line_a = (const struct link_line*)a;
+  const struct link_line* line_b = (const struct link_line*)b;
+  if (line_a->line->line_no != line_b->line->line_no)
+    return (line_a->line->line_no > line_b->line->line_no) -
+           (line_a->line->line_no < line_b->line->line_no);
+  return (line_a->input > line_b->input) - (line_a->input < line_b->input);
+}
+
+
+/*
+  LinkPrograms
+
+  Load, compile and offset every input, and merge their lines into
+  program.
+*/
+void
+LinkPrograms(struct BASIC_program* program, struct link_input* inputs, u32 num_inputs)
+{
+  struct BASIC_program* programs = (struct BASIC_program*)Counted_Calloc(num_inputs, sizeof(struct BASIC_program));
+  u32 num_lines = 0;
+  for (u32 i = 0; i < num_inputs; ++i)
+  {
+    if (Link_IsPRGPath(inputs[i].path))
+      Link_LoadPRG(&programs[i], inputs[i].path);
+    else
+    {
+      struct source_file source_file;
+      memset(&source_file, 0, sizeof(source_file));
+      LoadSrc(&source_file, inputs[i].path);
+      Program_Compile(&programs[i], &source_file);
+      Counted_Free(source_file.buffer);
+    }
+    Link_OffsetProgram(&programs[i], inputs[i].offset, inputs[i].path);
+
+    for (struct BASIC_line* line = programs[i].first_line;
+         line;
+         line = line->next)
+      ++num_lines;
+  }
+
+  struct link_line* lines = (struct link_line*)Counted_Malloc((num_lines + 1) * sizeof(struct link_line));
+  u32 n = 0;
+  for (u32 i = 0; i < num_inputs; ++i)
+  {
+    for (struct BASIC_line* line = programs[i].first_line;
+         line;
+         line = line->next)
+    {
+      lines[n].line  = line;
+      lines[n].input = i;
+      ++n;
+    }
+  }
+  qsort(lines, num_lines, sizeof(struct link_line), Link_CompareLines);
+
+  BOOL collision = FALSE;
+  for (u32 i = 0; i + 1 < num_lines; ++i)
+  {
+    if (lines[i].line->line_no == lines[i+1].line->line_no)
+    {
+      fprintf(stderr, "ERROR: Line number collision: line %d is in %s and %s\n",
+              lines[i].line->line_no, inputs[lines[i].input].path,
+              inputs[lines[i+1].input].path);
+      collision = TRUE;
+    }
+  }
+  if (collision)
+    exit(-1);
+
+  memset(program, 0, sizeof(struct BASIC_program));
+  for (u32 i = 0; i < num_lines; ++i)
+    lines[i].line->next = (i + 1 < num_lines) ? lines[i+1].line : 0;
+  if (num_lines)
+  {
+    program->first_line = lines[0].line;
+    program->last_line_no = lines[num_lines-1].line->line_no;
+  }
+
+  Counted_Free(lines);
+  Counted_Free(programs);
+}
+
+
+/*
+  Language server
+
+  --lsp runs prgbc as a language server for editors, speaking JSON-RPC
+  with Content-Length framing on stdin and stdout. Compiling the whole
+  program on every keystroke would be far too slow for large sources,
+  so the server keeps the state of each document per source line and
+  redoes only what an edit invalidates:
+
+   - Each edited line is classified, placeholder translated and
+     tokenized on its own, as DoLinesPass, DoPETSCIIPlaceholderPass and
+     DoTokenizePass would, and its jump targets are collected the way
+     TranslateLabels finds them.
+
+   - Labels and line numbers are symbols that know the lines defining
+     and referencing them. Line numbers are assigned from the edit
+     onward until a line keeps its number, and labels take the number
+     of the line after them.
+
+   - Only the edited lines, and the lines that define or reference a
+     symbol whose definition changed, are checked again. A line number
+     symbol only counts as changed if it became defined, undefined or
+     duplicate, and a label if the number of digits of its line number
+     changed, so that renumbering the lines after an edit doesn't make
+     every line to be checked again.
+
+  Duplicate labels and line numbers, undefined labels, jumps to missing
+  lines and lines too long to compile or to edit on the C64 are
+  published as diagnostics. Each line's size in bytes is shown as an
+  inlay hint, and labels and line numbers go to their definition.
+  Columns count bytes, since BASIC sources are ASCII.
+*/
+#define LSP_HASH_BUCKETS     4096
+#define MAX_LSP_DOCUMENTS    16
+#define MAX_LSP_MESSAGE_LEN  128
+#define LSP_MAX_LISTED_LEN   80
+#define LSP_ERROR            1
+#define LSP_WARNING          2
+
+struct lsp_line;
+
+struct lsp_line_list
+{
+  struct lsp_line**  lines;
+  u32    count;
+  u32    capacity;
+};
+
+struct lsp_symbol
+{
+  char   name[MAX_LABEL_LENGTH+1];  /* A label, or a line number in decimal */
+  s32    line_no;                   /* -1 for labels */
+  BOOL   queued;                    /* In the document's list of changed symbols */
+  BOOL   changed;                   /* Dependents must be checked again */
+  u32    checked_defs;              /* Definitions at the last check */
+  struct lsp_line_list  defs;
+  struct lsp_line_list  refs;
+  struct lsp_symbol*    next;       /* Hash chain */
+};
+
+struct lsp_ref
+{
+  struct lsp_symbol*  symbol;
+  u32    tokenized_len;             /* Bytes the target takes in the tokenized line */
+  BOOL   may_be_statement;          /* A THEN target that starts with a keyword */
+};
+
+struct lsp_diagnostic
+{
+  u32    begin;
+  u32    end;
+  int    severity;
+  char   message[MAX_LSP_MESSAGE_LEN];
+};
+
+struct lsp_line
+{
+  char*  text;            /* As written, without the line break */
+  u32    len;
+  u32    index;           /* Position in the document */
+  BOOL   dirty;
+  BOOL   diagnosed;       /* In the document's list of lines with diagnostics */
+  BOOL   duplicate;       /* Diagnosed as a duplicate line number */
+
+  /* Found from the line's text alone */
+  BOOL   is_label;
+  BOOL   is_code;
+  BOOL   is_incbin;
+  s32    explicit_line_no;  /* -1 if the line has no line number */
+  u32    text_begin;      /* Columns of the text after the line number */
+  u32    text_end;
+  u32    listed_len;      /* Characters LIST shows after the line number */
+  u32    tokenized_len;
+  char   error[MAX_LSP_MESSAGE_LEN];
+  struct lsp_symbol*  label;
+  struct lsp_ref*     refs;
+  u32    num_refs;
+
+  /* Found from the lines before and after it */
+  s32    line_no;         /* -1 until assigned */
+  u32    num_line_nos;    /* INCBIN directives span several lines */
+  u32    incbin_bytes;
+  s32    label_value;     /* Line number a label stands for, -1 if none */
+
+  struct lsp_diagnostic*  diagnostics;
+  u32    num_diagnostics;
+  u32    diagnostics_capacity;
+};
+
+struct lsp_document
+{
+  char*  uri;
+  struct lsp_line**    lines;
+  u32    num_lines;
+  u32    capacity;
+  struct lsp_symbol*   symbols[LSP_HASH_BUCKETS];
+  struct lsp_symbol**  line_no_symbols;  /* By line number, beyond the maximum last */
+  struct lsp_line_list dirty;
+  struct lsp_line_list diagnosed;
+  struct lsp_symbol**  changed;
+  u32    num_changed;
+  u32    changed_capacity;
+};
+struct lsp_document* lsp_documents[MAX_LSP_DOCUMENTS];
+
+/* A message being written */
+struct lsp_message
+{
+  FILE*  fp;
+  char*  body;
+  size_t len;
+};
+
+
+/*
+  Json_SkipSpace
+
+  Return the first character at or after p that isn't whitespace.
+*/
+char*
+Json_SkipSpace(char* p)
+{
+  while (*p == ' '  ||
+         *p == '\t' ||
+         *p == '\r' ||
+         *p == '\n')
+    ++p;
+  return p;
+}
+
+
+/*
+  Json_SkipValue
+
+  Return the end of the JSON value at p. Never runs past the end of the
+  message, even if the value is malformed.
+*/
+char*
+Json_SkipValue(char* p)
+{
+  p = Json_SkipSpace(p);
+  if (*p == '"')
+  {
+    for (++p; *p && *p != '"'; ++p)
+      if (*p == '\\' &&
+          p[1])
+        ++p;
+    return *p ? p + 1 : p;
+  }
+  if (*p == '{' ||
+      *p == '[')
+  {
+    u32 depth = 0;
+    while (*p)
+    {
+      if (*p == '"')
+      {
+        p = Json_SkipValue(p);
+        continue;
+      }
+      if (*p == '{' ||
+          *p == '[')
+        ++depth;
+      else if ((*p == '}' || *p == ']') &&
+               --depth == 0)
+        return p + 1;
+      ++p;
+    }
+    return p;
+  }
+  /* A number, true, false or null */
+  while (isalnum(*p) ||
+         *p == '-' ||
+         *p == '+' ||
+         *p == '.')
+    ++p;
+  return p;
+}
+
+
+/*
+  Json_Member
+
+  Returns the value of the member name of the JSON object at object, or
+  0 if there is none.
+*/
+char*
+Json_Member(char* object, char* name)
+{
+  object = Json_SkipSpace(object);
+  if (*object != '{')
+    return 0;
+  u32 name_len = strlen(name);
+  char* p = Json_SkipSpace(object + 1);
+  while (*p == '"')
+  {
+    char* key = p + 1;
+    char* value = Json_SkipSpace(Json_SkipValue(p));
+    if (*value != ':')
+      return 0;
+    value = Json_SkipSpace(value + 1);
+    if (strncmp(key, name, name_len) == 0 &&
+        key[name_len] == '"')
+      return value;
+    p = Json_SkipSpace(Json_SkipValue(value));
+    if (*p != ',')
+      return 0;
+    p = Json_SkipSpace(p + 1);
+  }
+  return 0;
+}
+
+
+/*
+  Json_Find
+
+  Returns the value at the dot separated path of member names, such as
+  "params.textDocument.uri", below the JSON object at json, or 0 if
+  there is none.
+*/
+char*
+Json_Find(char* json, char* path)
+{
+  char name[64];
+  while (json &&
+         *path)
+  {
+    u32 len = 0;
+    while (*path &&
+           *path != '.' &&
+           len < sizeof(name) - 1)
+      name[len++] = *path++;
+    name[len] = '\0';
+    if (*path == '.')
+      ++path;
+    json = Json_Member(json, name);
+  }
+  return json;
+}
+
+
+/*
+  Json_ReadString
+
+  Decode the JSON string at value into a newly allocated, NUL
+  terminated buffer, storing its length in len. \u escapes become
+  UTF-8.
+
+  Returns 0 if value isn't a string.
+*/
+char*
+Json_ReadString(char* value, u32* len)
+{
+  if (!value ||
+      *value != '"')
+    return 0;
+  char* end = Json_SkipValue(value);
+  char* string = (char*)Counted_Malloc(end - value + 1);
+  u32 out = 0;
+  for (char* p = value + 1; p < end && *p != '"'; ++p)
+  {
+    if (*p != '\\' ||
+        !p[1])
+    {
+      string[out++] = *p;
+      continue;
+    }
+    ++p;
+    switch (*p)
+    {
+      case 'b': string[out++] = '\b'; break;
+      case 'f': string[out++] = '\f'; break;
+      case 'n': string[out++] = '\n'; break;
+      case 'r': string[out++] = '\r'; break;
+      case 't': string[out++] = '\t'; break;
+      case 'u':
+      {
+        char hex[5] = { 0 };
+        strncpy(hex, p + 1, 4);
+        u32 code = strtoul(hex, 0, 16);
+        p += strlen(hex);
+        if (code >= 0xD800 && code < 0xDC00 &&
+            p[1] == '\\' && p[2] == 'u')
+        {
+          strncpy(hex, p + 3, 4);
+          u32 low = strtoul(hex, 0, 16);
+          if (low >= 0xDC00 && low < 0xE000)
+          {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            p += 2 + strlen(hex);
+          }
+        }
+        if (code < 0x80)
+          string[out++] = code;
+        else if (code < 0x800)
+        {
+          string[out++] = 0xC0 | (code >> 6);
+          string[out++] = 0x80 | (code & 0x3F);
+        }
+        else if (code < 0x10000)
+        {
+          string[out++] = 0xE0 | (code >> 12);
+          string[out++] = 0x80 | ((code >> 6) & 0x3F);
+          string[out++] = 0x80 | (code & 0x3F);
+        }
+        else
+        {
+          string[out++] = 0xF0 | (code >> 18);
+          string[out++] = 0x80 | ((code >> 12) & 0x3F);
+          string[out++] = 0x80 | ((code >> 6) & 0x3F);
+          string[out++] = 0x80 | (code & 0x3F);
+        }
+        break;
+      }
+      default:  string[out++] = *p; break;
+    }
+  }
+  string[out] = '\0';
+  *len = out;
+  return string;
+}
+
+
+/*
+  Json_ReadInt
+
+  Returns the JSON number at value, or fallback if there is none.
+*/
+s32
+Json_ReadInt(char* value, s32 fallback)
+{
+  if (!value ||
+      !(isdigit(*value) || *value == '-'))
+    return fallback;
+  return strtol(value, 0, 10);
+}
+
+
+/*
+  Json_WriteString
+
+  Write the len bytes of string to fp as a JSON string.
+*/
+void
+Json_WriteString(FILE* fp, char* string, u32 len)
+{
+  fputc('"', fp);
+  for (u32 i = 0; i < len; ++i)
+  {
+    byte_t c = string[i];
+    if (c == '"' ||
+        c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+
+/*
+  Lsp_ReadMessage
+
+  Read the next message from fp into a newly allocated, NUL terminated
+  buffer.
+
+  Returns 0 at the end of the stream.
+*/
+char*
+Lsp_ReadMessage(FILE* fp)
+{
+  char header[256];
+  s32 content_length = -1;
+  for (;;)
+  {
+    if (!fgets(header, sizeof(header), fp))
+      return 0;
+    if (strcmp(header, "\r\n") == 0 ||
+        strcmp(header, "\n") == 0)
+      break;
+    if (strncmp(header, "Content-Length:", 15) == 0)
+      content_length = strtol(&header[15], 0, 10);
+  }
+  if (content_length < 0)
+    return 0;
+
+  char* message = (char*)Counted_Malloc(content_length + 1);
+  if (fread(message, 1, content_length, fp) != (size_t)content_length)
+  {
+    Counted_Free(message);
+    return 0;
+  }
+  message[content_length] = '\0';
+  return message;
+}
+
+
+/*
+  MemStream_Open
+
+  Open a stream that collects what is written to it in memory, to be
+  closed with MemStream_Close. Hosts without open_memstream write to a
+  temporary file instead.
+*/
+FILE*
+MemStream_Open(char** data, size_t* len)
+{
+#if defined(HAVE_POSIX)
+  return open_memstream(data, len);
+#else
+  *data = 0;
+  *len = 0;
+  return tmpfile();
+#endif
+}
+
+
+/*
+  MemStream_Close
+
+  Close a stream from MemStream_Open, leaving what was written to it,
+  NULL terminated, in data (to be released with free) and its length
+  in len.
+*/
+void
+MemStream_Close(FILE* fp, char** data, size_t* len)
+{
+#if defined(HAVE_POSIX)
+  fclose(fp);
+#else
+  long size = ftell(fp);
+  *len = (size > 0) ? size : 0;
+  *data = (char*)malloc(*len + 1);
+  rewind(fp);
+  *len = fread(*data, 1, *len, fp);
+  (*data)[*len] = '\0';
+  fclose(fp);
+#endif
+}
+
+
+/*
+  Lsp_BeginMessage
+
+  Start writing a message. A response to the request id (the JSON text
+  of the id) is opened up to its result; without an id, a notification
+  of method is opened up to its params.
+*/
+void
+Lsp_BeginMessage(struct lsp_message* message, char* id, char* method)
+{
+  message->fp = MemStream_Open(&message->body, &message->len);
+  fprintf(message->fp, "{\"jsonrpc\":\"2.0\",");
+  if (id)
+    fprintf(message->fp, "\"id\":%s,\"result\":", id);
+  else
+    fprintf(message->fp, "\"method\":\"%s\",\"params\":", method);
+}
+
+
+/*
+  Lsp_SendMessage
+
+  Close the message and write it to stdout.
+*/
+void
+Lsp_SendMessage(struct lsp_message* message)
+{
+  fprintf(message->fp, "}");
+  MemStream_Close(message->fp, &message->body, &message->len);
+  fprintf(stdout, "Content-Length: %u\r\n\r\n", (u32)message->len);
+  fwrite(message->body, 1, message->len, stdout);
+  fflush(stdout);
+  free(message->body);
+}
+
+
+/*
+  LineList_Add
+
+  Append line to list.
+*/
+void
+LineList_Add(struct lsp_line_list* list, struct lsp_line* line)
+{
+  if (list->count == list->capacity)
+  {
+    list->capacity = list->capacity ? list->capacity * 2 : 4;
+    list->lines = (struct lsp_line**)Counted_Realloc(list->lines,
+                                             list->capacity * sizeof(struct lsp_line*));
+  }
+  list->lines[list->count++] = line;
+}
+
+
+/*
+  LineList_Remove
+
+  Remove all occurrences of line from list. The order of the list isn't
+  kept.
+*/
+void
+LineList_Remove(struct lsp_line_list* list, struct lsp_line* line)
+{
+  for (u32 i = list->count; i-- > 0;)
+    if (list->lines[i] == line)
+      list->lines[i] = list->lines[--list->count];
+}
+
+
+/*
+  Lsp_FindSymbol
+
+  Returns the symbol name of doc. If there is none, it is created if
+  create is set, and 0 returned otherwise.
+*/
+struct lsp_symbol*
+Lsp_FindSymbol(struct lsp_document* doc, char* name, BOOL create)
+{
+  u32 hash = 2166136261u;
+  for (char* c = name; *c; ++c)
+    hash = (hash ^ (byte_t)*c) * 16777619u;
+  struct lsp_symbol** bucket = &doc->symbols[hash % LSP_HASH_BUCKETS];
+
+  for (struct lsp_symbol* symbol = *bucket; symbol; symbol = symbol->next)
+    if (strcmp(symbol->name, name) == 0)
+      return symbol;
+  if (!create)
+    return 0;
+
+  struct lsp_symbol* symbol = (struct lsp_symbol*)Counted_Calloc(1, sizeof(struct lsp_symbol));
+  strncpy(symbol->name, name, MAX_LABEL_LENGTH);
+  symbol->line_no = -1;
+  symbol->next = *bucket;
+  *bucket = symbol;
+  return symbol;
+}
+
+
+/*
+  Lsp_LineNumberSymbol
+
+  Returns the symbol of line number line_no, as Lsp_FindSymbol. Line
+  numbers are looked up directly; all those beyond the maximum share a
+  symbol, as none of them can be defined.
+*/
+struct lsp_symbol*
+Lsp_LineNumberSymbol(struct lsp_document* doc, s32 line_no, BOOL create)
+{
+  if (line_no > MAX_LINE_NUMBER)
+    line_no = MAX_LINE_NUMBER + 1;
+  struct lsp_symbol* symbol = doc->line_no_symbols[line_no];
+  if (symbol ||
+      !create)
+    return symbol;
+
+  symbol = (struct lsp_symbol*)Counted_Calloc(1, sizeof(struct lsp_symbol));
+  sprintf(symbol->name, (line_no > MAX_LINE_NUMBER) ? "%d+" : "%d", line_no);
+  symbol->line_no = line_no;
+  doc->line_no_symbols[line_no] = symbol;
+  return symbol;
+}
+
+
+/*
+  Lsp_SymbolTouched
+
+  Note that the definitions of symbol may have changed. The lines
+  defining and referencing it are checked again if it became defined,
+  undefined or duplicate.
+*/
+void
+Lsp_SymbolTouched(struct lsp_document* doc, struct lsp_symbol* symbol)
+{
+  if (symbol->queued)
+    return;
+  symbol->queued = TRUE;
+  if (doc->num_changed == doc->changed_capacity)
+  {
+    doc->changed_capacity = doc->changed_capacity ? doc->changed_capacity * 2 : 64;
+    doc->changed = (struct lsp_symbol**)Counted_Realloc(doc->changed,
+                                                doc->changed_capacity * sizeof(struct lsp_symbol*));
+  }
+  doc->changed[doc->num_changed++] = symbol;
+}
+
+
+/*
+  Lsp_SymbolChanged
+
+  Note that the lines defining and referencing symbol need to be
+  checked again.
+*/
+void
+Lsp_SymbolChanged(struct lsp_document* doc, struct lsp_symbol* symbol)
+{
+  symbol->changed = TRUE;
+  Lsp_SymbolTouched(doc, symbol);
+}
+
+
+/*
+  Lsp_MarkDirty
+
+  Note that line needs to be checked again.
+*/
+void
+Lsp_MarkDirty(struct lsp_document* doc, struct lsp_line* line)
+{
+  if (line->dirty)
+    return;
+  line->dirty = TRUE;
+  LineList_Add(&doc->dirty, line);
+}
+
+
+/*
+  Lsp_FirstDef
+
+  Returns the first line in doc defining symbol, or 0 if there is
+  none. Duplicates are errors, but the first one is still used, so that
+  the result doesn't depend on the order of edits.
+*/
+struct lsp_line*
+Lsp_FirstDef(struct lsp_symbol* symbol)
+{
+  struct lsp_line* first = 0;
+  for (u32 i = 0; i < symbol->defs.count; ++i)
+    if (!first ||
+        symbol->defs.lines[i]->index < first->index)
+      first = symbol->defs.lines[i];
+  return first;
+}
+
+
+/*
+  Lsp_Digits
+
+  Returns the number of digits of line_no as LIST shows it.
+*/
+u32
+Lsp_Digits(s32 line_no)
+{
+  u32 digits = 1;
+  for (; line_no >= 10; line_no /= 10)
+    ++digits;
+  return digits;
+}
+
+
+/*
+  Lsp_SetError
+
+  Store message as line's error, truncated to fit.
+*/
+void
+Lsp_SetError(struct lsp_line* line, char* message)
+{
+  size_t len = strlen(message);
+  if (len > sizeof(line->error) - 1)
+    len = sizeof(line->error) - 1;
+  memcpy(line->error, message, len);
+  line->error[len] = '\0';
+}
+
+
+/*
+  Lsp_AddRef
+
+  Record that line jumps to symbol, spending tokenized_len bytes on it.
+  may_be_statement marks a reference that is a statement unless symbol
+  is defined.
+*/
+void
+Lsp_AddRef(struct lsp_line* line, struct lsp_symbol* symbol, u32 tokenized_len,
+           BOOL may_be_statement)
+{
+  line->refs = (struct lsp_ref*)Counted_Realloc(line->refs,
+                                        (line->num_refs + 1) * sizeof(struct lsp_ref));
+  line->refs[line->num_refs].symbol = symbol;
+  line->refs[line->num_refs].tokenized_len = tokenized_len;
+  line->refs[line->num_refs].may_be_statement = may_be_statement;
+  ++line->num_refs;
+  LineList_Add(&symbol->refs, line);
+}
+
+
+/*
+  Lsp_ScanTargets
+
+  Collect the jump targets of line at tokenized[*pos], as
+  TranslateLabelTargets translates them. A target after THEN that
+  starts with a keyword may be a statement, such as PRINT, and isn't
+  reported as undefined.
+*/
+void
+Lsp_ScanTargets(struct lsp_document* doc, struct lsp_line* line, byte_t* tokenized,
+                u32* pos, BOOL must_end_statement)
+{
+  for (;;)
   {
-    StripWhitespace(line_buffer);
-    len = strlen(line_buffer);
-    if (len < 1) continue;
-    
-    ++source_line_number;
+    while (tokenized[*pos] == ' ')
+      ++*pos;
+
+    if (isdigit(tokenized[*pos]))
+    {
+      u32 begin = *pos;
+      s32 line_no = 0;
+      while (isdigit(tokenized[*pos]))
+      {
+        if (line_no <= MAX_LINE_NUMBER)
+          line_no = line_no * 10 + (tokenized[*pos] - '0');
+        ++*pos;
+      }
+      Lsp_AddRef(line, Lsp_LineNumberSymbol(doc, line_no, TRUE), *pos - begin, FALSE);
+    }
+    else
+    {
+      char name[MAX_LABEL_LENGTH+1];
+      u32 end = *pos + LabelName(&tokenized[*pos], name);
+      if (!isalpha(name[0]))
+        return;
+      if (must_end_statement)
+      {
+        u32 next = end;
+        while (tokenized[next] == ' ')
+          ++next;
+        if (tokenized[next] &&
+            tokenized[next] != ':')
+          return;
+      }
+      u32 token_len;
+      Lsp_AddRef(line, Lsp_FindSymbol(doc, name, TRUE), end - *pos,
+                 must_end_statement && TokenText(&tokenized[*pos], &token_len));
+      *pos = end;
+    }
+
+    u32 next = *pos;
+    while (tokenized[next] == ' ')
+      ++next;
+    if (tokenized[next] != ',')
+      return;
+    *pos = next + 1;
+  }
+}
 
-    if (len == 0) continue;
-    
-    struct BASIC_line* line = (struct BASIC_line*)malloc(sizeof(struct BASIC_line));
-    memset(line, 0, sizeof(struct BASIC_line));
-    line->source_line_number = source_line_number;
 
-    /* Check if line is label. Store label and advance to next
-       non-blank line if so. */
-    if (IsLabel(line_buffer))
+/*
+  Lsp_ScanReferences
+
+  Collect the jump targets of the tokenized line, in the places
+  TranslateLabels looks for them.
+*/
+void
+Lsp_ScanReferences(struct lsp_document* doc, struct lsp_line* line, byte_t* tokenized)
+{
+  byte_t rem_token     = TranslateToken("REM");
+  byte_t data_token    = TranslateToken("DATA");
+  byte_t go_token      = TranslateToken("GO");
+  byte_t to_token      = TranslateToken("TO");
+  byte_t goto_token    = TranslateToken("GOTO");
+  byte_t gosub_token   = TranslateToken("GOSUB");
+  byte_t restore_token = TranslateToken("RESTORE");
+  byte_t run_token     = TranslateToken("RUN");
+  byte_t then_token    = TranslateToken("THEN");
+
+  u32 pos = 0;
+  BOOL in_quotes = FALSE;
+  BOOL in_data   = FALSE;
+  while (tokenized[pos])
+  {
+    byte_t token = tokenized[pos++];
+
+    if (token == '"')
+      in_quotes = !in_quotes;
+    if (in_quotes)
+      continue;
+    if (in_data)
     {
-      /* Labels are case-insensitive */
-      ConvertLowercaseToUppercase(line_buffer);
-      /* Remove trailing colon from label */
-      line_buffer[strlen(line_buffer)-1] = '\0';
-      strncpy(current_label, line_buffer, MAX_LABEL_LENGTH);
+      in_data = (token != ':');
+      continue;
+    }
+    if (token == rem_token)
+      break;
+    if (token == data_token)
+    {
+      in_data = TRUE;
       continue;
     }
 
-    if (strlen(current_label) > 0)
+    if (token == go_token)
+    {
+      while (tokenized[pos] == ' ')
+        ++pos;
+      if (tokenized[pos] != to_token)
+        continue;
+      ++pos;
+      token = goto_token;
+    }
+
+    if (token == goto_token  ||
+        token == gosub_token ||
+        token == restore_token ||
+        token == run_token)
+      Lsp_ScanTargets(doc, line, tokenized, &pos, FALSE);
+    else if (token == then_token)
+      Lsp_ScanTargets(doc, line, tokenized, &pos, TRUE);
+  }
+}
+
+
+/*
+  Lsp_AnalyzeLine
+
+  Classify line, tokenize it and collect its label and jump targets,
+  as far as its text alone tells.
+*/
+void
+Lsp_AnalyzeLine(struct lsp_document* doc, struct lsp_line* line)
+{
+  char* buffer = (char*)Counted_Malloc(line->len + 1);
+  for (u32 i = 0; i < line->len; ++i)
+    buffer[i] = (line->text[i] >= 'a' && line->text[i] <= 'z') ? line->text[i] - 0x20 : line->text[i];
+  buffer[line->len] = '\0';
+
+  struct source_line source_line;
+  struct source_lines source_lines = { &source_line, 0, 1 };
+  jmp_buf jump;
+  syntax_error_jump = &jump;
+  syntax_error_quiet = TRUE;
+  if (setjmp(jump) == 0)
+    Normalize_AddLine(buffer, 0, line->len, line->index + 1, &source_lines);
+  else
+    Lsp_SetError(line, syntax_error_message);
+  syntax_error_jump = 0;
+  syntax_error_quiet = FALSE;
+  if (line->error[0] ||
+      !source_lines.num_lines)
+  {
+    line->text_end = line->error[0] ? line->len : 0;
+    Counted_Free(buffer);
+    return;
+  }
+
+  line->text_begin = source_line.text - buffer;
+  line->text_end   = line->text_begin + source_line.len;
+  if (source_line.is_label)
+  {
+    char name[MAX_LABEL_LENGTH+1];
+    memcpy(name, source_line.text, source_line.len - 1);
+    name[source_line.len - 1] = '\0';
+    line->is_label = TRUE;
+    line->label = Lsp_FindSymbol(doc, name, TRUE);
+    LineList_Add(&line->label->defs, line);
+    Lsp_SymbolChanged(doc, line->label);
+    Counted_Free(buffer);
+    return;
+  }
+
+  line->is_code = TRUE;
+  line->explicit_line_no = source_line.line_no;
+  if (source_line.len >= MAX_SOURCE_LINE_LEN)
+  {
+    snprintf(line->error, MAX_LSP_MESSAGE_LEN, "Line too long (maximum: %d characters)",
+             MAX_SOURCE_LINE_LEN-1);
+    line->listed_len    = source_line.len;
+    line->tokenized_len = source_line.len;
+  }
+  else if (IsIncbinLine(source_line.text, source_line.len))
+    line->is_incbin = TRUE;
+  else
+  {
+    byte_t tokenized[MAX_SOURCE_LINE_LEN];
+    memcpy(tokenized, source_line.text, source_line.len);
+    tokenized[source_line.len] = 0;
+    TranslateASCIIToPETSCII(tokenized);
+    line->listed_len = strlen((char*)tokenized);
+    TokenizeLine(tokenized);
+    line->tokenized_len = strlen((char*)tokenized);
+    Lsp_ScanReferences(doc, line, tokenized);
+  }
+  Counted_Free(buffer);
+}
+
+
+/*
+  Lsp_IncludeBinary
+
+  Run the INCBIN directive of line, numbered line->line_no, to find
+  how many lines and bytes it takes.
+*/
+void
+Lsp_IncludeBinary(struct lsp_line* line)
+{
+  struct BASIC_program include_program;
+  memset(&include_program, 0, sizeof(include_program));
+  struct source_line source_line;
+  memset(&source_line, 0, sizeof(source_line));
+  source_line.line_no = line->line_no;
+  source_line.len = line->text_end - line->text_begin;
+  source_line.source_line_number = line->index + 1;
+
+  line->error[0] = '\0';
+  line->num_line_nos = 1;
+  line->incbin_bytes = 0;
+  jmp_buf jump;
+  syntax_error_jump = &jump;
+  syntax_error_quiet = TRUE;
+  if (setjmp(jump) == 0)
+  {
+    IncludeBinary(&include_program, &source_line, &line->text[line->text_begin], "");
+    line->num_line_nos = 0;
+    for (struct BASIC_line* included = include_program.first_line;
+         included;
+         included = included->next)
+    {
+      ++line->num_line_nos;
+      line->incbin_bytes += 4 + strlen((char*)included->tokenized_line) + 1;
+    }
+  }
+  else
+    Lsp_SetError(line, syntax_error_message);
+  syntax_error_jump = 0;
+  syntax_error_quiet = FALSE;
+  Program_Free(&include_program);
+}
+
+
+/*
+  Lsp_SetLineNumber
+
+  Number the code line line_no, moving its definitions to the symbols
+  of its new line numbers.
+*/
+void
+Lsp_SetLineNumber(struct lsp_document* doc, struct lsp_line* line, s32 line_no)
+{
+  for (u32 i = 0; i < line->num_line_nos; ++i)
+  {
+    struct lsp_symbol* symbol = Lsp_LineNumberSymbol(doc, line->line_no + i, FALSE);
+    LineList_Remove(&symbol->defs, line);
+    Lsp_SymbolTouched(doc, symbol);
+  }
+
+  /* The line's own diagnostics only depend on the length of its
+     number and whether it is valid, or duplicate */
+  if (line->line_no < 0 ||
+      line->is_incbin ||
+      line->duplicate ||
+      Lsp_Digits(line->line_no) != Lsp_Digits(line_no) ||
+      (line->line_no > MAX_LINE_NUMBER) != (line_no > MAX_LINE_NUMBER))
+    Lsp_MarkDirty(doc, line);
+
+  line->line_no = line_no;
+  line->num_line_nos = 1;
+  /* The lines of an INCBIN depend on its number, which LIST shows */
+  if (line->is_incbin)
+    Lsp_IncludeBinary(line);
+
+  for (u32 i = 0; i < line->num_line_nos; ++i)
+  {
+    struct lsp_symbol* symbol = Lsp_LineNumberSymbol(doc, line->line_no + i, TRUE);
+    LineList_Add(&symbol->defs, line);
+    Lsp_SymbolTouched(doc, symbol);
+  }
+}
+
+
+/*
+  Lsp_AssignLineNumbers
+
+  Number the code lines from index first onward, as Program_AddLine
+  does, after the lines from first up to end have been replaced. Lines
+  without a line number follow the previous line, so numbering goes on
+  past end until a line keeps its number. The labels whose next line
+  may have changed are updated too.
+*/
+void
+Lsp_AssignLineNumbers(struct lsp_document* doc, u32 first, u32 end)
+{
+  s32 prev_line_no = 0;
+  for (u32 i = first; i-- > 0;)
+  {
+    struct lsp_line* line = doc->lines[i];
+    if (line->is_code)
+    {
+      prev_line_no = line->line_no + line->num_line_nos - 1;
+      break;
+    }
+  }
+
+  u32 stop;
+  for (stop = first; stop < doc->num_lines; ++stop)
+  {
+    struct lsp_line* line = doc->lines[stop];
+    if (!line->is_code)
+      continue;
+    s32 line_no = (line->explicit_line_no >= 0) ? line->explicit_line_no : prev_line_no + 1;
+    if (line_no != line->line_no)
+      Lsp_SetLineNumber(doc, line, line_no);
+    else if (stop >= end)
+      break;
+    prev_line_no = line->line_no + line->num_line_nos - 1;
+  }
+
+  /* A label stands for the next line, unless another label comes
+     first (DoLinesPass keeps only the last) */
+  u32 begin = first;
+  while (begin > 0 &&
+         !doc->lines[begin-1]->is_code)
+    --begin;
+  for (u32 i = begin; i < stop; ++i)
+  {
+    struct lsp_line* line = doc->lines[i];
+    if (!line->is_label)
+      continue;
+    s32 value = -1;
+    for (u32 next = i + 1; next < doc->num_lines; ++next)
+    {
+      if (doc->lines[next]->is_label)
+        break;
+      if (doc->lines[next]->is_code)
+      {
+        value = doc->lines[next]->line_no;
+        break;
+      }
+    }
+    if (value == line->label_value)
+      continue;
+    /* References only depend on the length of the number */
+    if ((value < 0) != (line->label_value < 0) ||
+        Lsp_Digits(value) != Lsp_Digits(line->label_value))
+      Lsp_SymbolChanged(doc, line->label);
+    line->label_value = value;
+  }
+}
+
+
+/*
+  Lsp_AddDiagnostic
+
+  Add a diagnostic for the columns begin up to end to line.
+*/
+void
+Lsp_AddDiagnostic(struct lsp_line* line, u32 begin, u32 end, int severity, char* msg, ...)
+{
+  if (line->num_diagnostics == line->diagnostics_capacity)
+  {
+    line->diagnostics_capacity = line->diagnostics_capacity ? line->diagnostics_capacity * 2 : 2;
+    line->diagnostics = (struct lsp_diagnostic*)Counted_Realloc(line->diagnostics,
+                                         line->diagnostics_capacity * sizeof(struct lsp_diagnostic));
+  }
+  struct lsp_diagnostic* diagnostic = &line->diagnostics[line->num_diagnostics++];
+  diagnostic->begin = begin;
+  diagnostic->end = end;
+  diagnostic->severity = severity;
+  va_list args;
+  va_start(args, msg);
+  vsnprintf(diagnostic->message, MAX_LSP_MESSAGE_LEN, msg, args);
+  va_end(args);
+}
+
+
+/*
+  Lsp_NameMatches
+
+  Returns TRUE if the first len characters of text spell name, in
+  either case.
+*/
+BOOL
+Lsp_NameMatches(char* text, char* name, u32 len)
+{
+  for (u32 i = 0; i < len; ++i)
+    if (toupper((byte_t)text[i]) != toupper((byte_t)name[i]))
+      return FALSE;
+  return TRUE;
+}
+
+
+/*
+  Lsp_FindName
+
+  Find name in the text of line, ignoring case, at or after column
+  *begin and not followed by a label character. If strict is set, it
+  mustn't be preceded by one either.
+
+  Returns TRUE and stores the column in begin if found.
+*/
+BOOL
+Lsp_FindName(struct lsp_line* line, char* name, BOOL strict, u32* begin)
+{
+  u32 len = strlen(name);
+  for (u32 i = *begin; i + len <= line->text_end; ++i)
+  {
+    if (!Lsp_NameMatches(&line->text[i], name, len) ||
+        (i + len < line->len && IsValidLabelChar(line->text[i + len])) ||
+        (strict && i > 0 && IsValidLabelChar(line->text[i - 1])))
+      continue;
+    *begin = i;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+
+/*
+  Lsp_LabelDeltas
+
+  Add up how much longer line gets, listed and tokenized, once its
+  labels are replaced by their line numbers.
+*/
+void
+Lsp_LabelDeltas(struct lsp_line* line, s32* listed_delta, s32* tokenized_delta)
+{
+  *listed_delta = 0;
+  *tokenized_delta = 0;
+  for (u32 i = 0; i < line->num_refs; ++i)
+  {
+    struct lsp_symbol* symbol = line->refs[i].symbol;
+    struct lsp_line* def = Lsp_FirstDef(symbol);
+    if (symbol->line_no >= 0 ||
+        !def ||
+        def->label_value < 0)
+      continue;
+    s32 digits = Lsp_Digits(def->label_value);
+    *listed_delta += digits - (s32)strlen(symbol->name);
+    *tokenized_delta += digits - (s32)line->refs[i].tokenized_len;
+  }
+}
+
+
+/*
+  Lsp_CheckLine
+
+  Find the diagnostics of line.
+*/
+void
+Lsp_CheckLine(struct lsp_document* doc, struct lsp_line* line)
+{
+  line->num_diagnostics = 0;
+  u32 begin = line->text_begin;
+  u32 end   = line->text_end;
+
+  if (line->error[0])
+    Lsp_AddDiagnostic(line, begin, end, LSP_ERROR, "%s", line->error);
+
+  if (line->is_label)
+  {
+    if (line->label->defs.count > 1)
+      Lsp_AddDiagnostic(line, begin, end, LSP_ERROR, "Duplicate label: \"%s\"", line->label->name);
+    else if (line->label_value < 0)
+      Lsp_AddDiagnostic(line, begin, end, LSP_WARNING,
+                        "Label \"%s\" isn't followed by a line", line->label->name);
+  }
+
+  if (line->is_code)
+  {
+    /* The line number, or the whole line if it has none */
+    u32 number_begin = 0;
+    while (number_begin < begin &&
+           !isdigit(line->text[number_begin]))
+      ++number_begin;
+    u32 number_end = (line->explicit_line_no >= 0) ? begin : end;
+    if (line->line_no > MAX_LINE_NUMBER)
+      Lsp_AddDiagnostic(line, number_begin, number_end, LSP_ERROR,
+                        "Line number too high (maximum: %d)", MAX_LINE_NUMBER);
+    line->duplicate = FALSE;
+    for (u32 i = 0; i < line->num_line_nos && !line->duplicate; ++i)
+    {
+      struct lsp_symbol* symbol = Lsp_LineNumberSymbol(doc, line->line_no + i, FALSE);
+      if (symbol->line_no <= MAX_LINE_NUMBER &&
+          symbol->defs.count > 1)
+      {
+        Lsp_AddDiagnostic(line, number_begin, number_end, LSP_ERROR,
+                          "Duplicate line number %d", line->line_no + i);
+        line->duplicate = TRUE;
+      }
+    }
+
+    for (u32 i = 0; i < line->num_refs; ++i)
     {
-      /* Store label in line. Fail if duplicate. */
-      if (Program_FindLineNumberByLabel(program, current_label) >= 0)
+      struct lsp_symbol* symbol = line->refs[i].symbol;
+      u32 ref_begin = begin;
+      u32 ref_end = end;
+      if (Lsp_FindName(line, symbol->name, TRUE, &ref_begin) ||
+          Lsp_FindName(line, symbol->name, FALSE, &ref_begin))
+        ref_end = ref_begin + strlen(symbol->name);
+      if (symbol->line_no >= 0)
+      {
+        if (!symbol->defs.count ||
+            symbol->line_no > MAX_LINE_NUMBER)
+          Lsp_AddDiagnostic(line, ref_begin, ref_end, LSP_WARNING,
+                            "Jump to missing line %s", symbol->name);
+      }
+      else if (!symbol->defs.count)
       {
-        SyntaxError(-1, "Duplicate label: \"%s\"", current_label);
+        if (!line->refs[i].may_be_statement)
+          Lsp_AddDiagnostic(line, ref_begin, ref_end, LSP_ERROR,
+                            "Undefined label: \"%s\"", symbol->name);
       }
-      strncpy(line->label, current_label, MAX_LABEL_LENGTH);
+      else if (Lsp_FirstDef(symbol)->label_value < 0)
+        Lsp_AddDiagnostic(line, ref_begin, ref_end, LSP_ERROR,
+                          "Label \"%s\" isn't followed by a line", symbol->name);
+    }
+
+    s32 listed_delta;
+    s32 tokenized_delta;
+    Lsp_LabelDeltas(line, &listed_delta, &tokenized_delta);
+    u32 listed_len = Lsp_Digits(line->line_no) + 1 + line->listed_len + listed_delta;
+    if (line->tokenized_len + tokenized_delta >= MAX_SOURCE_LINE_LEN)
+      Lsp_AddDiagnostic(line, begin, end, LSP_ERROR, "Line too long after label substitution");
+    else if (!line->is_incbin &&
+             listed_len > LSP_MAX_LISTED_LEN)
+      Lsp_AddDiagnostic(line, begin, end, LSP_WARNING,
+                        "Line lists as %u characters, more than the %d the screen editor takes",
+                        listed_len, LSP_MAX_LISTED_LEN);
+  }
+
+  if (line->num_diagnostics &&
+      !line->diagnosed)
+    LineList_Add(&doc->diagnosed, line);
+  else if (!line->num_diagnostics &&
+           line->diagnosed)
+    LineList_Remove(&doc->diagnosed, line);
+  line->diagnosed = (line->num_diagnostics > 0);
+}
+
+
+/*
+  Lsp_Update
+
+  Check the lines that changed, and the lines defining or referencing
+  a symbol whose definitions changed.
+*/
+void
+Lsp_Update(struct lsp_document* doc)
+{
+  for (u32 i = 0; i < doc->num_changed; ++i)
+  {
+    struct lsp_symbol* symbol = doc->changed[i];
+    u32 defs = (symbol->defs.count < 2) ? symbol->defs.count : 2;
+    u32 checked_defs = (symbol->checked_defs < 2) ? symbol->checked_defs : 2;
+    /* The lines of a duplicate may have changed without its count */
+    if (symbol->changed ||
+        defs != checked_defs ||
+        defs > 1)
+    {
+      for (u32 j = 0; j < symbol->defs.count; ++j)
+        Lsp_MarkDirty(doc, symbol->defs.lines[j]);
+    }
+    if (symbol->changed ||
+        defs != checked_defs)
+    {
+      for (u32 j = 0; j < symbol->refs.count; ++j)
+        Lsp_MarkDirty(doc, symbol->refs.lines[j]);
     }
+    symbol->checked_defs = symbol->defs.count;
+    symbol->changed = FALSE;
+    symbol->queued = FALSE;
+  }
+  doc->num_changed = 0;
+
+  for (u32 i = 0; i < doc->dirty.count; ++i)
+  {
+    Lsp_CheckLine(doc, doc->dirty.lines[i]);
+    doc->dirty.lines[i]->dirty = FALSE;
+  }
+  doc->dirty.count = 0;
+}
+
+
+/*
+  Lsp_FreeLine
+
+  Free line and everything it holds.
+*/
+void
+Lsp_FreeLine(struct lsp_line* line)
+{
+  Counted_Free(line->text);
+  Counted_Free(line->refs);
+  Counted_Free(line->diagnostics);
+  Counted_Free(line);
+}
+
+
+/*
+  Lsp_ReleaseLine
+
+  Remove line from the symbols and lists of doc, and free it.
+*/
+void
+Lsp_ReleaseLine(struct lsp_document* doc, struct lsp_line* line)
+{
+  if (line->label)
+  {
+    LineList_Remove(&line->label->defs, line);
+    Lsp_SymbolChanged(doc, line->label);
+  }
+  for (u32 i = 0; i < line->num_refs; ++i)
+    LineList_Remove(&line->refs[i].symbol->refs, line);
+  for (u32 i = 0; i < line->num_line_nos; ++i)
+  {
+    struct lsp_symbol* symbol = Lsp_LineNumberSymbol(doc, line->line_no + i, FALSE);
+    LineList_Remove(&symbol->defs, line);
+    Lsp_SymbolTouched(doc, symbol);
+  }
+  if (line->diagnosed)
+    LineList_Remove(&doc->diagnosed, line);
+  Lsp_FreeLine(line);
+}
+
+
+/*
+  Lsp_ReplaceLines
 
+  Replace num_removed lines of doc, from index first, with the lines
+  of the len bytes of text, and bring the document's state up to date.
+*/
+void
+Lsp_ReplaceLines(struct lsp_document* doc, u32 first, u32 num_removed, char* text, u32 len)
+{
+  u32 num_added = 1;
+  for (u32 i = 0; i < len; ++i)
+    if (text[i] == '\n')
+      ++num_added;
 
-    char* line_ptr = line_buffer;
-    StripWhitespace(line_ptr);
+  for (u32 i = first; i < first + num_removed; ++i)
+    Lsp_ReleaseLine(doc, doc->lines[i]);
 
-    /* Grab line number, then skip past digits. If no line number,
-       we'll set it to a negative to be automatically generated. */
-    if (!isdigit(*line_ptr))
-      line->line_no = -1;
-    else
-      line->line_no = atoi(line_ptr);
-    while (isdigit(*line_ptr)) ++line_ptr;
+  u32 num_lines = doc->num_lines - num_removed + num_added;
+  if (num_lines > doc->capacity)
+  {
+    doc->capacity = num_lines * 2;
+    doc->lines = (struct lsp_line**)Counted_Realloc(doc->lines,
+                                            doc->capacity * sizeof(struct lsp_line*));
+  }
+  memmove(&doc->lines[first + num_added], &doc->lines[first + num_removed],
+          (doc->num_lines - first - num_removed) * sizeof(struct lsp_line*));
+  doc->num_lines = num_lines;
 
-    StripWhitespace(line_ptr);
-    strncpy(line->source_line, line_ptr, MAX_SOURCE_LINE_LEN);
+  u32 pos = 0;
+  for (u32 i = first; i < first + num_added; ++i)
+  {
+    u32 end = pos;
+    while (end < len &&
+           text[end] != '\n')
+      ++end;
+    struct lsp_line* line = (struct lsp_line*)Counted_Calloc(1, sizeof(struct lsp_line));
+    line->text = (char*)Counted_Malloc(end - pos + 1);
+    memcpy(line->text, &text[pos], end - pos);
+    line->text[end - pos] = '\0';
+    line->len = end - pos;
+    line->line_no = -1;
+    line->label_value = -1;
+    doc->lines[i] = line;
+    pos = end + 1;
+  }
 
-    strncpy((char*)line->tokenized_line, line->source_line, MAX_SOURCE_LINE_LEN);
-    ConvertLowercaseToUppercase((char*)line->tokenized_line);
+  /* Lines after the edit only move if the number of lines changed */
+  u32 moved_end = (num_added == num_removed) ? first + num_added : doc->num_lines;
+  for (u32 i = first; i < moved_end; ++i)
+    doc->lines[i]->index = i;
 
-    Program_AddLine(program, line);
-    strncpy(current_label, "", 1);
+  for (u32 i = first; i < first + num_added; ++i)
+  {
+    Lsp_AnalyzeLine(doc, doc->lines[i]);
+    Lsp_MarkDirty(doc, doc->lines[i]);
   }
+  Lsp_AssignLineNumbers(doc, first, first + num_added);
+  Lsp_Update(doc);
 }
 
+
 /*
-  DoTokenizePass
-  
-  Tokenize all BASIC keywords and operators in each line of program.
+  Lsp_ApplyChange
+
+  Apply a change of the document's text: a range and the text
+  replacing it, or the whole new text.
 */
 void
-DoTokenizePass(struct BASIC_program* program)
+Lsp_ApplyChange(struct lsp_document* doc, char* change)
 {
-  struct BASIC_line* line = program->first_line;
-  while (line)
+  u32 len;
+  char* text = Json_ReadString(Json_Member(change, "text"), &len);
+  if (!text)
+    return;
+  char* range = Json_Member(change, "range");
+  if (!range)
   {
-    TokenizeLine(line->tokenized_line);
+    Lsp_ReplaceLines(doc, 0, doc->num_lines, text, len);
+    Counted_Free(text);
+    return;
+  }
 
-    line = line->next;
+  u32 first_line = Json_ReadInt(Json_Find(range, "start.line"), 0);
+  u32 first_char = Json_ReadInt(Json_Find(range, "start.character"), 0);
+  u32 last_line  = Json_ReadInt(Json_Find(range, "end.line"), 0);
+  u32 last_char  = Json_ReadInt(Json_Find(range, "end.character"), 0);
+  if (first_line >= doc->num_lines)
+  {
+    first_line = doc->num_lines - 1;
+    first_char = doc->lines[first_line]->len;
   }
+  if (last_line >= doc->num_lines)
+  {
+    last_line = doc->num_lines - 1;
+    last_char = doc->lines[last_line]->len;
+  }
+  if (last_line < first_line)
+    last_line = first_line;
+  struct lsp_line* first = doc->lines[first_line];
+  struct lsp_line* last  = doc->lines[last_line];
+  if (first_char > first->len)
+    first_char = first->len;
+  if (last_char > last->len)
+    last_char = last->len;
+  if (last_line == first_line &&
+      last_char < first_char)
+    last_char = first_char;
+
+  /* The edited lines are replaced as a whole */
+  u32 suffix_len = last->len - last_char;
+  u32 edited_len = first_char + len + suffix_len;
+  char* edited = (char*)Counted_Malloc(edited_len + 1);
+  memcpy(edited, first->text, first_char);
+  memcpy(&edited[first_char], text, len);
+  memcpy(&edited[first_char + len], &last->text[last_char], suffix_len);
+  Lsp_ReplaceLines(doc, first_line, last_line - first_line + 1, edited, edited_len);
+  Counted_Free(edited);
+  Counted_Free(text);
 }
 
+
 /*
-  TranslateLabels
+  Lsp_FindDocument
 
-  Replace all occurances of valid labels (in valid locations) with the
-  corresponding BASIC line number.
+  Returns the open document uri, or 0.
 */
-void
-TranslateLabels(struct BASIC_program* program, byte_t* line)
+struct lsp_document*
+Lsp_FindDocument(char* uri)
 {
-  byte_t* line_ptr = line;
+  for (u32 i = 0; i < MAX_LSP_DOCUMENTS; ++i)
+    if (lsp_documents[i] &&
+        uri &&
+        strcmp(lsp_documents[i]->uri, uri) == 0)
+      return lsp_documents[i];
+  return 0;
+}
 
-  while (*line_ptr)
-  {
-    /* If token accepts labels (GOTO, GOSUB), check for label, and
-       replace with target line number if necessary */
-    byte_t token = *line_ptr;
-    ++line_ptr;
-    if (TranslateToken("GOTO")  != token &&
-        TranslateToken("GOSUB") != token)
-    {
-      continue;
-    }
 
-    /* First, skip whitespace, then continue looping if we don't
-       have an alphabetic character (i.e. we cannot be dealing with
-       a label). */
-    ++line_ptr;
-    char* label_start = (char*)line_ptr;
-    while (isspace(*label_start)) ++label_start;
-    if (!isalpha(*label_start))
+/*
+  Lsp_CloseDocument
+
+  Free the document in slot i.
+*/
+void
+Lsp_CloseDocument(u32 i)
+{
+  struct lsp_document* doc = lsp_documents[i];
+  for (u32 j = 0; j < doc->num_lines; ++j)
+    Lsp_FreeLine(doc->lines[j]);
+  for (u32 j = 0; j < LSP_HASH_BUCKETS; ++j)
+  {
+    struct lsp_symbol* symbol = doc->symbols[j];
+    while (symbol)
     {
-      ++label_start;
+      struct lsp_symbol* next = symbol->next;
+      Counted_Free(symbol->defs.lines);
+      Counted_Free(symbol->refs.lines);
+      Counted_Free(symbol);
+      symbol = next;
     }
-
-    /* Find the longest possible string that could be a valid label */
-    char* label_end = label_start;
-    while (*label_end &&
-           IsValidLabelChar(*label_end))
-      ++label_end;
-    while (label_end > label_start)
+  }
+  for (u32 j = 0; j <= MAX_LINE_NUMBER + 1; ++j)
+  {
+    struct lsp_symbol* symbol = doc->line_no_symbols[j];
+    if (symbol)
     {
-      char  temp_label[MAX_LABEL_LENGTH+1];
-
-      /* Is string too long to be a label? */
-      int temp_label_len = label_end - label_start + 1;
-      if (temp_label_len > MAX_LABEL_LENGTH)
-      {
-        --label_end;
-        continue;
-      }
-
-      strncpy(temp_label, label_start, temp_label_len);
-      s32 target_line_no = Program_FindLineNumberByLabel(program, temp_label);
-      if (target_line_no < 0)
-      {
-        /* Not an existing label */
-        --label_end;
-        continue;
-      }
-      /* We've found a label. Replace the text with the corresponding
-         line number */
-      char line_number_string[6];
-      sprintf(line_number_string, "%d", target_line_no);
-      ReplaceStringWithString(label_start, temp_label, line_number_string);
-      break;
+      Counted_Free(symbol->defs.lines);
+      Counted_Free(symbol->refs.lines);
+      Counted_Free(symbol);
     }
   }
+  Counted_Free(doc->line_no_symbols);
+  Counted_Free(doc->lines);
+  Counted_Free(doc->dirty.lines);
+  Counted_Free(doc->diagnosed.lines);
+  Counted_Free(doc->changed);
+  Counted_Free(doc->uri);
+  Counted_Free(doc);
+  lsp_documents[i] = 0;
 }
 
 
 /*
-  DoLabelPass
+  Lsp_PublishDiagnostics
 
-  Run through program and replace label strings with the corresponding
-  line numbers where necessary.
+  Send the diagnostics of all lines of doc.
 */
 void
-DoLabelPass(struct BASIC_program* program)
+Lsp_PublishDiagnostics(struct lsp_document* doc)
 {
-  struct BASIC_line* curr_line = program->first_line;
-  while (curr_line)
+  struct lsp_message message;
+  Lsp_BeginMessage(&message, 0, "textDocument/publishDiagnostics");
+  fprintf(message.fp, "{\"uri\":");
+  Json_WriteString(message.fp, doc->uri, strlen(doc->uri));
+  fprintf(message.fp, ",\"diagnostics\":[");
+  BOOL first = TRUE;
+  for (u32 i = 0; i < doc->diagnosed.count; ++i)
   {
-    TranslateLabels(program, curr_line->tokenized_line);
-    curr_line = curr_line->next;
+    struct lsp_line* line = doc->diagnosed.lines[i];
+    for (u32 j = 0; j < line->num_diagnostics; ++j)
+    {
+      struct lsp_diagnostic* diagnostic = &line->diagnostics[j];
+      fprintf(message.fp,
+              "%s{\"range\":{\"start\":{\"line\":%u,\"character\":%u},"
+              "\"end\":{\"line\":%u,\"character\":%u}},"
+              "\"severity\":%d,\"source\":\"prgbc\",\"message\":",
+              first ? "" : ",", line->index, diagnostic->begin, line->index, diagnostic->end,
+              diagnostic->severity);
+      Json_WriteString(message.fp, diagnostic->message, strlen(diagnostic->message));
+      fprintf(message.fp, "}");
+      first = FALSE;
+    }
   }
+  fprintf(message.fp, "]}");
+  Lsp_SendMessage(&message);
 }
 
+
 /*
-  DoPETSCIIPlaceholderPass
+  Lsp_Definition
 
-  Replace all PETSCII placeholder strings with correct PETSCII
-  code. This needs to be called before the tokenize pass so that the
-  curly braces are not translated to PETSCII.
+  Answer request id for the definition of the label or line number at
+  position in doc.
 */
-
 void
-DoPETSCIIPlaceholderPass(struct BASIC_program* program)
+Lsp_Definition(struct lsp_document* doc, char* id, char* position)
 {
-  struct BASIC_line* curr_line = program->first_line;
-  while (curr_line)
+  struct lsp_symbol* target = 0;
+  u32 line_index = Json_ReadInt(Json_Member(position, "line"), 0);
+  u32 character  = Json_ReadInt(Json_Member(position, "character"), 0);
+  if (doc &&
+      line_index < doc->num_lines)
   {
-    TranslateASCIIToPETSCII((byte_t*)curr_line->tokenized_line);
-    curr_line = curr_line->next;
+    struct lsp_line* line = doc->lines[line_index];
+    if (line->is_label &&
+        character >= line->text_begin &&
+        character <= line->text_end)
+      target = line->label;
+    for (u32 i = 0; i < line->num_refs && !target; ++i)
+    {
+      struct lsp_symbol* symbol = line->refs[i].symbol;
+      u32 begin = line->text_begin;
+      while (!target &&
+             Lsp_FindName(line, symbol->name, FALSE, &begin))
+      {
+        if (character >= begin &&
+            character <= begin + strlen(symbol->name))
+          target = symbol;
+        ++begin;
+      }
+    }
+  }
+
+  struct lsp_message message;
+  Lsp_BeginMessage(&message, id, 0);
+  struct lsp_line* def = target ? Lsp_FirstDef(target) : 0;
+  if (def)
+  {
+    u32 begin = 0;
+    while (begin < def->text_begin &&
+           (def->text[begin] == ' ' || def->text[begin] == '\t'))
+      ++begin;
+    fprintf(message.fp, "{\"uri\":");
+    Json_WriteString(message.fp, doc->uri, strlen(doc->uri));
+    fprintf(message.fp,
+            ",\"range\":{\"start\":{\"line\":%u,\"character\":%u},"
+            "\"end\":{\"line\":%u,\"character\":%u}}}",
+            def->index, begin, def->index, def->text_end);
   }
+  else
+    fprintf(message.fp, "null");
+  Lsp_SendMessage(&message);
 }
 
 
 /*
-  DoPETSCIIPass
+  Lsp_InlayHints
 
-  Convert each program line from ASCII to C64 PETSCII
+  Answer request id with the size in bytes of each code line in range
+  of doc, as it will be in the PRG.
 */
 void
-DoPETSCIIPass(struct BASIC_program* program)
+Lsp_InlayHints(struct lsp_document* doc, char* id, char* range)
 {
-  struct BASIC_line* curr_line = program->first_line;
-  while (curr_line)
+  struct lsp_message message;
+  Lsp_BeginMessage(&message, id, 0);
+  fprintf(message.fp, "[");
+  BOOL first = TRUE;
+  if (doc)
   {
-    TranslateASCIIToPETSCII((byte_t*)curr_line->tokenized_line);
-    curr_line = curr_line->next;
+    u32 first_line = Json_ReadInt(Json_Find(range, "start.line"), 0);
+    u32 last_line  = Json_ReadInt(Json_Find(range, "end.line"), 0);
+    for (u32 i = first_line; i <= last_line && i < doc->num_lines; ++i)
+    {
+      struct lsp_line* line = doc->lines[i];
+      if (!line->is_code)
+        continue;
+      u32 bytes = line->incbin_bytes;
+      if (!line->is_incbin)
+      {
+        s32 listed_delta;
+        s32 tokenized_delta;
+        Lsp_LabelDeltas(line, &listed_delta, &tokenized_delta);
+        bytes = 4 + line->tokenized_len + tokenized_delta + 1;
+      }
+      fprintf(message.fp,
+              "%s{\"position\":{\"line\":%u,\"character\":%u},"
+              "\"label\":\"%u bytes\",\"paddingLeft\":true}",
+              first ? "" : ",", i, line->text_end, bytes);
+      first = FALSE;
+    }
   }
+  fprintf(message.fp, "]");
+  Lsp_SendMessage(&message);
 }
 
 
 /*
-  ProgramCompile
+  RunLanguageServer
 
-  Run through the necessary passes to compile a source file into a
-  tokenized, PETSCII-compatible program.
- */
-void
-Program_Compile(struct BASIC_program* program, struct source_file* source_file)
+  Serve language server requests on stdin until the client exits.
+
+  Returns 0 if the client shut the server down first, 1 otherwise.
+*/
+int
+RunLanguageServer(void)
 {
-  DoLinesPass(program, source_file);
-  DoPETSCIIPlaceholderPass(program);
-  DoTokenizePass(program);
-  DoLabelPass(program);
-  DoPETSCIIPass(program);
+  BOOL shut_down = FALSE;
+  char* request;
+  while ((request = Lsp_ReadMessage(stdin)))
+  {
+    u32 len;
+    char* method = Json_ReadString(Json_Member(request, "method"), &len);
+    char* params = Json_Member(request, "params");
+    char* id_value = Json_Member(request, "id");
+    char id[64] = "";
+    if (id_value)
+    {
+      u32 id_len = Json_SkipValue(id_value) - id_value;
+      if (id_len >= sizeof(id))
+        id_len = sizeof(id) - 1;
+      memcpy(id, id_value, id_len);
+      id[id_len] = '\0';
+    }
+    char* uri = params ? Json_ReadString(Json_Find(params, "textDocument.uri"), &len) : 0;
+    struct lsp_document* doc = Lsp_FindDocument(uri);
+    BOOL exit_requested = FALSE;
+
+    if (!method)
+      ;  /* A response to us; the server sends no requests */
+    else if (strcmp(method, "initialize") == 0)
+    {
+      struct lsp_message message;
+      Lsp_BeginMessage(&message, id, 0);
+      fprintf(message.fp,
+              "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+              "\"definitionProvider\":true,\"inlayHintProvider\":true},"
+              "\"serverInfo\":{\"name\":\"prgbc\"}}");
+      Lsp_SendMessage(&message);
+    }
+    else if (strcmp(method, "shutdown") == 0)
+    {
+      shut_down = TRUE;
+      struct lsp_message message;
+      Lsp_BeginMessage(&message, id, 0);
+      fprintf(message.fp, "null");
+      Lsp_SendMessage(&message);
+    }
+    else if (strcmp(method, "exit") == 0)
+      exit_requested = TRUE;
+    else if (strcmp(method, "textDocument/didOpen") == 0 &&
+             uri &&
+             !doc)
+    {
+      char* text = Json_ReadString(Json_Find(params, "textDocument.text"), &len);
+      u32 slot = 0;
+      while (slot < MAX_LSP_DOCUMENTS &&
+             lsp_documents[slot])
+        ++slot;
+      if (slot == MAX_LSP_DOCUMENTS)
+        fprintf(stderr, "Too many open documents (maximum: %d)\n", MAX_LSP_DOCUMENTS);
+      else if (text)
+      {
+        doc = (struct lsp_document*)Counted_Calloc(1, sizeof(struct lsp_document));
+        doc->line_no_symbols = (struct lsp_symbol**)Counted_Calloc(MAX_LINE_NUMBER + 2,
+                                                           sizeof(struct lsp_symbol*));
+        doc->uri = uri;
+        uri = 0;
+        lsp_documents[slot] = doc;
+        Lsp_ReplaceLines(doc, 0, 0, text, len);
+        alloc_stats.input_lines += doc->num_lines;
+        Lsp_PublishDiagnostics(doc);
+      }
+      Counted_Free(text);
+    }
+    else if (strcmp(method, "textDocument/didChange") == 0 &&
+             doc)
+    {
+      char* change = Json_Member(params, "contentChanges");
+      if (change &&
+          *change == '[')
+      {
+        change = Json_SkipSpace(change + 1);
+        while (*change == '{')
+        {
+          Lsp_ApplyChange(doc, change);
+          change = Json_SkipSpace(Json_SkipValue(change));
+          if (*change == ',')
+            change = Json_SkipSpace(change + 1);
+        }
+      }
+      Lsp_PublishDiagnostics(doc);
+    }
+    else if (strcmp(method, "textDocument/didClose") == 0 &&
+             doc)
+    {
+      for (u32 i = 0; i < MAX_LSP_DOCUMENTS; ++i)
+        if (lsp_documents[i] == doc)
+          Lsp_CloseDocument(i);
+    }
+    else if (strcmp(method, "textDocument/definition") == 0)
+      Lsp_Definition(doc, id, Json_Member(params, "position"));
+    else if (strcmp(method, "textDocument/inlayHint") == 0)
+      Lsp_InlayHints(doc, id, Json_Member(params, "range"));
+    else if (id_value)
+    {
+      struct lsp_message message;
+      message.fp = MemStream_Open(&message.body, &message.len);
+      fprintf(message.fp, "{\"jsonrpc\":\"2.0\",\"id\":%s,"
+              "\"error\":{\"code\":-32601,\"message\":\"Method not found\"}", id);
+      Lsp_SendMessage(&message);
+    }
+
+    Counted_Free(uri);
+    Counted_Free(method);
+    Counted_Free(request);
+    if (exit_requested)
+      break;
+  }
+
+  for (u32 i = 0; i < MAX_LSP_DOCUMENTS; ++i)
+    if (lsp_documents[i])
+      Lsp_CloseDocument(i);
+  return shut_down ? 0 : 1;
 }
 
 
@@ -1265,8 +8384,15 @@ FixupOutputPath(struct global_args* args)
 {
   if (args->prg_path) return;
 
+  /* Source from stdin compiles to stdout */
+  if (strcmp(args->src_path, "-") == 0)
+  {
+    args->prg_path = "-";
+    return;
+  }
+
   int path_len = strlen(args->src_path);
-  args->prg_path = (char*)malloc(path_len+1);
+  args->prg_path = (char*)Counted_Malloc(path_len+1);
   strncpy(args->prg_path, args->src_path , path_len);
   char* path = args->prg_path;
 
@@ -1314,7 +8440,8 @@ ProcessArgs(struct global_args* args, int argc, char* argv[])
   {
     char* arg = argv[argi];
 
-    if (arg[0] != '-')
+    if (arg[0] != '-' ||
+        arg[1] == 0)
     {
       /* NOTE: This should always save the *last*
          non-option/non-option-argument (i.e. does not begin with '-'
@@ -1323,6 +8450,17 @@ ProcessArgs(struct global_args* args, int argc, char* argv[])
          to load. Is this really the desirable behavior? Perhaps save
          a list of non-option arguments? */
       args->src_path = arg;
+
+      /* All of them are inputs to --link */
+      if (args->num_link_inputs >= MAX_LINK_INPUTS)
+      {
+        fprintf(stderr, "Too many input files (maximum: %d)\n", MAX_LINK_INPUTS);
+        exit(-1);
+      }
+      args->link_inputs[args->num_link_inputs].path = arg;
+      args->link_inputs[args->num_link_inputs].offset = args->link_offset;
+      ++args->num_link_inputs;
+      args->link_offset = 0;
       continue;
     }
 
@@ -1369,30 +8507,274 @@ ProcessArgs(struct global_args* args, int argc, char* argv[])
         ++argi;
       }
     }
+
+    else if (strcmp(arg, "--renumber") == 0)
+    {
+      args->renumber = TRUE;
+    }
+
+    else if (strcmp(arg, "--fold-constants") == 0)
+    {
+      args->fold_constants = TRUE;
+    }
+
+    else if (strcmp(arg, "--cost-report") == 0)
+    {
+      args->cost_report = TRUE;
+    }
+
+    else if (strcmp(arg, "--skip-unchanged") == 0)
+    {
+      args->skip_unchanged = TRUE;
+    }
+
+    else if (strcmp(arg, "--memory-report") == 0)
+    {
+      args->memory_report = TRUE;
+    }
+
+    else if (strcmp(arg, "--max-size") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      char* end;
+      args->max_size = strtoul(argv[argi+1], &end, 0);
+      if (*end ||
+          !args->max_size)
+      {
+        fprintf(stderr, "Option %s requires a positive number of bytes\n", arg);
+        exit(-1);
+      }
+      ++argi;
+    }
+
+    else if (strcmp(arg, "--pack") == 0)
+    {
+      args->pack = TRUE;
+    }
+
+    else if (strcmp(arg, "--alloc-stats") == 0)
+    {
+      args->show_alloc_stats = TRUE;
+    }
+
+    else if (strcmp(arg, "--max-alloc-per-line") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      args->max_alloc_per_line = strtoul(argv[argi+1], 0, 0);
+      ++argi;
+    }
+
+    else if (strcmp(arg, "--order-variables") == 0)
+    {
+      args->order_variables = TRUE;
+    }
+
+    else if (strcmp(arg, "--framed") == 0)
+    {
+      args->framed = TRUE;
+    }
+
+    else if (strcmp(arg, "--link") == 0)
+    {
+      args->link = TRUE;
+    }
+
+    else if (strcmp(arg, "--offset") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      args->link_offset = atoi(argv[argi+1]);
+      ++argi;
+    }
+
+    else if (strcmp(arg, "--dialect") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      args->dialect = Dialect_Find(argv[argi+1]);
+      if (!args->dialect)
+      {
+        fprintf(stderr, "Unknown dialect \"%s\" (expected v2, 3.5, 7.0 or simons)\n", argv[argi+1]);
+        exit(-1);
+      }
+      ++argi;
+    }
+
+    else if (strcmp(arg, "--lsp") == 0)
+    {
+      args->lsp = TRUE;
+    }
+
+    else if (strcmp(arg, "--fuzz") == 0 ||
+             strcmp(arg, "--seed") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      u64 value = strtoull(argv[argi+1], 0, 0);
+      ++argi;
+      if (strcmp(arg, "--fuzz") == 0)
+        args->fuzz_iterations = value;
+      else
+        args->fuzz_seed = value;
+    }
+
+    else if (strcmp(arg, "--prgdc") == 0)
+    {
+      if (argi+1 >= argc)
+      {
+        fprintf(stderr, "Option %s requires an argument\n", arg);
+        exit(-1);
+      }
+      args->prgdc_path = argv[argi+1];
+      ++argi;
+    }
   }
 }
 
 
 
+/*
+  Alloc_Finish
+
+  Print the allocation statistics if requested, and check the peak
+  heap against the --max-alloc-per-line budget. Returns status, or -1
+  if the budget is exceeded.
+*/
+int
+Alloc_Finish(int status)
+{
+  if (args.show_alloc_stats)
+    Alloc_PrintStats(stderr);
+  if (args.max_alloc_per_line &&
+      alloc_stats.input_lines &&
+      alloc_stats.peak_live_bytes > (u64)args.max_alloc_per_line * alloc_stats.input_lines)
+  {
+    fprintf(stderr, "Peak heap of %llu bytes exceeds the budget of %u bytes per line (%llu lines)\n",
+            (unsigned long long)alloc_stats.peak_live_bytes, args.max_alloc_per_line,
+            (unsigned long long)alloc_stats.input_lines);
+    return -1;
+  }
+  return status;
+}
+
+
 int
 main(int argc, char* argv[])
 {
   ProcessArgs(&args, argc, argv);
+  if (args.dialect &&
+      args.dialect->keywords)
+  {
+    /* These analyze and rewrite the token stream, and only know V2 */
+    if (args.renumber ||
+        args.fold_constants ||
+        args.cost_report ||
+        args.order_variables ||
+        args.fuzz_iterations)
+    {
+      fprintf(stderr, "--renumber, --fold-constants, --cost-report, --order-variables and --fuzz only support --dialect v2\n");
+      exit(-1);
+    }
+    Dialect_BuildMatcher(args.dialect);
+  }
+  if (args.pack &&
+      ((args.load_address &&
+        args.load_address != DEFAULT_LOAD_ADDRESS) ||
+       args.framed))
+  {
+    fprintf(stderr, "--pack needs the default load address and can't be combined with --framed\n");
+    exit(-1);
+  }
+  if (args.lsp)
+    return Alloc_Finish(RunLanguageServer());
+
+  if (args.fuzz_iterations)
+    return Alloc_Finish(DoFuzz(args.fuzz_iterations, args.fuzz_seed,
+                               args.prgdc_path ? args.prgdc_path : "prgdc") ? 0 : 1);
+
+  if (args.framed)
+  {
+    CompileFrames(args.load_address);
+    return Alloc_Finish(0);
+  }
+
+  if (args.link)
+  {
+    if (!args.prg_path)
+    {
+      fprintf(stderr, "Please provide an output file path for --link\n");
+      exit(-1);
+    }
+    LinkPrograms(&program, args.link_inputs, args.num_link_inputs);
+    FILE* message_fp = (strcmp(args.prg_path, "-") == 0) ? stderr : stdout;
+    fprintf(message_fp, "Linked %u programs\n", args.num_link_inputs);
+    struct memory_footprint footprint;
+    BOOL unchanged;
+    BOOL written = WritePRG(&program, args.load_address, args.prg_path, &footprint,
+                            &unchanged);
+    if (args.memory_report &&
+        footprint.program_bytes)
+      Program_PrintMemoryReport(message_fp, &footprint);
+    if (!written)
+      return Alloc_Finish(-1);
+    if (unchanged)
+      fprintf(message_fp, "PRG file \"%s\" is unchanged\n", args.prg_path);
+    else if (message_fp == stdout)
+      printf("Wrote PRG file to \"%s\"\n", args.prg_path);
+    return Alloc_Finish(0);
+  }
+
   if (!args.src_path)
   {
     fprintf(stderr, "Please provide a path to a BASIC source file\n");
     exit(-1);
   }
+  FixupOutputPath(&args);
+
+  /* Keep stdout clean when the PRG is written to it */
+  FILE* message_fp = stdout;
+  if (strcmp(args.prg_path, "-") == 0)
+    message_fp = stderr;
 
   struct source_file source_file;
   memset(&source_file, 0, sizeof(source_file));
   LoadSrc(&source_file, args.src_path);
   Program_Compile(&program, &source_file);
-  printf("Compilation successful!\n");
-  FixupOutputPath(&args);
-  if (WritePRG(&program, args.load_address, args.prg_path))
+  struct memory_footprint footprint;
+  BOOL unchanged;
+  BOOL written = WritePRG(&program, args.load_address, args.prg_path, &footprint,
+                          &unchanged);
+  if (written)
+    fprintf(message_fp, "Compilation successful!\n");
+  if (args.cost_report)
+    Program_PrintCostReport(message_fp, &program);
+  if (args.memory_report &&
+      footprint.program_bytes)
+    Program_PrintMemoryReport(message_fp, &footprint);
+  if (!written)
+    return Alloc_Finish(-1);
+  if (unchanged)
+    fprintf(message_fp, "PRG file \"%s\" is unchanged\n", args.prg_path);
+  else if (message_fp == stdout)
     printf("Wrote PRG file to \"%s\"\n", args.prg_path);
 
-  return 0;
+  return Alloc_Finish(0);
 }
 
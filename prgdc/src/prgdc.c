@@ -4,23 +4,214 @@
   A simple Commodore 64 PRG file decompiler.
  */
 
+/* For fileno and open_memstream, where the host has them */
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
+/* The peak RSS of --alloc-stats and the in-memory listings of
+   --framed use POSIX; other hosts build without them or with plain
+   fallbacks */
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX 1
+#include <sys/resource.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
 
+typedef int32_t   s32;
 
 typedef uint8_t   u8;
 typedef uint16_t  u16;
+typedef uint32_t  u32;
+typedef uint64_t  u64;
 
 typedef u8  byte_t;
 
+#ifndef BOOL
+#define BOOL int
+#endif
+#ifndef TRUE
+#define TRUE  1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
 
 #define GETWORD(buf,i) ((buf[i+1] << 8) | buf[i])
 
 
+/*
+  Allocation accounting
+
+  All heap allocations go through counting wrappers, which keep the
+  size of every block in a small header in front of it. This tracks
+  the number of allocations, the bytes allocated and the live heap
+  bytes, including their peak, so that --alloc-stats can report them
+  at exit and --max-alloc-per-line can hold the peak to a budget per
+  input line. Memory the C library allocates itself isn't counted.
+*/
+#define ALLOC_HEADER_SIZE  16
+
+struct alloc_stats
+{
+  u64 allocations;
+  u64 bytes_allocated;
+  u64 live_bytes;
+  u64 peak_live_bytes;
+  u64 input_lines;
+};
+struct alloc_stats alloc_stats;
+
+
+/*
+  Alloc_Count
+
+  Record size in the header of a block just allocated with room for
+  the header, and count it. Returns the memory after the header, or 0
+  if the allocation failed.
+*/
+void*
+Alloc_Count(byte_t* header, size_t size)
+{
+  if (!header)
+    return 0;
+  memcpy(header, &size, sizeof(size));
+  ++alloc_stats.allocations;
+  alloc_stats.bytes_allocated += size;
+  alloc_stats.live_bytes += size;
+  if (alloc_stats.live_bytes > alloc_stats.peak_live_bytes)
+    alloc_stats.peak_live_bytes = alloc_stats.live_bytes;
+  return header + ALLOC_HEADER_SIZE;
+}
+
+
+/*
+  Alloc_BlockSize
+
+  Returns the size of a block allocated by the counting wrappers.
+*/
+size_t
+Alloc_BlockSize(void* ptr)
+{
+  size_t size;
+  memcpy(&size, (byte_t*)ptr - ALLOC_HEADER_SIZE, sizeof(size));
+  return size;
+}
+
+
+/*
+  Counted_Malloc
+
+  malloc, counted.
+*/
+void*
+Counted_Malloc(size_t size)
+{
+  return Alloc_Count((byte_t*)malloc(ALLOC_HEADER_SIZE + size), size);
+}
+
+
+/*
+  Counted_Calloc
+
+  calloc, counted.
+*/
+void*
+Counted_Calloc(size_t count, size_t size)
+{
+  if (size &&
+      count > (SIZE_MAX - ALLOC_HEADER_SIZE) / size)
+    return 0;
+  return Alloc_Count((byte_t*)calloc(1, ALLOC_HEADER_SIZE + count * size), count * size);
+}
+
+
+/*
+  Counted_Realloc
+
+  realloc, counted. A reallocation counts as an allocation of the new
+  size.
+*/
+void*
+Counted_Realloc(void* ptr, size_t size)
+{
+  if (!ptr)
+    return Counted_Malloc(size);
+  size_t old_size = Alloc_BlockSize(ptr);
+  byte_t* header = (byte_t*)realloc((byte_t*)ptr - ALLOC_HEADER_SIZE,
+                                    ALLOC_HEADER_SIZE + size);
+  if (!header)
+    return 0;
+  alloc_stats.live_bytes -= old_size;
+  return Alloc_Count(header, size);
+}
+
+
+/*
+  Counted_Free
+
+  free, counted.
+*/
+void
+Counted_Free(void* ptr)
+{
+  if (!ptr)
+    return;
+  alloc_stats.live_bytes -= Alloc_BlockSize(ptr);
+  free((byte_t*)ptr - ALLOC_HEADER_SIZE);
+}
+
+
+/*
+  Alloc_PrintStats
+
+  Print the allocation statistics and, where the host reports it, the
+  peak resident set size of the process.
+*/
+void
+Alloc_PrintStats(FILE* fp)
+{
+  fprintf(fp, "Allocations:      %llu (%llu bytes)\n",
+          (unsigned long long)alloc_stats.allocations,
+          (unsigned long long)alloc_stats.bytes_allocated);
+  fprintf(fp, "Peak heap:        %llu bytes",
+          (unsigned long long)alloc_stats.peak_live_bytes);
+  if (alloc_stats.input_lines)
+    fprintf(fp, " (%llu per line, %llu lines)",
+            (unsigned long long)(alloc_stats.peak_live_bytes / alloc_stats.input_lines),
+            (unsigned long long)alloc_stats.input_lines);
+  fprintf(fp, "\n");
+  fprintf(fp, "Leaked at exit:   %llu bytes\n",
+          (unsigned long long)alloc_stats.live_bytes);
+#if defined(HAVE_POSIX)
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  getrusage(RUSAGE_SELF, &usage);
+  /* ru_maxrss is in kilobytes on Linux and the BSDs, but in bytes on
+     macOS */
+#if defined(__APPLE__)
+  fprintf(fp, "Peak RSS:         %ld KB\n", (long)(usage.ru_maxrss / 1024));
+#else
+  fprintf(fp, "Peak RSS:         %ld KB\n", (long)usage.ru_maxrss);
+#endif
+#endif
+}
+
+
 /* Translation table for keycodes between modern ASCII standard and
    C64 PETSCII */
 char* PETSCII_table[] =
@@ -366,6 +557,405 @@ char* token_list[] =
 };
 
 
+/* Keywords that BASIC dialects add to the V2 set. A prefix of 0 means
+   a one-byte token; otherwise the keyword is tokenized as the two
+   bytes prefix, token. */
+struct dialect_keyword
+{
+  char*  keyword;
+  byte_t prefix;
+  byte_t token;
+};
+
+/* BASIC 3.5 (C16/Plus4) keywords following the V2 set */
+struct dialect_keyword basic35_keywords[] =
+{
+    { "RGR",       0x00, 0xCC },
+    { "RCLR",      0x00, 0xCD },
+    { "RLUM",      0x00, 0xCE },
+    { "JOY",       0x00, 0xCF },
+    { "RDOT",      0x00, 0xD0 },
+    { "DEC",       0x00, 0xD1 },
+    { "HEX$",      0x00, 0xD2 },
+    { "ERR$",      0x00, 0xD3 },
+    { "INSTR",     0x00, 0xD4 },
+    { "ELSE",      0x00, 0xD5 },
+    { "RESUME",    0x00, 0xD6 },
+    { "TRAP",      0x00, 0xD7 },
+    { "TRON",      0x00, 0xD8 },
+    { "TROFF",     0x00, 0xD9 },
+    { "SOUND",     0x00, 0xDA },
+    { "VOL",       0x00, 0xDB },
+    { "AUTO",      0x00, 0xDC },
+    { "PUDEF",     0x00, 0xDD },
+    { "GRAPHIC",   0x00, 0xDE },
+    { "PAINT",     0x00, 0xDF },
+    { "CHAR",      0x00, 0xE0 },
+    { "BOX",       0x00, 0xE1 },
+    { "CIRCLE",    0x00, 0xE2 },
+    { "GSHAPE",    0x00, 0xE3 },
+    { "SSHAPE",    0x00, 0xE4 },
+    { "DRAW",      0x00, 0xE5 },
+    { "LOCATE",    0x00, 0xE6 },
+    { "COLOR",     0x00, 0xE7 },
+    { "SCNCLR",    0x00, 0xE8 },
+    { "SCALE",     0x00, 0xE9 },
+    { "HELP",      0x00, 0xEA },
+    { "DO",        0x00, 0xEB },
+    { "LOOP",      0x00, 0xEC },
+    { "EXIT",      0x00, 0xED },
+    { "DIRECTORY", 0x00, 0xEE },
+    { "DSAVE",     0x00, 0xEF },
+    { "DLOAD",     0x00, 0xF0 },
+    { "HEADER",    0x00, 0xF1 },
+    { "SCRATCH",   0x00, 0xF2 },
+    { "COLLECT",   0x00, 0xF3 },
+    { "COPY",      0x00, 0xF4 },
+    { "RENAME",    0x00, 0xF5 },
+    { "BACKUP",    0x00, 0xF6 },
+    { "DELETE",    0x00, 0xF7 },
+    { "RENUMBER",  0x00, 0xF8 },
+    { "KEY",       0x00, 0xF9 },
+    { "MONITOR",   0x00, 0xFA },
+    { "USING",     0x00, 0xFB },
+    { "UNTIL",     0x00, 0xFC },
+    { "WHILE",     0x00, 0xFD },
+    { 0 }
+};
+
+
+/* BASIC 7.0 (C128) keywords. 0xCE and 0xFE prefix two-byte tokens
+   in place of 3.5's RLUM and the unused 0xFE. */
+struct dialect_keyword basic70_keywords[] =
+{
+    { "RGR",       0x00, 0xCC },
+    { "RCLR",      0x00, 0xCD },
+    { "JOY",       0x00, 0xCF },
+    { "RDOT",      0x00, 0xD0 },
+    { "DEC",       0x00, 0xD1 },
+    { "HEX$",      0x00, 0xD2 },
+    { "ERR$",      0x00, 0xD3 },
+    { "INSTR",     0x00, 0xD4 },
+    { "ELSE",      0x00, 0xD5 },
+    { "RESUME",    0x00, 0xD6 },
+    { "TRAP",      0x00, 0xD7 },
+    { "TRON",      0x00, 0xD8 },
+    { "TROFF",     0x00, 0xD9 },
+    { "SOUND",     0x00, 0xDA },
+    { "VOL",       0x00, 0xDB },
+    { "AUTO",      0x00, 0xDC },
+    { "PUDEF",     0x00, 0xDD },
+    { "GRAPHIC",   0x00, 0xDE },
+    { "PAINT",     0x00, 0xDF },
+    { "CHAR",      0x00, 0xE0 },
+    { "BOX",       0x00, 0xE1 },
+    { "CIRCLE",    0x00, 0xE2 },
+    { "GSHAPE",    0x00, 0xE3 },
+    { "SSHAPE",    0x00, 0xE4 },
+    { "DRAW",      0x00, 0xE5 },
+    { "LOCATE",    0x00, 0xE6 },
+    { "COLOR",     0x00, 0xE7 },
+    { "SCNCLR",    0x00, 0xE8 },
+    { "SCALE",     0x00, 0xE9 },
+    { "HELP",      0x00, 0xEA },
+    { "DO",        0x00, 0xEB },
+    { "LOOP",      0x00, 0xEC },
+    { "EXIT",      0x00, 0xED },
+    { "DIRECTORY", 0x00, 0xEE },
+    { "DSAVE",     0x00, 0xEF },
+    { "DLOAD",     0x00, 0xF0 },
+    { "HEADER",    0x00, 0xF1 },
+    { "SCRATCH",   0x00, 0xF2 },
+    { "COLLECT",   0x00, 0xF3 },
+    { "COPY",      0x00, 0xF4 },
+    { "RENAME",    0x00, 0xF5 },
+    { "BACKUP",    0x00, 0xF6 },
+    { "DELETE",    0x00, 0xF7 },
+    { "RENUMBER",  0x00, 0xF8 },
+    { "KEY",       0x00, 0xF9 },
+    { "MONITOR",   0x00, 0xFA },
+    { "USING",     0x00, 0xFB },
+    { "UNTIL",     0x00, 0xFC },
+    { "WHILE",     0x00, 0xFD },
+    { "POT",       0xCE, 0x02 },
+    { "BUMP",      0xCE, 0x03 },
+    { "PEN",       0xCE, 0x04 },
+    { "RSPPOS",    0xCE, 0x05 },
+    { "RSPRITE",   0xCE, 0x06 },
+    { "RSPCOLOR",  0xCE, 0x07 },
+    { "XOR",       0xCE, 0x08 },
+    { "RWINDOW",   0xCE, 0x09 },
+    { "POINTER",   0xCE, 0x0A },
+    { "BANK",      0xFE, 0x02 },
+    { "FILTER",    0xFE, 0x03 },
+    { "PLAY",      0xFE, 0x04 },
+    { "TEMPO",     0xFE, 0x05 },
+    { "MOVSPR",    0xFE, 0x06 },
+    { "SPRITE",    0xFE, 0x07 },
+    { "SPRCOLOR",  0xFE, 0x08 },
+    { "RREG",      0xFE, 0x09 },
+    { "ENVELOPE",  0xFE, 0x0A },
+    { "SLEEP",     0xFE, 0x0B },
+    { "CATALOG",   0xFE, 0x0C },
+    { "DOPEN",     0xFE, 0x0D },
+    { "APPEND",    0xFE, 0x0E },
+    { "DCLOSE",    0xFE, 0x0F },
+    { "BSAVE",     0xFE, 0x10 },
+    { "BLOAD",     0xFE, 0x11 },
+    { "RECORD",    0xFE, 0x12 },
+    { "CONCAT",    0xFE, 0x13 },
+    { "DVERIFY",   0xFE, 0x14 },
+    { "DCLEAR",    0xFE, 0x15 },
+    { "SPRSAV",    0xFE, 0x16 },
+    { "COLLISION", 0xFE, 0x17 },
+    { "BEGIN",     0xFE, 0x18 },
+    { "BEND",      0xFE, 0x19 },
+    { "WINDOW",    0xFE, 0x1A },
+    { "BOOT",      0xFE, 0x1B },
+    { "WIDTH",     0xFE, 0x1C },
+    { "SPRDEF",    0xFE, 0x1D },
+    { "QUIT",      0xFE, 0x1E },
+    { "STASH",     0xFE, 0x1F },
+    { "FETCH",     0xFE, 0x21 },
+    { "SWAP",      0xFE, 0x23 },
+    { "OFF",       0xFE, 0x24 },
+    { "FAST",      0xFE, 0x25 },
+    { "SLOW",      0xFE, 0x26 },
+    { 0 }
+};
+
+
+/* Simons' BASIC keywords, all of them 0x64-prefixed two-byte tokens.
+   Unassigned tokens are left out. */
+struct dialect_keyword simons_keywords[] =
+{
+    { "HIRES",     0x64, 0x01 },
+    { "PLOT",      0x64, 0x02 },
+    { "LINE",      0x64, 0x03 },
+    { "BLOCK",     0x64, 0x04 },
+    { "FCHR",      0x64, 0x05 },
+    { "FCOL",      0x64, 0x06 },
+    { "FILL",      0x64, 0x07 },
+    { "REC",       0x64, 0x08 },
+    { "ROT",       0x64, 0x09 },
+    { "DRAW",      0x64, 0x0A },
+    { "CHAR",      0x64, 0x0B },
+    { "HI COL",    0x64, 0x0C },
+    { "INV",       0x64, 0x0D },
+    { "FRAC",      0x64, 0x0E },
+    { "MOVE",      0x64, 0x0F },
+    { "PLACE",     0x64, 0x10 },
+    { "UPB",       0x64, 0x11 },
+    { "UPW",       0x64, 0x12 },
+    { "LEFTW",     0x64, 0x13 },
+    { "LEFTB",     0x64, 0x14 },
+    { "DOWNB",     0x64, 0x15 },
+    { "DOWNW",     0x64, 0x16 },
+    { "RIGHTB",    0x64, 0x17 },
+    { "RIGHTW",    0x64, 0x18 },
+    { "MULTI",     0x64, 0x19 },
+    { "COLOUR",    0x64, 0x1A },
+    { "MMOB",      0x64, 0x1B },
+    { "BFLASH",    0x64, 0x1C },
+    { "MOB SET",   0x64, 0x1D },
+    { "MUSIC",     0x64, 0x1E },
+    { "FLASH",     0x64, 0x1F },
+    { "REPEAT",    0x64, 0x20 },
+    { "PLAY",      0x64, 0x21 },
+    { "CENTRE",    0x64, 0x23 },
+    { "ENVELOPE",  0x64, 0x24 },
+    { "CGOTO",     0x64, 0x25 },
+    { "WAVE",      0x64, 0x26 },
+    { "FETCH",     0x64, 0x27 },
+    { "AT(",       0x64, 0x28 },
+    { "UNTIL",     0x64, 0x29 },
+    { "USE",       0x64, 0x2C },
+    { "GLOBAL",    0x64, 0x2E },
+    { "RESET",     0x64, 0x30 },
+    { "PROC",      0x64, 0x31 },
+    { "CALL",      0x64, 0x32 },
+    { "EXEC",      0x64, 0x33 },
+    { "END PROC",  0x64, 0x34 },
+    { "EXIT",      0x64, 0x35 },
+    { "END LOOP",  0x64, 0x36 },
+    { "ON KEY",    0x64, 0x37 },
+    { "DISABLE",   0x64, 0x38 },
+    { "RESUME",    0x64, 0x39 },
+    { "LOOP",      0x64, 0x3A },
+    { "DELAY",     0x64, 0x3B },
+    { "SECURE",    0x64, 0x40 },
+    { "DISAPA",    0x64, 0x41 },
+    { "CIRCLE",    0x64, 0x42 },
+    { "ON ERROR",  0x64, 0x43 },
+    { "NO ERROR",  0x64, 0x44 },
+    { "LOCAL",     0x64, 0x45 },
+    { "RCOMP",     0x64, 0x46 },
+    { "ELSE",      0x64, 0x47 },
+    { "RETRACE",   0x64, 0x48 },
+    { "TRACE",     0x64, 0x49 },
+    { "DIR",       0x64, 0x4A },
+    { "PAGE",      0x64, 0x4B },
+    { "DUMP",      0x64, 0x4C },
+    { "FIND",      0x64, 0x4D },
+    { "OPTION",    0x64, 0x4E },
+    { "AUTO",      0x64, 0x4F },
+    { "OLD",       0x64, 0x50 },
+    { "JOY",       0x64, 0x51 },
+    { "MOD",       0x64, 0x52 },
+    { "DIV",       0x64, 0x53 },
+    { "DUP",       0x64, 0x55 },
+    { "INKEY",     0x64, 0x56 },
+    { "INST",      0x64, 0x57 },
+    { "TEST",      0x64, 0x58 },
+    { "LIN",       0x64, 0x59 },
+    { "EXOR",      0x64, 0x5A },
+    { "INSERT",    0x64, 0x5B },
+    { "POT",       0x64, 0x5C },
+    { "PENX",      0x64, 0x5D },
+    { "PENY",      0x64, 0x5F },
+    { "SOUND",     0x64, 0x60 },
+    { "GRAPHICS",  0x64, 0x61 },
+    { "DESIGN",    0x64, 0x62 },
+    { "RLOCMOB",   0x64, 0x63 },
+    { "CMOB",      0x64, 0x64 },
+    { "BCKGNDS",   0x64, 0x65 },
+    { "PAUSE",     0x64, 0x66 },
+    { "NRM",       0x64, 0x67 },
+    { "MOB OFF",   0x64, 0x68 },
+    { "OFF",       0x64, 0x69 },
+    { "ANGL",      0x64, 0x6A },
+    { "ARC",       0x64, 0x6B },
+    { "COLD",      0x64, 0x6C },
+    { "SCRSV",     0x64, 0x6D },
+    { "SCRLD",     0x64, 0x6E },
+    { "TEXT",      0x64, 0x6F },
+    { "CSET",      0x64, 0x70 },
+    { "VOL",       0x64, 0x71 },
+    { "DISK",      0x64, 0x72 },
+    { "HRDCPY",    0x64, 0x73 },
+    { "KEY",       0x64, 0x74 },
+    { "PAINT",     0x64, 0x75 },
+    { "LOW COL",   0x64, 0x76 },
+    { "COPY",      0x64, 0x77 },
+    { "MERGE",     0x64, 0x78 },
+    { "RENUMBER",  0x64, 0x79 },
+    { "MEM",       0x64, 0x7A },
+    { "DETECT",    0x64, 0x7B },
+    { "CHECK",     0x64, 0x7C },
+    { "DISPLAY",   0x64, 0x7D },
+    { "ERR",       0x64, 0x7E },
+    { "OUT",       0x64, 0x7F },
+    { 0 }
+};
+
+/* Dialects selectable with --dialect. V2 adds nothing to token_list. */
+struct dialect
+{
+  char*                   name;
+  struct dialect_keyword* keywords;
+};
+
+struct dialect dialects[] =
+{
+    { "v2",     0 },
+    { "3.5",    basic35_keywords },
+    { "7.0",    basic70_keywords },
+    { "simons", simons_keywords },
+};
+
+/* Decode tables of the selected dialect, indexed by token byte. A
+   prefix byte's entry in prefixed points to the keywords of its
+   two-byte tokens; all entries are NULL with V2. */
+struct dialect_decoder
+{
+  char*  single[256];
+  char** prefixed[256];
+};
+struct dialect_decoder dialect_decoder;
+
+/* Token values, for code that needs to recognize specific tokens */
+enum basic_token
+{
+  TOKEN_END      = 0x80,
+  TOKEN_FOR      = 0x81,
+  TOKEN_NEXT     = 0x82,
+  TOKEN_DATA     = 0x83,
+  TOKEN_INPUT_FILE = 0x84,
+  TOKEN_INPUT    = 0x85,
+  TOKEN_DIM      = 0x86,
+  TOKEN_READ     = 0x87,
+  TOKEN_LET      = 0x88,
+  TOKEN_GOTO     = 0x89,
+  TOKEN_RUN      = 0x8a,
+  TOKEN_IF       = 0x8b,
+  TOKEN_RESTORE  = 0x8c,
+  TOKEN_GOSUB    = 0x8d,
+  TOKEN_RETURN   = 0x8e,
+  TOKEN_REM      = 0x8f,
+  TOKEN_STOP     = 0x90,
+  TOKEN_ON       = 0x91,
+  TOKEN_WAIT     = 0x92,
+  TOKEN_LOAD     = 0x93,
+  TOKEN_SAVE     = 0x94,
+  TOKEN_VERIFY   = 0x95,
+  TOKEN_DEF      = 0x96,
+  TOKEN_POKE     = 0x97,
+  TOKEN_PRINT_FILE = 0x98,
+  TOKEN_PRINT    = 0x99,
+  TOKEN_CONT     = 0x9a,
+  TOKEN_LIST     = 0x9b,
+  TOKEN_CLR      = 0x9c,
+  TOKEN_CMD      = 0x9d,
+  TOKEN_SYS      = 0x9e,
+  TOKEN_OPEN     = 0x9f,
+  TOKEN_CLOSE    = 0xa0,
+  TOKEN_GET      = 0xa1,
+  TOKEN_NEW      = 0xa2,
+  TOKEN_TAB      = 0xa3,
+  TOKEN_TO       = 0xa4,
+  TOKEN_FN       = 0xa5,
+  TOKEN_SPC      = 0xa6,
+  TOKEN_THEN     = 0xa7,
+  TOKEN_NOT      = 0xa8,
+  TOKEN_STEP     = 0xa9,
+  TOKEN_PLUS     = 0xaa,
+  TOKEN_MINUS    = 0xab,
+  TOKEN_MULTIPLY = 0xac,
+  TOKEN_DIVIDE   = 0xad,
+  TOKEN_POWER    = 0xae,
+  TOKEN_AND      = 0xaf,
+  TOKEN_OR       = 0xb0,
+  TOKEN_GREATER  = 0xb1,
+  TOKEN_EQUAL    = 0xb2,
+  TOKEN_LESS     = 0xb3,
+  TOKEN_SGN      = 0xb4,
+  TOKEN_INT      = 0xb5,
+  TOKEN_ABS      = 0xb6,
+  TOKEN_USR      = 0xb7,
+  TOKEN_FRE      = 0xb8,
+  TOKEN_POS      = 0xb9,
+  TOKEN_SQR      = 0xba,
+  TOKEN_RND      = 0xbb,
+  TOKEN_LOG      = 0xbc,
+  TOKEN_EXP      = 0xbd,
+  TOKEN_COS      = 0xbe,
+  TOKEN_SIN      = 0xbf,
+  TOKEN_TAN      = 0xc0,
+  TOKEN_ATN      = 0xc1,
+  TOKEN_PEEK     = 0xc2,
+  TOKEN_LEN      = 0xc3,
+  TOKEN_STR      = 0xc4,
+  TOKEN_VAL      = 0xc5,
+  TOKEN_ASC      = 0xc6,
+  TOKEN_CHR      = 0xc7,
+  TOKEN_LEFT     = 0xc8,
+  TOKEN_RIGHT    = 0xc9,
+  TOKEN_MID      = 0xca,
+  TOKEN_GO       = 0xcb,
+  TOKEN_PI       = 0xff
+};
+
+
 /* Maximum line length in C64 BASIC is 80 chars (two physical 40-char
    lines). Allocate a very large buffer for potential insertion of
    PETSCII placeholder strings. */
@@ -391,105 +981,371 @@ TranslateToken(byte_t token)
 }
 
 /*
-  MemInsert
-  
-  Insert len bytes from src into byte buffer dst at offset, replacing
-  the single byte at offset, and all bytes after offset by len to
-  accomodate the insertion of src.
-  
-  NOTE: This function *DOES NOT* perform any bounds checking. Use with
-  caution.
+  Dialect_Find
 
+  Return the dialect named name, or NULL if there is none.
+*/
+struct dialect*
+Dialect_Find(char* name)
+{
+  for (u32 i = 0;
+       i < sizeof(dialects) / sizeof(dialects[0]);
+       ++i)
+  {
+    if (strcmp(dialects[i].name, name) == 0)
+      return &dialects[i];
+  }
+  return 0;
+}
+
+/*
+  Dialect_BuildDecoder
+
+  Fill dialect_decoder with the keywords of dialect.
 */
 void
-MemInsert(byte_t* dest, byte_t* src, int offset, u16 len)
+Dialect_BuildDecoder(struct dialect* dialect)
 {
-  int line_end = 0;
-  while (dest[line_end++]);
-  for (int i = line_end;
-       i >= offset;
-       --i)
+  for (struct dialect_keyword* keyword = dialect->keywords;
+       keyword && keyword->keyword;
+       ++keyword)
   {
-    dest[i+len] = dest[i+1];
+    if (!keyword->prefix)
+    {
+      dialect_decoder.single[keyword->token] = keyword->keyword;
+      continue;
+    }
+    if (!dialect_decoder.prefixed[keyword->prefix])
+      dialect_decoder.prefixed[keyword->prefix] = (char**)Counted_Calloc(256, sizeof(char*));
+    dialect_decoder.prefixed[keyword->prefix][keyword->token] = keyword->keyword;
   }
-  for (int i = 0;
-       i < len;
-       ++i)
+}
+
+/*
+  Dialect_TranslateToken
+
+  Translate the dialect token at the start of the len bytes of data
+  into the corresponding keyword. The token's length in bytes is
+  stored in token_len.
+
+  Returns the keyword, or NULL if data doesn't start with a token of
+  the selected dialect.
+*/
+char*
+Dialect_TranslateToken(byte_t* data, u32 len, u32* token_len)
+{
+  char** prefixed = dialect_decoder.prefixed[data[0]];
+  if (prefixed)
   {
-    dest[offset+i] = src[i];
+    *token_len = 2;
+    return (len >= 2) ? prefixed[data[1]] : 0;
   }
+  *token_len = 1;
+  return dialect_decoder.single[data[0]];
 }
 
+/* Listing text of one line: no keyword or placeholder is longer than
+   32 characters, so neither is the text of any byte */
+#define MAX_LISTING_LINE_LEN  (MAX_DATA_LINE_LEN * 32)
+
 /*
   TranslatePETSCIIToASCII
   
-  Translate a string from PETSCII encoding to ASCII, inserting
-  placeholder strings where necessary.
+  Translate a string from PETSCII encoding to ASCII into out, inserting
+  placeholder strings where necessary. out must have room for
+  MAX_LISTING_LINE_LEN characters.
 */
 void
-TranslatePETSCIIToASCII(char* line)
+TranslatePETSCIIToASCII(char* line, char* out)
 {
-  for (u16 i = 0;
-       i < strlen(line);
+  u32 write = 0;
+  for (u32 i = 0;
+       line[i];
        ++i)
   {
-    /* TODO: This is inefficient. Bytes in which PETSCII and ASCII are
-       equivalent should be checked for and skipped */
-    byte_t byte = (byte_t)line[i];
-    char* ascii = PETSCII_table[byte];
-    u16 ascii_len = strlen(ascii);
-    MemInsert((byte_t*)line, (byte_t*)ascii, i, ascii_len);
-    i += ascii_len - 1;
+    char* ascii = PETSCII_table[(byte_t)line[i]];
+    /* Most bytes translate to a single character */
+    if (ascii[0] &&
+        !ascii[1])
+    {
+      out[write++] = ascii[0];
+      continue;
+    }
+    u32 ascii_len = strlen(ascii);
+    memcpy(&out[write], ascii, ascii_len);
+    write += ascii_len;
+  }
+  out[write] = 0;
+}
+
+/*
+  Structural scanning
+
+  ScanLine finds all quotes and colons of a line at once, 32 or 16
+  bytes at a time where the compiler targets AVX2 or SSE2, and byte by
+  byte otherwise. A prefix XOR over the quote positions then gives the
+  mask of bytes within strings. Scanning code can skip quoted text and
+  find the next unquoted colon with a bit scan instead of walking the
+  line.
+*/
+#define SCAN_WORDS  ((MAX_DATA_LINE_LEN + 63) / 64)
+
+struct line_scan
+{
+  u32    len;
+  u64    quotes[SCAN_WORDS];
+  u64    colons[SCAN_WORDS];
+  u64    quoted[SCAN_WORDS];  /* Strings, including their quotes */
+};
+
+
+/*
+  LowestBit
+
+  Return the index of the lowest set bit in the non-zero value bits.
+*/
+u32
+LowestBit(u64 bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  u32 index = 0;
+  while (!(bits & 1))
+  {
+    bits >>= 1;
+    ++index;
+  }
+  return index;
+#endif
+}
+
+
+/*
+  ScanLine
+
+  Build the quote, colon and quoted masks of the len bytes of line.
+*/
+void
+ScanLine(byte_t* line, u32 len, struct line_scan* scan)
+{
+  u32 num_words = len / 64 + 1;
+  scan->len = len;
+  memset(scan->quotes, 0, num_words * sizeof(u64));
+  memset(scan->colons, 0, num_words * sizeof(u64));
+
+  u32 i = 0;
+#if defined(__AVX2__)
+  const __m256i quote_32 = _mm256_set1_epi8('"');
+  const __m256i colon_32 = _mm256_set1_epi8(':');
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)&line[i]);
+    u32 quotes = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote_32));
+    u32 colons = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, colon_32));
+    scan->quotes[i / 64] |= (u64)quotes << (i % 64);
+    scan->colons[i / 64] |= (u64)colons << (i % 64);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i quote_16 = _mm_set1_epi8('"');
+  const __m128i colon_16 = _mm_set1_epi8(':');
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&line[i]);
+    u32 quotes = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote_16));
+    u32 colons = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, colon_16));
+    scan->quotes[i / 64] |= (u64)quotes << (i % 64);
+    scan->colons[i / 64] |= (u64)colons << (i % 64);
+  }
+#endif
+  for (; i < len; ++i)
+  {
+    if (line[i] == '"')
+      scan->quotes[i / 64] |= 1ULL << (i % 64);
+    else if (line[i] == ':')
+      scan->colons[i / 64] |= 1ULL << (i % 64);
+  }
+
+  /* Each bit of the prefix XOR of the quote bits tells whether an odd
+     number of quotes precede or are at that byte: set from an opening
+     quote up to, but not including, its closing quote. An unterminated
+     string runs to the end of the line. */
+  u64 carry = 0;
+  for (u32 word = 0; word < num_words; ++word)
+  {
+    u64 inside = scan->quotes[word];
+    inside ^= inside << 1;
+    inside ^= inside << 2;
+    inside ^= inside << 4;
+    inside ^= inside << 8;
+    inside ^= inside << 16;
+    inside ^= inside << 32;
+    inside ^= carry;
+    scan->quoted[word] = inside | scan->quotes[word];
+    carry = 0 - (inside >> 63);
   }
 }
 
+
+/*
+  Scan_NextUnquoted
+
+  Return the position of the first byte at or after pos that isn't
+  part of a string, or the line length if there is none.
+*/
+u32
+Scan_NextUnquoted(struct line_scan* scan, u32 pos)
+{
+  for (u32 word = pos / 64;
+       word * 64 < scan->len;
+       ++word)
+  {
+    u64 bits = ~scan->quoted[word];
+    if (word == pos / 64)
+      bits &= ~0ULL << (pos % 64);
+    if (bits)
+    {
+      u32 next = word * 64 + LowestBit(bits);
+      return (next < scan->len) ? next : scan->len;
+    }
+  }
+  return scan->len;
+}
+
+
+/*
+  Scan_NextUnquotedColon
+
+  Return the position of the first colon at or after pos that isn't
+  part of a string, or the line length if there is none.
+*/
+u32
+Scan_NextUnquotedColon(struct line_scan* scan, u32 pos)
+{
+  for (u32 word = pos / 64;
+       word * 64 < scan->len;
+       ++word)
+  {
+    u64 bits = scan->colons[word] & ~scan->quoted[word];
+    if (word == pos / 64)
+      bits &= ~0ULL << (pos % 64);
+    if (bits)
+      return word * 64 + LowestBit(bits);
+  }
+  return scan->len;
+}
+
+
 /*
   DecodeLine
 
-  Replace all BASIC tokens in line with the corresponding BASIC
-  keyword/operator.
+  Translate all BASIC tokens in line into the corresponding BASIC
+  keyword/operator, writing the result to out, which must have room
+  for MAX_LISTING_LINE_LEN characters. Tokens are only decoded where
+  prgbc produces them: not within quotes, after REM or within DATA.
 */
 void
-DecodeLine(char* line)
+DecodeLine(char* line, char* out)
 {
-  for (u8 i = 0;
-       i < strlen(line);
-       ++i)
+  u32 len = strlen(line);
+  struct line_scan scan;
+  ScanLine((byte_t*)line, len, &scan);
+
+  u32 write = 0;
+  u32 i = 0;
+  while (i < len)
   {
     /* Don't decode tokens in quotes */
-    if (line[i] == '"')
+    u32 unquoted = Scan_NextUnquoted(&scan, i);
+    if (unquoted != i)
     {
-      while (line[++i] != '"');
-      ++i;
+      memcpy(&out[write], &line[i], unquoted - i);
+      write += unquoted - i;
+      i = unquoted;
+      continue;
     }
 
     byte_t byte = (unsigned char)line[i];
-    if (byte < 0x80) continue;
-    char* keyword = TranslateToken(byte);
+    char* keyword = 0;
+    u32 token_len = 1;
+    if (byte >= 0x80 ||
+        dialect_decoder.prefixed[byte])
+    {
+      keyword = TranslateToken(byte);
+      if (!keyword)
+        keyword = Dialect_TranslateToken((byte_t*)&line[i], 2, &token_len);
+    }
     if (!keyword)
     {
+      out[write++] = line[i++];
       continue;
     }
-    //  printf(": %s\n", keyword);
-    MemInsert((byte_t*)line, (byte_t*)keyword, i, strlen(keyword));
+    u32 keyword_len = strlen(keyword);
+    memcpy(&out[write], keyword, keyword_len);
+    write += keyword_len;
+    i += token_len;
+
+    /* Remainder of line after REM is plain text, and DATA runs up to
+       the next colon outside quotes */
+    u32 copy_end = i;
+    if (byte == TOKEN_REM)
+      copy_end = len;
+    else if (byte == TOKEN_DATA)
+      copy_end = Scan_NextUnquotedColon(&scan, i);
+    memcpy(&out[write], &line[i], copy_end - i);
+    write += copy_end - i;
+    i = copy_end;
+  }
+  out[write] = 0;
+}
+
+/*
+  ReadStream
+
+  Read fp to its end into a newly allocated buffer. The length read is
+  stored in len.
+
+  Return: Pointer to byte buffer
+*/
+byte_t*
+ReadStream(FILE* fp, u32* len)
+{
+  u32 capacity = 0x10000;
+  byte_t* buffer = (byte_t*)Counted_Malloc(capacity);
+  *len = 0;
+  size_t bytes_read;
+  while ((bytes_read = fread(&buffer[*len], 1, capacity - *len, fp)) > 0)
+  {
+    *len += bytes_read;
+    if (*len == capacity)
+    {
+      capacity *= 2;
+      buffer = (byte_t*)Counted_Realloc(buffer, capacity);
+    }
   }
+  return buffer;
 }
 
+
 /*
   LoadPRGFile
 
-  Load a PRG file located at path into a buffer.
+  Load a PRG file located at path into a buffer. The length of the
+  file is stored in len. A path of "-" reads from stdin.
 
   Return: Pointer to byte buffer
 */
 byte_t*
-LoadPRGFile(char* path)
+LoadPRGFile(char* path, u32* len)
 {
   if (!path)
   {
     fprintf(stderr, "Please provide a path to a PRG file\n");
     exit(-1);
   }
+  if (strcmp(path, "-") == 0)
+    return ReadStream(stdin, len);
 
   FILE* fp = fopen(path, "rb");
   if (!fp)
@@ -499,57 +1355,4584 @@ LoadPRGFile(char* path)
   }
   struct stat fs;
   fstat(fileno(fp), &fs);
-  byte_t* buffer = (byte_t*)malloc(fs.st_size);
+  byte_t* buffer = (byte_t*)Counted_Malloc(fs.st_size);
   fread(buffer, 1, fs.st_size, fp);
   fclose(fp);
+  *len = fs.st_size;
 
   return buffer;
 }
 
 
-int
-main(int argc, char* argv[])
+/*
+  Host interpreter
+
+  Executes a tokenized program directly from a 64 KB memory image, the
+  same way the C64 does: statements are decoded from the token stream
+  at run time, lines are found by following link pointers and
+  PEEK/POKE operate on the same memory the program is loaded into.
+
+  Numbers are evaluated in host double precision rather than the
+  C64's 40-bit floats, so results may differ in the last digits. SYS,
+  USR, WAIT and all device I/O are stubs. INPUT and GET are fed from a
+  script file; the run ends once the script is exhausted.
+
+  While running, every line accumulates the number of times it was
+  entered, the number of statements executed on it and an estimate of
+  the 6502 cycles the C64 interpreter would have spent on it.
+*/
+
+/* Rough 6502 cycle costs of the C64 BASIC ROM routines, used to
+   estimate where a program spends its time. These are ballpark
+   figures, good enough to rank lines against each other. */
+#define COST_CHRGET          20     /* Fetch one byte of program text */
+#define COST_STATEMENT       60     /* Statement dispatch */
+#define COST_LINE_HOP        30     /* Follow one link during line search */
+#define COST_NUMBER_DIGIT    250    /* Parse one digit of a literal */
+#define COST_VAR_LOOKUP      60     /* Variable lookup, plus... */
+#define COST_VAR_SCAN        25     /* ...per variable scanned before it */
+#define COST_ARRAY_ELEMENT   400    /* Subscript computation */
+#define COST_FADD            180
+#define COST_FMUL            1100
+#define COST_FDIV            1900
+#define COST_FCOMPARE        150
+#define COST_FPOWER          25000
+#define COST_TRANSCENDENTAL  15000  /* SQR, LOG, EXP, SIN, COS, TAN, ATN */
+#define COST_INT             250
+#define COST_STRING_ALLOC    300    /* Allocate a string temporary */
+#define COST_STRING_CHAR     15     /* Copy/compare one string character */
+#define COST_PRINT_CHAR      200    /* Output one character to the screen */
+#define COST_NUMBER_TO_STRING 2500
+
+#define PAL_CLOCK_HZ         985248
+#define JIFFY_CYCLES         (PAL_CLOCK_HZ / 60)
+
+#define INTERP_MEMORY_SIZE   0x10000
+#define MAX_STRING_LEN       255
+#define MAX_VARIABLES        1024
+#define MAX_ARRAYS           256
+#define MAX_ARRAY_DIMENSIONS 8
+#define MAX_FUNCTIONS        64
+#define MAX_STACK_FRAMES     64
+#define NUM_LINE_NUMBERS     64000
+#define DEFAULT_MAX_STATEMENTS 10000000
+
+enum value_type
 {
-  char* path = 0;
-  /* allows for future expansion with command line args */
-  for(u8 argi = 1;
-      argi < argc;
-      ++argi)
-  {
-    if (argv[argi][0] != '-')
-    {
-      /* NOTE: This should always save the *last* non-option
-         (i.e. does not begin with '-') argument as the path of the
-         PRG file to load. Is this really the desirable behavior? */
-      path = argv[argi];
-      continue;
-    }
-  }
+  VALUE_NUMBER,
+  VALUE_STRING
+};
 
-  byte_t* buffer = LoadPRGFile(path);
+struct value
+{
+  int    type;
+  double number;
+  u16    len;
+  char   string[MAX_STRING_LEN+1];
+};
 
-  u16 load_address = GETWORD(buffer, 0);
-  u16 line_offset = 2;
-  while (line_offset)
-  {
-    struct basic_line line;
-    memset(&line, 0, sizeof(struct basic_line));
+/* Only the first two characters of a name are significant */
+struct var_name
+{
+  char   c1;
+  char   c2;
+  char   suffix;    /* 0, '%' or '$' */
+};
 
-    u16 next_line_offset = GETWORD(buffer, line_offset);
-    if (!next_line_offset) break;
+struct variable
+{
+  struct var_name name;
+  struct value    value;
+};
 
-    /* grab line from buffer up to NULL terminator */
-    line.line_no = GETWORD(buffer, line_offset+2);
-    strncpy(line.data, (char*)&buffer[line_offset+4], MAX_DATA_LINE_LEN);
+struct array
+{
+  struct var_name name;
+  int    num_dims;
+  int    dims[MAX_ARRAY_DIMENSIONS];
+  int    num_elements;
+  struct value*   elements;
+};
 
-    DecodeLine(line.data);
-    TranslatePETSCIIToASCII(line.data);
-    printf("%u %s\n", line.line_no, line.data);
+struct function
+{
+  struct var_name name;
+  struct var_name param;
+  u16    expression;      /* Address of the function's expression */
+};
 
-    /* Compute next line offset into buffer. The +2 accounts for first
-       2 bytes of buffer (program load address) */
-    line_offset = next_line_offset - load_address + 2; 
-  }
+enum frame_type
+{
+  FRAME_FOR,
+  FRAME_GOSUB
+};
 
-  return 0;
+struct stack_frame
+{
+  int    type;
+  u16    txtptr;
+  u16    line_addr;
+  /* FOR only */
+  struct value*   var;
+  double limit;
+  double step;
+};
+
+struct line_profile
+{
+  u64    hits;
+  u64    statements;
+  u64    cycles;
+};
+
+struct interpreter
+{
+  byte_t memory[INTERP_MEMORY_SIZE];
+  u16    load_address;
+  u16    program_end;
+
+  u16    txtptr;
+  u16    line_addr;
+  BOOL   jumped;          /* Set whenever a new line is entered */
+  BOOL   running;
+  char*  stop_reason;
+
+  struct variable vars[MAX_VARIABLES];
+  int    num_vars;
+  struct array    arrays[MAX_ARRAYS];
+  int    num_arrays;
+  struct function functions[MAX_FUNCTIONS];
+  int    num_functions;
+  struct stack_frame stack[MAX_STACK_FRAMES];
+  int    stack_depth;
+
+  u16    data_ptr;        /* Next DATA item, or 0 to search */
+
+  FILE*  input;
+  int    print_column;
+  u32    rnd_seed;
+
+  u64    max_statements;
+  u64    total_statements;
+  u64    total_cycles;
+  struct line_profile* profile;
+};
+
+
+void Interp_PrintReport(struct interpreter* interp);
+void Interp_EvalExpression(struct interpreter* interp, struct value* out);
+
+
+/*
+  Interp_LineNumber
+
+  Return the line number of the line currently being executed.
+*/
+u16
+Interp_LineNumber(struct interpreter* interp)
+{
+  return GETWORD(interp->memory, interp->line_addr+2);
+}
+
+
+/*
+  Interp_Error
+
+  Report a BASIC runtime error the way the C64 does, print the profile
+  gathered so far and exit.
+*/
+void
+Interp_Error(struct interpreter* interp, char* error)
+{
+  static char message[64];
+  snprintf(message, sizeof(message), "?%s ERROR IN %u", error, Interp_LineNumber(interp));
+  fflush(stdout);
+  fprintf(stderr, "%s\n", message);
+  interp->stop_reason = message;
+  Interp_PrintReport(interp);
+  exit(-1);
+}
+
+
+/*
+  Interp_IsValidLink
+
+  Returns TRUE if the link of the line at addr points forward to
+  another line or to the end of the program inside the program image.
+  Like WriteListing, the interpreter only follows such links, so that
+  a corrupt or crafted link chain can't send it around in circles.
+*/
+BOOL
+Interp_IsValidLink(struct interpreter* interp, u16 addr)
+{
+  u16 link = GETWORD(interp->memory, addr);
+  if (link <= addr ||
+      (u32)link + 2 > interp->program_end)
+    return FALSE;
+  /* A line, rather than the end of the program, needs its line number */
+  return (!GETWORD(interp->memory, link) ||
+          (u32)link + 4 <= interp->program_end);
+}
+
+
+/*
+  Interp_Malformed
+
+  Stop at the line at addr, whose link isn't valid, print the profile
+  gathered so far and exit.
+*/
+void
+Interp_Malformed(struct interpreter* interp, u16 addr)
+{
+  static char message[80];
+  snprintf(message, sizeof(message), "malformed program: bad link $%04X in line %u at $%04X",
+           GETWORD(interp->memory, addr), GETWORD(interp->memory, addr+2), addr);
+  fflush(stdout);
+  fprintf(stderr, "%s\n", message);
+  interp->stop_reason = message;
+  Interp_PrintReport(interp);
+  exit(-1);
+}
+
+
+/*
+  Interp_Charge
+
+  Add cycles to the estimated cost of the current line.
+*/
+void
+Interp_Charge(struct interpreter* interp, u64 cycles)
+{
+  u16 line_no = Interp_LineNumber(interp);
+  if (line_no < NUM_LINE_NUMBERS)
+    interp->profile[line_no].cycles += cycles;
+  interp->total_cycles += cycles;
+}
+
+
+/*
+  Interp_Peek
+
+  Skip spaces and return the next byte of program text without
+  consuming it.
+*/
+byte_t
+Interp_Peek(struct interpreter* interp)
+{
+  while (interp->memory[interp->txtptr] == ' ')
+  {
+    ++interp->txtptr;
+    Interp_Charge(interp, COST_CHRGET);
+  }
+  return interp->memory[interp->txtptr];
+}
+
+
+/*
+  Interp_Get
+
+  Skip spaces and consume the next byte of program text.
+*/
+byte_t
+Interp_Get(struct interpreter* interp)
+{
+  byte_t byte = Interp_Peek(interp);
+  ++interp->txtptr;
+  Interp_Charge(interp, COST_CHRGET);
+  return byte;
+}
+
+
+/*
+  Interp_Expect
+
+  Consume the next byte of program text, which must be byte.
+*/
+void
+Interp_Expect(struct interpreter* interp, byte_t byte)
+{
+  if (Interp_Get(interp) != byte)
+    Interp_Error(interp, "SYNTAX");
+}
+
+
+/*
+  Interp_IsStatementEnd
+
+  Returns TRUE if the next byte of program text ends the statement.
+*/
+BOOL
+Interp_IsStatementEnd(struct interpreter* interp)
+{
+  byte_t byte = Interp_Peek(interp);
+  return (byte == 0 || byte == ':');
+}
+
+
+/*
+  Interp_SkipStatement
+
+  Skip to the end of the current statement, honoring quotes.
+*/
+void
+Interp_SkipStatement(struct interpreter* interp)
+{
+  BOOL in_quotes = FALSE;
+  while (interp->memory[interp->txtptr] &&
+         (in_quotes || interp->memory[interp->txtptr] != ':'))
+  {
+    if (interp->memory[interp->txtptr] == '"')
+      in_quotes = !in_quotes;
+    ++interp->txtptr;
+    Interp_Charge(interp, COST_CHRGET);
+  }
+}
+
+
+/*
+  Interp_SkipLine
+
+  Skip to the end of the current line.
+*/
+void
+Interp_SkipLine(struct interpreter* interp)
+{
+  while (interp->memory[interp->txtptr])
+  {
+    ++interp->txtptr;
+    Interp_Charge(interp, COST_CHRGET);
+  }
+}
+
+
+/*
+  Interp_EnterLine
+
+  Begin executing the line at line_addr.
+*/
+void
+Interp_EnterLine(struct interpreter* interp, u16 line_addr)
+{
+  interp->line_addr = line_addr;
+  interp->txtptr    = line_addr + 4;
+  interp->jumped    = TRUE;
+  u16 line_no = Interp_LineNumber(interp);
+  if (line_no < NUM_LINE_NUMBERS)
+    ++interp->profile[line_no].hits;
+}
+
+
+/*
+  Interp_FindLine
+
+  Find the address of line line_no. Like the C64, search from the
+  current line if the target is further down, and from the start of
+  the program otherwise; every line passed costs time.
+*/
+u16
+Interp_FindLine(struct interpreter* interp, u16 line_no)
+{
+  u16 addr = interp->load_address;
+  if (interp->line_addr &&
+      line_no > Interp_LineNumber(interp))
+    addr = interp->line_addr;
+
+  while (GETWORD(interp->memory, addr))
+  {
+    Interp_Charge(interp, COST_LINE_HOP);
+    u16 curr_line_no = GETWORD(interp->memory, addr+2);
+    if (curr_line_no == line_no)
+      return addr;
+    if (curr_line_no > line_no)
+      break;
+    if (!Interp_IsValidLink(interp, addr))
+      Interp_Malformed(interp, addr);
+    addr = GETWORD(interp->memory, addr);
+  }
+  Interp_Error(interp, "UNDEF'D STATEMENT");
+  return 0;
+}
+
+
+/*
+  Interp_ParseLineNumber
+
+  Parse a line number argument (GOTO, GOSUB, THEN, ...).
+*/
+u16
+Interp_ParseLineNumber(struct interpreter* interp)
+{
+  if (!isdigit(Interp_Peek(interp)))
+    Interp_Error(interp, "SYNTAX");
+  u32 line_no = 0;
+  while (isdigit(Interp_Peek(interp)))
+  {
+    line_no = line_no * 10 + (Interp_Get(interp) - '0');
+    Interp_Charge(interp, COST_NUMBER_DIGIT);
+    if (line_no >= NUM_LINE_NUMBERS)
+      Interp_Error(interp, "SYNTAX");
+  }
+  return (u16)line_no;
+}
+
+
+/*
+  Interp_Goto
+
+  Continue execution at the beginning of line line_no.
+*/
+void
+Interp_Goto(struct interpreter* interp, u16 line_no)
+{
+  Interp_EnterLine(interp, Interp_FindLine(interp, line_no));
+}
+
+
+/*
+  Interp_SetNumber
+*/
+void
+Interp_SetNumber(struct value* v, double number)
+{
+  v->type   = VALUE_NUMBER;
+  v->number = number;
+}
+
+
+/*
+  Interp_SetString
+*/
+void
+Interp_SetString(struct interpreter* interp, struct value* v, char* string, int len)
+{
+  if (len > MAX_STRING_LEN)
+    Interp_Error(interp, "STRING TOO LONG");
+  v->type = VALUE_STRING;
+  v->len  = len;
+  memmove(v->string, string, len);
+  v->string[len] = 0;
+  Interp_Charge(interp, COST_STRING_ALLOC + len * COST_STRING_CHAR);
+}
+
+
+/*
+  Interp_CheckNumber / Interp_CheckString
+
+  Raise TYPE MISMATCH if v is not of the expected type.
+*/
+void
+Interp_CheckNumber(struct interpreter* interp, struct value* v)
+{
+  if (v->type != VALUE_NUMBER)
+    Interp_Error(interp, "TYPE MISMATCH");
+}
+
+void
+Interp_CheckString(struct interpreter* interp, struct value* v)
+{
+  if (v->type != VALUE_STRING)
+    Interp_Error(interp, "TYPE MISMATCH");
+}
+
+
+/*
+  Interp_ToInteger
+
+  Convert a number to a 16-bit signed integer, as used by AND, OR, NOT
+  and integer variables.
+*/
+s32
+Interp_ToInteger(struct interpreter* interp, double number)
+{
+  double truncated = floor(number);
+  if (truncated < -32768 ||
+      truncated > 32767)
+    Interp_Error(interp, "ILLEGAL QUANTITY");
+  return (s32)truncated;
+}
+
+
+/*
+  Interp_ToByte / Interp_ToAddress
+
+  Convert a number to a byte or a 16-bit address.
+*/
+u8
+Interp_ToByte(struct interpreter* interp, double number)
+{
+  if (number < 0 ||
+      number >= 256)
+    Interp_Error(interp, "ILLEGAL QUANTITY");
+  return (u8)number;
+}
+
+u16
+Interp_ToAddress(struct interpreter* interp, double number)
+{
+  if (number < 0 ||
+      number >= 65536)
+    Interp_Error(interp, "ILLEGAL QUANTITY");
+  return (u16)number;
+}
+
+
+/*
+  Interp_FormatNumber
+
+  Format a number the way the C64 prints it (without the leading sign
+  space): at most 9 significant digits, scientific notation outside
+  0.01 <= |number| < 1E9 and no leading zero before the decimal point.
+*/
+void
+Interp_FormatNumber(double number, char* buffer)
+{
+  double magnitude = fabs(number);
+  if (number == 0)
+  {
+    strcpy(buffer, "0");
+    return;
+  }
+  if (magnitude >= 1e9 ||
+      magnitude < 0.01)
+  {
+    char mantissa[32];
+    int exponent = 0;
+    sprintf(mantissa, "%.8e", number);
+    char* e = strchr(mantissa, 'e');
+    exponent = atoi(&e[1]);
+    *e = 0;
+    /* Trim trailing zeros of the mantissa */
+    char* end = &mantissa[strlen(mantissa)-1];
+    while (*end == '0') *end-- = 0;
+    if (*end == '.') *end = 0;
+    sprintf(buffer, "%sE%c%02d", mantissa, exponent < 0 ? '-' : '+', abs(exponent));
+    return;
+  }
+
+  char temp[32];
+  sprintf(temp, "%.9g", number);
+  char* digits = temp;
+  char* out = buffer;
+  if (*digits == '-')
+    *out++ = *digits++;
+  if (digits[0] == '0' &&
+      digits[1] == '.')
+    ++digits;
+  strcpy(out, digits);
+}
+
+
+/*
+  Interp_ParseNumber
+
+  Parse a numeric literal from program text.
+*/
+double
+Interp_ParseNumber(struct interpreter* interp)
+{
+  char buffer[64];
+  int len = 0;
+  while ((isdigit(Interp_Peek(interp)) ||
+          interp->memory[interp->txtptr] == '.') &&
+         len < 60)
+  {
+    buffer[len++] = Interp_Get(interp);
+    Interp_Charge(interp, COST_NUMBER_DIGIT);
+  }
+  if (Interp_Peek(interp) == 'E')
+  {
+    buffer[len++] = Interp_Get(interp);
+    byte_t sign = Interp_Peek(interp);
+    if (sign == TOKEN_MINUS ||
+        sign == '-')
+    {
+      Interp_Get(interp);
+      buffer[len++] = '-';
+    }
+    else if (sign == TOKEN_PLUS ||
+             sign == '+')
+      Interp_Get(interp);
+    while (isdigit(Interp_Peek(interp)) &&
+           len < 62)
+    {
+      buffer[len++] = Interp_Get(interp);
+      Interp_Charge(interp, COST_NUMBER_DIGIT);
+    }
+  }
+  buffer[len] = 0;
+  return strtod(buffer, 0);
+}
+
+
+/*
+  Interp_ParseName
+
+  Parse a variable name from program text.
+*/
+void
+Interp_ParseName(struct interpreter* interp, struct var_name* name)
+{
+  memset(name, 0, sizeof(struct var_name));
+  byte_t c = Interp_Peek(interp);
+  if (!isalpha(c))
+    Interp_Error(interp, "SYNTAX");
+  name->c1 = Interp_Get(interp);
+  while (isalnum(Interp_Peek(interp)))
+  {
+    c = Interp_Get(interp);
+    if (!name->c2)
+      name->c2 = c;
+  }
+  c = interp->memory[interp->txtptr];
+  if (c == '$' ||
+      c == '%')
+  {
+    name->suffix = c;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_NameEquals
+*/
+BOOL
+Interp_NameEquals(struct var_name* a, struct var_name* b)
+{
+  return (a->c1 == b->c1 &&
+          a->c2 == b->c2 &&
+          a->suffix == b->suffix);
+}
+
+
+/*
+  Interp_InitValue
+
+  Initialize v to the zero value for variables called name.
+*/
+void
+Interp_InitValue(struct value* v, struct var_name* name)
+{
+  memset(v, 0, sizeof(struct value));
+  v->type = (name->suffix == '$') ? VALUE_STRING : VALUE_NUMBER;
+}
+
+
+/*
+  Interp_FindVariable
+
+  Find (or create) the simple variable called name. Like the C64,
+  variables are searched in creation order, which the estimated cost
+  reflects.
+*/
+struct value*
+Interp_FindVariable(struct interpreter* interp, struct var_name* name)
+{
+  Interp_Charge(interp, COST_VAR_LOOKUP);
+  for (int i = 0;
+       i < interp->num_vars;
+       ++i)
+  {
+    if (Interp_NameEquals(&interp->vars[i].name, name))
+    {
+      Interp_Charge(interp, i * COST_VAR_SCAN);
+      return &interp->vars[i].value;
+    }
+  }
+  Interp_Charge(interp, interp->num_vars * COST_VAR_SCAN);
+  if (interp->num_vars >= MAX_VARIABLES)
+    Interp_Error(interp, "OUT OF MEMORY");
+  struct variable* var = &interp->vars[interp->num_vars++];
+  var->name = *name;
+  Interp_InitValue(&var->value, name);
+  return &var->value;
+}
+
+
+/*
+  Interp_CreateArray
+*/
+struct array*
+Interp_CreateArray(struct interpreter* interp, struct var_name* name,
+                   int num_dims, int* dims)
+{
+  if (interp->num_arrays >= MAX_ARRAYS)
+    Interp_Error(interp, "OUT OF MEMORY");
+  struct array* array = &interp->arrays[interp->num_arrays++];
+  array->name = *name;
+  array->num_dims = num_dims;
+  array->num_elements = 1;
+  for (int i = 0;
+       i < num_dims;
+       ++i)
+  {
+    array->dims[i] = dims[i] + 1;
+    array->num_elements *= dims[i] + 1;
+  }
+  array->elements = (struct value*)Counted_Malloc(array->num_elements * sizeof(struct value));
+  if (!array->elements)
+    Interp_Error(interp, "OUT OF MEMORY");
+  for (int i = 0;
+       i < array->num_elements;
+       ++i)
+    Interp_InitValue(&array->elements[i], name);
+  return array;
+}
+
+
+/*
+  Interp_FindArray
+
+  Find the array called name, or return 0 if it doesn't exist.
+*/
+struct array*
+Interp_FindArray(struct interpreter* interp, struct var_name* name)
+{
+  Interp_Charge(interp, COST_VAR_LOOKUP);
+  for (int i = 0;
+       i < interp->num_arrays;
+       ++i)
+  {
+    if (Interp_NameEquals(&interp->arrays[i].name, name))
+    {
+      Interp_Charge(interp, i * COST_VAR_SCAN);
+      return &interp->arrays[i];
+    }
+  }
+  return 0;
+}
+
+
+/*
+  Interp_ParseSubscripts
+
+  Parse a parenthesized list of subscripts. Returns the number of
+  subscripts.
+*/
+int
+Interp_ParseSubscripts(struct interpreter* interp, int* subscripts)
+{
+  int count = 0;
+  Interp_Expect(interp, '(');
+  for (;;)
+  {
+    struct value v;
+    Interp_EvalExpression(interp, &v);
+    Interp_CheckNumber(interp, &v);
+    if (count >= MAX_ARRAY_DIMENSIONS)
+      Interp_Error(interp, "BAD SUBSCRIPT");
+    s32 subscript = Interp_ToInteger(interp, v.number);
+    if (subscript < 0)
+      Interp_Error(interp, "ILLEGAL QUANTITY");
+    subscripts[count++] = subscript;
+    Interp_Charge(interp, COST_ARRAY_ELEMENT);
+    byte_t c = Interp_Get(interp);
+    if (c == ')')
+      break;
+    if (c != ',')
+      Interp_Error(interp, "SYNTAX");
+  }
+  return count;
+}
+
+
+/*
+  Interp_ParseVariable
+
+  Parse a variable reference (simple or array element) from program
+  text and return a pointer to its value. name receives the parsed
+  name.
+*/
+struct value*
+Interp_ParseVariable(struct interpreter* interp, struct var_name* name)
+{
+  Interp_ParseName(interp, name);
+  if (Interp_Peek(interp) != '(')
+    return Interp_FindVariable(interp, name);
+
+  int subscripts[MAX_ARRAY_DIMENSIONS];
+  int num_subscripts = Interp_ParseSubscripts(interp, subscripts);
+  struct array* array = Interp_FindArray(interp, name);
+  if (!array)
+  {
+    /* Arrays are implicitly dimensioned to 10 */
+    int dims[MAX_ARRAY_DIMENSIONS];
+    for (int i = 0;
+         i < num_subscripts;
+         ++i)
+      dims[i] = 10;
+    array = Interp_CreateArray(interp, name, num_subscripts, dims);
+  }
+  if (array->num_dims != num_subscripts)
+    Interp_Error(interp, "BAD SUBSCRIPT");
+
+  int index = 0;
+  for (int i = 0;
+       i < num_subscripts;
+       ++i)
+  {
+    if (subscripts[i] >= array->dims[i])
+      Interp_Error(interp, "BAD SUBSCRIPT");
+    index = index * array->dims[i] + subscripts[i];
+  }
+  return &array->elements[index];
+}
+
+
+/*
+  Interp_Assign
+
+  Store v into the variable target named name, converting to an
+  integer if necessary.
+*/
+void
+Interp_Assign(struct interpreter* interp, struct value* target,
+              struct var_name* name, struct value* v)
+{
+  if (name->suffix == '$')
+  {
+    Interp_CheckString(interp, v);
+    Interp_SetString(interp, target, v->string, v->len);
+    return;
+  }
+  Interp_CheckNumber(interp, v);
+  if (name->suffix == '%')
+    Interp_SetNumber(target, Interp_ToInteger(interp, v->number));
+  else
+    Interp_SetNumber(target, v->number);
+}
+
+
+/*
+  Interp_Rnd
+
+  Deterministic pseudo random numbers, so profiling runs are
+  repeatable.
+*/
+double
+Interp_Rnd(struct interpreter* interp, double arg)
+{
+  if (arg < 0)
+    interp->rnd_seed = (u32)(s32)(arg * 1000003);
+  if (arg != 0)
+    interp->rnd_seed = interp->rnd_seed * 1103515245 + 12345;
+  return (double)(interp->rnd_seed >> 8) / (double)(1 << 24);
+}
+
+
+/*
+  Interp_EvalFunction
+
+  Evaluate a built-in function call. The function token has already
+  been consumed.
+*/
+void
+Interp_EvalFunction(struct interpreter* interp, byte_t token, struct value* out)
+{
+  struct value arg;
+  Interp_Expect(interp, '(');
+  Interp_EvalExpression(interp, &arg);
+
+  if (token == TOKEN_LEFT ||
+      token == TOKEN_RIGHT ||
+      token == TOKEN_MID)
+  {
+    Interp_CheckString(interp, &arg);
+    struct value n1;
+    Interp_Expect(interp, ',');
+    Interp_EvalExpression(interp, &n1);
+    Interp_CheckNumber(interp, &n1);
+    int start = 0;
+    int len = Interp_ToByte(interp, n1.number);
+    if (token == TOKEN_MID)
+    {
+      if (len == 0)
+        Interp_Error(interp, "ILLEGAL QUANTITY");
+      start = len - 1;
+      len = MAX_STRING_LEN;
+      if (Interp_Peek(interp) == ',')
+      {
+        struct value n2;
+        Interp_Get(interp);
+        Interp_EvalExpression(interp, &n2);
+        Interp_CheckNumber(interp, &n2);
+        len = Interp_ToByte(interp, n2.number);
+      }
+    }
+    else if (token == TOKEN_RIGHT)
+    {
+      start = (len < arg.len) ? arg.len - len : 0;
+    }
+    if (start > arg.len)
+      start = arg.len;
+    if (start + len > arg.len)
+      len = arg.len - start;
+    Interp_Expect(interp, ')');
+    Interp_SetString(interp, out, &arg.string[start], len);
+    return;
+  }
+  Interp_Expect(interp, ')');
+
+  switch (token)
+  {
+    case TOKEN_LEN:
+    case TOKEN_VAL:
+    case TOKEN_ASC:
+    {
+      Interp_CheckString(interp, &arg);
+      if (token == TOKEN_LEN)
+        Interp_SetNumber(out, arg.len);
+      else if (token == TOKEN_VAL)
+      {
+        Interp_Charge(interp, arg.len * COST_NUMBER_DIGIT);
+        /* The C64 ignores spaces in numbers */
+        char digits[MAX_STRING_LEN+1];
+        int len = 0;
+        for (int i = 0;
+             i < arg.len;
+             ++i)
+          if (arg.string[i] != ' ')
+            digits[len++] = arg.string[i];
+        digits[len] = 0;
+        Interp_SetNumber(out, strtod(digits, 0));
+      }
+      else
+      {
+        if (arg.len == 0)
+          Interp_Error(interp, "ILLEGAL QUANTITY");
+        Interp_SetNumber(out, (byte_t)arg.string[0]);
+      }
+      return;
+    }
+    case TOKEN_STR:
+    {
+      Interp_CheckNumber(interp, &arg);
+      char buffer[40];
+      buffer[0] = (arg.number < 0) ? 0 : ' ';
+      Interp_FormatNumber(arg.number, &buffer[buffer[0] ? 1 : 0]);
+      Interp_Charge(interp, COST_NUMBER_TO_STRING);
+      Interp_SetString(interp, out, buffer, strlen(buffer));
+      return;
+    }
+    case TOKEN_CHR:
+    {
+      Interp_CheckNumber(interp, &arg);
+      char c = Interp_ToByte(interp, arg.number);
+      Interp_SetString(interp, out, &c, 1);
+      return;
+    }
+  }
+
+  Interp_CheckNumber(interp, &arg);
+  double x = arg.number;
+  double result = 0;
+  switch (token)
+  {
+    case TOKEN_SGN: result = (x > 0) - (x < 0);                 break;
+    case TOKEN_INT: result = floor(x);  Interp_Charge(interp, COST_INT); break;
+    case TOKEN_ABS: result = fabs(x);                           break;
+    case TOKEN_USR: result = x;                                 break;
+    case TOKEN_FRE: result = 0xa000 - interp->program_end;      break;
+    case TOKEN_POS: result = interp->print_column;              break;
+    case TOKEN_RND: result = Interp_Rnd(interp, x);  Interp_Charge(interp, COST_FMUL); break;
+    case TOKEN_PEEK: result = interp->memory[Interp_ToAddress(interp, x)]; break;
+    default:
+    {
+      Interp_Charge(interp, COST_TRANSCENDENTAL);
+      switch (token)
+      {
+        case TOKEN_SQR:
+          if (x < 0)
+            Interp_Error(interp, "ILLEGAL QUANTITY");
+          result = sqrt(x);
+          break;
+        case TOKEN_LOG:
+          if (x <= 0)
+            Interp_Error(interp, "ILLEGAL QUANTITY");
+          result = log(x);
+          break;
+        case TOKEN_EXP: result = exp(x);  break;
+        case TOKEN_COS: result = cos(x);  break;
+        case TOKEN_SIN: result = sin(x);  break;
+        case TOKEN_TAN: result = tan(x);  break;
+        case TOKEN_ATN: result = atan(x); break;
+        default:
+          Interp_Error(interp, "SYNTAX");
+      }
+    }
+  }
+  Interp_SetNumber(out, result);
+}
+
+
+/*
+  Interp_CallFunction
+
+  Evaluate a call of a user defined function (FN). The FN token has
+  already been consumed.
+*/
+void
+Interp_CallFunction(struct interpreter* interp, struct value* out)
+{
+  struct var_name name;
+  Interp_ParseName(interp, &name);
+  struct function* function = 0;
+  for (int i = 0;
+       i < interp->num_functions;
+       ++i)
+  {
+    if (Interp_NameEquals(&interp->functions[i].name, &name))
+      function = &interp->functions[i];
+  }
+  if (!function)
+    Interp_Error(interp, "UNDEF'D FUNCTION");
+
+  struct value arg;
+  Interp_Expect(interp, '(');
+  Interp_EvalExpression(interp, &arg);
+  Interp_CheckNumber(interp, &arg);
+  Interp_Expect(interp, ')');
+
+  /* Bind the parameter, evaluate the function body in place, then
+     restore the parameter and the text pointer */
+  struct value* param = Interp_FindVariable(interp, &function->param);
+  struct value saved = *param;
+  *param = arg;
+  u16 saved_txtptr = interp->txtptr;
+  interp->txtptr = function->expression;
+  Interp_EvalExpression(interp, out);
+  interp->txtptr = saved_txtptr;
+  *param = saved;
+  Interp_CheckNumber(interp, out);
+}
+
+
+/*
+  Interp_EvalPrimary
+*/
+void
+Interp_EvalPrimary(struct interpreter* interp, struct value* out)
+{
+  byte_t c = Interp_Peek(interp);
+
+  if (isdigit(c) ||
+      c == '.')
+  {
+    Interp_SetNumber(out, Interp_ParseNumber(interp));
+    return;
+  }
+
+  if (c == '"')
+  {
+    Interp_Get(interp);
+    u16 begin = interp->txtptr;
+    while (interp->memory[interp->txtptr] &&
+           interp->memory[interp->txtptr] != '"')
+    {
+      ++interp->txtptr;
+      Interp_Charge(interp, COST_CHRGET);
+    }
+    Interp_SetString(interp, out, (char*)&interp->memory[begin], interp->txtptr - begin);
+    if (interp->memory[interp->txtptr])
+      Interp_Get(interp);
+    return;
+  }
+
+  if (c == '(')
+  {
+    Interp_Get(interp);
+    Interp_EvalExpression(interp, out);
+    Interp_Expect(interp, ')');
+    return;
+  }
+
+  if (isalpha(c))
+  {
+    /* Reserved variables */
+    byte_t c2 = interp->memory[interp->txtptr+1];
+    byte_t c3 = interp->memory[interp->txtptr+2];
+    if (c == 'T' && c2 == 'I' && !isalnum(c3))
+    {
+      u64 jiffies = interp->total_cycles / JIFFY_CYCLES;
+      if (c3 == '$')
+      {
+        char buffer[8];
+        u64 seconds = jiffies / 60;
+        sprintf(buffer, "%02u%02u%02u",
+                (u32)(seconds / 3600 % 24), (u32)(seconds / 60 % 60), (u32)(seconds % 60));
+        interp->txtptr += 3;
+        Interp_SetString(interp, out, buffer, 6);
+        return;
+      }
+      interp->txtptr += 2;
+      Interp_SetNumber(out, (double)jiffies);
+      return;
+    }
+    if (c == 'S' && c2 == 'T' && !isalnum(c3) && c3 != '$' && c3 != '%' && c3 != '(')
+    {
+      interp->txtptr += 2;
+      Interp_SetNumber(out, 0);
+      return;
+    }
+
+    struct var_name name;
+    *out = *Interp_ParseVariable(interp, &name);
+    return;
+  }
+
+  Interp_Get(interp);
+  if (c == TOKEN_PI)
+  {
+    Interp_SetNumber(out, 3.14159265);
+    return;
+  }
+  if (c == TOKEN_FN)
+  {
+    Interp_CallFunction(interp, out);
+    return;
+  }
+  if (c >= TOKEN_SGN &&
+      c <= TOKEN_MID)
+  {
+    Interp_EvalFunction(interp, c, out);
+    return;
+  }
+  Interp_Error(interp, "SYNTAX");
+}
+
+
+/*
+  Interp_EvalUnary
+
+  Parse unary plus and minus, which bind less tightly than ^ but more
+  tightly than * and /.
+*/
+void Interp_EvalPower(struct interpreter* interp, struct value* out);
+void
+Interp_EvalUnary(struct interpreter* interp, struct value* out)
+{
+  byte_t c = Interp_Peek(interp);
+  if (c == TOKEN_MINUS ||
+      c == TOKEN_PLUS)
+  {
+    Interp_Get(interp);
+    Interp_EvalUnary(interp, out);
+    Interp_CheckNumber(interp, out);
+    if (c == TOKEN_MINUS)
+      out->number = -out->number;
+    return;
+  }
+  Interp_EvalPower(interp, out);
+}
+
+
+/*
+  Interp_EvalPower
+*/
+void
+Interp_EvalPower(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalPrimary(interp, out);
+  while (Interp_Peek(interp) == TOKEN_POWER)
+  {
+    struct value right;
+    Interp_Get(interp);
+    Interp_EvalUnary(interp, &right);
+    Interp_CheckNumber(interp, out);
+    Interp_CheckNumber(interp, &right);
+    if (out->number < 0 &&
+        right.number != floor(right.number))
+      Interp_Error(interp, "ILLEGAL QUANTITY");
+    out->number = pow(out->number, right.number);
+    Interp_Charge(interp, COST_FPOWER);
+  }
+}
+
+
+/*
+  Interp_EvalMultiplicative
+*/
+void
+Interp_EvalMultiplicative(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalUnary(interp, out);
+  for (;;)
+  {
+    byte_t op = Interp_Peek(interp);
+    if (op != TOKEN_MULTIPLY &&
+        op != TOKEN_DIVIDE)
+      return;
+    struct value right;
+    Interp_Get(interp);
+    Interp_EvalUnary(interp, &right);
+    Interp_CheckNumber(interp, out);
+    Interp_CheckNumber(interp, &right);
+    if (op == TOKEN_MULTIPLY)
+    {
+      out->number *= right.number;
+      Interp_Charge(interp, COST_FMUL);
+    }
+    else
+    {
+      if (right.number == 0)
+        Interp_Error(interp, "DIVISION BY ZERO");
+      out->number /= right.number;
+      Interp_Charge(interp, COST_FDIV);
+    }
+  }
+}
+
+
+/*
+  Interp_EvalAdditive
+*/
+void
+Interp_EvalAdditive(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalMultiplicative(interp, out);
+  for (;;)
+  {
+    byte_t op = Interp_Peek(interp);
+    if (op != TOKEN_PLUS &&
+        op != TOKEN_MINUS)
+      return;
+    struct value right;
+    Interp_Get(interp);
+    Interp_EvalMultiplicative(interp, &right);
+    if (op == TOKEN_PLUS &&
+        out->type == VALUE_STRING)
+    {
+      /* String concatenation */
+      Interp_CheckString(interp, &right);
+      if (out->len + right.len > MAX_STRING_LEN)
+        Interp_Error(interp, "STRING TOO LONG");
+      memcpy(&out->string[out->len], right.string, right.len);
+      out->len += right.len;
+      out->string[out->len] = 0;
+      Interp_Charge(interp, COST_STRING_ALLOC + out->len * COST_STRING_CHAR);
+      continue;
+    }
+    Interp_CheckNumber(interp, out);
+    Interp_CheckNumber(interp, &right);
+    if (op == TOKEN_PLUS)
+      out->number += right.number;
+    else
+      out->number -= right.number;
+    Interp_Charge(interp, COST_FADD);
+  }
+}
+
+
+/*
+  Interp_EvalRelational
+*/
+void
+Interp_EvalRelational(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalAdditive(interp, out);
+  for (;;)
+  {
+    /* Any combination of <, = and > */
+    int relation = 0;
+    while (Interp_Peek(interp) >= TOKEN_GREATER &&
+           interp->memory[interp->txtptr] <= TOKEN_LESS)
+      relation |= 1 << (Interp_Get(interp) - TOKEN_GREATER);
+    if (!relation)
+      return;
+
+    struct value right;
+    Interp_EvalAdditive(interp, &right);
+    int comparison;
+    if (out->type == VALUE_STRING)
+    {
+      Interp_CheckString(interp, &right);
+      int len = (out->len < right.len) ? out->len : right.len;
+      comparison = memcmp(out->string, right.string, len);
+      if (comparison == 0)
+        comparison = out->len - right.len;
+      Interp_Charge(interp, COST_FCOMPARE + len * COST_STRING_CHAR);
+    }
+    else
+    {
+      Interp_CheckNumber(interp, &right);
+      comparison = (out->number > right.number) - (out->number < right.number);
+      Interp_Charge(interp, COST_FCOMPARE);
+    }
+    /* Bit 0: >, bit 1: =, bit 2: < */
+    BOOL result = ((comparison > 0  && (relation & 1)) ||
+                   (comparison == 0 && (relation & 2)) ||
+                   (comparison < 0  && (relation & 4)));
+    Interp_SetNumber(out, result ? -1 : 0);
+  }
+}
+
+
+/*
+  Interp_EvalNot
+*/
+void
+Interp_EvalNot(struct interpreter* interp, struct value* out)
+{
+  if (Interp_Peek(interp) != TOKEN_NOT)
+  {
+    Interp_EvalRelational(interp, out);
+    return;
+  }
+  Interp_Get(interp);
+  Interp_EvalNot(interp, out);
+  Interp_CheckNumber(interp, out);
+  Interp_SetNumber(out, ~Interp_ToInteger(interp, out->number));
+}
+
+
+/*
+  Interp_EvalAnd
+*/
+void
+Interp_EvalAnd(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalNot(interp, out);
+  while (Interp_Peek(interp) == TOKEN_AND)
+  {
+    struct value right;
+    Interp_Get(interp);
+    Interp_EvalNot(interp, &right);
+    Interp_CheckNumber(interp, out);
+    Interp_CheckNumber(interp, &right);
+    Interp_SetNumber(out, Interp_ToInteger(interp, out->number) &
+                          Interp_ToInteger(interp, right.number));
+  }
+}
+
+
+/*
+  Interp_EvalExpression
+
+  Evaluate a full expression. From lowest to highest precedence: OR,
+  AND, NOT, relational operators, + -, * /, unary -, ^.
+*/
+void
+Interp_EvalExpression(struct interpreter* interp, struct value* out)
+{
+  Interp_EvalAnd(interp, out);
+  while (Interp_Peek(interp) == TOKEN_OR)
+  {
+    struct value right;
+    Interp_Get(interp);
+    Interp_EvalAnd(interp, &right);
+    Interp_CheckNumber(interp, out);
+    Interp_CheckNumber(interp, &right);
+    Interp_SetNumber(out, Interp_ToInteger(interp, out->number) |
+                          Interp_ToInteger(interp, right.number));
+  }
+}
+
+
+/*
+  Interp_EvalNumber
+
+  Evaluate an expression which must be numeric.
+*/
+double
+Interp_EvalNumber(struct interpreter* interp)
+{
+  struct value v;
+  Interp_EvalExpression(interp, &v);
+  Interp_CheckNumber(interp, &v);
+  return v.number;
+}
+
+
+/*
+  Interp_Output
+
+  Write PETSCII characters printed by the program to stdout.
+*/
+void
+Interp_Output(struct interpreter* interp, char* string, int len)
+{
+  for (int i = 0;
+       i < len;
+       ++i)
+  {
+    byte_t c = (byte_t)string[i];
+    if (c == 0x0d)
+    {
+      fputc('\n', stdout);
+      interp->print_column = 0;
+    }
+    else
+    {
+      fputs(PETSCII_table[c], stdout);
+      interp->print_column = (interp->print_column + 1) % 40;
+    }
+    Interp_Charge(interp, COST_PRINT_CHAR);
+  }
+}
+
+
+/*
+  Interp_ReadInputLine
+
+  Read the next line of scripted input into buffer. Ends the run if
+  the script is exhausted.
+*/
+BOOL
+Interp_ReadInputLine(struct interpreter* interp, char* buffer)
+{
+  if (!interp->input ||
+      !fgets(buffer, MAX_STRING_LEN+1, interp->input))
+  {
+    interp->running = FALSE;
+    interp->stop_reason = "input exhausted";
+    return FALSE;
+  }
+  buffer[strcspn(buffer, "\r\n")] = 0;
+  /* The script is typed on an unshifted keyboard */
+  for (char* c = buffer; *c; ++c)
+    *c = toupper(*c);
+  /* Echo the input like the C64 screen editor would */
+  fputs(buffer, stdout);
+  fputc('\n', stdout);
+  interp->print_column = 0;
+  return TRUE;
+}
+
+
+/*
+  Interp_DoPrint
+
+  PRINT and PRINT#. Output to files is evaluated but discarded.
+*/
+void
+Interp_DoPrint(struct interpreter* interp, BOOL to_file)
+{
+  if (to_file)
+  {
+    Interp_EvalNumber(interp);
+    if (Interp_IsStatementEnd(interp))
+      return;
+    Interp_Expect(interp, ',');
+  }
+
+  BOOL newline = TRUE;
+  while (!Interp_IsStatementEnd(interp))
+  {
+    byte_t c = Interp_Peek(interp);
+    newline = TRUE;
+    if (c == ';')
+    {
+      Interp_Get(interp);
+      newline = FALSE;
+      continue;
+    }
+    if (c == ',')
+    {
+      Interp_Get(interp);
+      newline = FALSE;
+      if (!to_file)
+      {
+        int spaces = 10 - interp->print_column % 10;
+        while (spaces--)
+          Interp_Output(interp, " ", 1);
+      }
+      continue;
+    }
+    if (c == TOKEN_TAB ||
+        c == TOKEN_SPC)
+    {
+      Interp_Get(interp);
+      int n = Interp_ToByte(interp, Interp_EvalNumber(interp));
+      Interp_Expect(interp, ')');
+      newline = FALSE;
+      if (to_file)
+        continue;
+      if (c == TOKEN_TAB)
+        n = (n > interp->print_column) ? n - interp->print_column : 0;
+      while (n--)
+        Interp_Output(interp, " ", 1);
+      continue;
+    }
+
+    struct value v;
+    Interp_EvalExpression(interp, &v);
+    if (to_file)
+      continue;
+    if (v.type == VALUE_STRING)
+    {
+      Interp_Output(interp, v.string, v.len);
+      continue;
+    }
+    char buffer[40];
+    buffer[0] = (v.number < 0) ? 0 : ' ';
+    Interp_FormatNumber(v.number, &buffer[buffer[0] ? 1 : 0]);
+    strcat(buffer, " ");
+    Interp_Charge(interp, COST_NUMBER_TO_STRING);
+    Interp_Output(interp, buffer, strlen(buffer));
+  }
+  if (newline && !to_file)
+    Interp_Output(interp, "\r", 1);
+}
+
+
+/*
+  Interp_StoreInputItem
+
+  Assign one item of INPUT or READ data to the variable target.
+  Returns FALSE if the item is not a valid number for a numeric
+  variable.
+*/
+BOOL
+Interp_StoreInputItem(struct interpreter* interp, struct value* target,
+                      struct var_name* name, char* item, int len)
+{
+  struct value v;
+  if (name->suffix == '$')
+  {
+    Interp_SetString(interp, &v, item, len);
+  }
+  else
+  {
+    char digits[MAX_STRING_LEN+1];
+    int digits_len = 0;
+    for (int i = 0;
+         i < len;
+         ++i)
+      if (item[i] != ' ')
+        digits[digits_len++] = item[i];
+    digits[digits_len] = 0;
+    char* end;
+    double number = strtod(digits, &end);
+    if (*end)
+      return FALSE;
+    Interp_Charge(interp, digits_len * COST_NUMBER_DIGIT);
+    Interp_SetNumber(&v, number);
+  }
+  Interp_Assign(interp, target, name, &v);
+  return TRUE;
+}
+
+
+/*
+  Interp_NextItem
+
+  Split the next comma separated item from *text. Leading spaces are
+  skipped and quotes removed. Returns the item length, or -1 if there
+  are no more items.
+*/
+int
+Interp_NextItem(char** text, char** item)
+{
+  char* c = *text;
+  if (!c)
+    return -1;
+  while (*c == ' ')
+    ++c;
+  int len;
+  if (*c == '"')
+  {
+    *item = ++c;
+    while (*c && *c != '"')
+      ++c;
+    len = c - *item;
+    if (*c == '"')
+      ++c;
+    while (*c && *c != ',')
+      ++c;
+  }
+  else
+  {
+    *item = c;
+    while (*c && *c != ',')
+      ++c;
+    len = c - *item;
+    while (len > 0 && (*item)[len-1] == ' ')
+      --len;
+  }
+  *text = (*c == ',') ? c + 1 : 0;
+  return len;
+}
+
+
+/*
+  Interp_DoInput
+
+  INPUT and INPUT#, fed from the input script.
+*/
+void
+Interp_DoInput(struct interpreter* interp, BOOL from_file)
+{
+  if (from_file)
+  {
+    Interp_EvalNumber(interp);
+    Interp_Expect(interp, ',');
+  }
+  else if (Interp_Peek(interp) == '"')
+  {
+    struct value prompt;
+    Interp_EvalPrimary(interp, &prompt);
+    Interp_Expect(interp, ';');
+    Interp_Output(interp, prompt.string, prompt.len);
+  }
+
+  char buffer[MAX_STRING_LEN+2];
+  char* text = 0;
+  BOOL first = TRUE;
+  for (;;)
+  {
+    struct var_name name;
+    struct value* target = Interp_ParseVariable(interp, &name);
+
+    char* item;
+    int len;
+    while ((len = Interp_NextItem(&text, &item)) < 0)
+    {
+      if (!from_file)
+        Interp_Output(interp, first ? "? " : "?? ", first ? 2 : 3);
+      first = FALSE;
+      if (!Interp_ReadInputLine(interp, buffer))
+        return;
+      text = buffer;
+    }
+    if (!Interp_StoreInputItem(interp, target, &name, item, len))
+    {
+      /* The C64 asks for the whole input again; we just move on to
+         the next script line for this variable */
+      Interp_Output(interp, "?REDO FROM START\r", 17);
+      text = 0;
+      continue;
+    }
+
+    if (Interp_Peek(interp) != ',')
+      break;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_DoGet
+
+  GET and GET#, fed one character at a time from the input script.
+  Line ends in the script are delivered as RETURN.
+*/
+void
+Interp_DoGet(struct interpreter* interp)
+{
+  if (Interp_Peek(interp) == '#')
+  {
+    Interp_Get(interp);
+    Interp_EvalNumber(interp);
+    Interp_Expect(interp, ',');
+  }
+  for (;;)
+  {
+    struct var_name name;
+    struct value* target = Interp_ParseVariable(interp, &name);
+    int c = interp->input ? fgetc(interp->input) : EOF;
+    if (c == EOF)
+    {
+      interp->running = FALSE;
+      interp->stop_reason = "input exhausted";
+      return;
+    }
+    if (c == '\n')
+      c = 0x0d;
+    c = toupper(c);
+    char ch = (char)c;
+    if (name.suffix == '$')
+    {
+      struct value v;
+      Interp_SetString(interp, &v, &ch, 1);
+      Interp_Assign(interp, target, &name, &v);
+    }
+    else
+    {
+      struct value v;
+      Interp_SetNumber(&v, isdigit(c) ? c - '0' : 0);
+      Interp_Assign(interp, target, &name, &v);
+    }
+    if (Interp_Peek(interp) != ',')
+      break;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_FindData
+
+  Search for the next DATA statement, starting at addr within the line
+  at line_addr. Returns the address following the DATA token, or
+  0xffff if there is none.
+*/
+u16
+Interp_FindData(struct interpreter* interp, u16 addr, u16 line_addr)
+{
+  byte_t* mem = interp->memory;
+  while (GETWORD(mem, line_addr))
+  {
+    BOOL in_quotes = FALSE;
+    for (; mem[addr]; ++addr)
+    {
+      Interp_Charge(interp, COST_CHRGET);
+      if (mem[addr] == '"')
+        in_quotes = !in_quotes;
+      if (in_quotes)
+        continue;
+      if (mem[addr] == TOKEN_REM)
+        break;
+      if (mem[addr] == TOKEN_DATA)
+        return addr + 1;
+    }
+    line_addr = GETWORD(mem, line_addr);
+    addr = line_addr + 4;
+  }
+  return 0xffff;
+}
+
+
+/*
+  Interp_NextData
+
+  Return the length of the next DATA item, setting *item to its first
+  byte. Quotes are removed.
+*/
+int
+Interp_NextData(struct interpreter* interp, char** item)
+{
+  byte_t* mem = interp->memory;
+  if (!interp->data_ptr)
+    interp->data_ptr = Interp_FindData(interp, interp->load_address + 4,
+                                       interp->load_address);
+  if (interp->data_ptr == 0xffff)
+    Interp_Error(interp, "OUT OF DATA");
+
+  u16 ptr = interp->data_ptr;
+  while (mem[ptr] == ' ')
+    ++ptr;
+  int len;
+  if (mem[ptr] == '"')
+  {
+    *item = (char*)&mem[++ptr];
+    while (mem[ptr] && mem[ptr] != '"')
+      ++ptr;
+    len = (char*)&mem[ptr] - *item;
+    if (mem[ptr] == '"')
+      ++ptr;
+    while (mem[ptr] == ' ')
+      ++ptr;
+  }
+  else
+  {
+    *item = (char*)&mem[ptr];
+    while (mem[ptr] && mem[ptr] != ',' && mem[ptr] != ':')
+      ++ptr;
+    len = (char*)&mem[ptr] - *item;
+    while (len > 0 && (*item)[len-1] == ' ')
+      --len;
+  }
+  Interp_Charge(interp, (ptr - interp->data_ptr) * COST_CHRGET);
+
+  if (mem[ptr] == ',')
+  {
+    interp->data_ptr = ptr + 1;
+    return len;
+  }
+
+  /* End of this DATA statement; continue the search after it */
+  u16 line_addr = interp->load_address;
+  while (GETWORD(mem, line_addr) &&
+         GETWORD(mem, line_addr) <= ptr)
+    line_addr = GETWORD(mem, line_addr);
+  interp->data_ptr = Interp_FindData(interp, ptr, line_addr);
+  return len;
+}
+
+
+/*
+  Interp_DoRead
+*/
+void
+Interp_DoRead(struct interpreter* interp)
+{
+  for (;;)
+  {
+    struct var_name name;
+    struct value* target = Interp_ParseVariable(interp, &name);
+    char* item;
+    int len = Interp_NextData(interp, &item);
+    if (!Interp_StoreInputItem(interp, target, &name, item, len))
+      Interp_Error(interp, "SYNTAX");
+    if (Interp_Peek(interp) != ',')
+      break;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_DoDim
+*/
+void
+Interp_DoDim(struct interpreter* interp)
+{
+  for (;;)
+  {
+    struct var_name name;
+    int dims[MAX_ARRAY_DIMENSIONS];
+    Interp_ParseName(interp, &name);
+    int num_dims = Interp_ParseSubscripts(interp, dims);
+    if (Interp_FindArray(interp, &name))
+      Interp_Error(interp, "REDIM'D ARRAY");
+    Interp_CreateArray(interp, &name, num_dims, dims);
+    if (Interp_Peek(interp) != ',')
+      break;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_Clear
+
+  Forget all variables, arrays, functions, FOR/GOSUB frames and the
+  DATA position (CLR, RUN).
+*/
+void
+Interp_Clear(struct interpreter* interp)
+{
+  for (int i = 0;
+       i < interp->num_arrays;
+       ++i)
+    Counted_Free(interp->arrays[i].elements);
+  interp->num_vars      = 0;
+  interp->num_arrays    = 0;
+  interp->num_functions = 0;
+  interp->stack_depth   = 0;
+  interp->data_ptr      = 0;
+}
+
+
+/*
+  Interp_PushFrame
+*/
+struct stack_frame*
+Interp_PushFrame(struct interpreter* interp, int type)
+{
+  if (interp->stack_depth >= MAX_STACK_FRAMES)
+    Interp_Error(interp, "OUT OF MEMORY");
+  struct stack_frame* frame = &interp->stack[interp->stack_depth++];
+  memset(frame, 0, sizeof(struct stack_frame));
+  frame->type      = type;
+  frame->txtptr    = interp->txtptr;
+  frame->line_addr = interp->line_addr;
+  return frame;
+}
+
+
+/*
+  Interp_DoFor
+*/
+void
+Interp_DoFor(struct interpreter* interp)
+{
+  struct var_name name;
+  Interp_ParseName(interp, &name);
+  if (name.suffix)
+    Interp_Error(interp, "TYPE MISMATCH");
+  struct value* var = Interp_FindVariable(interp, &name);
+  Interp_Expect(interp, TOKEN_EQUAL);
+  Interp_SetNumber(var, Interp_EvalNumber(interp));
+  Interp_Expect(interp, TOKEN_TO);
+  double limit = Interp_EvalNumber(interp);
+  double step = 1;
+  if (Interp_Peek(interp) == TOKEN_STEP)
+  {
+    Interp_Get(interp);
+    step = Interp_EvalNumber(interp);
+  }
+
+  /* A FOR on a variable that already has a loop replaces that loop
+     and all loops within it */
+  for (int i = interp->stack_depth - 1;
+       i >= 0;
+       --i)
+  {
+    if (interp->stack[i].type == FRAME_GOSUB)
+      break;
+    if (interp->stack[i].var == var)
+    {
+      interp->stack_depth = i;
+      break;
+    }
+  }
+  struct stack_frame* frame = Interp_PushFrame(interp, FRAME_FOR);
+  frame->var   = var;
+  frame->limit = limit;
+  frame->step  = step;
+}
+
+
+/*
+  Interp_DoNext
+*/
+void
+Interp_DoNext(struct interpreter* interp)
+{
+  for (;;)
+  {
+    struct value* var = 0;
+    if (!Interp_IsStatementEnd(interp))
+    {
+      struct var_name name;
+      Interp_ParseName(interp, &name);
+      var = Interp_FindVariable(interp, &name);
+    }
+
+    int i = interp->stack_depth - 1;
+    while (i >= 0 &&
+           interp->stack[i].type == FRAME_FOR &&
+           var &&
+           interp->stack[i].var != var)
+      --i;
+    if (i < 0 ||
+        interp->stack[i].type != FRAME_FOR)
+      Interp_Error(interp, "NEXT WITHOUT FOR");
+    interp->stack_depth = i + 1;
+
+    struct stack_frame* frame = &interp->stack[i];
+    frame->var->number += frame->step;
+    Interp_Charge(interp, COST_FADD + COST_FCOMPARE);
+    BOOL done = (frame->step >= 0) ? (frame->var->number > frame->limit)
+                                   : (frame->var->number < frame->limit);
+    if (!done)
+    {
+      interp->line_addr = frame->line_addr;
+      interp->txtptr    = frame->txtptr;
+      return;
+    }
+    --interp->stack_depth;
+
+    if (Interp_Peek(interp) != ',')
+      return;
+    Interp_Get(interp);
+  }
+}
+
+
+/*
+  Interp_DoReturn
+*/
+void
+Interp_DoReturn(struct interpreter* interp)
+{
+  /* Discard FOR loops started within the subroutine */
+  while (interp->stack_depth > 0 &&
+         interp->stack[interp->stack_depth-1].type != FRAME_GOSUB)
+    --interp->stack_depth;
+  if (interp->stack_depth == 0)
+    Interp_Error(interp, "RETURN WITHOUT GOSUB");
+  struct stack_frame* frame = &interp->stack[--interp->stack_depth];
+  interp->line_addr = frame->line_addr;
+  interp->txtptr    = frame->txtptr;
+  Interp_SkipStatement(interp);
+}
+
+
+/*
+  Interp_DoDef
+*/
+void
+Interp_DoDef(struct interpreter* interp)
+{
+  Interp_Expect(interp, TOKEN_FN);
+  if (interp->num_functions >= MAX_FUNCTIONS)
+    Interp_Error(interp, "OUT OF MEMORY");
+  struct var_name name;
+  Interp_ParseName(interp, &name);
+  struct function* function = 0;
+  for (int i = 0;
+       i < interp->num_functions;
+       ++i)
+  {
+    if (Interp_NameEquals(&interp->functions[i].name, &name))
+      function = &interp->functions[i];
+  }
+  if (!function)
+    function = &interp->functions[interp->num_functions++];
+  function->name = name;
+  Interp_Expect(interp, '(');
+  Interp_ParseName(interp, &function->param);
+  Interp_Expect(interp, ')');
+  Interp_Expect(interp, TOKEN_EQUAL);
+  function->expression = interp->txtptr;
+  Interp_SkipStatement(interp);
+}
+
+
+/*
+  Interp_SkipArguments
+
+  Evaluate and discard a comma separated argument list (device I/O
+  stubs).
+*/
+void
+Interp_SkipArguments(struct interpreter* interp)
+{
+  while (!Interp_IsStatementEnd(interp))
+  {
+    struct value v;
+    if (Interp_Peek(interp) == ',')
+    {
+      Interp_Get(interp);
+      continue;
+    }
+    Interp_EvalExpression(interp, &v);
+  }
+}
+
+
+/*
+  Interp_DoStatement
+
+  Execute a single statement.
+*/
+void
+Interp_DoStatement(struct interpreter* interp)
+{
+  byte_t token = Interp_Peek(interp);
+  if (token < 0x80)
+  {
+    /* Implicit LET */
+    struct var_name name;
+    struct value* target = Interp_ParseVariable(interp, &name);
+    struct value v;
+    Interp_Expect(interp, TOKEN_EQUAL);
+    Interp_EvalExpression(interp, &v);
+    Interp_Assign(interp, target, &name, &v);
+    return;
+  }
+  Interp_Get(interp);
+
+  switch (token)
+  {
+    case TOKEN_LET:
+    {
+      struct var_name name;
+      struct value* target = Interp_ParseVariable(interp, &name);
+      struct value v;
+      Interp_Expect(interp, TOKEN_EQUAL);
+      Interp_EvalExpression(interp, &v);
+      Interp_Assign(interp, target, &name, &v);
+      break;
+    }
+    case TOKEN_PRINT:      Interp_DoPrint(interp, FALSE);  break;
+    case TOKEN_PRINT_FILE: Interp_DoPrint(interp, TRUE);   break;
+    case TOKEN_INPUT:      Interp_DoInput(interp, FALSE);  break;
+    case TOKEN_INPUT_FILE: Interp_DoInput(interp, TRUE);   break;
+    case TOKEN_GET:        Interp_DoGet(interp);           break;
+    case TOKEN_READ:       Interp_DoRead(interp);          break;
+    case TOKEN_DIM:        Interp_DoDim(interp);           break;
+    case TOKEN_FOR:        Interp_DoFor(interp);           break;
+    case TOKEN_NEXT:       Interp_DoNext(interp);          break;
+    case TOKEN_RETURN:     Interp_DoReturn(interp);        break;
+    case TOKEN_DEF:        Interp_DoDef(interp);           break;
+
+    case TOKEN_DATA:
+      Interp_SkipStatement(interp);
+      break;
+
+    case TOKEN_REM:
+      Interp_SkipLine(interp);
+      break;
+
+    case TOKEN_GOTO:
+      Interp_Goto(interp, Interp_ParseLineNumber(interp));
+      break;
+
+    case TOKEN_GO:
+      Interp_Expect(interp, TOKEN_TO);
+      Interp_Goto(interp, Interp_ParseLineNumber(interp));
+      break;
+
+    case TOKEN_GOSUB:
+    {
+      u16 line_no = Interp_ParseLineNumber(interp);
+      Interp_PushFrame(interp, FRAME_GOSUB);
+      Interp_Goto(interp, line_no);
+      break;
+    }
+
+    case TOKEN_IF:
+    {
+      double condition = Interp_EvalNumber(interp);
+      byte_t next = Interp_Get(interp);
+      if (next != TOKEN_THEN &&
+          next != TOKEN_GOTO)
+        Interp_Error(interp, "SYNTAX");
+      if (condition == 0)
+      {
+        Interp_SkipLine(interp);
+        break;
+      }
+      if (isdigit(Interp_Peek(interp)))
+        Interp_Goto(interp, Interp_ParseLineNumber(interp));
+      else if (next == TOKEN_GOTO)
+        Interp_Error(interp, "SYNTAX");
+      else
+        Interp_DoStatement(interp);
+      break;
+    }
+
+    case TOKEN_ON:
+    {
+      int index = Interp_ToByte(interp, Interp_EvalNumber(interp));
+      byte_t kind = Interp_Get(interp);
+      if (kind != TOKEN_GOTO &&
+          kind != TOKEN_GOSUB)
+        Interp_Error(interp, "SYNTAX");
+      for (int i = 1;
+           ;
+           ++i)
+      {
+        u16 line_no = Interp_ParseLineNumber(interp);
+        if (i == index)
+        {
+          Interp_SkipStatement(interp);
+          if (kind == TOKEN_GOSUB)
+            Interp_PushFrame(interp, FRAME_GOSUB);
+          Interp_Goto(interp, line_no);
+          break;
+        }
+        if (Interp_Peek(interp) != ',')
+          break;
+        Interp_Get(interp);
+      }
+      break;
+    }
+
+    case TOKEN_RESTORE:
+      interp->data_ptr = 0;
+      break;
+
+    case TOKEN_POKE:
+    {
+      u16 address = Interp_ToAddress(interp, Interp_EvalNumber(interp));
+      Interp_Expect(interp, ',');
+      interp->memory[address] = Interp_ToByte(interp, Interp_EvalNumber(interp));
+      break;
+    }
+
+    case TOKEN_CLR:
+      Interp_Clear(interp);
+      break;
+
+    case TOKEN_RUN:
+    {
+      Interp_Clear(interp);
+      if (isdigit(Interp_Peek(interp)))
+        Interp_Goto(interp, Interp_ParseLineNumber(interp));
+      else
+        Interp_EnterLine(interp, interp->load_address);
+      break;
+    }
+
+    case TOKEN_END:
+    case TOKEN_STOP:
+    case TOKEN_NEW:
+      interp->running = FALSE;
+      interp->stop_reason = token_list[token - 0x80];
+      break;
+
+    case TOKEN_WAIT:
+    case TOKEN_SYS:
+    case TOKEN_OPEN:
+    case TOKEN_CLOSE:
+    case TOKEN_CMD:
+    case TOKEN_LOAD:
+    case TOKEN_SAVE:
+    case TOKEN_VERIFY:
+      /* Stubs: evaluate the arguments only */
+      Interp_SkipArguments(interp);
+      break;
+
+    case TOKEN_CONT:
+    case TOKEN_LIST:
+      Interp_SkipStatement(interp);
+      break;
+
+    default:
+      Interp_Error(interp, "SYNTAX");
+  }
+}
+
+
+/*
+  Interp_Run
+
+  Execute the program from its first line until it ends, the input
+  script is exhausted or max_statements statements have run.
+*/
+void
+Interp_Run(struct interpreter* interp)
+{
+  interp->running = TRUE;
+  interp->stop_reason = "END";
+  if ((u32)interp->load_address + 4 > interp->program_end ||
+      !GETWORD(interp->memory, interp->load_address))
+    return;
+  Interp_EnterLine(interp, interp->load_address);
+
+  while (interp->running)
+  {
+    byte_t c = Interp_Peek(interp);
+    if (c == ':')
+    {
+      Interp_Get(interp);
+      continue;
+    }
+    if (c == 0)
+    {
+      /* Advance to the next line, or stop at the end of the program */
+      if (!Interp_IsValidLink(interp, interp->line_addr))
+        Interp_Malformed(interp, interp->line_addr);
+      u16 next_line_addr = GETWORD(interp->memory, interp->line_addr);
+      if (!GETWORD(interp->memory, next_line_addr))
+        break;
+      Interp_EnterLine(interp, next_line_addr);
+      continue;
+    }
+
+    if (interp->total_statements >= interp->max_statements)
+    {
+      interp->stop_reason = "statement limit reached";
+      break;
+    }
+    ++interp->total_statements;
+    u16 line_no = Interp_LineNumber(interp);
+    if (line_no < NUM_LINE_NUMBERS)
+      ++interp->profile[line_no].statements;
+    Interp_Charge(interp, COST_STATEMENT);
+
+    interp->jumped = FALSE;
+    Interp_DoStatement(interp);
+    /* Unless control was transferred, the statement must end here */
+    if (interp->running &&
+        !interp->jumped &&
+        !Interp_IsStatementEnd(interp))
+      Interp_Error(interp, "SYNTAX");
+  }
+}
+
+
+/*
+  Interp_PrintReport
+
+  Print the per-line execution profile gathered by the run.
+*/
+void
+Interp_PrintReport(struct interpreter* interp)
+{
+  fflush(stdout);
+  printf("\n%-8s %12s %12s %14s %7s\n", "Line", "Hits", "Statements", "Cycles", "Time%");
+  u16 addr = interp->load_address;
+  while ((u32)addr + 4 <= interp->program_end &&
+         GETWORD(interp->memory, addr))
+  {
+    u16 line_no = GETWORD(interp->memory, addr+2);
+    if (line_no < NUM_LINE_NUMBERS)
+    {
+      struct line_profile* line = &interp->profile[line_no];
+      double percent = interp->total_cycles ?
+        100.0 * line->cycles / interp->total_cycles : 0;
+      printf("%-8u %12llu %12llu %14llu %7.2f\n", line_no,
+             (unsigned long long)line->hits,
+             (unsigned long long)line->statements,
+             (unsigned long long)line->cycles,
+             percent);
+    }
+    /* Interp_Malformed reports a bad link; just stop listing there */
+    if (!Interp_IsValidLink(interp, addr))
+      break;
+    addr = GETWORD(interp->memory, addr);
+  }
+  printf("\nStopped: %s\n", interp->stop_reason);
+  printf("Total: %llu statements, %llu cycles (~%.2f s on a PAL C64)\n",
+         (unsigned long long)interp->total_statements,
+         (unsigned long long)interp->total_cycles,
+         (double)interp->total_cycles / PAL_CLOCK_HZ);
+}
+
+
+/*
+  ProfilePRG
+
+  Run the PRG image in buffer (including its two byte load address) on
+  the host interpreter and print a per-line profile.
+*/
+void
+ProfilePRG(byte_t* buffer, u32 buffer_len, char* input_path, u64 max_statements)
+{
+  struct interpreter* interp = (struct interpreter*)Counted_Malloc(sizeof(struct interpreter));
+  memset(interp, 0, sizeof(struct interpreter));
+  interp->profile = (struct line_profile*)Counted_Calloc(NUM_LINE_NUMBERS, sizeof(struct line_profile));
+  interp->max_statements = max_statements ? max_statements : DEFAULT_MAX_STATEMENTS;
+  interp->rnd_seed = 1;
+
+  interp->load_address = GETWORD(buffer, 0);
+  u32 image_len = buffer_len - 2;
+  if (interp->load_address + image_len > INTERP_MEMORY_SIZE)
+    image_len = INTERP_MEMORY_SIZE - interp->load_address;
+  memcpy(&interp->memory[interp->load_address], &buffer[2], image_len);
+  interp->program_end = interp->load_address + image_len;
+
+  if (input_path)
+  {
+    interp->input = fopen(input_path, "rb");
+    if (!interp->input)
+    {
+      fprintf(stderr, "Failed to open file %s\n", input_path);
+      exit(-1);
+    }
+  }
+
+  Interp_Run(interp);
+  Interp_PrintReport(interp);
+
+  if (interp->input)
+    fclose(interp->input);
+  Interp_Clear(interp);
+  Counted_Free(interp->profile);
+  Counted_Free(interp);
+}
+
+/*
+  Structured output
+
+  Besides the plain listing, prgdc can emit every line as a record
+  holding its line number, address, link pointer, raw bytes and a
+  token stream, for tools that would otherwise have to lex BASIC
+  again. Tokens cover the raw bytes of the line without gaps, and the
+  concatenation of their texts is the line as listed in text format.
+
+  Two formats are available:
+
+  - JSON Lines: one object per BASIC line,
+
+      {"line":10,"address":2049,"link":2061,"bytes":"99 22 ...",
+       "tokens":[{"kind":"keyword","offset":0,"length":1,
+                  "text":"PRINT"},...]}
+
+  - Binary: a compact little-endian format of 4-byte aligned records
+    that can be mapped into memory and walked directly.
+
+      File header (16 bytes)
+        char[4]  magic "PRGT"
+        u16      format version (1)
+        u16      load address
+        u32      number of records
+        u32      reserved (0)
+
+      Record
+        u32      record length in bytes, including padding
+        u16      line number
+        u16      address of the line
+        u16      link pointer
+        u16      number of raw bytes, excluding the terminating 0
+        u16      number of tokens
+        u16      length of the text pool
+        token[]  8 bytes each:
+                   u8   kind (enum lex_kind)
+                   u8   reserved (0)
+                   u16  offset into the raw bytes
+                   u16  length in raw bytes
+                   u16  offset of the token's text in the text pool;
+                        the text ends where the next token's begins
+        u8[]     raw bytes
+        char[]   text pool
+        u8[]     zero padding to a multiple of 4 bytes
+*/
+enum output_format
+{
+  FORMAT_TEXT,
+  FORMAT_JSONL,
+  FORMAT_BINARY
+};
+
+enum lex_kind
+{
+  LEX_KEYWORD,
+  LEX_NUMBER,
+  LEX_STRING,
+  LEX_VARIABLE,
+  LEX_CONTROL,     /* PETSCII control codes: colors, cursor movement, ... */
+  LEX_TEXT,        /* Unquoted text after REM and within DATA */
+  LEX_OTHER        /* Operators, punctuation and whitespace */
+};
+
+char* lex_kind_names[] =
+{
+  "keyword",
+  "number",
+  "string",
+  "variable",
+  "control",
+  "text",
+  "other"
+};
+
+struct lex_token
+{
+  u8     kind;
+  u16    offset;
+  u16    length;
+};
+
+#define BINARY_FORMAT_VERSION  1
+
+
+/*
+  IsPETSCIIControl
+
+  Returns TRUE if byte is a PETSCII control code.
+*/
+BOOL
+IsPETSCIIControl(byte_t byte)
+{
+  return (byte < 0x20 ||
+          (byte >= 0x80 && byte < 0xa0));
+}
+
+
+/*
+  LexLine
+
+  Split the len raw bytes of a tokenized line into tokens.
+
+  Returns the number of tokens stored in tokens, which must have room
+  for len entries.
+*/
+u32
+LexLine(byte_t* data, u32 len, struct lex_token* tokens)
+{
+  u32 num_tokens = 0;
+  BOOL in_quotes = FALSE;
+  BOOL in_data   = FALSE;
+  BOOL in_rem    = FALSE;
+  u32 i = 0;
+  while (i < len)
+  {
+    byte_t byte = data[i];
+    u32 begin = i;
+    u32 token_len = 1;
+    u8 kind;
+
+    if ((in_quotes || in_data || in_rem) &&
+        IsPETSCIIControl(byte))
+    {
+      kind = LEX_CONTROL;
+      ++i;
+    }
+    else if (in_quotes ||
+             byte == '"')
+    {
+      /* A string runs up to its closing quote, and is split around
+         any control codes it contains */
+      kind = LEX_STRING;
+      if (!in_quotes)
+      {
+        in_quotes = TRUE;
+        ++i;
+      }
+      while (i < len &&
+             in_quotes &&
+             !IsPETSCIIControl(data[i]))
+      {
+        if (data[i] == '"')
+          in_quotes = FALSE;
+        ++i;
+      }
+    }
+    else if (in_rem)
+    {
+      kind = LEX_TEXT;
+      while (i < len &&
+             !IsPETSCIIControl(data[i]))
+        ++i;
+    }
+    else if (in_data)
+    {
+      if (byte == ':')
+      {
+        kind = LEX_OTHER;
+        in_data = FALSE;
+        ++i;
+      }
+      else
+      {
+        kind = LEX_TEXT;
+        while (i < len &&
+               data[i] != ':' &&
+               data[i] != '"' &&
+               !IsPETSCIIControl(data[i]))
+          ++i;
+      }
+    }
+    else if (TranslateToken(byte) ||
+             byte == TOKEN_PI ||
+             Dialect_TranslateToken(&data[i], len - i, &token_len))
+    {
+      kind = LEX_KEYWORD;
+      if (byte == TOKEN_REM)
+        in_rem = TRUE;
+      else if (byte == TOKEN_DATA)
+        in_data = TRUE;
+      i += token_len;
+    }
+    else if (IsPETSCIIControl(byte))
+    {
+      kind = LEX_CONTROL;
+      ++i;
+    }
+    else if (isdigit(byte) ||
+             byte == '.')
+    {
+      kind = LEX_NUMBER;
+      while (i < len &&
+             (isdigit(data[i]) || data[i] == '.'))
+        ++i;
+      /* Exponent; the sign was tokenized as an operator */
+      if (i < len &&
+          data[i] == 'E')
+      {
+        u32 exponent = i + 1;
+        if (exponent < len &&
+            (data[exponent] == TOKEN_PLUS || data[exponent] == TOKEN_MINUS ||
+             data[exponent] == '+' || data[exponent] == '-'))
+          ++exponent;
+        if (exponent < len &&
+            isdigit(data[exponent]))
+        {
+          i = exponent;
+          while (i < len &&
+                 isdigit(data[i]))
+            ++i;
+        }
+      }
+    }
+    else if (isalpha(byte))
+    {
+      kind = LEX_VARIABLE;
+      while (i < len &&
+             isalnum(data[i]))
+        ++i;
+      if (i < len &&
+          (data[i] == '$' || data[i] == '%'))
+        ++i;
+    }
+    else
+    {
+      kind = LEX_OTHER;
+      ++i;
+    }
+
+    tokens[num_tokens].kind   = kind;
+    tokens[num_tokens].offset = begin;
+    tokens[num_tokens].length = i - begin;
+    ++num_tokens;
+  }
+  return num_tokens;
+}
+
+
+/*
+  Lex_TokenText
+
+  Write the listing text of token to out.
+
+  Returns the length of the text.
+*/
+u32
+Lex_TokenText(byte_t* data, struct lex_token* token, char* out)
+{
+  u32 len = 0;
+  u32 end = (u32)token->offset + token->length;
+  for (u32 i = token->offset;
+       i < end;
+       ++i)
+  {
+    /* Keywords, and the exponent sign of numbers, are tokens */
+    char* keyword = 0;
+    u32 token_len = 1;
+    if (token->kind == LEX_KEYWORD ||
+        token->kind == LEX_NUMBER)
+      keyword = TranslateToken(data[i]);
+    if (!keyword &&
+        token->kind == LEX_KEYWORD)
+      keyword = Dialect_TranslateToken(&data[i], end - i, &token_len);
+    if (keyword)
+    {
+      len += sprintf(&out[len], "%s", keyword);
+      i += token_len - 1;
+    }
+    else
+      len += sprintf(&out[len], "%s", PETSCII_table[data[i]]);
+  }
+  return len;
+}
+
+
+/*
+  WriteJSONString
+
+  Write string to fp as a quoted JSON string.
+*/
+void
+WriteJSONString(FILE* fp, char* string, u32 len)
+{
+  fputc('"', fp);
+  for (u32 i = 0; i < len; ++i)
+  {
+    byte_t c = (byte_t)string[i];
+    if (c == '"' ||
+        c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20 ||
+             c >= 0x7f)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+
+/*
+  PutWord, PutLong
+
+  Write a little-endian 16 or 32-bit value to fp.
+*/
+void
+PutWord(FILE* fp, u16 value)
+{
+  fputc(value & 0xff, fp);
+  fputc(value >> 8, fp);
+}
+
+void
+PutLong(FILE* fp, u32 value)
+{
+  PutWord(fp, value & 0xffff);
+  PutWord(fp, value >> 16);
+}
+
+
+/*
+  WriteLineRecord
+
+  Write one line record in format to fp. data holds the line's len raw
+  bytes.
+*/
+void
+WriteLineRecord(FILE* fp, enum output_format format,
+                u16 line_no, u16 address, u16 link, byte_t* data, u32 len)
+{
+  struct lex_token* tokens = (struct lex_token*)Counted_Malloc((len+1) * sizeof(struct lex_token));
+  u32 num_tokens = LexLine(data, len, tokens);
+
+  /* The longest PETSCII placeholder is under 32 characters */
+  char* text = (char*)Counted_Malloc(len * 32 + 1);
+  u16* text_offsets = (u16*)Counted_Malloc((num_tokens+1) * sizeof(u16));
+  u32 text_len = 0;
+  for (u32 i = 0; i < num_tokens; ++i)
+  {
+    text_offsets[i] = text_len;
+    text_len += Lex_TokenText(data, &tokens[i], &text[text_len]);
+  }
+  text_offsets[num_tokens] = text_len;
+
+  if (format == FORMAT_JSONL)
+  {
+    fprintf(fp, "{\"line\":%u,\"address\":%u,\"link\":%u,\"bytes\":\"",
+            line_no, address, link);
+    for (u32 i = 0; i < len; ++i)
+      fprintf(fp, "%s%02x", i ? " " : "", data[i]);
+    fprintf(fp, "\",\"tokens\":[");
+    for (u32 i = 0; i < num_tokens; ++i)
+    {
+      fprintf(fp, "%s{\"kind\":\"%s\",\"offset\":%u,\"length\":%u,\"text\":",
+              i ? "," : "", lex_kind_names[tokens[i].kind],
+              tokens[i].offset, tokens[i].length);
+      WriteJSONString(fp, &text[text_offsets[i]], text_offsets[i+1] - text_offsets[i]);
+      fputc('}', fp);
+    }
+    fprintf(fp, "]}\n");
+  }
+  else
+  {
+    u32 record_len = 16 + num_tokens * 8 + len + text_len;
+    u32 padding = (4 - record_len % 4) % 4;
+    PutLong(fp, record_len + padding);
+    PutWord(fp, line_no);
+    PutWord(fp, address);
+    PutWord(fp, link);
+    PutWord(fp, len);
+    PutWord(fp, num_tokens);
+    PutWord(fp, text_len);
+    for (u32 i = 0; i < num_tokens; ++i)
+    {
+      fputc(tokens[i].kind, fp);
+      fputc(0, fp);
+      PutWord(fp, tokens[i].offset);
+      PutWord(fp, tokens[i].length);
+      PutWord(fp, text_offsets[i]);
+    }
+    fwrite(data, 1, len, fp);
+    fwrite(text, 1, text_len, fp);
+    while (padding--)
+      fputc(0, fp);
+  }
+
+  Counted_Free(text_offsets);
+  Counted_Free(text);
+  Counted_Free(tokens);
+}
+
+
+/*
+  WriteStructuredListing
+
+  Write every line of the PRG image in buffer (including its two byte
+  load address) to fp as a record in format.
+*/
+void
+WriteStructuredListing(FILE* fp, byte_t* buffer, u32 buffer_len, enum output_format format)
+{
+  u16 load_address = GETWORD(buffer, 0);
+
+  /* Walk the line links twice: the binary header needs the number of
+     records up front */
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    u32 num_records = 0;
+    u32 line_offset = 2;
+    while (line_offset + 4 <= buffer_len)
+    {
+      u16 link = GETWORD(buffer, line_offset);
+      if (!link)
+        break;
+
+      byte_t* data = &buffer[line_offset+4];
+      u32 len = 0;
+      while (line_offset + 4 + len < buffer_len &&
+             data[len])
+        ++len;
+
+      if (pass == 1)
+      {
+        WriteLineRecord(fp, format, GETWORD(buffer, line_offset+2),
+                        load_address + line_offset - 2, link, data, len);
+        ++alloc_stats.input_lines;
+      }
+      ++num_records;
+
+      /* Stop at links that don't point forward */
+      u32 next_line_offset = (u32)link - load_address + 2;
+      if (link < load_address ||
+          next_line_offset <= line_offset)
+        break;
+      line_offset = next_line_offset;
+    }
+
+    if (pass == 0 &&
+        format == FORMAT_BINARY)
+    {
+      fwrite("PRGT", 1, 4, fp);
+      PutWord(fp, BINARY_FORMAT_VERSION);
+      PutWord(fp, load_address);
+      PutLong(fp, num_records);
+      PutLong(fp, 0);
+    }
+  }
+}
+
+/*
+  Label reconstruction
+
+  With --labels, the text listing names the lines that are jumped to
+  instead of using their numbers: each such line is preceded by a label
+  line Lnnnn:, and every reference to it becomes Lnnnn. The references
+  are the targets prgbc translates labels in: those of GOTO, GO TO,
+  GOSUB (including the lists of ON...GOTO and ON...GOSUB), RESTORE,
+  RUN, and of THEN where nothing else follows in the statement. Only
+  references written the way prgbc writes line numbers (no leading
+  zeros or embedded spaces) to lines that exist are replaced, so the
+  listing compiles back to the identical PRG.
+
+  The targets are collected in a first walk over the program into a
+  bit set of all line numbers, keeping the cost linear in the program
+  size.
+*/
+#define LINE_SET_WORDS  (NUM_LINE_NUMBERS / 64)
+
+struct line_target
+{
+  u32    offset;
+  u16    line_no;
+};
+
+struct label_targets
+{
+  u64    targets[LINE_SET_WORDS];
+  u64    lines[LINE_SET_WORDS];
+};
+
+/*
+  LineSet_Add
+
+  Add line_no to the bit set set.
+*/
+void
+LineSet_Add(u64* set, u16 line_no)
+{
+  if (line_no < NUM_LINE_NUMBERS)
+    set[line_no / 64] |= 1ULL << (line_no % 64);
+}
+
+/*
+  LineSet_Contains
+
+  Returns TRUE if line_no is in the bit set set.
+*/
+BOOL
+LineSet_Contains(u64* set, u16 line_no)
+{
+  return (line_no < NUM_LINE_NUMBERS &&
+          (set[line_no / 64] >> (line_no % 64)) & 1);
+}
+
+/*
+  FindTargetList
+
+  Find the numeric jump targets of the comma separated list at
+  line[*pos], advancing *pos past them. If must_end_statement is set,
+  a target only counts if nothing but the end of the statement follows
+  it.
+
+  Returns the new number of targets stored in targets.
+*/
+u32
+FindTargetList(byte_t* line, u32* pos, BOOL must_end_statement,
+               struct line_target* targets, u32 num_targets)
+{
+  for (;;)
+  {
+    while (line[*pos] == ' ')
+      ++*pos;
+    if (!isdigit(line[*pos]))
+      return num_targets;
+
+    u32 begin = *pos;
+    u32 value = 0;
+    while (isdigit(line[*pos]))
+    {
+      if (value < NUM_LINE_NUMBERS)
+        value = value * 10 + (line[*pos] - '0');
+      ++*pos;
+    }
+
+    u32 next = *pos;
+    while (line[next] == ' ')
+      ++next;
+    BOOL canonical = (line[begin] != '0' || *pos - begin == 1);
+    if (value < NUM_LINE_NUMBERS &&
+        canonical &&
+        (!must_end_statement || !line[next] || line[next] == ':'))
+    {
+      targets[num_targets].offset  = begin;
+      targets[num_targets].line_no = (u16)value;
+      ++num_targets;
+    }
+
+    if (line[next] != ',')
+      return num_targets;
+    *pos = next + 1;
+  }
+}
+
+/*
+  FindLineTargets
+
+  Find the numeric jump targets of the tokenized line, storing them in
+  targets in order, which must have room for one per byte of line.
+  Text within quotes, after REM and within DATA is skipped.
+
+  Returns the number of targets found.
+*/
+u32
+FindLineTargets(byte_t* line, struct line_target* targets)
+{
+  u32 num_targets = 0;
+  u32 pos = 0;
+  BOOL in_quotes = FALSE;
+  BOOL in_data   = FALSE;
+  while (line[pos])
+  {
+    byte_t token = line[pos++];
+
+    if (token == '"')
+      in_quotes = !in_quotes;
+    if (in_quotes)
+      continue;
+    if (in_data)
+    {
+      in_data = (token != ':');
+      continue;
+    }
+    if (token == TOKEN_REM)
+      break;
+    if (token == TOKEN_DATA)
+    {
+      in_data = TRUE;
+      continue;
+    }
+
+    if (token == TOKEN_GO)
+    {
+      /* GO TO */
+      while (line[pos] == ' ')
+        ++pos;
+      if (line[pos] != TOKEN_TO)
+        continue;
+      ++pos;
+      token = TOKEN_GOTO;
+    }
+
+    if (token == TOKEN_GOTO  ||
+        token == TOKEN_GOSUB ||
+        token == TOKEN_RESTORE ||
+        token == TOKEN_RUN)
+      num_targets = FindTargetList(line, &pos, FALSE, targets, num_targets);
+    else if (token == TOKEN_THEN)
+      num_targets = FindTargetList(line, &pos, TRUE, targets, num_targets);
+  }
+  return num_targets;
+}
+
+/*
+  InsertLabelReferences
+
+  Turn the numeric jump targets of the tokenized line that refer to
+  labeled lines into label references, by prefixing them with L.
+*/
+void
+InsertLabelReferences(char* line, struct label_targets* labels)
+{
+  static struct line_target targets[MAX_DATA_LINE_LEN];
+  u32 num_targets = FindLineTargets((byte_t*)line, targets);
+
+  /* Insert back to front, so that the offsets stay valid */
+  u32 len = strlen(line);
+  while (num_targets--)
+  {
+    u16 line_no = targets[num_targets].line_no;
+    if (!LineSet_Contains(labels->targets, line_no) ||
+        !LineSet_Contains(labels->lines, line_no) ||
+        len + 1 >= MAX_DATA_LINE_LEN)
+      continue;
+    u32 offset = targets[num_targets].offset;
+    memmove(&line[offset + 1], &line[offset], len - offset + 1);
+    line[offset] = 'L';
+    ++len;
+  }
+}
+
+/*
+  ReadListingLine
+
+  Copy the line at *line_offset of the PRG image in buffer into line,
+  and advance *line_offset to the next line.
+
+  Returns FALSE at the end of the program.
+*/
+BOOL
+ReadListingLine(byte_t* buffer, u32 buffer_len, u32* line_offset, struct basic_line* line)
+{
+  u16 load_address = GETWORD(buffer, 0);
+  if (*line_offset + 4 > buffer_len)
+    return FALSE;
+
+  u16 next_line_offset = GETWORD(buffer, *line_offset);
+  if (!next_line_offset)
+    return FALSE;
+
+  /* grab line from buffer up to NULL terminator */
+  memset(line, 0, sizeof(struct basic_line));
+  line->line_no = GETWORD(buffer, *line_offset+2);
+  u32 len = buffer_len - (*line_offset+4);
+  if (len > MAX_DATA_LINE_LEN - 1)
+    len = MAX_DATA_LINE_LEN - 1;
+  strncpy(line->data, (char*)&buffer[*line_offset+4], len);
+
+  /* Compute next line offset into buffer. The +2 accounts for first 2
+     bytes of buffer (program load address). Stop at links that don't
+     point forward. */
+  if (next_line_offset - load_address + 2 <= (s32)*line_offset)
+    *line_offset = buffer_len;
+  else
+    *line_offset = next_line_offset - load_address + 2;
+  return TRUE;
+}
+
+/*
+  Line index
+
+  To list a few lines of a large program, --lines first indexes the
+  offsets of all lines by following the link pointers alone, without
+  looking at the line contents, then finds the first line of the
+  range by binary search and decodes only the lines in the range.
+  WriteListingRange is the entry point for callers other than main.
+  If the line numbers aren't ascending, as in some hand-patched
+  programs, the index is searched linearly instead.
+*/
+struct line_index
+{
+  u32*   offsets;
+  u16*   line_nos;
+  u32    num_lines;
+  BOOL   sorted;
+};
+
+
+/*
+  BuildLineIndex
+
+  Index the lines of the PRG image in buffer by following the links.
+  The caller frees the index with FreeLineIndex.
+*/
+void
+BuildLineIndex(byte_t* buffer, u32 buffer_len, struct line_index* index)
+{
+  /* Every line takes at least five bytes */
+  u32 capacity = buffer_len / 5 + 1;
+  index->offsets  = (u32*)Counted_Malloc(capacity * sizeof(u32));
+  index->line_nos = (u16*)Counted_Malloc(capacity * sizeof(u16));
+  index->num_lines = 0;
+  index->sorted = TRUE;
+
+  u16 load_address = GETWORD(buffer, 0);
+  u32 line_offset = 2;
+  while (line_offset + 4 <= buffer_len)
+  {
+    u16 link = GETWORD(buffer, line_offset);
+    if (!link)
+      break;
+    u16 line_no = GETWORD(buffer, line_offset + 2);
+    if (index->num_lines &&
+        line_no <= index->line_nos[index->num_lines - 1])
+      index->sorted = FALSE;
+    index->offsets[index->num_lines] = line_offset;
+    index->line_nos[index->num_lines] = line_no;
+    ++index->num_lines;
+
+    /* Stop at links that don't point forward */
+    u32 next_line_offset = (u32)link - load_address + 2;
+    if (link < load_address ||
+        next_line_offset <= line_offset)
+      break;
+    line_offset = next_line_offset;
+  }
+}
+
+
+/*
+  FreeLineIndex
+*/
+void
+FreeLineIndex(struct line_index* index)
+{
+  Counted_Free(index->offsets);
+  Counted_Free(index->line_nos);
+  memset(index, 0, sizeof(struct line_index));
+}
+
+
+/*
+  LineIndex_LowerBound
+
+  Returns the position in index of the first line numbered line_no or
+  higher, or index->num_lines if there is none.
+*/
+u32
+LineIndex_LowerBound(struct line_index* index, u16 line_no)
+{
+  u32 low = 0;
+  u32 high = index->num_lines;
+  while (low < high)
+  {
+    u32 mid = low + (high - low) / 2;
+    if (index->line_nos[mid] < line_no)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+
+/*
+  WriteDecodedLine
+
+  Write line to fp as it appears in the text listing.
+*/
+void
+WriteDecodedLine(FILE* fp, struct basic_line* line)
+{
+  static char decoded[MAX_LISTING_LINE_LEN];
+  static char text[MAX_LISTING_LINE_LEN];
+  DecodeLine(line->data, decoded);
+  TranslatePETSCIIToASCII(decoded, text);
+  fprintf(fp, "%u %s\n", line->line_no, text);
+}
+
+
+/*
+  WriteListingRange
+
+  Write the text listing of the lines numbered first to last of the
+  PRG image in buffer to fp, using index.
+
+  Returns the number of lines written.
+*/
+u32
+WriteListingRange(FILE* fp, byte_t* buffer, u32 buffer_len, struct line_index* index,
+                  u16 first, u16 last)
+{
+  static struct basic_line line;
+  u32 num_written = 0;
+  u32 i = index->sorted ? LineIndex_LowerBound(index, first) : 0;
+  for (; i < index->num_lines; ++i)
+  {
+    u16 line_no = index->line_nos[i];
+    if (line_no > last &&
+        index->sorted)
+      break;
+    if (line_no < first ||
+        line_no > last)
+      continue;
+    u32 line_offset = index->offsets[i];
+    ReadListingLine(buffer, buffer_len, &line_offset, &line);
+    WriteDecodedLine(fp, &line);
+    ++num_written;
+  }
+  return num_written;
+}
+
+
+/*
+  ParseLineRange
+
+  Parse a line range given as A-B, A (just line A), A- (from A on) or
+  -B (up to B) into *first and *last.
+
+  Returns FALSE if range isn't valid.
+*/
+BOOL
+ParseLineRange(char* range, u16* first, u16* last)
+{
+  char* end;
+  u32 low = 0;
+  u32 high = 0xFFFF;
+  if (*range != '-')
+  {
+    low = strtoul(range, &end, 10);
+    if (end == range)
+      return FALSE;
+    range = end;
+    if (!*range)
+      high = low;
+  }
+  if (*range == '-')
+  {
+    ++range;
+    if (*range)
+    {
+      high = strtoul(range, &end, 10);
+      if (end == range)
+        return FALSE;
+      range = end;
+    }
+  }
+  if (*range ||
+      low > high ||
+      high > 0xFFFF)
+    return FALSE;
+  *first = low;
+  *last = high;
+  return TRUE;
+}
+
+/*
+  Data extraction
+
+  --extract-data pulls the bytes of DATA statements, such as sprites,
+  charsets and music, back out of a program into binary files. It
+  walks the tokenized lines directly, without building a listing: the
+  quote and colon masks of ScanLine find the DATA tokens outside
+  strings and the end of each statement, and ParseByteList checks the
+  items 16 or 32 bytes at a time before reading the numbers between
+  the commas. Consecutive DATA statements whose items are all
+  integers from 0 to 255 (an empty item reads as 0) form a run; a
+  line without DATA or any other item ends it. Runs of at least
+  MIN_EXTRACT_RUN bytes are written to <prefix>_<first>-<last>.bin,
+  named for their line range. A leading statement holding just the
+  number of bytes that follow, as prgbc's INCBIN writes, is left out.
+*/
+#define MIN_EXTRACT_RUN  8
+
+struct data_run
+{
+  byte_t* bytes;
+  u32     len;
+  u32     capacity;
+  u16     first_line_no;
+  u16     last_line_no;
+  u32     first_items;  /* Items of the run's first DATA statement */
+};
+
+
+/*
+  ParseByteList
+
+  Parse the len bytes of text as a comma-separated list of integers
+  from 0 to 255, writing them to out. Spaces are ignored, and empty
+  items are 0. At least two readable bytes must precede text.
+
+  Returns the number of items, or -1 if text isn't such a list.
+*/
+s32
+ParseByteList(byte_t* text, u32 len, byte_t* out)
+{
+  u64 commas[SCAN_WORDS];
+  u32 num_words = len / 64 + 1;
+  memset(commas, 0, num_words * sizeof(u64));
+
+  /* Every byte must be a digit, comma or space */
+  u32 i = 0;
+  u32 has_spaces = FALSE;
+#if defined(__AVX2__)
+  const __m256i comma_32 = _mm256_set1_epi8(',');
+  const __m256i space_32 = _mm256_set1_epi8(' ');
+  const __m256i before_0_32 = _mm256_set1_epi8('0' - 1);
+  const __m256i after_9_32 = _mm256_set1_epi8('9' + 1);
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)&text[i]);
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, before_0_32),
+                                     _mm256_cmpgt_epi8(after_9_32, chunk));
+    __m256i comma = _mm256_cmpeq_epi8(chunk, comma_32);
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(digit, comma),
+                                    _mm256_cmpeq_epi8(chunk, space_32));
+    if ((u32)_mm256_movemask_epi8(valid) != 0xFFFFFFFF)
+      return -1;
+    commas[i / 64] |= (u64)(u32)_mm256_movemask_epi8(comma) << (i % 64);
+    has_spaces |= _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, space_32));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i comma_16 = _mm_set1_epi8(',');
+  const __m128i space_16 = _mm_set1_epi8(' ');
+  const __m128i before_0_16 = _mm_set1_epi8('0' - 1);
+  const __m128i after_9_16 = _mm_set1_epi8('9' + 1);
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)&text[i]);
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, before_0_16),
+                                  _mm_cmpgt_epi8(after_9_16, chunk));
+    __m128i comma = _mm_cmpeq_epi8(chunk, comma_16);
+    __m128i valid = _mm_or_si128(_mm_or_si128(digit, comma),
+                                 _mm_cmpeq_epi8(chunk, space_16));
+    if ((u32)_mm_movemask_epi8(valid) != 0xFFFF)
+      return -1;
+    commas[i / 64] |= (u64)(u32)_mm_movemask_epi8(comma) << (i % 64);
+    has_spaces |= _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space_16));
+  }
+#endif
+  for (; i < len; ++i)
+  {
+    if (text[i] == ',')
+      commas[i / 64] |= 1ULL << (i % 64);
+    else if (text[i] == ' ')
+      has_spaces = TRUE;
+    else if (!isdigit(text[i]))
+      return -1;
+  }
+
+  /* Read the numbers between the commas, walking the comma bits */
+  s32 count = 0;
+  u32 begin = 0;
+  for (u32 word = 0; word < num_words; ++word)
+  {
+    u64 bits = commas[word];
+    for (;;)
+    {
+      u32 end = len;
+      if (bits)
+      {
+        end = word * 64 + LowestBit(bits);
+        bits &= bits - 1;
+      }
+      else if (word + 1 < num_words)
+        break;
+
+      u32 value = 0;
+      u32 digits = end - begin;
+      if (!has_spaces &&
+          digits <= 3)
+      {
+        /* Without spaces, an item is just its digits. Weigh the three
+           bytes ending the item by place, zeroing the places it
+           doesn't have, which avoids branching on its length. */
+        byte_t* last = &text[end];
+        value = (last[-1] - '0') * (digits >= 1) +
+                (last[-2] - '0') * 10 * (digits >= 2) +
+                (last[-3] - '0') * 100 * (digits >= 3);
+      }
+      else
+      {
+        digits = 0;
+        for (u32 pos = begin; pos < end; ++pos)
+        {
+          if (text[pos] == ' ')
+            continue;
+          value = value * 10 + (text[pos] - '0');
+          ++digits;
+        }
+      }
+      if (digits > 3 ||
+          value > 255)
+        return -1;
+      out[count++] = value;
+
+      if (end == len)
+        return count;
+      begin = end + 1;
+    }
+  }
+  return count;
+}
+
+
+/*
+  Extract_AddBytes
+
+  Append the count bytes of a DATA statement on line line_no to run.
+*/
+void
+Extract_AddBytes(struct data_run* run, u16 line_no, byte_t* bytes, u32 count)
+{
+  if (!run->len)
+  {
+    run->first_line_no = line_no;
+    run->first_items = count;
+  }
+  run->last_line_no = line_no;
+  if (run->len + count > run->capacity)
+  {
+    run->capacity = (run->len + count) * 2;
+    run->bytes = (byte_t*)Counted_Realloc(run->bytes, run->capacity);
+  }
+  memcpy(&run->bytes[run->len], bytes, count);
+  run->len += count;
+}
+
+
+/*
+  Extract_FlushRun
+
+  End run, writing it to a file named for prefix and its line range
+  if it is long enough.
+
+  Returns TRUE if a file was written.
+*/
+BOOL
+Extract_FlushRun(struct data_run* run, char* prefix)
+{
+  byte_t* bytes = run->bytes;
+  u32 len = run->len;
+  run->len = 0;
+
+  /* Leave out a byte count heading the run */
+  if (len > 1 &&
+      run->first_items == 1 &&
+      bytes[0] == len - 1)
+  {
+    ++bytes;
+    --len;
+  }
+  if (len < MIN_EXTRACT_RUN)
+    return FALSE;
+
+  char path[FILENAME_MAX];
+  snprintf(path, sizeof(path), "%s_%u-%u.bin", prefix,
+           run->first_line_no, run->last_line_no);
+  FILE* fp = fopen(path, "wb");
+  if (!fp)
+  {
+    fprintf(stderr, "Failed to open %s for writing\n", path);
+    exit(-1);
+  }
+  fwrite(bytes, 1, len, fp);
+  fclose(fp);
+  printf("Lines %u-%u: %u bytes to \"%s\"\n",
+         run->first_line_no, run->last_line_no, len, path);
+  return TRUE;
+}
+
+
+/*
+  ExtractData
+
+  Write the runs of byte DATA in the PRG image in buffer to binary
+  files named for prefix.
+*/
+void
+ExtractData(byte_t* buffer, u32 buffer_len, char* prefix)
+{
+  static struct line_scan scan;
+  static byte_t items[MAX_DATA_LINE_LEN];
+  struct data_run run;
+  memset(&run, 0, sizeof(run));
+  u32 num_files = 0;
+
+  u16 load_address = GETWORD(buffer, 0);
+  u32 line_offset = 2;
+  while (line_offset + 4 <= buffer_len)
+  {
+    u16 link = GETWORD(buffer, line_offset);
+    if (!link)
+      break;
+    u16 line_no = GETWORD(buffer, line_offset + 2);
+    byte_t* data = &buffer[line_offset + 4];
+    u32 len = 0;
+    while (line_offset + 4 + len < buffer_len &&
+           data[len] &&
+           len < MAX_DATA_LINE_LEN - 1)
+      ++len;
+    ++alloc_stats.input_lines;
+
+    ScanLine(data, len, &scan);
+    BOOL has_data = FALSE;
+    u32 pos = Scan_NextUnquoted(&scan, 0);
+    while (pos < len &&
+           data[pos] != TOKEN_REM)
+    {
+      if (data[pos] != TOKEN_DATA)
+      {
+        /* Skip both bytes of a prefixed dialect token */
+        u32 next = pos + (dialect_decoder.prefixed[data[pos]] ? 2 : 1);
+        pos = Scan_NextUnquoted(&scan, (next < len) ? next : len);
+        continue;
+      }
+      u32 end = Scan_NextUnquotedColon(&scan, pos + 1);
+      s32 count = ParseByteList(&data[pos + 1], end - pos - 1, items);
+      if (count < 0)
+        num_files += Extract_FlushRun(&run, prefix);
+      else
+        Extract_AddBytes(&run, line_no, items, count);
+      has_data = TRUE;
+      pos = Scan_NextUnquoted(&scan, end);
+    }
+    if (!has_data)
+      num_files += Extract_FlushRun(&run, prefix);
+
+    /* Stop at links that don't point forward */
+    u32 next_line_offset = (u32)link - load_address + 2;
+    if (link < load_address ||
+        next_line_offset <= line_offset)
+      break;
+    line_offset = next_line_offset;
+  }
+  num_files += Extract_FlushRun(&run, prefix);
+  Counted_Free(run.bytes);
+
+  if (!num_files)
+    fprintf(stderr, "No runs of at least %d DATA bytes found\n", MIN_EXTRACT_RUN);
+}
+
+/*
+  Disassembly
+
+  Many PRGs follow a SYS stub with machine code after the end of the
+  BASIC program, which LIST doesn't show. prgdc notes such trailing
+  bytes, and --disassemble lists them as 6502 code, decoded through a
+  table of all 256 opcodes. Code is found by following the flow of
+  control from the targets of the program's SYS statements, or from
+  the first trailing byte if no SYS lands in the trailing bytes:
+  branches, JSR and JMP are followed, while RTS, RTI, BRK, indirect
+  JMP and undocumented opcodes end a path. Bytes that aren't reached
+  are listed as data.
+*/
+#define MAX_SYS_TARGETS  64
+
+enum address_mode
+{
+  MODE_ILL,     /* Undocumented opcode */
+  MODE_IMP,
+  MODE_ACC,
+  MODE_IMM,
+  MODE_ZP,
+  MODE_ZPX,
+  MODE_ZPY,
+  MODE_ABS,
+  MODE_ABX,
+  MODE_ABY,
+  MODE_IND,
+  MODE_IZX,
+  MODE_IZY,
+  MODE_REL
+};
+
+/* Instruction length in bytes, by address mode */
+u8 mode_lengths[] =
+{
+  1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2, 2
+};
+
+/* Operand syntax by address mode: the text around its hex value */
+char* mode_prefixes[] =
+{
+  "", "", " A", " #$", " $", " $", " $", " $", " $", " $", " ($", " ($", " ($", " $"
+};
+char* mode_suffixes[] =
+{
+  "", "", "", "", "", ",X", ",Y", "", ",X", ",Y", ")", ",X)", "),Y", ""
+};
+
+struct opcode
+{
+  char*  mnemonic;
+  u8     mode;
+};
+
+/* Offsets into this table equal the opcode */
+struct opcode opcode_table[256] =
+{
+    /* 00 */ { "BRK", MODE_IMP },
+    /* 01 */ { "ORA", MODE_IZX },
+    /* 02 */ { 0,     MODE_ILL },
+    /* 03 */ { 0,     MODE_ILL },
+    /* 04 */ { 0,     MODE_ILL },
+    /* 05 */ { "ORA", MODE_ZP },
+    /* 06 */ { "ASL", MODE_ZP },
+    /* 07 */ { 0,     MODE_ILL },
+    /* 08 */ { "PHP", MODE_IMP },
+    /* 09 */ { "ORA", MODE_IMM },
+    /* 0A */ { "ASL", MODE_ACC },
+    /* 0B */ { 0,     MODE_ILL },
+    /* 0C */ { 0,     MODE_ILL },
+    /* 0D */ { "ORA", MODE_ABS },
+    /* 0E */ { "ASL", MODE_ABS },
+    /* 0F */ { 0,     MODE_ILL },
+    /* 10 */ { "BPL", MODE_REL },
+    /* 11 */ { "ORA", MODE_IZY },
+    /* 12 */ { 0,     MODE_ILL },
+    /* 13 */ { 0,     MODE_ILL },
+    /* 14 */ { 0,     MODE_ILL },
+    /* 15 */ { "ORA", MODE_ZPX },
+    /* 16 */ { "ASL", MODE_ZPX },
+    /* 17 */ { 0,     MODE_ILL },
+    /* 18 */ { "CLC", MODE_IMP },
+    /* 19 */ { "ORA", MODE_ABY },
+    /* 1A */ { 0,     MODE_ILL },
+    /* 1B */ { 0,     MODE_ILL },
+    /* 1C */ { 0,     MODE_ILL },
+    /* 1D */ { "ORA", MODE_ABX },
+    /* 1E */ { "ASL", MODE_ABX },
+    /* 1F */ { 0,     MODE_ILL },
+    /* 20 */ { "JSR", MODE_ABS },
+    /* 21 */ { "AND", MODE_IZX },
+    /* 22 */ { 0,     MODE_ILL },
+    /* 23 */ { 0,     MODE_ILL },
+    /* 24 */ { "BIT", MODE_ZP },
+    /* 25 */ { "AND", MODE_ZP },
+    /* 26 */ { "ROL", MODE_ZP },
+    /* 27 */ { 0,     MODE_ILL },
+    /* 28 */ { "PLP", MODE_IMP },
+    /* 29 */ { "AND", MODE_IMM },
+    /* 2A */ { "ROL", MODE_ACC },
+    /* 2B */ { 0,     MODE_ILL },
+    /* 2C */ { "BIT", MODE_ABS },
+    /* 2D */ { "AND", MODE_ABS },
+    /* 2E */ { "ROL", MODE_ABS },
+    /* 2F */ { 0,     MODE_ILL },
+    /* 30 */ { "BMI", MODE_REL },
+    /* 31 */ { "AND", MODE_IZY },
+    /* 32 */ { 0,     MODE_ILL },
+    /* 33 */ { 0,     MODE_ILL },
+    /* 34 */ { 0,     MODE_ILL },
+    /* 35 */ { "AND", MODE_ZPX },
+    /* 36 */ { "ROL", MODE_ZPX },
+    /* 37 */ { 0,     MODE_ILL },
+    /* 38 */ { "SEC", MODE_IMP },
+    /* 39 */ { "AND", MODE_ABY },
+    /* 3A */ { 0,     MODE_ILL },
+    /* 3B */ { 0,     MODE_ILL },
+    /* 3C */ { 0,     MODE_ILL },
+    /* 3D */ { "AND", MODE_ABX },
+    /* 3E */ { "ROL", MODE_ABX },
+    /* 3F */ { 0,     MODE_ILL },
+    /* 40 */ { "RTI", MODE_IMP },
+    /* 41 */ { "EOR", MODE_IZX },
+    /* 42 */ { 0,     MODE_ILL },
+    /* 43 */ { 0,     MODE_ILL },
+    /* 44 */ { 0,     MODE_ILL },
+    /* 45 */ { "EOR", MODE_ZP },
+    /* 46 */ { "LSR", MODE_ZP },
+    /* 47 */ { 0,     MODE_ILL },
+    /* 48 */ { "PHA", MODE_IMP },
+    /* 49 */ { "EOR", MODE_IMM },
+    /* 4A */ { "LSR", MODE_ACC },
+    /* 4B */ { 0,     MODE_ILL },
+    /* 4C */ { "JMP", MODE_ABS },
+    /* 4D */ { "EOR", MODE_ABS },
+    /* 4E */ { "LSR", MODE_ABS },
+    /* 4F */ { 0,     MODE_ILL },
+    /* 50 */ { "BVC", MODE_REL },
+    /* 51 */ { "EOR", MODE_IZY },
+    /* 52 */ { 0,     MODE_ILL },
+    /* 53 */ { 0,     MODE_ILL },
+    /* 54 */ { 0,     MODE_ILL },
+    /* 55 */ { "EOR", MODE_ZPX },
+    /* 56 */ { "LSR", MODE_ZPX },
+    /* 57 */ { 0,     MODE_ILL },
+    /* 58 */ { "CLI", MODE_IMP },
+    /* 59 */ { "EOR", MODE_ABY },
+    /* 5A */ { 0,     MODE_ILL },
+    /* 5B */ { 0,     MODE_ILL },
+    /* 5C */ { 0,     MODE_ILL },
+    /* 5D */ { "EOR", MODE_ABX },
+    /* 5E */ { "LSR", MODE_ABX },
+    /* 5F */ { 0,     MODE_ILL },
+    /* 60 */ { "RTS", MODE_IMP },
+    /* 61 */ { "ADC", MODE_IZX },
+    /* 62 */ { 0,     MODE_ILL },
+    /* 63 */ { 0,     MODE_ILL },
+    /* 64 */ { 0,     MODE_ILL },
+    /* 65 */ { "ADC", MODE_ZP },
+    /* 66 */ { "ROR", MODE_ZP },
+    /* 67 */ { 0,     MODE_ILL },
+    /* 68 */ { "PLA", MODE_IMP },
+    /* 69 */ { "ADC", MODE_IMM },
+    /* 6A */ { "ROR", MODE_ACC },
+    /* 6B */ { 0,     MODE_ILL },
+    /* 6C */ { "JMP", MODE_IND },
+    /* 6D */ { "ADC", MODE_ABS },
+    /* 6E */ { "ROR", MODE_ABS },
+    /* 6F */ { 0,     MODE_ILL },
+    /* 70 */ { "BVS", MODE_REL },
+    /* 71 */ { "ADC", MODE_IZY },
+    /* 72 */ { 0,     MODE_ILL },
+    /* 73 */ { 0,     MODE_ILL },
+    /* 74 */ { 0,     MODE_ILL },
+    /* 75 */ { "ADC", MODE_ZPX },
+    /* 76 */ { "ROR", MODE_ZPX },
+    /* 77 */ { 0,     MODE_ILL },
+    /* 78 */ { "SEI", MODE_IMP },
+    /* 79 */ { "ADC", MODE_ABY },
+    /* 7A */ { 0,     MODE_ILL },
+    /* 7B */ { 0,     MODE_ILL },
+    /* 7C */ { 0,     MODE_ILL },
+    /* 7D */ { "ADC", MODE_ABX },
+    /* 7E */ { "ROR", MODE_ABX },
+    /* 7F */ { 0,     MODE_ILL },
+    /* 80 */ { 0,     MODE_ILL },
+    /* 81 */ { "STA", MODE_IZX },
+    /* 82 */ { 0,     MODE_ILL },
+    /* 83 */ { 0,     MODE_ILL },
+    /* 84 */ { "STY", MODE_ZP },
+    /* 85 */ { "STA", MODE_ZP },
+    /* 86 */ { "STX", MODE_ZP },
+    /* 87 */ { 0,     MODE_ILL },
+    /* 88 */ { "DEY", MODE_IMP },
+    /* 89 */ { 0,     MODE_ILL },
+    /* 8A */ { "TXA", MODE_IMP },
+    /* 8B */ { 0,     MODE_ILL },
+    /* 8C */ { "STY", MODE_ABS },
+    /* 8D */ { "STA", MODE_ABS },
+    /* 8E */ { "STX", MODE_ABS },
+    /* 8F */ { 0,     MODE_ILL },
+    /* 90 */ { "BCC", MODE_REL },
+    /* 91 */ { "STA", MODE_IZY },
+    /* 92 */ { 0,     MODE_ILL },
+    /* 93 */ { 0,     MODE_ILL },
+    /* 94 */ { "STY", MODE_ZPX },
+    /* 95 */ { "STA", MODE_ZPX },
+    /* 96 */ { "STX", MODE_ZPY },
+    /* 97 */ { 0,     MODE_ILL },
+    /* 98 */ { "TYA", MODE_IMP },
+    /* 99 */ { "STA", MODE_ABY },
+    /* 9A */ { "TXS", MODE_IMP },
+    /* 9B */ { 0,     MODE_ILL },
+    /* 9C */ { 0,     MODE_ILL },
+    /* 9D */ { "STA", MODE_ABX },
+    /* 9E */ { 0,     MODE_ILL },
+    /* 9F */ { 0,     MODE_ILL },
+    /* A0 */ { "LDY", MODE_IMM },
+    /* A1 */ { "LDA", MODE_IZX },
+    /* A2 */ { "LDX", MODE_IMM },
+    /* A3 */ { 0,     MODE_ILL },
+    /* A4 */ { "LDY", MODE_ZP },
+    /* A5 */ { "LDA", MODE_ZP },
+    /* A6 */ { "LDX", MODE_ZP },
+    /* A7 */ { 0,     MODE_ILL },
+    /* A8 */ { "TAY", MODE_IMP },
+    /* A9 */ { "LDA", MODE_IMM },
+    /* AA */ { "TAX", MODE_IMP },
+    /* AB */ { 0,     MODE_ILL },
+    /* AC */ { "LDY", MODE_ABS },
+    /* AD */ { "LDA", MODE_ABS },
+    /* AE */ { "LDX", MODE_ABS },
+    /* AF */ { 0,     MODE_ILL },
+    /* B0 */ { "BCS", MODE_REL },
+    /* B1 */ { "LDA", MODE_IZY },
+    /* B2 */ { 0,     MODE_ILL },
+    /* B3 */ { 0,     MODE_ILL },
+    /* B4 */ { "LDY", MODE_ZPX },
+    /* B5 */ { "LDA", MODE_ZPX },
+    /* B6 */ { "LDX", MODE_ZPY },
+    /* B7 */ { 0,     MODE_ILL },
+    /* B8 */ { "CLV", MODE_IMP },
+    /* B9 */ { "LDA", MODE_ABY },
+    /* BA */ { "TSX", MODE_IMP },
+    /* BB */ { 0,     MODE_ILL },
+    /* BC */ { "LDY", MODE_ABX },
+    /* BD */ { "LDA", MODE_ABX },
+    /* BE */ { "LDX", MODE_ABY },
+    /* BF */ { 0,     MODE_ILL },
+    /* C0 */ { "CPY", MODE_IMM },
+    /* C1 */ { "CMP", MODE_IZX },
+    /* C2 */ { 0,     MODE_ILL },
+    /* C3 */ { 0,     MODE_ILL },
+    /* C4 */ { "CPY", MODE_ZP },
+    /* C5 */ { "CMP", MODE_ZP },
+    /* C6 */ { "DEC", MODE_ZP },
+    /* C7 */ { 0,     MODE_ILL },
+    /* C8 */ { "INY", MODE_IMP },
+    /* C9 */ { "CMP", MODE_IMM },
+    /* CA */ { "DEX", MODE_IMP },
+    /* CB */ { 0,     MODE_ILL },
+    /* CC */ { "CPY", MODE_ABS },
+    /* CD */ { "CMP", MODE_ABS },
+    /* CE */ { "DEC", MODE_ABS },
+    /* CF */ { 0,     MODE_ILL },
+    /* D0 */ { "BNE", MODE_REL },
+    /* D1 */ { "CMP", MODE_IZY },
+    /* D2 */ { 0,     MODE_ILL },
+    /* D3 */ { 0,     MODE_ILL },
+    /* D4 */ { 0,     MODE_ILL },
+    /* D5 */ { "CMP", MODE_ZPX },
+    /* D6 */ { "DEC", MODE_ZPX },
+    /* D7 */ { 0,     MODE_ILL },
+    /* D8 */ { "CLD", MODE_IMP },
+    /* D9 */ { "CMP", MODE_ABY },
+    /* DA */ { 0,     MODE_ILL },
+    /* DB */ { 0,     MODE_ILL },
+    /* DC */ { 0,     MODE_ILL },
+    /* DD */ { "CMP", MODE_ABX },
+    /* DE */ { "DEC", MODE_ABX },
+    /* DF */ { 0,     MODE_ILL },
+    /* E0 */ { "CPX", MODE_IMM },
+    /* E1 */ { "SBC", MODE_IZX },
+    /* E2 */ { 0,     MODE_ILL },
+    /* E3 */ { 0,     MODE_ILL },
+    /* E4 */ { "CPX", MODE_ZP },
+    /* E5 */ { "SBC", MODE_ZP },
+    /* E6 */ { "INC", MODE_ZP },
+    /* E7 */ { 0,     MODE_ILL },
+    /* E8 */ { "INX", MODE_IMP },
+    /* E9 */ { "SBC", MODE_IMM },
+    /* EA */ { "NOP", MODE_IMP },
+    /* EB */ { 0,     MODE_ILL },
+    /* EC */ { "CPX", MODE_ABS },
+    /* ED */ { "SBC", MODE_ABS },
+    /* EE */ { "INC", MODE_ABS },
+    /* EF */ { 0,     MODE_ILL },
+    /* F0 */ { "BEQ", MODE_REL },
+    /* F1 */ { "SBC", MODE_IZY },
+    /* F2 */ { 0,     MODE_ILL },
+    /* F3 */ { 0,     MODE_ILL },
+    /* F4 */ { 0,     MODE_ILL },
+    /* F5 */ { "SBC", MODE_ZPX },
+    /* F6 */ { "INC", MODE_ZPX },
+    /* F7 */ { 0,     MODE_ILL },
+    /* F8 */ { "SED", MODE_IMP },
+    /* F9 */ { "SBC", MODE_ABY },
+    /* FA */ { 0,     MODE_ILL },
+    /* FB */ { 0,     MODE_ILL },
+    /* FC */ { 0,     MODE_ILL },
+    /* FD */ { "SBC", MODE_ABX },
+    /* FE */ { "INC", MODE_ABX },
+    /* FF */ { 0,     MODE_ILL }
+};
+
+/* Per byte of the trailing area */
+#define DISASM_CODE      0x01   /* First byte of an instruction */
+#define DISASM_OPERAND   0x02   /* Operand byte of an instruction */
+#define DISASM_ENTRY     0x04   /* A SYS target */
+
+char hex_digits[] = "0123456789ABCDEF";
+
+/*
+  FindProgramEnd
+
+  Follow the link pointers of the PRG image in buffer to the end of
+  the BASIC program.
+
+  Returns the offset into buffer just past the terminating zero link,
+  or 0 if the link chain is broken.
+*/
+u32
+FindProgramEnd(byte_t* buffer, u32 buffer_len)
+{
+  if (buffer_len < 2)
+    return 0;
+  u16 load_address = GETWORD(buffer, 0);
+  u32 line_offset = 2;
+  while (line_offset + 2 <= buffer_len)
+  {
+    u16 next_line_offset = GETWORD(buffer, line_offset);
+    if (!next_line_offset)
+      return line_offset + 2;
+    if (next_line_offset - load_address + 2 <= (s32)line_offset)
+      return 0;
+    line_offset = next_line_offset - load_address + 2;
+  }
+  return 0;
+}
+
+/*
+  FindSysTargets
+
+  Collect the addresses of the SYS statements of the PRG image in
+  buffer that are followed by a literal number.
+
+  Returns the number of addresses stored in targets.
+*/
+u32
+FindSysTargets(byte_t* buffer, u32 buffer_len, u16* targets)
+{
+  static struct basic_line line;
+  u32 num_targets = 0;
+  u32 line_offset = 2;
+  while (ReadListingLine(buffer, buffer_len, &line_offset, &line))
+  {
+    byte_t* data = (byte_t*)line.data;
+    BOOL in_quotes = FALSE;
+    BOOL in_data   = FALSE;
+    for (u32 i = 0; data[i]; ++i)
+    {
+      if (data[i] == '"')
+        in_quotes = !in_quotes;
+      if (in_quotes)
+        continue;
+      if (in_data)
+      {
+        in_data = (data[i] != ':');
+        continue;
+      }
+      if (data[i] == TOKEN_REM)
+        break;
+      if (data[i] == TOKEN_DATA)
+        in_data = TRUE;
+      if (data[i] != TOKEN_SYS)
+        continue;
+
+      u32 pos = i + 1;
+      while (data[pos] == ' ' ||
+             data[pos] == '(')
+        ++pos;
+      if (!isdigit(data[pos]))
+        continue;
+      u32 address = 0;
+      while (isdigit(data[pos]) &&
+             address < 0x10000)
+        address = address * 10 + (data[pos++] - '0');
+      if (address < 0x10000 &&
+          num_targets < MAX_SYS_TARGETS)
+        targets[num_targets++] = (u16)address;
+    }
+  }
+  return num_targets;
+}
+
+/*
+  Disasm_Trace
+
+  Mark the instructions reachable from entry in flags, the per-byte
+  flags of the len bytes of code loaded at base.
+*/
+void
+Disasm_Trace(byte_t* code, u32 len, u16 base, u32 entry, byte_t* flags)
+{
+  u32* pending = (u32*)Counted_Malloc((len + 1) * sizeof(u32));
+  u32 num_pending = 0;
+  pending[num_pending++] = entry;
+  while (num_pending)
+  {
+    u32 pos = pending[--num_pending];
+    for (;;)
+    {
+      if (pos >= len ||
+          (flags[pos] & (DISASM_CODE | DISASM_OPERAND)))
+        break;
+      struct opcode* op = &opcode_table[code[pos]];
+      u32 op_len = mode_lengths[op->mode];
+      if (op->mode == MODE_ILL ||
+          pos + op_len > len)
+        break;
+
+      flags[pos] |= DISASM_CODE;
+      for (u32 i = 1; i < op_len; ++i)
+        flags[pos + i] |= DISASM_OPERAND;
+
+      /* Jump targets within the trailing bytes */
+      s32 target = -1;
+      if (op->mode == MODE_REL)
+        target = (u16)(base + pos + 2 + (signed char)code[pos + 1]);
+      else if (op->mode == MODE_ABS &&
+               (code[pos] == 0x20 || code[pos] == 0x4C))
+        target = code[pos + 1] | (code[pos + 2] << 8);
+      if (target >= base &&
+          target < base + (s32)len &&
+          num_pending < len)
+        pending[num_pending++] = target - base;
+
+      /* Ends of a path: BRK, RTI, RTS, JMP */
+      byte_t opcode = code[pos];
+      if (opcode == 0x00 ||
+          opcode == 0x40 ||
+          opcode == 0x60 ||
+          opcode == 0x4C ||
+          opcode == 0x6C)
+        break;
+      pos += op_len;
+    }
+  }
+  Counted_Free(pending);
+}
+
+/*
+  Disasm_FormatInstruction
+
+  Write the listing line of the instruction at code[pos], loaded at
+  address, to out.
+
+  Returns the length of the line.
+*/
+u32
+Disasm_FormatInstruction(byte_t* code, u32 pos, u16 address, char* out)
+{
+  struct opcode* op = &opcode_table[code[pos]];
+  u32 op_len = mode_lengths[op->mode];
+  char* p = out;
+
+  /* Address and bytes, padded to a fixed width */
+  for (int shift = 12; shift >= 0; shift -= 4)
+    *p++ = hex_digits[(address >> shift) & 0xf];
+  *p++ = ' ';
+  for (u32 i = 0; i < 3; ++i)
+  {
+    *p++ = ' ';
+    if (i < op_len)
+    {
+      *p++ = hex_digits[code[pos + i] >> 4];
+      *p++ = hex_digits[code[pos + i] & 0xf];
+    }
+    else
+    {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+  }
+  *p++ = ' ';
+  *p++ = ' ';
+  memcpy(p, op->mnemonic, 3);
+  p += 3;
+
+  /* Formatted by hand; this is the hot loop of large dumps */
+  u16 operand = (op_len == 3) ? (code[pos + 1] | (code[pos + 2] << 8)) : code[pos + 1];
+  int digits = (op_len == 3) ? 4 : 2;
+  if (op->mode == MODE_REL)
+  {
+    operand = address + 2 + (signed char)operand;
+    digits = 4;
+  }
+  for (char* c = mode_prefixes[op->mode]; *c; ++c)
+    *p++ = *c;
+  if (op_len > 1)
+  {
+    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+      *p++ = hex_digits[(operand >> shift) & 0xf];
+  }
+  for (char* c = mode_suffixes[op->mode]; *c; ++c)
+    *p++ = *c;
+  *p++ = '\n';
+  return p - out;
+}
+
+/*
+  WriteDisassembly
+
+  Disassemble the bytes of the PRG image in buffer from end_offset,
+  the end of the BASIC program, to fp.
+*/
+void
+WriteDisassembly(FILE* fp, byte_t* buffer, u32 buffer_len, u32 end_offset)
+{
+  byte_t* code = &buffer[end_offset];
+  u32 len = buffer_len - end_offset;
+  u16 base = GETWORD(buffer, 0) + end_offset - 2;
+  /* Nothing loads past the top of memory */
+  if (base + len > 0x10000)
+    len = 0x10000 - base;
+  byte_t* flags = (byte_t*)Counted_Calloc(len, 1);
+
+  u16 targets[MAX_SYS_TARGETS];
+  u32 num_targets = FindSysTargets(buffer, buffer_len, targets);
+  BOOL traced = FALSE;
+  for (u32 i = 0; i < num_targets; ++i)
+  {
+    if (targets[i] < base ||
+        targets[i] >= base + len)
+      continue;
+    flags[targets[i] - base] |= DISASM_ENTRY;
+    Disasm_Trace(code, len, base, targets[i] - base, flags);
+    traced = TRUE;
+  }
+  if (!traced)
+    Disasm_Trace(code, len, base, 0, flags);
+
+  fprintf(fp, "\n; %u bytes after the BASIC program\n", len);
+  char out[80];
+  u32 pos = 0;
+  while (pos < len)
+  {
+    u16 address = base + pos;
+    if (flags[pos] & DISASM_ENTRY)
+      fprintf(fp, "; SYS %u\n", address);
+
+    if (flags[pos] & DISASM_CODE)
+    {
+      fwrite(out, 1, Disasm_FormatInstruction(code, pos, address, out), fp);
+      pos += mode_lengths[opcode_table[code[pos]].mode];
+      continue;
+    }
+
+    /* Data, up to 8 bytes per line until the next instruction */
+    char* p = out;
+    for (int shift = 12; shift >= 0; shift -= 4)
+      *p++ = hex_digits[(address >> shift) & 0xf];
+    p += sprintf(p, "  .BYTE ");
+    u32 count = 0;
+    do
+    {
+      if (count)
+        *p++ = ',';
+      *p++ = '$';
+      *p++ = hex_digits[code[pos] >> 4];
+      *p++ = hex_digits[code[pos] & 0xf];
+      ++pos;
+      ++count;
+    } while (pos < len &&
+             count < 8 &&
+             !(flags[pos] & (DISASM_CODE | DISASM_ENTRY)));
+    *p++ = '\n';
+    fwrite(out, 1, p - out, fp);
+  }
+  Counted_Free(flags);
+}
+
+/*
+  WriteListing
+
+  Write the BASIC listing of the PRG image in buffer (including its two
+  byte load address) to fp in format. flags selects options of the
+  text listing: LISTING_LABELS names jump targets (see Label
+  reconstruction), and LISTING_DISASSEMBLE lists the bytes after the
+  BASIC program as machine code (see Disassembly). Otherwise, any such
+  bytes are noted on stderr.
+*/
+#define LISTING_LABELS       0x01
+#define LISTING_DISASSEMBLE  0x02
+
+void
+WriteListing(FILE* fp, byte_t* buffer, u32 buffer_len, enum output_format format,
+             u32 flags)
+{
+  u32 end_offset = FindProgramEnd(buffer, buffer_len);
+  if (end_offset &&
+      end_offset < buffer_len &&
+      !(flags & LISTING_DISASSEMBLE))
+  {
+    fprintf(stderr, "NOTE: %u bytes follow the BASIC program at $%04X (list them with --disassemble)\n",
+            buffer_len - end_offset, (u16)(GETWORD(buffer, 0) + end_offset - 2));
+  }
+
+  if (format != FORMAT_TEXT)
+  {
+    WriteStructuredListing(fp, buffer, buffer_len, format);
+    return;
+  }
+
+  static struct basic_line line;
+  static struct label_targets label_targets;
+  static struct line_target targets[MAX_DATA_LINE_LEN];
+  u32 line_offset;
+  if (flags & LISTING_LABELS)
+  {
+    memset(&label_targets, 0, sizeof(label_targets));
+    line_offset = 2;
+    while (ReadListingLine(buffer, buffer_len, &line_offset, &line))
+    {
+      LineSet_Add(label_targets.lines, line.line_no);
+      u32 num_targets = FindLineTargets((byte_t*)line.data, targets);
+      for (u32 i = 0; i < num_targets; ++i)
+        LineSet_Add(label_targets.targets, targets[i].line_no);
+    }
+  }
+
+  line_offset = 2;
+  while (ReadListingLine(buffer, buffer_len, &line_offset, &line))
+  {
+    ++alloc_stats.input_lines;
+    if (flags & LISTING_LABELS)
+    {
+      if (LineSet_Contains(label_targets.targets, line.line_no))
+        fprintf(fp, "L%u:\n", line.line_no);
+      InsertLabelReferences(line.data, &label_targets);
+    }
+    WriteDecodedLine(fp, &line);
+  }
+
+  if (end_offset &&
+      end_offset < buffer_len &&
+      (flags & LISTING_DISASSEMBLE))
+    WriteDisassembly(fp, buffer, buffer_len, end_offset);
+}
+
+
+/*
+  Framing
+
+  In framed mode, stdin carries a stream of PRG images and stdout the
+  corresponding listings, so that one process can decompile any number
+  of programs. Each frame is a 32-bit little-endian length followed by
+  that many bytes. A program that can't be processed yields an empty
+  frame, with the reason on stderr.
+*/
+
+/*
+  ReadFrame
+
+  Read the next frame from fp into a newly allocated buffer, storing
+  its length in len.
+
+  Returns FALSE at the end of the stream.
+*/
+BOOL
+ReadFrame(FILE* fp, byte_t** data, u32* len)
+{
+  byte_t header[4];
+  size_t header_len = fread(header, 1, 4, fp);
+  if (header_len == 0)
+    return FALSE;
+  if (header_len < 4)
+  {
+    fprintf(stderr, "ERROR: Truncated frame header\n");
+    exit(-1);
+  }
+  *len = header[0] | (header[1] << 8) | (header[2] << 16) | ((u32)header[3] << 24);
+  /* Spare bytes so the frame is NULL terminated */
+  *data = (byte_t*)Counted_Calloc(*len + 2, 1);
+  if (fread(*data, 1, *len, fp) != *len)
+  {
+    fprintf(stderr, "ERROR: Truncated frame\n");
+    exit(-1);
+  }
+  return TRUE;
+}
+
+
+/*
+  WriteFrame
+
+  Write len bytes of data to fp as one frame.
+*/
+void
+WriteFrame(FILE* fp, byte_t* data, u32 len)
+{
+  byte_t header[4] = { len & 0xff, (len >> 8) & 0xff, (len >> 16) & 0xff, len >> 24 };
+  fwrite(header, 1, 4, fp);
+  /* An empty frame has no data buffer */
+  if (len)
+    fwrite(data, 1, len, fp);
+}
+
+
+/*
+  MemStream_Open
+
+  Open a stream that collects what is written to it in memory, to be
+  closed with MemStream_Close. Hosts without open_memstream write to a
+  temporary file instead.
+*/
+FILE*
+MemStream_Open(char** data, size_t* len)
+{
+#if defined(HAVE_POSIX)
+  return open_memstream(data, len);
+#else
+  *data = 0;
+  *len = 0;
+  return tmpfile();
+#endif
+}
+
+
+/*
+  MemStream_Close
+
+  Close a stream from MemStream_Open, leaving what was written to it,
+  NULL terminated, in data (to be released with free) and its length
+  in len.
+*/
+void
+MemStream_Close(FILE* fp, char** data, size_t* len)
+{
+#if defined(HAVE_POSIX)
+  fclose(fp);
+#else
+  long size = ftell(fp);
+  *len = (size > 0) ? size : 0;
+  *data = (char*)malloc(*len + 1);
+  rewind(fp);
+  *len = fread(*data, 1, *len, fp);
+  (*data)[*len] = '\0';
+  fclose(fp);
+#endif
+}
+
+
+/*
+  DecompileFrames
+
+  Decompile every PRG frame on stdin into a listing frame on stdout.
+*/
+void
+DecompileFrames(enum output_format format, u32 flags)
+{
+  byte_t* data;
+  u32 len;
+  for (u32 frame = 0;
+       ReadFrame(stdin, &data, &len);
+       ++frame)
+  {
+    if (len < 2)
+    {
+      fprintf(stderr, "Frame %u: Not a PRG image\n", frame);
+      WriteFrame(stdout, 0, 0);
+      Counted_Free(data);
+      continue;
+    }
+
+    char* listing = 0;
+    size_t listing_len = 0;
+    FILE* listing_fp = MemStream_Open(&listing, &listing_len);
+    WriteListing(listing_fp, data, len, format, flags);
+    MemStream_Close(listing_fp, &listing, &listing_len);
+    WriteFrame(stdout, (byte_t*)listing, listing_len);
+    /* Answer every frame at once, for callers such as prgbc's fuzzer
+       that wait for it before sending the next */
+    fflush(stdout);
+    /* Allocated by the C library, not counted */
+    free(listing);
+    Counted_Free(data);
+  }
+  fflush(stdout);
+}
+
+
+struct global_args
+{
+  char*   prg_path;
+  BOOL    profile;
+  char*   input_path;
+  u64     max_statements;
+  enum output_format format;
+  BOOL    framed;
+  u32     listing_flags;
+  struct dialect* dialect;
+  char*   extract_prefix;
+  BOOL    line_range;
+  u16     first_line_no;
+  u16     last_line_no;
+  BOOL    show_alloc_stats;
+  u32     max_alloc_per_line;
+};
+struct global_args args;
+
+
+/*
+  GetOptionArgument
+
+  Return the argument of the option at argv[*argi], given either as
+  --option=argument or as the following command line argument (in
+  which case *argi is advanced past it).
+*/
+char*
+GetOptionArgument(int argc, char* argv[], int* argi)
+{
+  char* equals = strchr(argv[*argi], '=');
+  if (equals)
+    return &equals[1];
+  if (*argi + 1 >= argc)
+  {
+    fprintf(stderr, "Option %s requires an argument\n", argv[*argi]);
+    exit(-1);
+  }
+  return argv[++*argi];
+}
+
+
+/*
+  IsOption
+
+  Returns TRUE if arg is the option name, with or without an attached
+  =argument.
+*/
+BOOL
+IsOption(char* arg, char* name)
+{
+  int len = strlen(name);
+  return (strncmp(arg, name, len) == 0 &&
+          (arg[len] == 0 || arg[len] == '='));
+}
+
+
+/*
+  ProcessArgs
+
+  Process command line arguments. Store relevant arguments in args.
+*/
+void
+ProcessArgs(struct global_args* args, int argc, char* argv[])
+{
+  for(int argi = 1;
+      argi < argc;
+      ++argi)
+  {
+    char* arg = argv[argi];
+
+    if (arg[0] != '-' ||
+        arg[1] == 0)
+    {
+      /* NOTE: This should always save the *last* non-option
+         (i.e. does not begin with '-') argument as the path of the
+         PRG file to load. Is this really the desirable behavior? */
+      args->prg_path = arg;
+      continue;
+    }
+
+    else if (IsOption(arg, "--profile"))
+    {
+      args->profile = TRUE;
+    }
+
+    else if (IsOption(arg, "--input"))
+    {
+      args->input_path = GetOptionArgument(argc, argv, &argi);
+    }
+
+    else if (IsOption(arg, "--max-statements"))
+    {
+      args->max_statements = strtoull(GetOptionArgument(argc, argv, &argi), 0, 10);
+    }
+
+    else if (IsOption(arg, "--alloc-stats"))
+    {
+      args->show_alloc_stats = TRUE;
+    }
+
+    else if (IsOption(arg, "--max-alloc-per-line"))
+    {
+      args->max_alloc_per_line = strtoul(GetOptionArgument(argc, argv, &argi), 0, 10);
+    }
+
+    else if (IsOption(arg, "--framed"))
+    {
+      args->framed = TRUE;
+    }
+
+    else if (IsOption(arg, "--labels"))
+    {
+      args->listing_flags |= LISTING_LABELS;
+    }
+
+    else if (IsOption(arg, "--disassemble"))
+    {
+      args->listing_flags |= LISTING_DISASSEMBLE;
+    }
+
+    else if (IsOption(arg, "--lines"))
+    {
+      char* range = GetOptionArgument(argc, argv, &argi);
+      if (!ParseLineRange(range, &args->first_line_no, &args->last_line_no))
+      {
+        fprintf(stderr, "Invalid line range \"%s\" (expected A-B, A, A- or -B)\n", range);
+        exit(-1);
+      }
+      args->line_range = TRUE;
+    }
+
+    else if (IsOption(arg, "--extract-data"))
+    {
+      args->extract_prefix = GetOptionArgument(argc, argv, &argi);
+    }
+
+    else if (IsOption(arg, "--dialect"))
+    {
+      char* dialect = GetOptionArgument(argc, argv, &argi);
+      args->dialect = Dialect_Find(dialect);
+      if (!args->dialect)
+      {
+        fprintf(stderr, "Unknown dialect \"%s\" (expected v2, 3.5, 7.0 or simons)\n", dialect);
+        exit(-1);
+      }
+    }
+
+    else if (IsOption(arg, "--format"))
+    {
+      char* format = GetOptionArgument(argc, argv, &argi);
+      if (strcmp(format, "text") == 0)
+        args->format = FORMAT_TEXT;
+      else if (strcmp(format, "jsonl") == 0)
+        args->format = FORMAT_JSONL;
+      else if (strcmp(format, "binary") == 0)
+        args->format = FORMAT_BINARY;
+      else
+      {
+        fprintf(stderr, "Unknown format \"%s\" (expected text, jsonl or binary)\n", format);
+        exit(-1);
+      }
+    }
+  }
+}
+
+
+/*
+  Alloc_Finish
+
+  Print the allocation statistics if requested, and check the peak
+  heap against the --max-alloc-per-line budget. Returns status, or -1
+  if the budget is exceeded.
+*/
+int
+Alloc_Finish(int status)
+{
+  if (args.show_alloc_stats)
+    Alloc_PrintStats(stderr);
+  if (args.max_alloc_per_line &&
+      alloc_stats.input_lines &&
+      alloc_stats.peak_live_bytes > (u64)args.max_alloc_per_line * alloc_stats.input_lines)
+  {
+    fprintf(stderr, "Peak heap of %llu bytes exceeds the budget of %u bytes per line (%llu lines)\n",
+            (unsigned long long)alloc_stats.peak_live_bytes, args.max_alloc_per_line,
+            (unsigned long long)alloc_stats.input_lines);
+    return -1;
+  }
+  return status;
+}
+
+
+int
+main(int argc, char* argv[])
+{
+  ProcessArgs(&args, argc, argv);
+  if (args.dialect &&
+      args.dialect->keywords)
+  {
+    /* The interpreter only knows V2 */
+    if (args.profile)
+    {
+      fprintf(stderr, "--profile only supports --dialect v2\n");
+      exit(-1);
+    }
+    Dialect_BuildDecoder(args.dialect);
+  }
+  if (args.listing_flags &&
+      args.format != FORMAT_TEXT)
+  {
+    fprintf(stderr, "--labels and --disassemble only apply to --format text\n");
+    exit(-1);
+  }
+
+  if (args.line_range &&
+      (args.profile ||
+       args.framed ||
+       args.extract_prefix ||
+       args.listing_flags ||
+       args.format != FORMAT_TEXT))
+  {
+    fprintf(stderr, "--lines only applies to the plain text listing\n");
+    exit(-1);
+  }
+  if (args.extract_prefix &&
+      (args.profile ||
+       args.framed))
+  {
+    fprintf(stderr, "--extract-data can't be combined with --profile or --framed\n");
+    exit(-1);
+  }
+
+  if (args.framed)
+  {
+    if (args.profile)
+    {
+      fprintf(stderr, "--profile can't be combined with --framed\n");
+      exit(-1);
+    }
+    DecompileFrames(args.format, args.listing_flags);
+    return Alloc_Finish(0);
+  }
+
+  u32 buffer_len = 0;
+  byte_t* buffer = LoadPRGFile(args.prg_path, &buffer_len);
+
+  if (args.extract_prefix)
+  {
+    ExtractData(buffer, buffer_len, args.extract_prefix);
+    return Alloc_Finish(0);
+  }
+
+  if (args.line_range)
+  {
+    struct line_index index;
+    BuildLineIndex(buffer, buffer_len, &index);
+    alloc_stats.input_lines += WriteListingRange(stdout, buffer, buffer_len, &index,
+                                                 args.first_line_no, args.last_line_no);
+    FreeLineIndex(&index);
+    return Alloc_Finish(0);
+  }
+
+  if (args.profile)
+  {
+    ProfilePRG(buffer, buffer_len, args.input_path, args.max_statements);
+    return Alloc_Finish(0);
+  }
+
+  WriteListing(stdout, buffer, buffer_len, args.format, args.listing_flags);
+
+  return Alloc_Finish(0);
 }
@@ -0,0 +1,309 @@
+#!/bin/sh
+#
+# regress.sh
+#
+# Compiles prgbc and prgdc and checks them against known cases: most
+# compile a source with prgbc and compare prgdc's listing of the result
+# with the expected one, some expect an error, and the rest check the
+# files prgbc and prgdc write.
+#
+# Usage: tests/regress.sh  (from the repository root; CC defaults to gcc)
+
+CC=${CC:-gcc}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -Wall -o "$WORK/prgbc" "$ROOT/prgbc/src/prgbc.c" || exit 1
+$CC -O2 -Wall -o "$WORK/prgdc" "$ROOT/prgdc/src/prgdc.c" -lm || exit 1
+
+failures=0
+
+# check <name> <prgbc options> <source> <expected listing> [prgdc options]
+#
+# An empty expected listing expects no output.
+check()
+{
+  printf '%s\n' "$3" > "$WORK/case.bas"
+  { [ -z "$4" ] || printf '%s\n' "$4"; } > "$WORK/expected.txt"
+  if ! "$WORK/prgbc" $2 -o "$WORK/case.prg" "$WORK/case.bas" > "$WORK/prgbc.log" 2>&1 ||
+     ! "$WORK/prgdc" $5 "$WORK/case.prg" > "$WORK/listing.txt" 2> "$WORK/prgdc.log" ||
+     ! cmp -s "$WORK/expected.txt" "$WORK/listing.txt"
+  then
+    echo "FAIL: $1"
+    cat "$WORK/prgbc.log" "$WORK/prgdc.log"
+    diff "$WORK/expected.txt" "$WORK/listing.txt"
+    failures=$((failures + 1))
+  else
+    echo "ok:   $1"
+  fi
+}
+
+# check_error <name> <prgbc options> <source> <expected message>
+check_error()
+{
+  printf '%s\n' "$3" > "$WORK/case.bas"
+  if "$WORK/prgbc" $2 -o "$WORK/case.prg" "$WORK/case.bas" > "$WORK/prgbc.log" 2>&1 ||
+     ! grep -qF "$4" "$WORK/prgbc.log"
+  then
+    echo "FAIL: $1"
+    cat "$WORK/prgbc.log"
+    failures=$((failures + 1))
+  else
+    echo "ok:   $1"
+  fi
+}
+
+# unpack <packed PRG>: the bytes of the program a --pack image
+# restores, one per line, decoded from its LZ stream as the depacker
+# does. The stream starts at the mover's source address (its last
+# partial page, less the number of full pages).
+unpack()
+{
+  od -An -v -tu1 "$1" | awk '
+    { for (i = 1; i <= NF; ++i) b[n++] = $i }
+    END {
+      p = b[26] + 256 * b[30] - 256 * b[42] - 2049 + 2
+      while (b[p])
+      {
+        t = b[p]
+        if (t < 128)
+        {
+          for (i = 1; i <= t; ++i)
+            out[o++] = b[p + i]
+          p += t + 1
+          continue
+        }
+        if (t < 192)
+        {
+          len = t - 128 + 2
+          dist = 256 - b[p + 1]
+          p += 2
+        }
+        else
+        {
+          len = t - 192 + 3
+          dist = 65536 - (b[p + 1] * 256 + b[p + 2])
+          p += 3
+        }
+        for (i = 0; i < len; ++i)
+        {
+          out[o] = out[o - dist]
+          ++o
+        }
+      }
+      for (i = 0; i < o; ++i)
+        print out[i]
+    }'
+}
+
+# ^ binds more tightly than unary minus: a negative folded base keeps
+# its parentheses
+check "fold negative base of ^" "--fold-constants" \
+'10 X=(0-2)^2:Y=(2-5)^A:Z=A*(0-2)
+20 W=-(0-2)^2:V=2^(0-2)' \
+'10 X=(-2)^2:Y=(-3)^A:Z=A*-2
+20 W=-(-2)^2:V=2^-2'
+
+# Labels containing BASIC 7.0 keywords (DO, BOX, the prefixed DOPEN)
+# resolve like any other
+check "BASIC 7.0 labels with keywords" "--dialect 7.0" \
+'10 GOSUB box_sub:GOTO doit
+20 GOTO dopen_it
+box_sub:
+30 BOX 1,10,10,20,20:RETURN
+doit:
+40 DO:LOOP
+dopen_it:
+50 END' \
+'10 GOSUB 30:GOTO 40
+20 GOTO 50
+30 BOX 1,10,10,20,20:RETURN
+40 DO:LOOP
+50 END' "--dialect 7.0"
+
+# A label of the maximum length (32 characters) is kept whole
+check "label of maximum length" "" \
+'abcdefghijklmnopqrstuvwxyz012345:
+10 PRINT 1
+20 GOTO abcdefghijklmnopqrstuvwxyz012345' \
+'10 PRINT 1
+20 GOTO 10'
+
+# Lines out of order are sorted by line number
+check "lines out of order" "" \
+'30 PRINT 3
+10 PRINT 1:GOTO 30
+20 PRINT 2' \
+'10 PRINT 1:GOTO 30
+20 PRINT 2
+30 PRINT 3'
+
+# The DATA lines of INCBIN take the line numbers after its own, which
+# no other line may use
+printf 'ABC' > "$WORK/abc.bin"
+check "INCBIN" "" \
+"10 INCBIN \"$WORK/abc.bin\"
+20 READ N" \
+'10 DATA3
+11 DATA65,66,67
+20 READ N'
+check_error "INCBIN overlapping the next line" "" \
+"10 INCBIN \"$WORK/abc.bin\"
+11 READ N" \
+"INCBIN needs lines 11 to 11 for its bytes, which overlap line 11"
+
+# A jump target that isn't a label is an error, as the language server
+# reports it, even if it starts with one; after THEN, a keyword starts
+# a statement instead
+check_error "undefined label" "" \
+'10 GOTO nowhere' \
+'Undefined label: "NOWHERE"'
+check_error "target that only starts with a label" "" \
+'sub:
+10 ON A GOSUB sub, subx' \
+'Undefined label: "SUBX"'
+check "statement after THEN" "" \
+'10 IF A THEN PRINT
+20 IF A THEN END' \
+'10 IF A THEN PRINT
+20 IF A THEN END'
+
+# --renumber rewrites every kind of jump target, including the lists
+# of ON GOTO and labels, to the new line numbers
+check "renumber" "--renumber" \
+'10 X=1
+20 IF X THEN 50
+30 GOSUB sub:ON X GOTO 10,50
+sub:
+40 RETURN
+50 GO TO 20' \
+'0 X=1
+1 IF X THEN 4
+2 GOSUB 3:ON X GOTO 0,4
+3 RETURN
+4 GO TO 1'
+check_error "renumber jump target too high" "--renumber" \
+'10 GOTO 99999999999' \
+"Jump target too high"
+
+# Literal-only arithmetic is folded where the result is exact, but not
+# in strings or DATA
+check "fold constants" "--fold-constants" \
+'10 POKE 53248+21,255:X=6*7-2:Y=1/3
+20 PRINT "1+1":DATA 2*3' \
+'10 POKE 53269,255:X=40:Y=1/3
+20 PRINT "1+1":DATA 2*3'
+
+# --profile runs the program and counts the entries, statements and
+# cycles of every line
+check "profile" "" \
+'10 FOR I=1 TO 3:A=A+I:NEXT
+20 IF A>5 THEN 40
+30 PRINT "NOT REACHED"
+40 END' \
+'
+Line             Hits   Statements         Cycles   Time%
+10                  1            7           3860   73.18
+20                  1            1           1335   25.31
+30                  0            0              0    0.00
+40                  1            1             80    1.52
+
+Stopped: END
+Total: 9 statements, 5275 cycles (~0.01 s on a PAL C64)' "--profile"
+
+# --order-variables creates the variables hottest first, weighting the
+# references in a loop by its count, on a new line before the program
+check "order variables" "--order-variables" \
+'10 X=1
+20 FOR I=1 TO 100:A=A+I:NEXT
+30 PRINT X' \
+'9 A=0:I=0:X=0
+10 X=1
+20 FOR I=1 TO 100:A=A+I:NEXT
+30 PRINT X'
+
+# --format jsonl emits a record per line with its address, link, bytes
+# and tagged tokens
+check "structured listing" "" \
+'10 A$="HI":REM X' \
+'{"line":10,"address":2049,"link":2065,"bytes":"41 24 b2 22 48 49 22 3a 8f 20 58","tokens":[{"kind":"variable","offset":0,"length":2,"text":"A$"},{"kind":"keyword","offset":2,"length":1,"text":"="},{"kind":"string","offset":3,"length":4,"text":"\"HI\""},{"kind":"other","offset":7,"length":1,"text":":"},{"kind":"keyword","offset":8,"length":1,"text":"REM"},{"kind":"text","offset":9,"length":2,"text":" X"}]}' \
+"--format jsonl"
+
+# --link appends the second source, whose lines and own jump targets
+# --offset moves, to the first; line numbers may not collide
+printf '10 GOSUB 200\n20 END\n' > "$WORK/first.bas"
+check "link two sources" "--link $WORK/first.bas --offset 100" \
+'sub:
+100 PRINT "B":GOTO 110
+110 RETURN' \
+'10 GOSUB 200
+20 END
+200 PRINT "B":GOTO 210
+210 RETURN'
+check_error "link line number collision" "--link $WORK/first.bas" \
+'10 END' \
+"Line number collision: line 10"
+
+# A --pack image unpacks to the bytes of the plain PRG after its load
+# address
+awk 'BEGIN {
+  for (i = 1; i <= 60; ++i)
+    printf "%d PRINT \"HELLO, WORLD\";I*%d:GOSUB 1000\n", i * 10, i
+  print "1000 RETURN"
+}' > "$WORK/pack.bas"
+if "$WORK/prgbc" -o "$WORK/plain.prg" "$WORK/pack.bas" > "$WORK/prgbc.log" 2>&1 &&
+   "$WORK/prgbc" --pack -o "$WORK/packed.prg" "$WORK/pack.bas" >> "$WORK/prgbc.log" 2>&1 &&
+   [ $(wc -c < "$WORK/packed.prg") -lt $(wc -c < "$WORK/plain.prg") ] &&
+   unpack "$WORK/packed.prg" > "$WORK/unpacked.txt" &&
+   od -An -v -tu1 "$WORK/plain.prg" | awk '{ for (i = 1; i <= NF; ++i) if (n++ >= 2) print $i }' > "$WORK/plain.txt" &&
+   cmp -s "$WORK/plain.txt" "$WORK/unpacked.txt"
+then
+  echo "ok:   pack"
+else
+  echo "FAIL: pack"
+  cat "$WORK/prgbc.log"
+  failures=$((failures + 1))
+fi
+
+# --extract-data writes a run of byte DATA across lines to one file,
+# named after its first and last line
+printf '10 DATA 1,2,3,4\n20 DATA 5,6,7,8,9\n30 READ A\n' > "$WORK/case.bas"
+printf '\001\002\003\004\005\006\007\010\011' > "$WORK/expected.bin"
+if "$WORK/prgbc" -o "$WORK/case.prg" "$WORK/case.bas" > "$WORK/prgbc.log" 2>&1 &&
+   "$WORK/prgdc" --extract-data "$WORK/data" "$WORK/case.prg" >> "$WORK/prgbc.log" 2>&1 &&
+   cmp -s "$WORK/expected.bin" "$WORK/data_10-20.bin"
+then
+  echo "ok:   extract data"
+else
+  echo "FAIL: extract data"
+  cat "$WORK/prgbc.log"
+  failures=$((failures + 1))
+fi
+
+# --lines lists a single line, open-ended ranges and nothing for a
+# range between or past the lines
+three_lines='10 PRINT 1
+20 PRINT 2
+30 PRINT 3'
+check "lines 20" "" "$three_lines" \
+'20 PRINT 2' "--lines 20"
+check "lines 20-" "" "$three_lines" \
+'20 PRINT 2
+30 PRINT 3' "--lines 20-"
+check "lines -20" "" "$three_lines" \
+'10 PRINT 1
+20 PRINT 2' "--lines -20"
+check "lines 15-25" "" "$three_lines" \
+'20 PRINT 2' "--lines 15-25"
+check "lines 25" "" "$three_lines" \
+'' "--lines 25"
+check "lines 40-50" "" "$three_lines" \
+'' "--lines 40-50"
+
+if [ $failures -ne 0 ]
+then
+  echo "$failures case(s) failed"
+  exit 1
+fi
+echo "All cases passed"
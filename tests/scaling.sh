@@ -0,0 +1,206 @@
+#!/bin/sh
+#
+# scaling.sh
+#
+# Compiles prgbc and prgdc and checks that their run time grows no
+# faster than n*log(n) with the size of the input. Each series runs a
+# tool on inputs growing geometrically, and a step fails if its time
+# ratio exceeds the n*log(n) ratio of its sizes by more than SLACK, as
+# a quadratic path does.
+#
+# prgbc compiles programs of 1k to 63k labelled lines, of 1k to 63k
+# jumps to line numbers with the lines in ascending, interleaved and
+# descending order, and lines of 30 to 1920 bytes dense with PETSCII
+# placeholders. Programs past 64 KB
+# fail only once every pass has run, so they still time the compiler.
+# prgdc decompiles the largest programs that fit, RUNS framed copies
+# at a time so that starting the process doesn't hide its growth.
+#
+# Usage: tests/scaling.sh  (from the repository root; CC defaults to gcc)
+
+CC=${CC:-gcc}
+SLACK=${SLACK:-1.5}
+RUNS=${RUNS:-200}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -Wall -o "$WORK/prgbc" "$ROOT/prgbc/src/prgbc.c" || exit 1
+$CC -O2 -Wall -o "$WORK/prgdc" "$ROOT/prgdc/src/prgdc.c" -lm || exit 1
+
+failures=0
+
+# now: the time in seconds
+now()
+{
+  date +%s.%N
+}
+
+# compile: compile case.bas to case.prg, allowing only a program too
+# large for memory to fail
+compile()
+{
+  "$WORK/prgbc" -o "$WORK/case.prg" "$WORK/case.bas" > /dev/null 2> "$WORK/prgbc.log" ||
+    grep -q "Program too large" "$WORK/prgbc.log"
+}
+
+# le32 <value>: value as 32-bit little-endian bytes
+le32()
+{
+  value=$1
+  for byte in 1 2 3 4
+  do
+    printf "\\$(printf %03o $((value % 256)))"
+    value=$((value / 256))
+  done
+}
+
+# frame: write RUNS frames of case.prg to case.frames
+frame()
+{
+  len=$(wc -c < "$WORK/case.prg")
+  copies=$RUNS
+  while [ "$copies" -gt 0 ]
+  do
+    le32 "$len"
+    cat "$WORK/case.prg"
+    copies=$((copies - 1))
+  done > "$WORK/case.frames"
+}
+
+# decompile [prgdc options]: list the frames of case.frames
+decompile()
+{
+  "$WORK/prgdc" --framed "$@" < "$WORK/case.frames" > /dev/null 2> "$WORK/prgdc.log" &&
+    ! [ -s "$WORK/prgdc.log" ]
+}
+
+# best_time <command...>: the shortest of three runs, in seconds
+best_time()
+{
+  best=
+  for run in 1 2 3
+  do
+    start=$(now)
+    "$@" || return 1
+    end=$(now)
+    best=$(echo "$start $end $best" | awk '{ t = $2 - $1; print ($3 == "" || t < $3) ? t : $3 }')
+  done
+  echo "$best"
+}
+
+# check_step <name> <n1> <t1> <n2> <t2>
+#
+# Times under 10 ms are taken as 10 ms, so that timer noise on small
+# inputs doesn't fail a step.
+check_step()
+{
+  if echo "$2 $3 $4 $5 $SLACK" | awk '{
+       t1 = ($2 < 0.01) ? 0.01 : $2; t2 = ($4 < 0.01) ? 0.01 : $4
+       allowed = $5 * ($3 * log($3)) / ($1 * log($1))
+       printf "%-18s n %6d -> %6d  time %7.3fs -> %7.3fs  ratio %6.2f (allowed %6.2f)\n", name, $1, $3, $2, $4, t2 / t1, allowed
+       exit (t2 / t1 > allowed)
+     }' name="$1"
+  then
+    :
+  else
+    echo "FAIL: $1 grows faster than n*log(n)"
+    failures=$((failures + 1))
+  fi
+}
+
+# labelled_source <n>: n labelled lines, each jumping to another label
+labelled_source()
+{
+  awk -v n="$1" 'BEGIN {
+    for (i = 1; i <= n; ++i)
+    {
+      printf "l%d:\n", i
+      printf "%d PRINT \"{PETSCII_STOP}X\";A%d:IF A THEN l%d\n", i, i % 100, (i * 7919) % n + 1
+    }
+  }'
+}
+
+# goto_source <order> <n>: n lines, each jumping to another line, in
+# ascending order, interleaved (the odd line numbers, then the even
+# ones) or descending
+goto_source()
+{
+  awk -v order="$1" -v n="$2" 'BEGIN {
+    for (k = 0; k < n; ++k)
+    {
+      if (order == "descending")
+        i = n - k
+      else if (order == "interleaved")
+        i = (k < (n + 1) / 2) ? 2 * k + 1 : 2 * (k - int((n + 1) / 2)) + 2
+      else
+        i = k + 1
+      printf "%d GOTO %d\n", i, (i * 7919) % n + 1
+    }
+  }'
+}
+
+# placeholder_source <lines> <k>: lines of k placeholder-and-letter
+# pairs
+placeholder_source()
+{
+  awk -v lines="$1" -v k="$2" 'BEGIN {
+    for (i = 1; i <= lines; ++i)
+    {
+      printf "%d PRINT \"", i
+      for (j = 0; j < k; ++j)
+        printf "{PETSCII_STOP}A"
+      printf "\"\n"
+    }
+  }'
+}
+
+# series <name> <generator> <size unit> <command> <sizes...>
+#
+# Times command on the source of each size, compiled to case.prg and
+# framed for prgdc. n is the size argument times the size unit.
+series()
+{
+  name=$1
+  generator=$2
+  unit=$3
+  command=$4
+  shift 4
+  prev_n=
+  for size in "$@"
+  do
+    $generator "$size" > "$WORK/case.bas"
+    n=$((size * unit))
+    rm -f "$WORK/case.prg"
+    if ! compile ||
+       { [ -f "$WORK/case.prg" ] && ! frame; } ||
+       ! time=$(best_time $command)
+    then
+      echo "FAIL: $name failed on an input of size $n"
+      cat "$WORK/prgbc.log" "$WORK/prgdc.log" 2> /dev/null
+      failures=$((failures + 1))
+      return
+    fi
+    if [ -n "$prev_n" ]
+    then
+      check_step "$name" "$prev_n" "$prev_time" "$n" "$time"
+    fi
+    prev_n=$n
+    prev_time=$time
+  done
+}
+
+series "prgbc lines" labelled_source 1 compile 1000 8000 63000
+series "prgbc gotos" "goto_source ascending" 1 compile 1000 8000 63000
+series "prgbc interleaved" "goto_source interleaved" 1 compile 1000 8000 63000
+series "prgbc descending" "goto_source descending" 1 compile 1000 8000 63000
+series "prgbc line length" "placeholder_source 2000" 15 compile 2 16 128
+series "prgdc lines" "goto_source ascending" 1 "decompile --labels" 600 4800
+series "prgdc line length" "placeholder_source 120" 15 decompile 2 16 128
+
+if [ $failures -ne 0 ]
+then
+  echo "$failures step(s) failed"
+  exit 1
+fi
+echo "All steps passed"